@@ -0,0 +1,206 @@
+// Micro-benchmarks for hot paths whose savings are not visible in a single
+// request. Run without arguments for every case, or name the cases to run.
+
+#include "content_sniffer.h"
+#include "hash_utils.h"
+#include "metrics.h"
+#include "storage_manager.h"
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace imgstore;
+
+namespace {
+
+struct TempDir {
+    std::filesystem::path path;
+    TempDir() {
+        path = std::filesystem::temp_directory_path() / ("imgstore-bench-" + std::to_string(::getpid()));
+        std::filesystem::remove_all(path);
+        std::filesystem::create_directories(path);
+    }
+    ~TempDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+};
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+std::vector<uint8_t> image(uint64_t seed, size_t size) {
+    std::vector<uint8_t> data(size);
+    uint64_t state = seed * 0x9E3779B97F4A7C15ULL + 1;
+    for (auto& byte : data) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        byte = static_cast<uint8_t>(state);
+    }
+    return data;
+}
+
+uint64_t counterValue(const std::string& name) {
+    return Metrics::instance().counter(name, "").value();
+}
+
+// Writes into a store whose shard directories already exist, as in any store
+// that has been running for a while: with the default layout that takes
+// millions of images, so this uses 256 leaf directories instead
+void benchWrites(size_t count) {
+    struct Configuration {
+        const char* name;
+        size_t dirCacheSize;
+        bool knownDirs;
+    };
+    const Configuration configurations[] = {
+        {"dir cache + known dirs", 4096, true},
+        {"dir cache only", 4096, false},
+        {"known dirs only", 0, true},
+        {"neither", 0, false},
+    };
+
+    std::printf("writes: %zu per configuration, 4 KiB each, after as many warm-up writes\n", count);
+    std::printf("%-24s %10s %20s %15s\n", "configuration", "us/write", "dir syscalls/write", "known-dir hits");
+    for (const auto& configuration : configurations) {
+        TempDir dir;
+        StorageOptions options;
+        options.shardDepth = 2;
+        options.shardWidth = 1;
+        options.dirCacheSize = configuration.dirCacheSize;
+        options.knownDirs = configuration.knownDirs;
+        StorageManager storage(dir.path.string(), options);
+
+        for (size_t i = 0; i < count; ++i) {
+            auto data = image(i, 4096);
+            storage.storeImage(HashUtils::hashToHex(HashUtils::xxh3_64(data.data(), data.size())), data);
+        }
+
+        uint64_t syscalls = counterValue("imgstore_dir_cache_syscalls_total");
+        uint64_t hits = counterValue("imgstore_known_dirs_hits_total");
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = count; i < 2 * count; ++i) {
+            auto data = image(i, 4096);
+            storage.storeImage(HashUtils::hashToHex(HashUtils::xxh3_64(data.data(), data.size())), data);
+        }
+        double seconds = secondsSince(start);
+        syscalls = counterValue("imgstore_dir_cache_syscalls_total") - syscalls;
+        hits = counterValue("imgstore_known_dirs_hits_total") - hits;
+
+        std::printf("%-24s %10.1f %20.2f %14.1f%%\n", configuration.name, seconds * 1e6 / count,
+                    static_cast<double>(syscalls) / count, 100.0 * hits / count);
+    }
+}
+
+// Leading bytes of one file per format, padded to the sniffer's window
+std::vector<uint8_t> sample(const char* header, size_t headerSize) {
+    std::vector<uint8_t> data = image(headerSize, ContentSniffer::kSniffLength);
+    std::memcpy(data.data(), header, headerSize);
+    return data;
+}
+
+// Cost of one format lookup, as paid by every upload and by downloads of
+// images the index learned about from a directory scan
+void benchSniff(size_t count) {
+    struct Sample {
+        const char* name;
+        ImageFormat expected;
+        std::vector<uint8_t> data;
+    };
+    const char svg[] = "\xEF\xBB\xBF<?xml version=\"1.0\"?>\n<!-- drawn by hand -->\n"
+                       "<!DOCTYPE svg PUBLIC \"-//W3C//DTD SVG 1.1//EN\" \"x\">\n<svg xmlns=\"x\">";
+    const std::vector<Sample> samples = {
+        {"jpeg", ImageFormat::Jpeg, sample("\xFF\xD8\xFF\xE0", 4)},
+        {"png", ImageFormat::Png, sample("\x89PNG\r\n\x1A\n", 8)},
+        {"gif", ImageFormat::Gif, sample("GIF89a", 6)},
+        {"webp", ImageFormat::Webp, sample("RIFF\x10\0\0\0WEBPVP8 ", 16)},
+        {"avif", ImageFormat::Avif, sample("\0\0\0\x20" "ftypmif1\0\0\0\0mif1miafMA1Bavif", 32)},
+        {"heic", ImageFormat::Heic, sample("\0\0\0\x18" "ftypheic\0\0\0\0mif1heic", 24)},
+        {"tiff", ImageFormat::Tiff, sample("II*\0", 4)},
+        {"ico", ImageFormat::Ico, sample("\0\0\1\0", 4)},
+        {"bmp", ImageFormat::Bmp, sample("BM", 2)},
+        {"jxl", ImageFormat::Jxl, sample("\0\0\0\x0CJXL \r\n\x87\n", 12)},
+        {"svg", ImageFormat::Svg, sample(svg, sizeof(svg) - 1)},
+        {"unknown", ImageFormat::Unknown, sample("\x7F" "ELF", 4)},
+    };
+
+    size_t iterations = count * 100;
+    std::printf("sniff: %zu lookups per format\n", iterations);
+    std::printf("%-10s %10s\n", "format", "ns/sniff");
+    for (const auto& s : samples) {
+        if (ContentSniffer::sniff(s.data) != s.expected) {
+            std::printf("%-10s sample not recognised\n", s.name);
+            continue;
+        }
+        // Summing the results keeps the calls from being optimised away
+        volatile size_t sink = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < iterations; ++i) {
+            sink = sink + static_cast<size_t>(ContentSniffer::sniff(s.data.data(), s.data.size()));
+        }
+        std::printf("%-10s %10.1f\n", s.name, secondsSince(start) * 1e9 / iterations);
+    }
+
+    // For scale: hashing the same window, which every upload does over the whole image
+    const auto& window = samples.front().data;
+    volatile uint64_t sink = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        sink = sink ^ HashUtils::xxh3_64(window.data(), window.size());
+    }
+    std::printf("%-10s %10.1f  (xxh3 of %zu bytes)\n", "hash", secondsSince(start) * 1e9 / iterations, window.size());
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // The store reports its startup on std::cout; results go through printf
+    std::cout.rdbuf(nullptr);
+
+    struct Case {
+        const char* name;
+        std::function<void()> run;
+    };
+    size_t count = 20000;
+    if (const char* env = std::getenv("IMGSTORE_BENCH_COUNT")) {
+        count = std::stoul(env);
+    }
+    const std::vector<Case> cases = {
+        {"writes", [count]() { benchWrites(count); }},
+        {"sniff", [count]() { benchSniff(count); }},
+    };
+
+    std::vector<std::string> selected(argv + 1, argv + argc);
+    for (const auto& name : selected) {
+        bool known = false;
+        for (const auto& c : cases) {
+            known = known || name == c.name;
+        }
+        if (!known) {
+            std::cerr << "Unknown benchmark '" << name << "'; available:";
+            for (const auto& c : cases) {
+                std::cerr << " " << c.name;
+            }
+            std::cerr << std::endl;
+            return 1;
+        }
+    }
+
+    for (const auto& c : cases) {
+        if (selected.empty() || std::find(selected.begin(), selected.end(), c.name) != selected.end()) {
+            c.run();
+            std::printf("\n");
+        }
+    }
+    return 0;
+}
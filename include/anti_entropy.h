@@ -0,0 +1,196 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "metrics.h"
+#include "peer_client.h"
+#include "storage_manager.h"
+
+namespace imgstore {
+
+/**
+ * @brief Background job that copies images a replica is missing from its peers
+ *
+ * Each round compares this node's hash tree with every peer's, top down,
+ * asking only for the children of nodes whose digests differ. The leaves
+ * that still differ are listed on both sides, and the images only the peer
+ * has are pulled in large batches and checked against their hash. Two
+ * replicas that agree exchange one root digest; the traffic beyond that
+ * grows with the number of differing leaves and missing images, not with
+ * the size of the store.
+ *
+ * Deletes travel as tombstones in the same listings. A replica applies a
+ * peer's tombstone to any copy written before the delete, and does not pull
+ * an image it deleted itself unless the peer's copy was written later, so a
+ * delete missed by a replica that was down does not come back.
+ */
+class AntiEntropy {
+public:
+    /**
+     * @brief Decides whether this node should hold an image
+     */
+    using Filter = std::function<bool(const std::string& imageId)>;
+
+    /**
+     * @brief Peers and pacing
+     */
+    struct Options {
+        std::vector<std::string> peers;          // host:port of each replica to pull from
+        std::chrono::seconds interval{600};      // pause between rounds; 0 runs rounds only on trigger()
+        std::chrono::milliseconds timeout{2000}; // connect and socket timeout for peers
+        std::string apiKey;                      // sent to peers, whose sync endpoints need it
+        size_t batchBytes = 16 * 1024 * 1024;    // image bytes a peer sends per request
+    };
+
+    /**
+     * @brief Snapshot of sync progress
+     */
+    struct Status {
+        bool running = false;
+        uint64_t rounds = 0;
+        uint64_t bucketsDiffering = 0;
+        uint64_t objectsPulled = 0;
+        uint64_t objectsDeleted = 0;
+        uint64_t bytesPulled = 0;
+        uint64_t treeBytes = 0;
+        uint64_t peerErrors = 0;
+        std::string lastError;
+    };
+
+    /**
+     * @brief Construct a sync job
+     * @param storage Storage to fill
+     * @param options Peers and pacing
+     * @param filter Images this node should hold; empty accepts all
+     */
+    AntiEntropy(std::shared_ptr<StorageManager> storage, Options options, Filter filter);
+
+    ~AntiEntropy();
+
+    AntiEntropy(const AntiEntropy&) = delete;
+    AntiEntropy& operator=(const AntiEntropy&) = delete;
+
+    /**
+     * @brief Start the background thread
+     */
+    void start();
+
+    /**
+     * @brief Stop the background thread, abandoning any round in progress
+     */
+    void stop();
+
+    /**
+     * @brief Request a round to start as soon as possible
+     * @return false if a round is already running
+     */
+    bool trigger();
+
+    /**
+     * @brief Get current progress and counters
+     * @return Status snapshot
+     */
+    Status status() const;
+
+    const std::vector<std::string>& peers() const { return options_.peers; }
+
+private:
+    std::shared_ptr<StorageManager> storage_;
+    Options options_;
+    Filter filter_;
+    PeerClient client_;
+
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopRequested_ = false;
+    bool triggerRequested_ = false;
+    std::atomic<bool> running_{false};
+    std::string lastError_;
+
+    Counter& rounds_;
+    Counter& bucketsDiffering_;
+    Counter& objectsPulled_;
+    Counter& objectsDeleted_;
+    Counter& bytesPulled_;
+    Counter& treeBytes_;
+    Counter& peerErrors_;
+    Summary& roundSeconds_;
+
+    void loop();
+    void runRound();
+
+    bool stopping() const;
+
+    /**
+     * @brief Bring this node up to date with one peer
+     * @param peer Peer as host:port
+     * @return false if the peer could not be compared completely
+     */
+    bool syncWith(const std::string& peer);
+
+    /**
+     * @brief Fetch tree digests from a peer
+     * @param peer Peer as host:port
+     * @param prefixes Inner nodes whose children to fetch; empty asks for the root's
+     * @param root Set to the peer's root digest
+     * @param children Set to the children digests of each prefix, in request order
+     * @return false if the peer did not answer properly
+     */
+    bool fetchNodes(const std::string& peer, const std::vector<std::string>& prefixes, uint64_t& root,
+                    std::vector<std::vector<uint64_t>>& children);
+
+    /**
+     * @brief List a peer's images and deletes under some leaves
+     * @param peer Peer as host:port
+     * @param buckets Leaves to list
+     * @param ids Receives the image IDs
+     * @param deleted Receives the IDs the peer deleted, with the unix time of each delete
+     * @return false if the peer did not answer properly
+     */
+    bool fetchListing(const std::string& peer, const std::vector<uint16_t>& buckets, std::vector<std::string>& ids,
+                      std::vector<std::pair<std::string, int64_t>>& deleted);
+
+    /**
+     * @brief Ask a peer when it last wrote some images
+     * @param peer Peer as host:port
+     * @param ids Images to ask about
+     * @param written Receives a unix time for each image the peer holds
+     * @return false if the peer did not answer properly
+     */
+    bool fetchWritten(const std::string& peer, const std::vector<std::string>& ids,
+                      std::unordered_map<std::string, int64_t>& written);
+
+    /**
+     * @brief Copy images from a peer
+     * @param peer Peer as host:port
+     * @param ids Images to copy
+     * @return false if the peer stopped answering
+     */
+    bool pullImages(const std::string& peer, const std::vector<std::string>& ids);
+
+    /**
+     * @brief Send an authenticated request to a peer
+     * @param peer Peer as host:port
+     * @param method HTTP method
+     * @param target Path and query string
+     * @param body Request body
+     * @return 200 response, or nullopt after recording the failure
+     */
+    std::optional<PeerClient::Response> request(const std::string& peer, const std::string& method,
+                                                const std::string& target, const std::string& body);
+
+    void recordError(const std::string& error);
+};
+
+} // namespace imgstore
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "metrics.h"
+#include "object_index.h"
+#include "rate_limiter.h"
+#include "storage_manager.h"
+
+namespace imgstore {
+
+/**
+ * @brief Exports point-in-time backups of the store as tar archives
+ *
+ * A backup starts by capturing the index: the set of images and name
+ * mappings as of one journal sequence. Stored images never change, so the
+ * archive is then filled from that capture in the background, throttled so
+ * serving traffic keeps its disk bandwidth. A captured image deleted
+ * before the export reaches it is first copied to a holding directory next
+ * to the archive, from which the export takes it; one that cannot be read
+ * at all is left out and counted as missing.
+ *
+ * Each archive holds `names.jsonl` (one `{"name","id"}` object per line),
+ * `images/<id>` for every image, and a `backup.json` manifest written last.
+ * An incremental backup names an earlier complete backup as its base and
+ * holds only the images and names added or changed since, plus a
+ * `deleted.jsonl` listing the images and names that went away; the
+ * capture each complete backup was made from is kept next to its archive
+ * for this purpose. Names of missing images are listed in `deleted.jsonl`
+ * too, so a restore does not leave them pointing at nothing.
+ */
+class BackupManager {
+public:
+    enum class State { Running, Complete, Failed };
+
+    /**
+     * @brief Description and progress of one backup
+     */
+    struct Info {
+        std::string id;
+        std::string base;          // backup this one is incremental to; empty for a full backup
+        State state = State::Running;
+        int64_t created = 0;       // Unix seconds
+        int64_t finished = 0;      // Unix seconds; 0 while running
+        uint64_t seq = 0;          // index journal sequence the backup reflects
+        uint64_t images = 0;       // images written so far
+        uint64_t imagesTotal = 0;  // images the backup will hold
+        uint64_t names = 0;
+        uint64_t deletedImages = 0;
+        uint64_t deletedNames = 0;
+        uint64_t missing = 0;      // images that could not be read for the export
+        uint64_t bytes = 0;        // archive size so far
+        std::string error;
+    };
+
+    enum class StartResult { Started, AlreadyRunning, UnknownBase, Failed };
+
+    /**
+     * @brief Construct a backup manager
+     * @param storage Storage to back up
+     * @param dir Directory the archives are written to
+     * @param bytesPerSecond Read rate of an export; 0 disables throttling
+     */
+    BackupManager(std::shared_ptr<StorageManager> storage, const std::filesystem::path& dir, double bytesPerSecond);
+
+    ~BackupManager();
+
+    BackupManager(const BackupManager&) = delete;
+    BackupManager& operator=(const BackupManager&) = delete;
+
+    /**
+     * @brief Capture the index and start exporting it
+     * @param base ID of the complete backup to export changes since; empty for a full backup
+     * @param id Set to the new backup's ID when started
+     * @return Whether the export started
+     */
+    StartResult start(const std::string& base, std::string& id);
+
+    /**
+     * @brief Abandon a running export and wait for its thread
+     */
+    void stop();
+
+    /**
+     * @brief Describe every known backup
+     * @return Backups, oldest first
+     */
+    std::vector<Info> list() const;
+
+    /**
+     * @brief Describe one backup
+     * @param id Backup ID
+     * @return Description, or nullopt if unknown
+     */
+    std::optional<Info> find(const std::string& id) const;
+
+    /**
+     * @brief Archive file of a complete backup
+     * @param id Backup ID
+     * @return Path, or nullopt unless the backup is complete
+     */
+    std::optional<std::filesystem::path> archivePath(const std::string& id) const;
+
+    /**
+     * @brief Delete a backup's archive and metadata
+     * @param id Backup ID
+     * @return false if the backup is unknown or still running
+     */
+    bool remove(const std::string& id);
+
+    /**
+     * @brief Name of a state as reported by the API
+     * @param state Backup state
+     * @return "running", "complete" or "failed"
+     */
+    static const char* stateName(State state);
+
+private:
+    std::shared_ptr<StorageManager> storage_;
+    std::filesystem::path dir_;
+    RateLimiter limiter_;
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Info> backups_;
+    std::thread thread_;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stopRequested_{false};
+
+    // Captured images the running export has yet to read, and those copied aside on delete
+    std::mutex holdMutex_;
+    std::filesystem::path holdDir_;
+    std::unordered_set<uint64_t> pending_;
+    std::unordered_set<uint64_t> held_;
+
+    Counter& completed_;
+    Counter& failed_;
+    Counter& imagesWritten_;
+    Counter& bytesWritten_;
+    Summary& exportSeconds_;
+
+    /**
+     * @brief Write the archive for a capture
+     * @param id Backup ID
+     * @param capture Index contents to export
+     * @param base Capture of the base backup, for an incremental backup
+     */
+    void exportBackup(const std::string& id, ObjectIndex::Capture capture,
+                      std::optional<ObjectIndex::Capture> base);
+
+    /**
+     * @brief Copy a captured image aside before it is erased; the storage erase hook
+     * @param imageId Image about to be erased
+     */
+    void holdImage(const std::string& imageId);
+
+    /**
+     * @brief Mark an image as read by the export and take its held copy
+     * @param hash Image hash
+     * @return Content copied aside when the image was deleted, or nullopt
+     */
+    std::optional<std::vector<uint8_t>> releaseImage(uint64_t hash);
+
+    /**
+     * @brief Update a running backup's progress
+     * @param id Backup ID
+     * @param fn Applied to the backup's description under the lock
+     */
+    template <typename Fn>
+    void update(const std::string& id, Fn&& fn);
+
+    /**
+     * @brief Persist a backup's description next to its archive
+     * @param info Description to write
+     */
+    bool writeInfo(const Info& info) const;
+
+    std::filesystem::path infoPath(const std::string& id) const { return dir_ / (id + ".json"); }
+    std::filesystem::path tarPath(const std::string& id) const { return dir_ / (id + ".tar"); }
+    std::filesystem::path capturePath(const std::string& id) const { return dir_ / (id + ".capture"); }
+    std::filesystem::path holdPath(const std::string& id) const { return dir_ / (id + ".hold"); }
+
+    static bool writeCapture(const std::filesystem::path& path, const ObjectIndex::Capture& capture);
+    static std::optional<ObjectIndex::Capture> readCapture(const std::filesystem::path& path);
+};
+
+} // namespace imgstore
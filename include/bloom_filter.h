@@ -0,0 +1,69 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+
+namespace imgstore {
+
+/**
+ * @brief Cache-line blocked Bloom filter for negative lookups
+ *
+ * Every key maps to a single 512-bit block, so a lookup touches one cache
+ * line. Insertions are lock-free and may run concurrently with lookups.
+ * Deletions are not supported; stale entries only cost false positives
+ * until the filter is rebuilt.
+ */
+class BloomFilter {
+public:
+    /**
+     * @brief Construct a filter sized for a target false-positive rate
+     * @param expectedItems Number of keys the filter should hold
+     * @param falsePositiveRate Target false-positive probability at capacity
+     */
+    BloomFilter(size_t expectedItems, double falsePositiveRate = 0.01);
+
+    /**
+     * @brief Add a key to the filter
+     * @param key Key to add
+     */
+    void add(std::string_view key);
+
+    /**
+     * @brief Check whether a key may be present
+     * @param key Key to look up
+     * @return false if the key is definitely absent
+     */
+    bool mightContain(std::string_view key) const;
+
+    /**
+     * @brief Number of keys added so far
+     * @return Insertion count
+     */
+    size_t size() const { return insertions_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Number of keys the filter was sized for
+     * @return Capacity
+     */
+    size_t capacity() const { return capacity_; }
+
+    /**
+     * @brief Theoretical false-positive rate at the current fill level
+     * @return Estimated probability that an absent key passes the filter
+     */
+    double estimatedFalsePositiveRate() const;
+
+private:
+    static constexpr size_t kWordsPerBlock = 8; // 512 bits, one cache line
+
+    size_t capacity_;
+    size_t numBlocks_;
+    int numHashes_;
+    std::unique_ptr<std::atomic<uint64_t>[]> bits_;
+    std::atomic<size_t> insertions_{0};
+};
+
+} // namespace imgstore
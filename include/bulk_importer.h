@@ -0,0 +1,148 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_set>
+#include <vector>
+#include "io_executor.h"
+#include "storage_manager.h"
+
+namespace imgstore {
+
+/**
+ * @brief Seeds a store from directories and tar archives without going through HTTP
+ *
+ * Files are read by one thread and hashed and written by a pool, so the
+ * disks stay busy. Content already stored, or seen earlier in the import,
+ * is skipped. Writes are not synced one by one; the storage roots are
+ * synced once per batch of bytes and at the end. Name mappings are
+ * collected while content is written and stored in one pass per source.
+ *
+ * A backup archive from the backup endpoints is recognised by its
+ * `names.jsonl`: its images are checked against their IDs, its names are
+ * restored, and the deletions of an incremental backup are applied.
+ * Import full and incremental backups in the order they were taken.
+ *
+ * The store must not be served while importing.
+ */
+class BulkImporter {
+public:
+    /**
+     * @brief Parallelism and batching
+     */
+    struct Options {
+        size_t threads = 16;                        // files hashed and written at once
+        bool nameFiles = false;                     // map each plain file's name to its content
+        uint64_t syncBytes = 1024ull * 1024 * 1024; // bytes written between syncs of the storage roots
+        size_t bufferBytes = 256 * 1024 * 1024;     // file contents held in memory waiting for a writer
+    };
+
+    /**
+     * @brief Counts over everything imported so far
+     */
+    struct Stats {
+        uint64_t files = 0;         // files read
+        uint64_t imported = 0;      // images newly stored
+        uint64_t duplicates = 0;    // files whose content was already stored
+        uint64_t bytes = 0;         // bytes of newly stored images
+        uint64_t names = 0;         // name mappings stored
+        uint64_t nameConflicts = 0; // names given to more than one file in a source; the first is kept
+        uint64_t deleted = 0;       // images and names removed by incremental backups
+        uint64_t errors = 0;        // files that could not be read or stored
+    };
+
+    /**
+     * @brief Construct an importer
+     * @param storage Storage to fill
+     * @param options Parallelism and batching
+     */
+    BulkImporter(std::shared_ptr<StorageManager> storage, Options options);
+
+    BulkImporter(const BulkImporter&) = delete;
+    BulkImporter& operator=(const BulkImporter&) = delete;
+
+    /**
+     * @brief Import every regular file of a source
+     * @param source Directory, tar archive, or "-" for a tar archive on standard input
+     * @return false if the source could not be read completely
+     */
+    bool import(const std::filesystem::path& source);
+
+    /**
+     * @brief Get the counts so far
+     * @return Stats snapshot
+     */
+    Stats stats() const;
+
+private:
+    /**
+     * @brief A name to store once the source's content is written
+     */
+    struct PendingName {
+        uint64_t order; // position in the source; the first of conflicting names wins
+        std::string name;
+        std::string id;
+    };
+
+    std::shared_ptr<StorageManager> storage_;
+    Options options_;
+    IoExecutor pool_;
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    size_t pending_ = 0;       // submitted tasks not yet finished
+    size_t bufferedBytes_ = 0; // file contents held by pending tasks
+    uint64_t unsyncedBytes_ = 0;
+    std::unordered_set<uint64_t> seen_;
+    std::vector<PendingName> names_;
+    Stats stats_;
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point lastProgress_;
+
+    bool importDirectory(const std::filesystem::path& dir);
+    bool importTar(const std::filesystem::path& path);
+
+    /**
+     * @brief Run a task on the pool once its bytes fit in the buffer
+     * @param bytes Memory the task holds until it finishes
+     * @param task Work to run
+     */
+    void submit(size_t bytes, std::function<void()> task);
+
+    /**
+     * @brief Wait for every submitted task to finish
+     */
+    void drain();
+
+    /**
+     * @brief Hash a file's content and store it unless already present
+     * @param data File content
+     * @param source Where the file came from, for messages
+     * @param expectedId ID the content must hash to; empty to accept any
+     * @param name Name to map to the content, with its order in the source
+     */
+    void ingest(const std::vector<uint8_t>& data, const std::string& source, const std::string& expectedId,
+                std::optional<std::pair<uint64_t, std::string>> name);
+
+    /**
+     * @brief Store the names collected from a source, first occurrence winning
+     */
+    void writeNames();
+
+    /**
+     * @brief Sync the storage roots if enough bytes were written since the last sync
+     * @param force Sync regardless of the amount written
+     */
+    void sync(bool force);
+
+    void printProgress(bool force);
+};
+
+} // namespace imgstore
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Append-only log of the changes clients make to the store
+ *
+ * Every upload, delete, name update and name removal gets the next sequence
+ * number and is appended to a segment file under `feed/`, one JSON object
+ * per line. Consumers read forward from the last sequence they processed,
+ * so they can stop and resume at will. Segments are retired oldest first
+ * once the log exceeds its size or age limit; a consumer whose cursor fell
+ * behind the oldest retained event must resynchronise from a full listing.
+ *
+ * Recent events are also kept in memory, so consumers that keep up never
+ * touch the disk, and waiters are woken as soon as a new event arrives.
+ */
+class ChangeFeed {
+public:
+    enum class Type { Upload, Delete, Name, NameDelete };
+
+    /**
+     * @brief One logged change
+     */
+    struct Event {
+        uint64_t seq = 0;
+        int64_t timeMs = 0; // Unix time in milliseconds
+        Type type = Type::Upload;
+        std::string id;     // image hash
+        std::string name;   // set for name events
+    };
+
+    /**
+     * @brief Retention limits
+     */
+    struct Options {
+        std::chrono::seconds retention{7 * 24 * 3600}; // age after which segments are retired; 0 keeps all
+        uint64_t maxBytes = 1024ull * 1024 * 1024;      // total log size after which segments are retired
+    };
+
+    /**
+     * @brief Events after a cursor
+     */
+    struct Page {
+        std::vector<Event> events;
+        uint64_t oldest = 0;  // first sequence still retained
+        uint64_t latest = 0;  // last sequence written
+        bool expired = false; // events after the cursor were already retired
+    };
+
+    /**
+     * @brief Called once when an event after the awaited cursor is appended
+     */
+    using Waiter = std::function<void()>;
+
+    /**
+     * @brief Open the log, recovering the last sequence from its newest segment
+     * @param dir Directory holding the segments
+     * @param options Retention limits
+     */
+    ChangeFeed(const std::filesystem::path& dir, Options options);
+
+    ~ChangeFeed();
+
+    ChangeFeed(const ChangeFeed&) = delete;
+    ChangeFeed& operator=(const ChangeFeed&) = delete;
+
+    /**
+     * @brief Record a change and wake the waiters
+     * @param type Kind of change
+     * @param id Image hash
+     * @param name Image name, for name events
+     * @return Sequence number of the event
+     */
+    uint64_t append(Type type, const std::string& id, const std::string& name = "");
+
+    /**
+     * @brief Read the events after a cursor
+     * @param since Last sequence the consumer has processed; 0 for the start
+     * @param limit Maximum number of events to return
+     * @return Events in sequence order
+     */
+    Page read(uint64_t since, size_t limit) const;
+
+    /**
+     * @brief Register a one-shot callback for the next event after a cursor
+     *
+     * The callback runs on the appending thread and must not block.
+     * @param since Cursor being waited on
+     * @param waiter Callback
+     * @return Token for cancel(), or nullopt if the cursor is not at the end of the log
+     */
+    std::optional<uint64_t> wait(uint64_t since, Waiter waiter);
+
+    /**
+     * @brief Drop a waiter that is no longer interested
+     * @param token Token returned by wait(); unknown tokens are ignored
+     */
+    void cancel(uint64_t token);
+
+    /**
+     * @brief Name of an event type as it appears in the log
+     * @param type Event type
+     * @return "upload", "delete", "name" or "name_delete"
+     */
+    static const char* typeName(Type type);
+
+private:
+    /**
+     * @brief A segment file, named after the first sequence it may hold
+     */
+    struct Segment {
+        std::filesystem::path path;
+        uint64_t bytes = 0;
+    };
+
+    std::filesystem::path dir_;
+    Options options_;
+    uint64_t segmentBytes_;
+
+    mutable std::mutex mutex_;
+    std::map<uint64_t, Segment> segments_;
+    uint64_t totalBytes_ = 0;
+    uint64_t lastSeq_ = 0;
+    int fd_ = -1;
+    std::deque<Event> tail_;
+    std::map<uint64_t, std::pair<uint64_t, Waiter>> waiters_; // token -> cursor, callback
+    uint64_t nextToken_ = 1;
+    std::chrono::steady_clock::time_point lastAgeCheck_;
+
+    Counter* appended_[4];
+    Counter& retired_;
+    Counter& writeErrors_;
+
+    /**
+     * @brief Start a new segment for events from a sequence on
+     * @param firstSeq Sequence of the segment's first event
+     */
+    void openSegment(uint64_t firstSeq);
+
+    /**
+     * @brief Retire the oldest segments beyond the size and age limits
+     *
+     * The segment being written is never retired.
+     */
+    void enforceRetention();
+
+    /**
+     * @brief Read a segment's events after a cursor
+     * @param path Segment file
+     * @param since Cursor
+     * @param limit Stop once this many events are collected
+     * @param events Receives the events
+     * @return Size of the valid prefix of the file, which ends at a complete line
+     */
+    static uint64_t readSegment(const std::filesystem::path& path, uint64_t since, size_t limit,
+                                std::vector<Event>& events);
+
+    static std::string serialize(const Event& event);
+    static std::optional<Event> parse(const std::string& line);
+};
+
+} // namespace imgstore
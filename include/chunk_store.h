@@ -0,0 +1,162 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <shared_mutex>
+#include <vector>
+#include "hash_utils.h"
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief One chunk of a chunked image
+ */
+struct ChunkRef {
+    Hash128 hash;
+    uint32_t size = 0;
+};
+
+/**
+ * @brief Content-defined chunk store for deduplicating large images
+ *
+ * Images are cut with FastCDC: a gear rolling hash picks chunk boundaries
+ * from the content itself, so an edit only changes the chunks around it
+ * and the rest of the file still matches chunks already stored. Chunks are
+ * addressed by their XXH3-128 and stored once under `chunks/`; the image
+ * itself is replaced by a small manifest listing its chunks in order.
+ *
+ * Chunks are never deleted when an image is; collectGarbage() marks the
+ * chunks every manifest references and sweeps the rest.
+ */
+class ChunkStore {
+public:
+    static constexpr size_t kMinChunkSize = 16 * 1024;
+    static constexpr size_t kAverageChunkSize = 64 * 1024;
+    static constexpr size_t kMaxChunkSize = 256 * 1024;
+
+    /**
+     * @brief Callback receiving the chunks and total size of one manifest
+     */
+    using ManifestVisitor = std::function<void(const std::vector<ChunkRef>& chunks, uint64_t totalSize)>;
+
+    /**
+     * @brief Outcome of a garbage collection pass
+     */
+    struct GcResult {
+        bool completed = false;
+        uint64_t manifests = 0;
+        uint64_t chunksKept = 0;
+        uint64_t chunksRemoved = 0;
+        uint64_t bytesRemoved = 0;
+        uint64_t logicalBytes = 0; // sum of the sizes of chunked images
+        uint64_t storedBytes = 0;  // bytes of chunk files left on disk
+    };
+
+    /**
+     * @brief Construct a chunk store
+     * @param baseDir Storage base directory; chunks live in `chunks/` below it
+     */
+    explicit ChunkStore(const std::filesystem::path& baseDir);
+
+    ~ChunkStore();
+
+    ChunkStore(const ChunkStore&) = delete;
+    ChunkStore& operator=(const ChunkStore&) = delete;
+
+    /**
+     * @brief Find FastCDC chunk boundaries
+     * @param data Data to split
+     * @param size Number of bytes
+     * @return Length of each chunk, in order
+     */
+    static std::vector<size_t> split(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Check whether stored bytes are a chunk manifest
+     * @param data Start of the stored file
+     * @param size Number of bytes available
+     * @return true if the data starts with the manifest magic
+     */
+    static bool isManifest(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Parse a chunk manifest
+     * @param manifest Manifest bytes
+     * @param totalSize Set to the size of the image it describes
+     * @return Chunks in order, or nullopt if the manifest is damaged
+     */
+    static std::optional<std::vector<ChunkRef>> parseManifest(const std::vector<uint8_t>& manifest,
+                                                              uint64_t& totalSize);
+
+    /**
+     * @brief Store the chunks of an image that are not stored yet
+     * @param data Image data
+     * @return Manifest to store in place of the image, or nullopt on I/O error
+     */
+    std::optional<std::vector<uint8_t>> write(const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Reassemble an image from its chunks
+     *
+     * Each chunk is read straight into its place in the output buffer and
+     * fed to the hasher while still in cache.
+     * @param chunks Chunks from the manifest
+     * @param totalSize Image size from the manifest
+     * @param out Receives the image data
+     * @param hasher Optional hasher updated with the data in order
+     * @return false if a chunk is missing or shorter than recorded
+     */
+    bool read(const std::vector<ChunkRef>& chunks, uint64_t totalSize, std::vector<uint8_t>& out,
+              Xxh3Stream* hasher) const;
+
+    /**
+     * @brief Account for a deleted chunked image
+     * @param totalSize Size of the image
+     */
+    void release(uint64_t totalSize);
+
+    /**
+     * @brief Delete chunks no manifest references
+     *
+     * Chunks written or reused within the last few minutes are kept, so
+     * uploads racing with the pass never lose a chunk their manifest is
+     * about to reference.
+     * @param walkManifests Calls its argument for every manifest in the store; returns false on error
+     * @return Counts for the pass; nothing is deleted if the walk fails
+     */
+    GcResult collectGarbage(const std::function<bool(const ManifestVisitor&)>& walkManifests);
+
+    /**
+     * @brief Path of a chunk file
+     * @param hash Chunk hash
+     * @return Path below `chunks/`
+     */
+    std::filesystem::path chunkPath(const Hash128& hash) const;
+
+private:
+    std::filesystem::path dir_;
+
+    // Writers hold it shared while they check for and reuse chunks; the
+    // sweep takes it exclusively around each deletion
+    std::shared_mutex gcMutex_;
+    std::atomic<uint64_t> tempCounter_{0};
+
+    // Store-wide totals: exact after a GC pass, maintained incrementally
+    // between passes and saved across restarts
+    std::atomic<uint64_t> logicalBytes_{0};
+    std::atomic<uint64_t> storedBytes_{0};
+
+    Counter& ingestLogical_;
+    Counter& ingestStored_;
+    Counter& gcRemoved_;
+
+    std::filesystem::path usagePath() const { return dir_ / "usage"; }
+    void loadUsage();
+    void saveUsage() const;
+};
+
+} // namespace imgstore
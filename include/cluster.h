@@ -0,0 +1,212 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+#include "crow_all.h"
+#include "auth_middleware.h"
+#include "cluster_ring.h"
+#include "io_executor.h"
+#include "metrics.h"
+#include "peer_client.h"
+
+namespace imgstore {
+
+/**
+ * @brief Routes image requests to the nodes that own them
+ *
+ * Images are placed by content hash and name mappings by the hash of the
+ * name, each on the first `replicas` distinct nodes of a consistent-hash
+ * ring. A request reaching a node that owns its key is served there: reads
+ * locally, asking the other owners until the read quorum has answered (and,
+ * on a local miss, until one has the object); writes locally and on every
+ * other owner, succeeding once the write quorum acknowledged. A request
+ * reaching any other node is proxied to the first owner that answers, or
+ * redirected to the primary owner.
+ *
+ * Nodes talk plain HTTP through the public routes; an `X-Imgstore-Hop`
+ * header marks forwarded requests so they are never forwarded again. It is
+ * only believed next to the cluster secret, so clients cannot use it to skip
+ * replication. Authorization headers are passed along, so every node needs
+ * the same key.
+ *
+ * Requests to other nodes block, so they run on the cluster's own bounded
+ * pool; the thread that served the local part returns as soon as they are
+ * queued, and the response is delivered once the other nodes have answered.
+ */
+class Cluster {
+public:
+    /**
+     * @brief Membership and replication settings
+     */
+    struct Options {
+        std::vector<ClusterRing::Node> nodes;
+        std::string self;                      // id of this node
+        size_t replicas = 3;                   // owners per key, capped at the node count
+        size_t writeQuorum = 0;                // acknowledgements a write needs; 0 = majority
+        size_t readQuorum = 1;                 // owners that must answer a read
+        size_t virtualNodes = 128;             // ring points per node
+        bool redirect = false;                 // answer 307 instead of proxying
+        std::chrono::milliseconds timeout{2000}; // connect and socket timeout for peers
+        size_t threads = 16;                   // requests to other nodes in flight at once
+        std::string secret;                    // shared by members; empty trusts every hop header
+    };
+
+    /**
+     * @brief Carries the cluster secret on requests between members
+     */
+    static constexpr const char* kSecretHeader = "X-Imgstore-Cluster-Key";
+
+    /**
+     * @brief Receives the response for the client; may run on any thread
+     */
+    using Reply = std::function<void(crow::response)>;
+
+    /**
+     * @brief Snapshot of the membership for the admin API
+     */
+    struct Status {
+        std::string self;
+        std::vector<ClusterRing::Node> nodes;
+        size_t replicas = 0;
+        size_t writeQuorum = 0;
+        size_t readQuorum = 0;
+        size_t virtualNodes = 0;
+        bool redirect = false;
+    };
+
+    /**
+     * @brief Join the cluster
+     * @param options Membership and replication settings
+     * @throws std::invalid_argument if this node is not a member, ids repeat or a quorum cannot be met
+     */
+    explicit Cluster(Options options);
+
+    /**
+     * @brief Ring key of an image
+     * @param imageId Content hash, or any other image ID
+     * @return The hash itself, so placement follows the content
+     */
+    static uint64_t imageKey(const std::string& imageId);
+
+    /**
+     * @brief Ring key of a name mapping
+     * @param name Image name
+     * @return XXH3 of the name
+     */
+    static uint64_t nameKey(const std::string& name);
+
+    /**
+     * @brief Nodes owning a key
+     * @param key Ring key
+     * @return Owners, primary first
+     */
+    std::vector<ClusterRing::Node> owners(uint64_t key) const;
+
+    /**
+     * @brief Serve a request here or on the owners of its key
+     *
+     * The local part runs on the calling thread; anything involving other
+     * nodes is queued on the cluster pool and this returns without waiting.
+     * @param req Incoming request; must stay alive until reply is called
+     * @param key Ring key of the object the request is about
+     * @param local Handles the request against this node's storage
+     * @param reply Called exactly once with the response for the client
+     * @param contentKey For named uploads, the image's content key; the
+     *        image is also copied to the owners of its hash
+     */
+    void route(const crow::request& req, uint64_t key, const std::function<crow::response()>& local,
+               const Reply& reply, std::optional<uint64_t> contentKey = std::nullopt);
+
+    /**
+     * @brief Describe the membership
+     * @return Status snapshot
+     */
+    Status status() const;
+
+private:
+    struct PendingWrite;
+
+    ClusterRing ring_;
+    size_t self_;
+    size_t replicas_;
+    size_t writeQuorum_;
+    size_t readQuorum_;
+    bool redirect_;
+    PeerClient client_;
+    std::string secret_;
+    AuthMiddleware members_;
+
+    Counter& servedLocal_;
+    Counter& proxied_;
+    Counter& redirected_;
+    Counter& replicaWrites_;
+    Counter& replicaFailures_;
+    Counter& peerErrors_;
+    Counter& readQuorumFailures_;
+    Counter& writeQuorumFailures_;
+    Summary& peerSeconds_;
+
+    // Declared last so its workers stop before anything they use is destroyed
+    IoExecutor pool_;
+
+    /**
+     * @brief Hop header of a request, if it came from a member
+     * @param req Incoming request
+     * @return Hop value, or empty for client requests and unproven hops
+     */
+    std::string trustedHop(const crow::request& req) const;
+
+    /**
+     * @brief Run work on the cluster pool and reply with its result
+     * @param reply Receives the result, or a 500 if work throws
+     * @param work Request handling that talks to other nodes
+     */
+    void onPool(const Reply& reply, std::function<crow::response()> work);
+
+    /**
+     * @brief Send a request on to another node
+     * @param req Incoming request, whose headers are passed along
+     * @param node Destination
+     * @param hop Value of the hop header: "proxy" or "replica"
+     * @param target Path and query; defaults to the request's own
+     * @return Peer response, or nullopt if it could not be reached
+     */
+    std::optional<PeerClient::Response> forward(const crow::request& req, const ClusterRing::Node& node,
+                                                const std::string& hop, const std::string& target = "");
+
+    void read(const crow::request& req, const std::vector<size_t>& owners,
+              const std::function<crow::response()>& local, const Reply& reply);
+
+    /**
+     * @brief Ask the other owners until the read quorum has answered
+     * @param req Incoming request
+     * @param owners Owners of the key
+     * @param mine This node's own answer
+     * @return Response for the client
+     */
+    crow::response readOthers(const crow::request& req, const std::vector<size_t>& owners, crow::response mine);
+
+    void write(const crow::request& req, const std::vector<size_t>& owners,
+               const std::function<crow::response()>& local, const Reply& reply, std::optional<uint64_t> contentKey);
+
+    /**
+     * @brief Reply to a write once every forwarded copy has answered
+     * @param write Collected acknowledgements
+     */
+    void finishWrite(PendingWrite& write);
+
+    crow::response proxy(const crow::request& req, const std::vector<size_t>& owners);
+
+    /**
+     * @brief Convert a peer response for the client
+     * @param peer Response from another node
+     * @return Equivalent Crow response
+     */
+    static crow::response toResponse(const PeerClient::Response& peer);
+};
+
+} // namespace imgstore
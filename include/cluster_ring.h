@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Consistent-hash ring mapping keys to cluster nodes
+ *
+ * Every node is placed at many points on a 64-bit ring (virtual nodes), so
+ * keys spread evenly and adding or removing a node moves only about 1/n of
+ * them. Keys are XXH3 values: image content hashes are used as they are,
+ * names are hashed first. A key is owned by the nodes of the first distinct
+ * points found walking clockwise from it.
+ */
+class ClusterRing {
+public:
+    /**
+     * @brief Cluster member
+     */
+    struct Node {
+        std::string id;      // stable name; the ring positions derive from it
+        std::string address; // host:port the node serves HTTP on
+    };
+
+    /**
+     * @brief Build the ring
+     * @param nodes Cluster members; ids must be unique
+     * @param virtualNodes Ring points per node
+     */
+    ClusterRing(std::vector<Node> nodes, size_t virtualNodes);
+
+    /**
+     * @brief Nodes that own a key, primary first
+     * @param key Ring key
+     * @param count Number of distinct owners wanted
+     * @return Indices into nodes(), at most count and at most the node count
+     */
+    std::vector<size_t> owners(uint64_t key, size_t count) const;
+
+    const std::vector<Node>& nodes() const { return nodes_; }
+    size_t virtualNodes() const { return virtualNodes_; }
+
+    /**
+     * @brief Parse an "id=host:port" member specification
+     * @param spec Specification
+     * @param node Receives the member
+     * @return false if the specification is malformed
+     */
+    static bool parseNode(const std::string& spec, Node& node);
+
+    /**
+     * @brief Read members from a file of "id host:port" lines
+     *
+     * Blank lines and lines starting with '#' are skipped.
+     * @param path File to read
+     * @param nodes Members are appended here
+     * @param error Set to the reason on failure
+     * @return true if the whole file was read
+     */
+    static bool loadFile(const std::string& path, std::vector<Node>& nodes, std::string& error);
+
+private:
+    std::vector<Node> nodes_;
+    size_t virtualNodes_;
+    std::vector<std::pair<uint64_t, size_t>> points_; // ring position, node index; sorted
+};
+
+} // namespace imgstore
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Which reads check image content against its hash before serving
+ */
+struct ReadVerifyConfig {
+    bool hashRoutes = false;                // GET /images/<hash>
+    bool namedRoutes = false;               // GET /<name>
+    std::vector<std::string> namePrefixes;  // GET /<name> for names starting with a prefix
+};
+
+/**
+ * @brief Runtime configuration assembled from command-line flags and environment
+ */
+struct ServerConfig {
+    std::string storageDir = "./storage";
+    int port = 8080;
+    std::string apiKey;
+
+    // Worker threads for blocking storage I/O
+    int ioThreads = 16;
+
+    // Threads used to resize a single image variant
+    int resizeThreads = 4;
+
+    // Formats downloads may be transcoded to when the Accept header lists
+    // them, most preferred first; empty disables negotiation
+    std::vector<std::string> transcodeFormats = {"avif", "webp"};
+
+    // Named variant presets as "name:w=...,h=...,fit=...,q=..." definitions
+    std::vector<std::string> variantPresets = {
+        "thumb:w=200,h=200,fit=cover",
+        "card:w=600,h=400,fit=cover",
+        "hero:w=1600",
+    };
+
+    // Eager generation of preset variants after upload; a queue size of 0
+    // leaves all variants to be built on first download
+    int variantQueueSize = 256;
+    int variantThreads = 2;
+
+    // Shed eager variant work while the 1-minute load average per core is
+    // above this (0 ignores load) or requests are waiting for I/O threads
+    double variantMaxLoad = 1.0;
+
+    // Cached variants kept on disk per source image; 0 keeps every one
+    int variantsPerSource = 64;
+
+    // Structural validation of uploads (PNG, JPEG, GIF, WebP); strict also
+    // refuses content that is not a recognised image format
+    bool validateUploads = false;
+    bool rejectUnknownUploads = false;
+
+    // Perceptual hashing at upload for near-duplicate search
+    bool similarityIndex = false;
+
+    // Content-defined chunking of images at or above chunkMinSizeKB
+    bool chunking = false;
+    int chunkMinSizeKB = 1024;
+
+    // More disks to stripe storageDir's images across; each admits
+    // diskQueueDepth operations at a time
+    std::vector<std::string> dataDisks;
+    int diskQueueDepth = 8;
+
+    // Colder storage roots after storageDir, in tier order. Images idle for
+    // demoteAfterHours move one tier colder; promoteAfterReads reads of a
+    // cold image (0 = never) move it back to storageDir
+    std::vector<std::string> coldStorageDirs;
+    double demoteAfterHours = 72.0;
+    int promoteAfterReads = 1;
+
+    // Second storage root every write is replicated to, before the request
+    // returns or through a queue of mirrorQueueSize writes. Reads fail over
+    // to it when the primary copy is missing or damaged, or its disk does not
+    // admit the read within mirrorReadTimeoutMs (0 = wait indefinitely)
+    std::string mirrorDir;
+    bool mirrorAsync = false;
+    int mirrorQueueSize = 1024;
+    int mirrorReadTimeoutMs = 1000;
+
+    // Shard roots for Reed-Solomon coded images of at least ecMinSizeKB:
+    // ecParity of the roots hold parity and the rest data, so any ecParity
+    // roots can be lost. Smaller images are stored whole in storageDir
+    std::vector<std::string> ecDirs;
+    int ecParity = 2;
+    int ecMinSizeKB = 4096;
+
+    // Cluster membership as "id=host:port" entries and/or a file of
+    // "id host:port" lines; clustering is on when nodeId names a member.
+    // Every key lives on `replicas` nodes of a ring with virtualNodes points
+    // per node; writes need writeQuorum acknowledgements (0 = majority) and
+    // reads readQuorum answers. Requests for keys this node does not own are
+    // proxied to an owner, or redirected when clusterRedirect is set
+    std::vector<std::string> clusterNodes;
+    std::string clusterConfigFile;
+    std::string nodeId;
+    int replicas = 3;
+    int writeQuorum = 0;
+    int readQuorum = 1;
+    int virtualNodes = 128;
+    bool clusterRedirect = false;
+    int clusterTimeoutMs = 2000;
+    // Threads making requests to other nodes, and the secret members prove
+    // themselves with (empty = the API key)
+    int clusterThreads = 16;
+    std::string clusterSecret;
+
+    // Peers (host:port) asked for images that miss locally; fetched copies
+    // are verified against their hash and kept when peerCache is set
+    std::vector<std::string> peers;
+    bool peerCache = false;
+    int peerTimeoutMs = 2000;
+
+    // Replicas (host:port) whose hash trees are compared every
+    // syncIntervalSeconds (0 = only on request); images only they hold are copied
+    // and deletes remembered for tombstoneRetentionHours are applied (0 = forever)
+    std::vector<std::string> syncPeers;
+    int syncIntervalSeconds = 600;
+    int tombstoneRetentionHours = 720;
+
+    // Append-only log of uploads, deletes and name changes under feed/,
+    // trimmed to feedMaxSizeMB and feedRetentionHours (0 = no age limit)
+    bool feedEnabled = false;
+    int feedRetentionHours = 168;
+    int feedMaxSizeMB = 1024;
+
+    // Point-in-time backup archives written on request to backupDir
+    // (empty = <storageDir>/backups), reading at most backupRateMBps (0 = unlimited)
+    std::string backupDir;
+    double backupRateMBps = 50.0;
+
+    // Shard directory levels and hex digits per level; a store written with
+    // another layout is migrated online, reshardRate entries per second (0 = unthrottled)
+    int shardDepth = 3;
+    int shardWidth = 2;
+    double reshardRate = 1000.0;
+
+    // Shard directories StorageManager keeps open for openat() and friends
+    // (0 = open per request)
+    int dirCacheSize = 4096;
+
+    // Track which shard directories exist so writes skip checking them
+    bool knownDirs = true;
+
+    // Index snapshot cadence
+    int snapshotIntervalSeconds = 300;
+
+    // Background integrity scrubber
+    bool scrubEnabled = false;
+    double scrubRateMBps = 50.0;
+    int scrubIntervalHours = 24;
+
+    // Hash verification on read
+    ReadVerifyConfig verifyReads;
+};
+
+} // namespace imgstore
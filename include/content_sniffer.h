@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Encoded image formats the store can recognise
+ *
+ * Values are persisted in the object index; append new formats, never
+ * renumber.
+ */
+enum class ImageFormat : uint8_t {
+    Unknown = 0,
+    Jpeg = 1,
+    Png = 2,
+    Gif = 3,
+    Bmp = 4,
+    Webp = 5,
+    Avif = 6,
+    Heic = 7,
+    Tiff = 8,
+    Ico = 9,
+    Svg = 10,
+    Jxl = 11,
+};
+
+/**
+ * @brief Identify image formats from their leading bytes
+ *
+ * Magic numbers live in a signature table that is compiled, together with
+ * a 256-entry index on the first byte, into constant data. A lookup reads
+ * the first byte once, then compares only the signatures that can start
+ * with it. ISO-BMFF files (AVIF, HEIC) are told apart by their ftyp
+ * brands, and SVG by its root element.
+ */
+class ContentSniffer {
+public:
+    /**
+     * @brief Bytes of an image that sniff() may look at
+     */
+    static constexpr size_t kSniffLength = 4096;
+
+    /**
+     * @brief Identify the format of encoded data
+     * @param data Start of the encoded image
+     * @param size Number of bytes available
+     * @return Detected format, or ImageFormat::Unknown
+     */
+    static ImageFormat sniff(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Identify the format of encoded data
+     * @param data Encoded image
+     * @return Detected format, or ImageFormat::Unknown
+     */
+    static ImageFormat sniff(const std::vector<uint8_t>& data) { return sniff(data.data(), data.size()); }
+};
+
+} // namespace imgstore
@@ -13770,6 +13770,10 @@ namespace crow
         /// Call the after handle middleware and send the write the response to the connection.
         void complete_request()
         {
+            // prepare_buffers() resets complete_request_handler_, which may hold
+            // the last reference to this connection when a response is ended
+            // asynchronously; keep it alive until the write is queued.
+            auto self = this->shared_from_this();
             CROW_LOG_INFO << "Response: " << this << ' ' << req_.raw_url << ' ' << res.code << ' ' << close_connection_;
             res.is_alive_helper_ = nullptr;
 
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <array>
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Bounded LRU of open shard directory descriptors
+ *
+ * A plain open() of a stored file makes the kernel walk every component of
+ * its path again. With the directory already open, the same open is an
+ * openat() of just the file name, and stat, unlink and rename likewise
+ * become fstatat(), unlinkat() and renameat() relative to it.
+ *
+ * Directories are opened with O_PATH, which costs no read access, and are
+ * created on first use with mkdirat() below their cached parent, so writes
+ * never check the whole chain of shard directories. Descriptors are shared:
+ * one evicted while an operation still uses it is closed when that
+ * operation finishes.
+ *
+ * Shard directories are not removed while the store runs, except the ones
+ * a layout migration empties, so a cached descriptor stays valid. Writes
+ * that find their directory gone reopen it.
+ */
+class DirectoryCache {
+public:
+    /**
+     * @brief An open directory, closed when the last user lets go
+     */
+    struct Directory {
+        int fd = -1;
+        ~Directory();
+    };
+
+    /**
+     * @brief Construct a cache
+     * @param capacity Directories kept open at most, and at most a quarter of the
+     *        descriptor limit; 0 opens each one per use
+     */
+    explicit DirectoryCache(size_t capacity);
+
+    ~DirectoryCache();
+
+    DirectoryCache(const DirectoryCache&) = delete;
+    DirectoryCache& operator=(const DirectoryCache&) = delete;
+
+    /**
+     * @brief Get an open directory
+     * @param dir Directory path
+     * @param create Create the directory and any missing parents
+     * @return Directory, or nullptr with errno set
+     */
+    std::shared_ptr<const Directory> open(const std::filesystem::path& dir, bool create);
+
+    /**
+     * @brief Get a directory only if it is already open
+     * @param dir Directory path
+     * @return Directory, or nullptr without touching the filesystem
+     */
+    std::shared_ptr<const Directory> cached(const std::filesystem::path& dir);
+
+    /**
+     * @brief Open a file relative to its cached directory
+     * @param path File path
+     * @param flags open(2) flags; with O_CREAT the directory is created as needed
+     * @param mode Permissions for a created file
+     * @return File descriptor, or -1 with errno set
+     */
+    int openFile(const std::filesystem::path& path, int flags, mode_t mode = 0644);
+
+    /**
+     * @brief Stat a file relative to its cached directory
+     * @param path File path
+     * @param st Receives the file status
+     * @return true if the file exists
+     */
+    bool stat(const std::filesystem::path& path, struct stat& st);
+
+    /**
+     * @brief Check that a file exists
+     * @param path File path
+     * @return true if it exists
+     */
+    bool exists(const std::filesystem::path& path);
+
+    /**
+     * @brief Remove a file relative to its cached directory
+     * @param path File path
+     * @return true if a file was removed
+     */
+    bool unlink(const std::filesystem::path& path);
+
+    /**
+     * @brief Rename a file between two cached directories
+     * @param from Current path
+     * @param to New path; its directory must exist
+     * @return true on success, false with errno set
+     */
+    bool rename(const std::filesystem::path& from, const std::filesystem::path& to);
+
+    /**
+     * @brief Drop a directory that was removed or replaced behind the cache's back
+     * @param dir Directory path
+     */
+    void forget(const std::filesystem::path& dir);
+
+private:
+    static constexpr size_t kShards = 16;
+
+    /**
+     * @brief Independently locked part of the LRU
+     */
+    struct Shard {
+        using Entry = std::pair<std::string, std::shared_ptr<const Directory>>;
+        std::mutex mutex;
+        std::list<Entry> lru; // most recently used first
+        std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+    };
+
+    size_t shardCapacity_;
+    std::array<Shard, kShards> shards_;
+
+    Counter& hits_;
+    Counter& misses_;
+    Counter& created_;
+    Counter& syscalls_;
+
+    Shard& shardOf(const std::string& dir);
+    std::shared_ptr<const Directory> lookup(const std::string& dir);
+    void insert(const std::string& dir, std::shared_ptr<const Directory> directory);
+};
+
+} // namespace imgstore
@@ -0,0 +1,246 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief Spreads the primary storage tier across several disks
+ *
+ * Each image lives on the disk with the highest rendezvous score, the XXH3
+ * of the image hash and the disk's ID. Every disk can compute the owner
+ * without a lookup table, and adding a disk only moves the images the new
+ * disk wins; nothing moves between the existing disks.
+ *
+ * The main storage directory is always disk 0 and keeps the index, name
+ * mappings and chunk store. The placement map in its `disks` file lists
+ * the other disks by ID and path, and how many disks images are already
+ * balanced across. Each disk root holds its ID in `.disk-id`, so disks
+ * can be remounted elsewhere without losing their place.
+ *
+ * After a disk is added, a background pass moves the images it wins.
+ * Until the pass completes, a read that misses falls back to where the
+ * image was placed before the disk was added.
+ *
+ * Each disk admits a bounded number of operations at a time; the rest wait
+ * in a FIFO queue of their own, so a slow disk backs up without taking
+ * turns from the others.
+ */
+class DiskSet {
+    struct Disk;
+
+public:
+    /**
+     * @brief Snapshot of one disk for the admin API
+     */
+    struct DiskStatus {
+        size_t disk = 0;
+        std::string path;
+        std::string id;
+        bool healthy = true;
+        size_t queued = 0;
+        size_t inFlight = 0;
+        uint64_t errors = 0;
+    };
+
+    /**
+     * @brief Admission to a disk's I/O queue, held for the duration of one operation
+     *
+     * Paths outside every disk get an empty slot that admits immediately.
+     */
+    class Slot {
+    public:
+        Slot() = default;
+        Slot(Slot&& other) noexcept;
+        Slot& operator=(Slot&&) = delete;
+        ~Slot();
+
+        /**
+         * @brief Record that the operation failed with an I/O error
+         */
+        void fail() { failed_ = true; }
+
+        /**
+         * @brief Whether the wait ran out before the disk admitted the operation
+         * @return true if the caller must not touch the disk
+         */
+        bool timedOut() const { return timedOut_; }
+
+    private:
+        friend class DiskSet;
+        Disk* disk_ = nullptr;
+        std::chrono::steady_clock::time_point start_;
+        bool failed_ = false;
+        bool timedOut_ = false;
+    };
+
+    /**
+     * @brief Callback running one rebalance pass; returns true if it completed
+     */
+    using RebalancePass = std::function<bool()>;
+
+    /**
+     * @brief Open the disk set
+     * @param baseDir Main storage directory; disk 0
+     * @param extraDirs Disks to add if the placement map does not list them yet
+     * @param layout Shard directory layout below every disk root
+     * @param queueDepth Operations each disk runs at once
+     */
+    DiskSet(const std::filesystem::path& baseDir, const std::vector<std::string>& extraDirs, const ShardLayout& layout,
+            size_t queueDepth);
+
+    ~DiskSet();
+
+    DiskSet(const DiskSet&) = delete;
+    DiskSet& operator=(const DiskSet&) = delete;
+
+    size_t diskCount() const;
+
+    /**
+     * @brief Root directory of a disk
+     * @param disk Disk number
+     * @return Root path
+     */
+    std::filesystem::path root(size_t disk) const;
+
+    /**
+     * @brief Where an image belongs under the current disk set
+     * @param imageId Unique identifier for the image
+     * @return Sharded path on the owning disk
+     */
+    std::filesystem::path pathFor(const std::string& imageId) const;
+
+    /**
+     * @brief The other place an image may be while a rebalance is in progress
+     * @param imageId Unique identifier for the image
+     * @param tried Path that was tried
+     * @return The current or previous placement, whichever was not tried;
+     *         nullopt when no rebalance is pending or both are the same
+     */
+    std::optional<std::filesystem::path> alternatePath(const std::string& imageId,
+                                                       const std::filesystem::path& tried) const;
+
+    /**
+     * @brief Find where an image is stored right now
+     *
+     * Costs a stat only while a rebalance is pending.
+     * @param imageId Unique identifier for the image
+     * @return Current placement, or the previous one if the image has not moved yet
+     */
+    std::filesystem::path locate(const std::string& imageId) const;
+
+    /**
+     * @brief Wait for a turn on the disk holding a path
+     * @param path Image path
+     * @param timeout Longest wait before giving up; zero waits indefinitely
+     * @return Slot to hold while doing the I/O; check timedOut() when a timeout was given
+     */
+    Slot acquire(const std::filesystem::path& path,
+                 std::chrono::milliseconds timeout = std::chrono::milliseconds::zero());
+
+    /**
+     * @brief Add a disk online and start moving the images it wins
+     * @param dir Root directory of the new disk
+     * @param error Set to the reason on failure
+     * @return false if the directory is unusable or already part of the set
+     */
+    bool addDisk(const std::string& dir, std::string& error);
+
+    /**
+     * @brief Set the rebalance pass and run it if a rebalance is pending
+     * @param pass Moves every image not on the disk that owns it
+     */
+    void startRebalance(RebalancePass pass);
+
+    /**
+     * @brief Abandon any running rebalance pass and join its thread
+     */
+    void stop();
+
+    /**
+     * @brief Whether a rebalance pass should give up
+     * @return true once stop() has been called
+     */
+    bool stopping() const { return stopping_.load(); }
+
+    /**
+     * @brief Whether some disks do not hold all their images yet
+     * @return true while a rebalance is pending or running
+     */
+    bool rebalancing() const;
+
+    /**
+     * @brief Count an image moved by a rebalance pass
+     * @param bytes Size of the image
+     */
+    void recordMove(uint64_t bytes);
+
+    /**
+     * @brief Describe every disk
+     * @return One entry per disk, in disk order
+     */
+    std::vector<DiskStatus> status() const;
+
+    /**
+     * @brief Copy a file into place on another disk without exposing a partial copy
+     *
+     * The copy is written beside the target, flushed, and renamed over it;
+     * the source is left for the caller to remove.
+     * @param source File to copy
+     * @param target Destination path; its directory is created if needed
+     * @param bytes Set to the size of the file
+     * @return false on I/O error, with nothing left at the target
+     */
+    static bool copyDurably(const std::filesystem::path& source, const std::filesystem::path& target,
+                            uint64_t& bytes);
+
+private:
+    std::filesystem::path baseDir_;
+    ShardLayout layout_;
+    size_t queueDepth_;
+
+    mutable std::shared_mutex mutex_;
+    std::vector<std::unique_ptr<Disk>> disks_;
+    size_t settled_ = 1; // images are balanced across disks [0, settled_)
+
+    std::mutex rebalanceMutex_;
+    std::thread rebalanceThread_;
+    RebalancePass pass_;
+    bool rerun_ = false;
+    std::atomic<bool> running_{false};
+    std::atomic<bool> stopping_{false};
+
+    Counter& rebalanceMoved_;
+    Counter& rebalanceBytes_;
+
+    std::filesystem::path mapPath() const { return baseDir_ / "disks"; }
+
+    static std::filesystem::path normalize(const std::string& dir);
+    static std::optional<uint64_t> readDiskId(const std::filesystem::path& root);
+    static std::optional<uint64_t> claimDisk(const std::filesystem::path& root);
+
+    bool loadMap(std::vector<std::pair<uint64_t, std::filesystem::path>>& disks);
+    bool saveMapLocked() const;
+    void registerDisk(uint64_t id, const std::filesystem::path& root, bool healthy);
+
+    size_t placeLocked(const std::string& imageId, size_t count) const;
+    std::filesystem::path pathOnLocked(const std::string& imageId, size_t disk) const;
+    Disk* diskOfLocked(const std::filesystem::path& path) const;
+    void launchRebalance();
+};
+
+} // namespace imgstore
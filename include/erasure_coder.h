@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Systematic Reed-Solomon code over GF(256)
+ *
+ * k data shards are extended with m parity shards so that any k of the
+ * k+m shards recover the rest. The encoding matrix is a Vandermonde matrix
+ * normalised so its first k rows are the identity: data shards are stored
+ * as they are, and every k-row subset stays invertible.
+ *
+ * All the arithmetic reduces to "multiply a region by a constant and XOR it
+ * into another". That kernel uses split-nibble table lookups, 32 bytes per
+ * instruction with AVX2 or 16 with SSSE3, falling back to a 64 KiB product
+ * table elsewhere; the variant is picked once at startup.
+ */
+class ErasureCoder {
+public:
+    /**
+     * @brief Build the code
+     * @param dataShards k, at least 1
+     * @param parityShards m, at least 1; k + m is at most 255
+     */
+    ErasureCoder(size_t dataShards, size_t parityShards);
+
+    size_t dataShards() const { return k_; }
+    size_t parityShards() const { return m_; }
+    size_t totalShards() const { return k_ + m_; }
+
+    /**
+     * @brief Compute the parity shards
+     * @param data k data shards of size bytes each
+     * @param parity m parity shards of size bytes each, overwritten
+     * @param size Shard size in bytes
+     */
+    void encode(const std::vector<const uint8_t*>& data, const std::vector<uint8_t*>& parity, size_t size) const;
+
+    /**
+     * @brief Recompute missing shards from any k present ones
+     * @param shards k+m shards of size bytes each, data first
+     * @param present Which shards hold valid data
+     * @param size Shard size in bytes
+     * @param withParity Rebuild missing parity shards too, not just data
+     * @return false if fewer than k shards are present
+     */
+    bool reconstruct(const std::vector<uint8_t*>& shards, const std::vector<bool>& present, size_t size,
+                     bool withParity) const;
+
+    /**
+     * @brief Name of the multiply-add kernel in use, for logs and status
+     * @return "avx2", "ssse3" or "portable"
+     */
+    static const char* kernelName();
+
+private:
+    size_t k_;
+    size_t m_;
+    std::vector<uint8_t> matrix_; // (k+m) x k encoding matrix, row-major
+};
+
+} // namespace imgstore
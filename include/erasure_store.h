@@ -0,0 +1,218 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include "erasure_coder.h"
+#include "metrics.h"
+#include "object_index.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief Erasure-coded storage of large images across several roots
+ *
+ * An image is cut into k data shards and extended with m Reed-Solomon
+ * parity shards, one per root, so losing any m roots loses nothing while
+ * costing m/k extra space instead of a full copy. Which root gets which
+ * shard rotates with the image hash, spreading parity writes evenly.
+ *
+ * The image's place in the primary tree holds a small stub recording the
+ * layout; the shards live at the same shard path under each root, each with
+ * a header carrying its checksum, so a damaged shard is told apart from a
+ * missing one and neither is ever decoded as data.
+ *
+ * Reads use the data shards directly and only decode when some are missing
+ * or damaged. Such degraded reads queue the image for a background thread
+ * that rewrites the lost shards. The same thread sweeps every root on
+ * request, or at startup when a root is new or was swapped, rebuilding
+ * shards that are missing and removing those of deleted images.
+ */
+class ErasureStore {
+public:
+    /**
+     * @brief Layout recorded in an image's stub
+     */
+    struct Stub {
+        uint64_t size = 0;
+        uint8_t dataShards = 0;
+        uint8_t parityShards = 0;
+    };
+
+    /**
+     * @brief Counts from one sweep over the shard roots
+     */
+    struct SweepResult {
+        bool completed = false;
+        uint64_t objects = 0;
+        uint64_t shardsRebuilt = 0;
+        uint64_t unrecoverable = 0;
+        uint64_t orphansRemoved = 0;
+    };
+
+    /**
+     * @brief Snapshot of the store for the admin API
+     */
+    struct Status {
+        size_t dataShards = 0;
+        size_t parityShards = 0;
+        std::vector<std::string> roots;
+        std::string kernel;
+        size_t queued = 0;
+        bool sweeping = false;
+        SweepResult lastSweep;
+    };
+
+    /**
+     * @brief Open the shard roots
+     * @param roots One directory per shard, ideally each on its own disk
+     * @param parityShards m; the remaining roots hold data shards
+     * @param layout Shard directory layout below every root
+     * @param index Object index, consulted to tell deleted images' shards from live ones
+     * @throws std::invalid_argument if the roots cannot hold at least one data and one parity shard
+     */
+    ErasureStore(const std::vector<std::string>& roots, size_t parityShards, const ShardLayout& layout,
+                 ObjectIndex& index);
+
+    ~ErasureStore();
+
+    ErasureStore(const ErasureStore&) = delete;
+    ErasureStore& operator=(const ErasureStore&) = delete;
+
+    size_t dataShards() const { return coder_.dataShards(); }
+    size_t parityShards() const { return coder_.parityShards(); }
+
+    /**
+     * @brief Check whether stored bytes are an erasure-coding stub
+     * @param data Start of the stored file
+     * @param size Number of bytes available
+     * @return true if the data starts with the stub magic
+     */
+    static bool isStub(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Parse a stub
+     * @param stub Stub bytes
+     * @return Layout, or nullopt if the stub is damaged
+     */
+    static std::optional<Stub> parseStub(const std::vector<uint8_t>& stub);
+
+    /**
+     * @brief Read and parse the stub stored at a path
+     * @param path File in the primary tree
+     * @return Layout, or nullopt if the file is not a stub
+     */
+    static std::optional<Stub> readStub(const std::filesystem::path& path);
+
+    /**
+     * @brief Encode an image and write its shards
+     *
+     * Succeeds as long as k shards are written; the rest are queued for rebuild.
+     * @param imageId Unique identifier for the image
+     * @param data Image data
+     * @return Stub to store in place of the image, or nullopt on I/O error
+     */
+    std::optional<std::vector<uint8_t>> write(const std::string& imageId, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Read an image, decoding around missing or damaged shards
+     * @param imageId Unique identifier for the image
+     * @param stub Layout from the image's stub
+     * @param out Receives the image data
+     * @return false if fewer than k intact shards remain
+     */
+    bool read(const std::string& imageId, const Stub& stub, std::vector<uint8_t>& out);
+
+    /**
+     * @brief Read every shard of an image, rewriting damaged ones, for the scrubber
+     * @param imageId Unique identifier for the image
+     * @param stub Layout from the image's stub
+     * @param out Receives the image data
+     * @param bytesRead Set to the shard bytes read
+     * @return false if the image cannot be recovered
+     */
+    bool scrub(const std::string& imageId, const Stub& stub, std::vector<uint8_t>& out, uint64_t& bytesRead);
+
+    /**
+     * @brief Delete the shards of an image
+     * @param imageId Unique identifier for the image
+     */
+    void remove(const std::string& imageId);
+
+    /**
+     * @brief Start the rebuild thread
+     * @param sweepNow Sweep the roots now instead of waiting for a request
+     */
+    void start(bool sweepNow);
+
+    /**
+     * @brief Stop the rebuild thread, abandoning queued rebuilds
+     */
+    void stop();
+
+    /**
+     * @brief Request a sweep over every root
+     * @return false if one is already running
+     */
+    bool triggerSweep();
+
+    /**
+     * @brief Whether a root was new or replaced at startup
+     * @return true if some root carried no `.ec-root` marker
+     */
+    bool needsSweep() const { return needsSweep_; }
+
+    /**
+     * @brief Describe the store
+     * @return Status snapshot
+     */
+    Status status() const;
+
+private:
+    struct Loaded;
+
+    std::vector<std::filesystem::path> roots_;
+    ShardLayout layout_;
+    ObjectIndex& index_;
+    ErasureCoder coder_;
+    bool needsSweep_ = false;
+    std::atomic<uint64_t> tempCounter_{0};
+
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopRequested_ = false;
+    bool sweepRequested_ = false;
+    std::atomic<bool> sweeping_{false};
+    std::deque<std::string> pending_; // images with shards to rebuild
+    std::unordered_set<std::string> queued_;
+    SweepResult lastSweep_;
+
+    Summary& encodeSeconds_;
+    Summary& decodeSeconds_;
+    Counter& degradedReads_;
+    Counter& degradedWrites_;
+    Counter& shardErrors_;
+    Counter& shardsRebuilt_;
+    Counter& unrecoverable_;
+
+    std::filesystem::path shardPath(const std::string& imageId, size_t shard) const;
+    bool writeShard(const std::string& imageId, size_t shard, uint64_t size, size_t shardSize, const uint8_t* payload);
+    bool readShard(const std::string& imageId, size_t shard, uint64_t size, size_t shardSize, uint8_t* payload);
+    bool load(const std::string& imageId, uint64_t size, bool everyShard, Loaded& loaded);
+    bool rebuild(const std::string& imageId, std::optional<uint64_t> size, size_t& rebuilt);
+    void queueRebuild(const std::string& imageId);
+    SweepResult sweep();
+    void loop();
+};
+
+} // namespace imgstore
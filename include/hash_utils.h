@@ -2,9 +2,22 @@
 
 #include <string>
 #include <cstdint>
+#include <cstddef>
+
+struct XXH3_state_s;
 
 namespace imgstore {
 
+/**
+ * @brief 128-bit hash value
+ */
+struct Hash128 {
+    uint64_t high = 0;
+    uint64_t low = 0;
+
+    bool operator==(const Hash128&) const = default;
+};
+
 /**
  * @brief Utility class for hashing operations using xxHash3
  */
@@ -25,6 +38,17 @@ public:
      */
     static uint64_t xxh3_64(const std::string& str);
 
+    /**
+     * @brief Compute XXH3 128-bit hash of data
+     *
+     * For keys that must stay collision-free across far more objects than
+     * a 64-bit hash comfortably covers, such as deduplicated chunks.
+     * @param data Pointer to data buffer
+     * @param size Size of data in bytes
+     * @return 128-bit hash value
+     */
+    static Hash128 xxh3_128(const void* data, size_t size);
+
     /**
      * @brief Generate shard path from hash value
      * @param hash Hash value
@@ -40,6 +64,54 @@ public:
      * @return Hexadecimal string representation
      */
     static std::string hashToHex(uint64_t hash);
+
+    /**
+     * @brief Convert a 128-bit hash to a 32-character hex string
+     * @param hash Hash value
+     * @return Hexadecimal string, high half first
+     */
+    static std::string hashToHex(const Hash128& hash);
+
+    /**
+     * @brief Parse a 16-character hexadecimal image ID back into its hash
+     * @param hex Hexadecimal string
+     * @param hash Output hash value
+     * @return true if the string is a well-formed image ID
+     */
+    static bool hexToHash(const std::string& hex, uint64_t& hash);
+};
+
+/**
+ * @brief Incremental XXH3 64-bit hasher for data that arrives in chunks
+ */
+class Xxh3Stream {
+public:
+    Xxh3Stream();
+    ~Xxh3Stream();
+
+    Xxh3Stream(const Xxh3Stream&) = delete;
+    Xxh3Stream& operator=(const Xxh3Stream&) = delete;
+
+    /**
+     * @brief Start a new hash
+     */
+    void reset();
+
+    /**
+     * @brief Feed more input
+     * @param data Pointer to data buffer
+     * @param size Size of data in bytes
+     */
+    void update(const void* data, size_t size);
+
+    /**
+     * @brief Hash of everything fed since the last reset
+     * @return 64-bit hash value
+     */
+    uint64_t digest() const;
+
+private:
+    XXH3_state_s* state_;
 };
 
 } // namespace imgstore
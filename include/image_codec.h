@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+#include "content_sniffer.h"
+
+namespace imgstore {
+
+/**
+ * @brief Decoded 8-bit image with interleaved RGB or RGBA pixels
+ */
+struct Image {
+    int width = 0;
+    int height = 0;
+    int channels = 0; // 3 (RGB) or 4 (RGBA)
+    std::vector<uint8_t> pixels;
+};
+
+/**
+ * @brief Decode and encode images with whichever codec libraries were built in
+ *
+ * JPEG uses libjpeg, PNG libpng, WebP libwebp and AVIF libavif; each is
+ * optional and enabled by IMGSTORE_HAVE_JPEG / _PNG / _WEBP / _AVIF at
+ * build time.
+ */
+class ImageCodec {
+public:
+    /**
+     * @brief Largest image (in pixels) that will be decoded
+     *
+     * Guards against decompression bombs: a few kilobytes of PNG can
+     * declare a multi-gigapixel canvas.
+     */
+    static constexpr uint64_t kMaxPixels = 64ull * 1024 * 1024;
+
+    /**
+     * @brief Identify the format of encoded data; see ContentSniffer
+     * @param data Encoded image
+     * @return Detected format, or ImageFormat::Unknown
+     */
+    static ImageFormat detectFormat(const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Check whether images of this format can be decoded
+     * @param format Image format
+     * @return true if a decoder was built in
+     */
+    static bool canDecode(ImageFormat format);
+
+    /**
+     * @brief Check whether images can be encoded to this format
+     * @param format Image format
+     * @return true if an encoder was built in
+     */
+    static bool canEncode(ImageFormat format);
+
+    /**
+     * @brief Decode an image to RGB or RGBA
+     *
+     * When a minimum size is given, JPEG is decoded with DCT scaling to the
+     * smallest of 1/2, 1/4 or 1/8 that still covers it, which skips most of
+     * the decoding work; other formats always decode at full size.
+     * @param data Encoded image
+     * @param minWidth Smallest width the caller needs; 0 for full size
+     * @param minHeight Smallest height the caller needs; 0 for full size
+     * @return Decoded image, or nullopt if unsupported, corrupt or too large
+     */
+    static std::optional<Image> decode(const std::vector<uint8_t>& data, int minWidth = 0, int minHeight = 0);
+
+    /**
+     * @brief Encode an image
+     * @param image Decoded image; alpha is flattened onto white for formats without it
+     * @param format Output format
+     * @param quality Lossy quality, 1-100; 0 picks a per-format default
+     * @return Encoded image, or nullopt if the format is unsupported or encoding failed
+     */
+    static std::optional<std::vector<uint8_t>> encode(const Image& image, ImageFormat format, int quality);
+
+    /**
+     * @brief Pick an output format from an HTTP Accept header
+     *
+     * Only formats the client lists explicitly are considered; wildcards
+     * alone never trigger a transcode. The highest q-value wins and ties go
+     * to the earlier entry in candidates.
+     * @param accept Value of the Accept header
+     * @param candidates Formats the server may transcode to, most preferred first
+     * @return Chosen format, or ImageFormat::Unknown to serve the original
+     */
+    static ImageFormat negotiate(const std::string& accept, const std::vector<ImageFormat>& candidates);
+
+    /**
+     * @brief Parse a format name
+     * @param name "jpeg", "png", "webp" or "avif"
+     * @return Format, or ImageFormat::Unknown
+     */
+    static ImageFormat parseFormat(const std::string& name);
+
+    /**
+     * @brief Short name of a format
+     * @param format Image format
+     * @return Name accepted by parseFormat()
+     */
+    static std::string formatName(ImageFormat format);
+
+    /**
+     * @brief MIME type of a format
+     * @param format Image format
+     * @return MIME type string
+     */
+    static std::string mimeType(ImageFormat format);
+};
+
+} // namespace imgstore
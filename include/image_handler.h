@@ -1,8 +1,23 @@
 #pragma once
 
+#include <map>
 #include <memory>
 #include "crow_all.h"
+#include "anti_entropy.h"
+#include "backup_manager.h"
+#include "change_feed.h"
+#include "cluster.h"
+#include "peer_fetcher.h"
 #include "storage_manager.h"
+#include "integrity_scrubber.h"
+#include "image_transform.h"
+#include "variant_cache.h"
+#include "variant_pipeline.h"
+#include "image_validator.h"
+#include "io_executor.h"
+#include "similarity_index.h"
+#include "metrics.h"
+#include "config.h"
 
 namespace imgstore {
 
@@ -26,10 +41,14 @@ public:
 
     /**
      * @brief Handle image download request
+     *
+     * Query parameters w, h, fit and q, or a named preset, request a
+     * resized variant; the Accept header may select a transcoded one.
      * @param imageId Unique identifier for the image
+     * @param req HTTP request
      * @return HTTP response
      */
-    crow::response handleDownload(const std::string& imageId);
+    crow::response handleDownload(const std::string& imageId, const crow::request& req);
 
     /**
      * @brief Handle image delete request
@@ -48,10 +67,13 @@ public:
 
     /**
      * @brief Handle named image download request
+     *
+     * Accepts the same variant parameters as handleDownload().
      * @param imageName User-friendly name for the image
+     * @param req HTTP request
      * @return HTTP response
      */
-    crow::response handleNamedDownload(const std::string& imageName);
+    crow::response handleNamedDownload(const std::string& imageName, const crow::request& req);
 
     /**
      * @brief Handle named image delete request
@@ -72,8 +94,415 @@ public:
      */
     crow::response handleListNames();
 
+    /**
+     * @brief Handle metrics scrape request
+     * @return HTTP response in Prometheus text format
+     */
+    crow::response handleMetrics();
+
+    /**
+     * @brief Handle near-duplicate search request
+     *
+     * Query parameters: distance (maximum Hamming distance, default 10)
+     * and limit (maximum matches, default 20).
+     * @param imageId Hash of the image to find copies of
+     * @param req HTTP request
+     * @return HTTP response listing matches by distance
+     */
+    crow::response handleSimilar(const std::string& imageId, const crow::request& req);
+
+    /**
+     * @brief Handle lookup filter rebuild request
+     * @return HTTP response
+     */
+    crow::response handleRebuildFilters();
+
+    /**
+     * @brief Handle chunk garbage collection request
+     * @return HTTP response with the counts of the pass
+     */
+    crow::response handleChunkGc();
+
+    /**
+     * @brief Handle a request for the state of the storage disks
+     * @return HTTP response listing each disk
+     */
+    crow::response handleListDisks();
+
+    /**
+     * @brief Handle a request to add a storage disk
+     * @param req HTTP request with the disk root in the `path` query parameter
+     * @return HTTP response
+     */
+    crow::response handleAddDisk(const crow::request& req);
+
+    /**
+     * @brief Handle a request for the shard layout and the progress of a change to it
+     * @return HTTP response with the current layout and any migration from a previous one
+     */
+    crow::response handleLayoutStatus();
+
+    /**
+     * @brief Handle a request for the state of the storage mirror
+     * @return HTTP response with the replication queue and the last repair
+     */
+    crow::response handleMirrorStatus();
+
+    /**
+     * @brief Handle a request to re-sync the primary storage and the mirror
+     * @return HTTP response
+     */
+    crow::response handleMirrorRepair();
+
+    /**
+     * @brief Handle a request for the state of the erasure-coded store
+     * @return HTTP response with the code layout, rebuild queue and last sweep
+     */
+    crow::response handleErasureStatus();
+
+    /**
+     * @brief Handle a request to sweep the shard roots for lost shards
+     * @return HTTP response
+     */
+    crow::response handleErasureSweep();
+
+    /**
+     * @brief Handle a request for hash tree digests
+     *
+     * With a `children` query parameter (a comma-separated list of "root"
+     * and two-digit prefixes), also returns the digests below those nodes.
+     * @param req HTTP request
+     * @return HTTP response with the root digest and any requested children
+     */
+    crow::response handleMerkle(const crow::request& req);
+
+    /**
+     * @brief Handle a request to list the images under some hash tree leaves
+     * @param req HTTP request whose body lists four-digit leaf prefixes
+     * @return HTTP response with the image IDs and the deletes remembered there
+     */
+    crow::response handleMerkleObjects(const crow::request& req);
+
+    /**
+     * @brief Handle a request for when images were last written
+     * @param req HTTP request whose body lists image IDs, one per line
+     * @return HTTP response mapping each stored image to a unix time
+     */
+    crow::response handleMerkleWritten(const crow::request& req);
+
+    /**
+     * @brief Handle a request for the bytes of many images at once
+     *
+     * The body lists image IDs, one per line. The response frames each as
+     * "<id> <size>\n" followed by the bytes, or "<id> -\n" when the image is
+     * not stored, and stops after the `max` query parameter's worth of bytes.
+     * @param req HTTP request
+     * @return HTTP response with the framed images
+     */
+    crow::response handleMerkleFetch(const crow::request& req);
+
+    /**
+     * @brief Handle a request for the state of anti-entropy sync
+     * @return HTTP response with the peers and counters
+     */
+    crow::response handleSyncStatus();
+
+    /**
+     * @brief Handle a request to start an anti-entropy round
+     * @return HTTP response
+     */
+    crow::response handleSyncStart();
+
+    /**
+     * @brief Handle a request for change feed events after a cursor
+     * @param since Last sequence the consumer has processed
+     * @param limit Maximum number of events to return
+     * @return HTTP response with the events and the next cursor, or 410 if the cursor expired
+     */
+    crow::response handleFeed(uint64_t since, size_t limit);
+
+    /**
+     * @brief Handle a request for the known backups and their progress
+     * @return HTTP response with one entry per backup
+     */
+    crow::response handleBackupList();
+
+    /**
+     * @brief Handle a request to start a backup
+     *
+     * A `base` query parameter names the complete backup an incremental
+     * backup is taken against.
+     * @param req HTTP request
+     * @return HTTP response with the new backup's ID
+     */
+    crow::response handleBackupStart(const crow::request& req);
+
+    /**
+     * @brief Handle a request to download a complete backup
+     *
+     * The archive is streamed from disk rather than loaded into memory.
+     * @param id Backup ID
+     * @return HTTP response serving the tar file
+     */
+    crow::response handleBackupDownload(const std::string& id);
+
+    /**
+     * @brief Handle a request to delete a backup
+     * @param id Backup ID
+     * @return HTTP response
+     */
+    crow::response handleBackupDelete(const std::string& id);
+
+    /**
+     * @brief Attach the backup manager used by the backup endpoints
+     * @param backups Shared pointer to the manager
+     */
+    void setBackups(std::shared_ptr<BackupManager> backups);
+
+    /**
+     * @brief Record uploads, deletes and name changes in a change feed
+     * @param feed Feed to append to
+     */
+    void setChangeFeed(std::shared_ptr<ChangeFeed> feed);
+
+    /**
+     * @brief Attach the anti-entropy job used by the sync endpoints
+     * @param sync Shared pointer to the job
+     */
+    void setAntiEntropy(std::shared_ptr<AntiEntropy> sync);
+
+    /**
+     * @brief Attach the integrity scrubber used by the admin endpoints
+     * @param scrubber Shared pointer to the scrubber
+     */
+    void setScrubber(std::shared_ptr<IntegrityScrubber> scrubber);
+
+    /**
+     * @brief Attach the cluster membership described by the admin endpoint
+     * @param cluster Shared pointer to the cluster
+     */
+    void setCluster(std::shared_ptr<Cluster> cluster);
+
+    /**
+     * @brief Handle a request for the cluster membership
+     *
+     * With an `id` or `name` query parameter, also lists the owners of that image or name.
+     * @param req HTTP request
+     * @return HTTP response with the members, replication settings and owners
+     */
+    crow::response handleClusterStatus(const crow::request& req);
+
+    /**
+     * @brief Look up images missing here on peers before answering 404
+     * @param fetcher Fetcher for the configured peers
+     */
+    void setPeerFetcher(std::shared_ptr<PeerFetcher> fetcher);
+
+    /**
+     * @brief Keep an image fetched from a peer as if it had been uploaded here
+     *
+     * Appears in the change feed and the similarity index like an upload.
+     * Skipped if the image was deleted here while the fetch was running.
+     * @param imageId Hash of the image, already checked against data
+     * @param data Image bytes
+     * @return true if the image is stored
+     */
+    bool keepPeerImage(const std::string& imageId, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Enable resized variants on the download routes
+     * @param transformer Transformer that produces variants
+     * @param variants Cache that stores them
+     */
+    void setTransforms(std::shared_ptr<ImageTransformer> transformer, std::shared_ptr<VariantCache> variants);
+
+    /**
+     * @brief Enable Accept-based transcoding of downloads
+     * @param formats Formats to offer, most preferred first; empty disables negotiation
+     */
+    void setTranscodeFormats(const std::vector<ImageFormat>& formats);
+
+    /**
+     * @brief Define the variant presets addressable with ?preset=
+     * @param presets Transform for each preset name
+     */
+    void setPresets(const std::map<std::string, TransformSpec>& presets);
+
+    /**
+     * @brief Pre-generate preset variants of new uploads in the background
+     * @param pipeline Pipeline that runs and sheds the generation work
+     */
+    void setVariantPipeline(std::shared_ptr<VariantPipeline> pipeline);
+
+    /**
+     * @brief Compute perceptual hashes at upload and enable near-duplicate search
+     * @param index Index the hashes are recorded in
+     */
+    void setSimilarityIndex(std::shared_ptr<SimilarityIndex> index);
+
+    /**
+     * @brief Configure which downloads verify content against its hash
+     * @param config Routes and name prefixes to verify
+     */
+    void setReadVerification(const ReadVerifyConfig& config);
+
+    /**
+     * @brief Configure structural validation of uploads
+     * @param enabled Reject truncated or corrupt PNG, JPEG, GIF and WebP uploads
+     * @param rejectUnknown Also reject content that is not a recognised image format
+     */
+    void setUploadValidation(bool enabled, bool rejectUnknown);
+
+    /**
+     * @brief Handle integrity scrub status request
+     * @return HTTP response with progress and corruption counts
+     */
+    crow::response handleScrubStatus();
+
+    /**
+     * @brief Handle request to start an integrity scrub pass
+     * @return HTTP response
+     */
+    crow::response handleScrubStart();
+
 private:
     std::shared_ptr<StorageManager> storage_;
+    std::shared_ptr<IntegrityScrubber> scrubber_;
+    std::shared_ptr<Cluster> cluster_;
+    std::shared_ptr<PeerFetcher> peers_;
+    std::shared_ptr<AntiEntropy> sync_;
+    std::shared_ptr<ChangeFeed> feed_;
+    std::shared_ptr<BackupManager> backups_;
+    std::shared_ptr<ImageTransformer> transformer_;
+    std::shared_ptr<VariantCache> variants_;
+    std::vector<ImageFormat> transcodeFormats_;
+    std::map<std::string, TransformSpec> presets_;
+    std::shared_ptr<VariantPipeline> pipeline_;
+    std::shared_ptr<SimilarityIndex> similarity_;
+    ReadVerifyConfig verifyReads_;
+    bool validateUploads_ = false;
+    bool rejectUnknownUploads_ = false;
+
+    Summary& validateSeconds_;
+    Counter& rejectedCorrupt_;
+    Counter& rejectedTruncated_;
+    Counter& rejectedUnknown_;
+    Summary& phashSeconds_;
+
+    // Hashes new images for near-duplicate search off the request path.
+    // Declared last so queued hashes finish before the members they use go
+    std::unique_ptr<IoExecutor> hashPool_;
+
+    /**
+     * @brief Validate an upload's structure when validation is enabled
+     * @param data Uploaded bytes
+     * @param result Set to the validation result
+     * @return Error response if the upload must be rejected
+     */
+    std::optional<crow::response> validateUpload(const std::vector<uint8_t>& data, ImageValidator::Result& result);
+
+    /**
+     * @brief Compute an image's perceptual hash and record it in the similarity index
+     * @param imageId Hash of the stored image
+     * @param data Image data
+     * @return Perceptual hash, or nullopt if the index is disabled or the image cannot be decoded
+     */
+    std::optional<uint64_t> indexPerceptualHash(const std::string& imageId, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Index a newly stored image's perceptual hash in the background
+     *
+     * Decoding the whole image is slower than storing it, so uploads leave it
+     * to the hashing pool. When that pool is backed up the caller hashes the
+     * image itself rather than leave it out of the index.
+     * @param imageId Hash of the stored image
+     * @param data Image data
+     */
+    void queuePerceptualHash(const std::string& imageId, std::vector<uint8_t> data);
+
+    /**
+     * @brief Add the dimensions found by validation to an upload response
+     * @param validation Validation result
+     * @param result Upload response
+     */
+    static void addImageInfo(const ImageValidator::Result& validation, crow::json::wvalue& result);
+
+    /**
+     * @brief Work out which variant, if any, a download asks for
+     * @param req HTTP request (query parameters and Accept header)
+     * @param spec Output transform
+     * @param error Set to a description of the problem on failure
+     * @return true if a resized or transcoded variant is requested
+     */
+    bool parseTransform(const crow::request& req, TransformSpec& spec, std::string& error) const;
+
+    /**
+     * @brief Build the response for malformed transform parameters
+     * @param message Description of the problem
+     * @return HTTP 400 response
+     */
+    crow::response invalidTransformResponse(const std::string& message);
+
+    /**
+     * @brief Serve a resized or transcoded variant of a stored image
+     * @param imageId Hash of the source image
+     * @param spec Transform to apply
+     * @param verify Check the source against its hash if it has to be read
+     * @return HTTP response
+     */
+    crow::response serveVariant(const std::string& imageId, const TransformSpec& spec, bool verify);
+
+    /**
+     * @brief Fetch an image missing here from the peers
+     *
+     * With caching the fetched copy is stored and the caller serves it as
+     * usual; without, the peer's bytes (or its variant) are served directly.
+     * Images deleted here are not fetched, whatever the peers still hold.
+     * @param imageId Hash of the image
+     * @param req HTTP request
+     * @param transform Whether the request asks for a variant
+     * @return Response to send, or nullopt to carry on with local storage
+     */
+    std::optional<crow::response> serveFromPeers(const std::string& imageId, const crow::request& req,
+                                                 bool transform);
+
+    /**
+     * @brief Read a stored image and apply a transform to it
+     * @param imageId Hash of the source image
+     * @param spec Transform to apply
+     * @param verify Check the source against its hash
+     * @return Variant to store in the cache
+     */
+    Variant produceVariant(const std::string& imageId, const TransformSpec& spec, bool verify);
+
+    /**
+     * @brief Queue eager generation of every preset variant of a new image
+     * @param imageId Hash of the stored image
+     * @param result Upload response; gets a "variants" field when presets are configured
+     */
+    void queuePresetVariants(const std::string& imageId, crow::json::wvalue& result);
+
+    /**
+     * @brief Decide whether a named download must be verified
+     * @param imageName User-friendly name for the image
+     * @return true if the name is covered by the verification config
+     */
+    bool shouldVerifyName(const std::string& imageName) const;
+
+    /**
+     * @brief Build the response for a read that failed verification
+     * @param imageId Hash of the corrupted image
+     * @return HTTP 500 response
+     */
+    crow::response corruptImageResponse(const std::string& imageId);
+
+    /**
+     * @brief Append a change to the feed, if one is attached
+     * @param type Kind of change
+     * @param imageId Image hash
+     * @param imageName Image name, for name events
+     */
+    void recordChange(ChangeFeed::Type type, const std::string& imageId, const std::string& imageName = "");
 
     /**
      * @brief Generate unique image ID from content
@@ -83,11 +512,14 @@ private:
     std::string generateImageId(const std::vector<uint8_t>& data);
 
     /**
-     * @brief Detect content type from image data
+     * @brief Set Content-Type from the format recorded at ingest
+     *
+     * Falls back to sniffing the data for images indexed without a format.
+     * @param res Response to update
+     * @param imageId Hash of the image
      * @param data Image data
-     * @return MIME type string
      */
-    std::string detectContentType(const std::vector<uint8_t>& data);
+    void setContentType(crow::response& res, const std::string& imageId, const std::vector<uint8_t>& data);
 };
 
 } // namespace imgstore
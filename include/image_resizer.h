@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include "image_codec.h"
+
+namespace imgstore {
+
+/**
+ * @brief How a resized image fits the requested box
+ *
+ * None enlarges: a box bigger than the source is first shrunk, keeping its
+ * aspect ratio, until it fits inside the source.
+ */
+enum class ResizeFit {
+    Contain, // scale to fit inside the box, preserving aspect ratio
+    Cover,   // scale to fill the box, cropping the overflow around the centre
+    Fill     // stretch to exactly the box
+};
+
+/**
+ * @brief Separable Lanczos-3 resampler
+ *
+ * Each pass precomputes its filter taps once, then runs them over pixels
+ * held as four-lane float vectors so every multiply-add covers a whole pixel.
+ * Rows are split across threads for large images.
+ */
+class ImageResizer {
+public:
+    /**
+     * @brief Construct a resizer
+     * @param threads Maximum threads used for a single image
+     */
+    explicit ImageResizer(int threads);
+
+    /**
+     * @brief Resize an image into a box
+     * @param src Source image
+     * @param width Box width; 0 derives it from height and the aspect ratio
+     * @param height Box height; 0 derives it from width and the aspect ratio
+     * @param fit How the image fits the box
+     * @return Resized image with the same channel count as the source
+     */
+    Image resize(const Image& src, int width, int height, ResizeFit fit) const;
+
+    /**
+     * @brief Parse a fit mode name
+     * @param name "contain", "cover" or "fill"
+     * @param fit Output fit mode
+     * @return false if the name is not recognised
+     */
+    static bool parseFit(const std::string& name, ResizeFit& fit);
+
+    /**
+     * @brief Name of a fit mode
+     * @param fit Fit mode
+     * @return Name accepted by parseFit()
+     */
+    static std::string fitName(ResizeFit fit);
+
+private:
+    int threads_;
+};
+
+} // namespace imgstore
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "image_codec.h"
+#include "image_resizer.h"
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Requested transformation of a stored image
+ */
+struct TransformSpec {
+    int width = 0;   // 0: derived from height and aspect ratio
+    int height = 0;  // 0: derived from width and aspect ratio
+    ResizeFit fit = ResizeFit::Contain;
+    int quality = 0; // 0: encoder default
+    ImageFormat format = ImageFormat::Unknown; // Unknown: keep the source format
+
+    /**
+     * @brief Check whether the transform resizes the image
+     * @return false for a pure format conversion
+     */
+    bool resizes() const { return width > 0 || height > 0; }
+
+    /**
+     * @brief Set one parameter from its query-string form
+     * @param param Parameter name: "w", "h", "fit" or "q"
+     * @param value Parameter value
+     * @param error Set to a description of the problem on failure
+     * @return false if the name or value is invalid
+     */
+    bool set(const std::string& param, const std::string& value, std::string& error);
+
+    /**
+     * @brief Set parameters from a list such as "w=320,h=240,fit=cover"
+     * @param params Comma- or ampersand-separated name=value pairs
+     * @param error Set to a description of the problem on failure
+     * @return false if any pair is malformed or invalid
+     */
+    bool parse(const std::string& params, std::string& error);
+
+    /**
+     * @brief Canonical description of the transform
+     *
+     * Equal transforms always produce the same key, whatever order or
+     * spelling the parameters were given in; the key names cached variants.
+     * @return Canonical key
+     */
+    std::string key() const;
+};
+
+/**
+ * @brief Decodes, resizes and re-encodes images
+ */
+class ImageTransformer {
+public:
+    /**
+     * @brief Outcome of a transform
+     */
+    enum class Status { Ok, Unsupported, Undecodable, Failed };
+
+    static constexpr int kMaxDimension = 8192;
+
+    /**
+     * @brief Construct a transformer
+     * @param threads Maximum threads used to resize a single image
+     */
+    explicit ImageTransformer(int threads);
+
+    /**
+     * @brief Apply a transform to an encoded image
+     *
+     * @param source Encoded source image
+     * @param spec Transform to apply
+     * @param out Encoded result
+     * @return Ok, Unsupported if no codec handles the source format,
+     *         Undecodable if the source is corrupt or too large, or Failed
+     */
+    Status apply(const std::vector<uint8_t>& source, const TransformSpec& spec, std::vector<uint8_t>& out);
+
+private:
+    ImageResizer resizer_;
+    Summary& decodeSeconds_;
+    Summary& resizeSeconds_;
+    Summary& encodeSeconds_;
+    Counter& failures_;
+};
+
+} // namespace imgstore
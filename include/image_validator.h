@@ -0,0 +1,137 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "content_sniffer.h"
+
+namespace imgstore {
+
+/**
+ * @brief Streaming structural check of an encoded image
+ *
+ * Walks the container structure without decoding pixels. For PNG it checks
+ * chunk framing and CRCs, for JPEG marker segments through EOI, for GIF
+ * blocks and sub-blocks through the trailer, and for WebP the RIFF header
+ * and chunk bounds. Data can arrive in arbitrary pieces. Only chunk
+ * headers are buffered; payloads are skipped or run through the CRC in
+ * place, so the cost per byte is bounded and memory use is constant.
+ * Other formats are reported as Unchecked.
+ */
+class ImageValidator {
+public:
+    /**
+     * @brief Outcome of a validation
+     */
+    enum class Verdict {
+        Valid,      // structure intact through the end marker
+        Unchecked,  // not a format the validator understands
+        Truncated,  // data ended before the end marker
+        Corrupt     // structure or checksum error
+    };
+
+    /**
+     * @brief Verdict plus whatever the headers revealed
+     */
+    struct Result {
+        Verdict verdict = Verdict::Unchecked;
+        ImageFormat format = ImageFormat::Unknown;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t frames = 0;
+        std::string error;
+    };
+
+    ImageValidator();
+
+    /**
+     * @brief Feed the next piece of the image
+     *
+     * Once the structure is known to be broken further data is ignored.
+     * @param data Next bytes
+     * @param size Number of bytes
+     */
+    void update(const uint8_t* data, size_t size);
+
+    /**
+     * @brief Check whether the image has already been found corrupt
+     * @return true if update() detected an error, so the upload can be cut short
+     */
+    bool failed() const { return stage_ == Stage::Failed; }
+
+    /**
+     * @brief Finish after the last byte
+     * @return Validation result
+     */
+    Result finish();
+
+    /**
+     * @brief Validate a complete image in one call
+     * @param data Encoded image
+     * @return Validation result
+     */
+    static Result validate(const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Short name of a verdict
+     * @param verdict Verdict
+     * @return "valid", "unchecked", "truncated" or "corrupt"
+     */
+    static const char* verdictName(Verdict verdict);
+
+private:
+    enum class Stage : uint8_t {
+        Detect,
+        PngSignature, PngChunkHeader, PngChunkBody, PngCrc,
+        JpegSoi, JpegMarkerPrefix, JpegMarkerCode, JpegLength, JpegFrameHeader, JpegEntropy,
+        GifHeader, GifBlock, GifExtensionLabel, GifImageDescriptor, GifLzwCodeSize, GifSubBlock,
+        WebpHeader, WebpChunkHeader, WebpChunkHead,
+        Done, Failed
+    };
+
+    Stage stage_ = Stage::Detect;
+    Result result_;
+
+    // Bytes the current stage needs before step() runs, collected in buffer_
+    size_t want_ = 0;
+    std::vector<uint8_t> buffer_;
+    // Payload bytes to pass over before collecting again
+    uint64_t skip_ = 0;
+    // Rest of the current segment or chunk after its buffered head
+    uint64_t remaining_ = 0;
+    uint64_t position_ = 0;
+
+    // PNG
+    uint32_t crc_ = 0;
+    bool crcActive_ = false;
+    uint32_t chunkType_ = 0;
+    bool seenIdat_ = false;
+
+    // JPEG
+    bool seenFrame_ = false;
+    bool seenScan_ = false;
+    bool entropyMarker_ = false; // last entropy-coded byte was 0xFF
+    uint8_t marker_ = 0;
+
+    // WebP
+    uint64_t riffEnd_ = 0;
+    uint32_t webpChunk_ = 0;
+    bool webpAnimated_ = false;
+    bool seenWebpImage_ = false;
+
+    void expect(Stage stage, size_t bytes, uint64_t skipFirst = 0);
+    void fail(const std::string& error);
+    void step();
+    void startFormat();
+    size_t scanEntropy(const uint8_t* data, size_t size);
+    void jpegMarker(uint8_t marker);
+    void finishWebp();
+
+    void stepPng();
+    void stepJpeg();
+    void stepGif();
+    void stepWebp();
+};
+
+} // namespace imgstore
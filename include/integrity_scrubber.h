@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "storage_manager.h"
+
+namespace imgstore {
+
+/**
+ * @brief Background job that re-hashes stored images to detect bit rot
+ *
+ * Images are content-addressed, so a file whose XXH3 no longer matches its
+ * name is corrupt. The scrubber walks the shard tree in order, reads each
+ * file sequentially with large buffers under a bandwidth cap and moves
+ * mismatches to quarantine. Chunked images are hashed by streaming their
+ * chunks in manifest order.
+ */
+class IntegrityScrubber {
+public:
+    /**
+     * @brief Snapshot of scrubber progress
+     */
+    struct Status {
+        bool running = false;
+        uint64_t passesCompleted = 0;
+        uint64_t objectsChecked = 0;
+        uint64_t bytesChecked = 0;
+        uint64_t corruptObjects = 0;
+        uint64_t skippedObjects = 0;
+        double progress = 0.0;
+        std::string lastCorruptId;
+    };
+
+    /**
+     * @brief Construct a scrubber
+     * @param storage Storage to scrub
+     * @param bytesPerSecond Read bandwidth cap; 0 disables throttling
+     * @param interval Pause between full passes; 0 runs passes only on trigger()
+     */
+    IntegrityScrubber(std::shared_ptr<StorageManager> storage,
+                      double bytesPerSecond,
+                      std::chrono::seconds interval);
+
+    ~IntegrityScrubber();
+
+    IntegrityScrubber(const IntegrityScrubber&) = delete;
+    IntegrityScrubber& operator=(const IntegrityScrubber&) = delete;
+
+    /**
+     * @brief Start the background thread
+     * @param runImmediately Begin a pass now instead of after one interval
+     */
+    void start(bool runImmediately = false);
+
+    /**
+     * @brief Stop the background thread, abandoning any pass in progress
+     */
+    void stop();
+
+    /**
+     * @brief Request a pass to start as soon as possible
+     * @return false if a pass is already running
+     */
+    bool trigger();
+
+    /**
+     * @brief Get current progress and counters
+     * @return Status snapshot
+     */
+    Status status() const;
+
+    /**
+     * @brief Verify a single image file against its ID
+     * @param imageId Image ID (hex XXH3 of the content)
+     * @param path Path of the image file or chunk manifest
+     * @param bytesRead Number of bytes read
+     * @return true if the content hash matches the ID
+     */
+    bool verifyFile(const std::string& imageId, const std::string& path, uint64_t& bytesRead);
+
+private:
+    std::shared_ptr<StorageManager> storage_;
+    RateLimiter limiter_;
+    std::chrono::seconds interval_;
+    std::vector<char> buffer_;
+
+    std::thread thread_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopRequested_ = false;
+    bool triggerRequested_ = false;
+    std::atomic<bool> running_{false};
+    std::atomic<double> progress_{0.0};
+    std::string lastCorruptId_;
+
+    Counter& objectsChecked_;
+    Counter& bytesChecked_;
+    Counter& corruptObjects_;
+    Counter& skippedObjects_;
+    Counter& passesCompleted_;
+
+    void loop();
+    void runPass();
+};
+
+} // namespace imgstore
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Work-stealing thread pool for blocking disk I/O
+ *
+ * Crow's network threads hand storage work to this pool and return
+ * immediately, so a slow disk never stalls request parsing or cached
+ * responses. Each worker owns a deque: it pops its own work from the front
+ * and, when idle, steals from the back of its siblings' queues.
+ */
+class IoExecutor {
+public:
+    /**
+     * @brief Start the pool
+     * @param threads Number of worker threads
+     * @param name Metric name part, exported as imgstore_<name>_*
+     */
+    explicit IoExecutor(size_t threads, const std::string& name = "io");
+
+    /**
+     * @brief Drain queued tasks and join the workers
+     */
+    ~IoExecutor();
+
+    IoExecutor(const IoExecutor&) = delete;
+    IoExecutor& operator=(const IoExecutor&) = delete;
+
+    /**
+     * @brief Queue a task
+     *
+     * Tasks submitted from a worker go to that worker's own queue; others
+     * are spread round-robin.
+     * @param task Work to run on a pool thread
+     */
+    void submit(std::function<void()> task);
+
+    /**
+     * @brief Number of tasks waiting to start
+     * @return Queue depth across all workers
+     */
+    size_t queueDepth() const { return pending_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Number of worker threads
+     * @return Thread count
+     */
+    size_t threadCount() const { return threads_.size(); }
+
+    /**
+     * @brief Stop accepting work, finish what is queued and join the workers
+     */
+    void shutdown();
+
+private:
+    struct Task {
+        std::function<void()> fn;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> queue;
+    };
+
+    std::string name_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::vector<std::thread> threads_;
+
+    std::mutex sleepMutex_;
+    std::condition_variable cv_;
+    bool stopping_ = false;
+
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> active_{0};
+    std::atomic<size_t> nextQueue_{0};
+
+    Summary& waitSeconds_;
+    Summary& runSeconds_;
+    Counter& steals_;
+
+    /**
+     * @brief Take a task from the worker's own queue, or steal one
+     * @param self Index of the calling worker
+     * @param task Output task
+     * @return true if a task was found
+     */
+    bool tryPop(size_t self, Task& task);
+
+    void workerLoop(size_t index);
+};
+
+} // namespace imgstore
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief Bitmap of the shard directories known to exist under a set of roots
+ *
+ * A leaf shard directory such as `ab/cd/ef` is one bit, numbered by its hex
+ * digits, so the default layout needs 2^24 bits (2 MiB) per root. Bits are
+ * set by a parallel scan started with the store and by writers that create
+ * a directory, and never cleared: the store does not remove leaf directories
+ * of the layout it writes, and a writer that finds one gone anyway falls back
+ * to creating it.
+ *
+ * A clear bit means "not known", not "missing": writes before the scan
+ * reached a directory simply take the slower path that checks it.
+ */
+class KnownDirectories {
+public:
+    /**
+     * @brief Largest bitmap kept per root, in bits of leaf number
+     */
+    static constexpr int kMaxBits = 24;
+
+    /**
+     * @brief Construct an empty map
+     * @param layout Layout of the trees below every root
+     * @param roots Roots to track; directories under other roots are never known
+     * @param enabled false to track nothing, as do layouts with more than 2^kMaxBits leaves
+     */
+    KnownDirectories(const ShardLayout& layout, const std::vector<std::filesystem::path>& roots, bool enabled);
+
+    ~KnownDirectories();
+
+    KnownDirectories(const KnownDirectories&) = delete;
+    KnownDirectories& operator=(const KnownDirectories&) = delete;
+
+    /**
+     * @brief Start scanning the roots for existing leaf directories in the background
+     */
+    void startScan();
+
+    /**
+     * @brief Stop a scan still in progress
+     */
+    void stop();
+
+    /**
+     * @brief Check whether a leaf shard directory is known to exist
+     *
+     * Counted as a hit or miss; meant for writers deciding whether to check.
+     *
+     * @param dir Directory path
+     * @return true if it was seen by the scan or recorded with add()
+     */
+    bool contains(const std::filesystem::path& dir) const;
+
+    /**
+     * @brief Record that a leaf shard directory exists
+     * @param dir Directory path; ignored if it is not a leaf under a tracked root
+     */
+    void add(const std::filesystem::path& dir);
+
+    /**
+     * @brief Whether the map tracks anything
+     * @return false if disabled or the layout is too large
+     */
+    bool enabled() const { return !roots_.empty(); }
+
+private:
+    /**
+     * @brief One tracked root and its bitmap
+     */
+    struct Root {
+        std::string path;
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+    };
+
+    ShardLayout layout_;
+    size_t words_ = 0; // per root
+    std::vector<Root> roots_;
+
+    std::vector<std::thread> scanners_;
+    std::atomic<bool> stopRequested_{false};
+    std::atomic<bool> scanned_{false};
+    std::atomic<uint64_t> count_{0};
+    std::atomic<double> scanSeconds_{0.0};
+
+    Counter& hits_;
+    Counter& misses_;
+
+    /**
+     * @brief Find the bit of a directory
+     * @param dir Directory path
+     * @param word Receives the word holding the bit
+     * @return Mask of the bit within the word, or nullopt if the directory is not tracked
+     */
+    std::optional<uint64_t> bitOf(const std::string& dir, std::atomic<uint64_t>*& word) const;
+
+    void set(std::atomic<uint64_t>& word, uint64_t mask);
+
+    /**
+     * @brief Mark every leaf directory below a shard directory
+     * @param root Root being scanned
+     * @param dir Directory at the given level
+     * @param level Shard components between the root and dir
+     * @param leaf Leaf number of the components so far
+     */
+    void scanDirectory(Root& root, const std::filesystem::path& dir, int level, uint64_t leaf);
+};
+
+} // namespace imgstore
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "rate_limiter.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief Background job that moves a store from one shard layout to another
+ *
+ * The layout a store was written with is recorded in its `LAYOUT` file.
+ * When a different one is configured, the file is updated to name the new
+ * layout and the old one as `previous`, every write goes to the new layout
+ * at once, and this job walks the old directories and renames each entry
+ * to its new place, a throttled number per second. Until it finishes,
+ * readers that miss under the new layout look under the old one too. Once
+ * every tree is walked cleanly, `previous` is dropped from the file; a
+ * restart before then resumes the walk.
+ *
+ * Entries are moved with a rename that never replaces, so one written
+ * under the new layout meanwhile wins and the old copy is dropped.
+ */
+class LayoutMigrator {
+public:
+    /**
+     * @brief What a tree holds, which decides how its entries are named
+     */
+    enum class Kind {
+        Images,  // files named by image ID
+        Names,   // `<name>.mapping` files
+        Variants // directories named by source image ID
+    };
+
+    /**
+     * @brief A sharded directory tree to migrate
+     */
+    struct Tree {
+        std::filesystem::path root;
+        Kind kind = Kind::Images;
+    };
+
+    /**
+     * @brief Contents of the LAYOUT file
+     */
+    struct Stored {
+        ShardLayout layout;                  // layout new entries are written with
+        std::optional<ShardLayout> previous; // layout still being migrated from
+    };
+
+    /**
+     * @brief Snapshot of migration progress
+     */
+    struct Status {
+        bool running = false;
+        bool complete = false;
+        uint64_t shards = 0;     // top-level directories of the old layout to walk
+        uint64_t shardsDone = 0;
+        uint64_t scanned = 0;    // entries found under the old layout
+        uint64_t moved = 0;
+        uint64_t merged = 0;     // entries already present under the new layout
+        uint64_t errors = 0;
+        double seconds = 0;
+    };
+
+    /**
+     * @brief Gives the lock that serialises moves and deletes of an image
+     */
+    using LockFor = std::function<std::mutex&(const std::string& imageId)>;
+
+    /**
+     * @brief Construct a migration
+     * @param from Layout the trees were written with
+     * @param to Layout to move them to
+     * @param trees Trees to migrate
+     * @param entriesPerSecond Entries moved per second; 0 disables throttling
+     * @param lockFor Image locks, held while an image is moved
+     * @param done Called from the migration thread once every tree is migrated
+     */
+    LayoutMigrator(const ShardLayout& from, const ShardLayout& to, std::vector<Tree> trees, double entriesPerSecond,
+                   LockFor lockFor, std::function<void()> done);
+
+    ~LayoutMigrator();
+
+    LayoutMigrator(const LayoutMigrator&) = delete;
+    LayoutMigrator& operator=(const LayoutMigrator&) = delete;
+
+    /**
+     * @brief Start the migration thread
+     */
+    void start();
+
+    /**
+     * @brief Stop the migration thread; the next start resumes the walk
+     */
+    void stop();
+
+    /**
+     * @brief Whether entries may still be under the old layout
+     * @return true until every tree was migrated
+     */
+    bool active() const { return !complete_.load(); }
+
+    const ShardLayout& from() const { return from_; }
+    const ShardLayout& to() const { return to_; }
+
+    /**
+     * @brief Map a path under the new layout to the old one
+     * @param path Path laid out by to()
+     * @param key Key the shard directories derive from
+     * @return Old path, or nullopt if path is not laid out by to() or the migration is complete
+     */
+    std::optional<std::filesystem::path> previousPath(const std::filesystem::path& path, const std::string& key) const;
+
+    /**
+     * @brief Map a path under the old layout to the new one
+     * @param path Path laid out by from()
+     * @param key Key the shard directories derive from
+     * @return New path, or nullopt if path is not laid out by from()
+     */
+    std::optional<std::filesystem::path> currentPath(const std::filesystem::path& path, const std::string& key) const;
+
+    /**
+     * @brief Get current progress and counters
+     * @return Status snapshot
+     */
+    Status status() const;
+
+    /**
+     * @brief Read a store's LAYOUT file
+     * @param baseDir Storage directory
+     * @return Recorded layouts; the original fixed layout if the file is missing
+     */
+    static Stored load(const std::filesystem::path& baseDir);
+
+    /**
+     * @brief Replace a store's LAYOUT file
+     * @param baseDir Storage directory
+     * @param stored Layouts to record
+     * @return true if the file was written durably
+     */
+    static bool save(const std::filesystem::path& baseDir, const Stored& stored);
+
+private:
+    ShardLayout from_;
+    ShardLayout to_;
+    std::vector<Tree> trees_;
+    RateLimiter limiter_;
+    LockFor lockFor_;
+    std::function<void()> done_;
+
+    std::thread thread_;
+    std::atomic<bool> stopRequested_{false};
+    std::atomic<bool> running_{false};
+    std::atomic<bool> complete_{false};
+    std::atomic<uint64_t> shards_{0};
+    std::atomic<uint64_t> shardsDone_{0};
+    std::atomic<uint64_t> scanned_{0};
+    std::atomic<uint64_t> moved_{0};
+    std::atomic<uint64_t> merged_{0};
+    std::atomic<uint64_t> errors_{0};
+    mutable std::mutex mutex_;
+    std::chrono::steady_clock::time_point started_;
+    std::chrono::steady_clock::time_point finished_;
+
+    Counter& movedTotal_;
+    Counter& mergedTotal_;
+    Counter& errorsTotal_;
+
+    void run();
+
+    /**
+     * @brief Walk one level of the old layout below a tree's root
+     * @param tree Tree being migrated
+     * @param dir Directory at the given level
+     * @param level Shard components between the root and dir
+     * @return false if stopped
+     */
+    bool migrateDirectory(const Tree& tree, const std::filesystem::path& dir, int level);
+
+    /**
+     * @brief Move one entry to its place under the new layout
+     * @param tree Tree being migrated
+     * @param path Entry under the old layout
+     * @param key Key its shard directories derive from
+     */
+    void moveEntry(const Tree& tree, const std::filesystem::path& path, const std::string& key);
+
+    /**
+     * @brief Key of an entry found at the leaf level of the old layout
+     * @param kind Kind of tree
+     * @param entry Directory entry
+     * @return Key, or nullopt for entries that are not migrated (temporary files and the like)
+     */
+    static std::optional<std::string> keyOf(Kind kind, const std::filesystem::directory_entry& entry);
+};
+
+} // namespace imgstore
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Hash tree summarising the set of stored images
+ *
+ * The tree mirrors the first two levels of the shard layout: the root has
+ * one child per first-level shard directory, and each of those one leaf per
+ * second-level directory, so a leaf covers exactly the images of one
+ * `aa/bb` prefix of generateShardPath(). Every node holds the XOR of a
+ * mixed hash of each image below it. XOR makes an update order-independent
+ * and its own inverse, so storing or deleting an image touches three words
+ * with atomic instructions and never locks or rescans anything.
+ *
+ * Two replicas holding the same images have equal roots; where they
+ * differ, comparing children narrows the difference down to the leaves
+ * whose images actually need to be listed.
+ */
+class MerkleTree {
+public:
+    static constexpr size_t kFanout = 256;
+    static constexpr size_t kBuckets = kFanout * kFanout;
+
+    MerkleTree();
+
+    MerkleTree(const MerkleTree&) = delete;
+    MerkleTree& operator=(const MerkleTree&) = delete;
+
+    /**
+     * @brief Leaf covering an image
+     * @param hash Image hash
+     * @return The two leading shard directories of the image, as one number
+     */
+    static uint16_t bucketOf(uint64_t hash);
+
+    /**
+     * @brief Add an image that was absent, or remove one that was present
+     * @param hash Image hash
+     */
+    void toggle(uint64_t hash);
+
+    /**
+     * @brief Forget every image
+     */
+    void clear();
+
+    /**
+     * @brief Digest of the whole set
+     * @return Root digest; 0 for an empty set
+     */
+    uint64_t root() const { return root_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Digests of the children of a node
+     * @param prefix Node as hex: empty for the root, two digits for a first-level directory
+     * @return kFanout digests, or nullopt if the prefix does not name an inner node
+     */
+    std::optional<std::vector<uint64_t>> children(const std::string& prefix) const;
+
+    /**
+     * @brief Parse a leaf written as four hex digits
+     * @param hex Bucket prefix such as "3fa0"
+     * @param bucket Set to the bucket on success
+     * @return false if the text is not a bucket
+     */
+    static bool parseBucket(const std::string& hex, uint16_t& bucket);
+
+    /**
+     * @brief Format a bucket as four hex digits
+     * @param bucket Bucket number
+     * @return Prefix such as "3fa0"
+     */
+    static std::string bucketToHex(uint16_t bucket);
+
+private:
+    std::atomic<uint64_t> root_{0};
+    std::array<std::atomic<uint64_t>, kFanout> level1_;
+    std::unique_ptr<std::atomic<uint64_t>[]> leaves_;
+};
+
+} // namespace imgstore
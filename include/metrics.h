@@ -0,0 +1,130 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace imgstore {
+
+/**
+ * @brief Monotonically increasing counter
+ */
+class Counter {
+public:
+    void increment(uint64_t delta = 1) { value_.fetch_add(delta, std::memory_order_relaxed); }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_{0};
+};
+
+/**
+ * @brief Point-in-time value that can go up and down
+ */
+class Gauge {
+public:
+    void set(double value) { value_.store(value, std::memory_order_relaxed); }
+    void add(double delta) { value_.fetch_add(delta, std::memory_order_relaxed); }
+    double value() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> value_{0.0};
+};
+
+/**
+ * @brief Running sum and count of observations (e.g. latencies in seconds)
+ */
+class Summary {
+public:
+    void observe(double value) {
+        sum_.fetch_add(value, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    double sum() const { return sum_.load(std::memory_order_relaxed); }
+    uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<double> sum_{0.0};
+    std::atomic<uint64_t> count_{0};
+};
+
+/**
+ * @brief Process-wide metrics registry rendered in Prometheus text format
+ *
+ * Metric names may carry a label set, e.g. `imgstore_bloom_lookups_total{filter="hash"}`.
+ * Registration returns a reference that stays valid for the lifetime of the
+ * process, so hot paths should look a metric up once and keep the reference.
+ */
+class Metrics {
+public:
+    /**
+     * @brief Get the process-wide registry
+     * @return Metrics registry
+     */
+    static Metrics& instance();
+
+    /**
+     * @brief Get or create a counter
+     * @param name Metric name including optional labels
+     * @param help Help text (used for the first registration of the family)
+     * @return Counter reference
+     */
+    Counter& counter(const std::string& name, const std::string& help = "");
+
+    /**
+     * @brief Get or create a gauge
+     * @param name Metric name including optional labels
+     * @param help Help text
+     * @return Gauge reference
+     */
+    Gauge& gauge(const std::string& name, const std::string& help = "");
+
+    /**
+     * @brief Get or create a summary
+     * @param name Metric name including optional labels
+     * @param help Help text
+     * @return Summary reference
+     */
+    Summary& summary(const std::string& name, const std::string& help = "");
+
+    /**
+     * @brief Register a gauge whose value is computed at scrape time
+     *
+     * The callback runs under the registry lock and must not register metrics.
+     * @param name Metric name including optional labels
+     * @param help Help text
+     * @param fn Callback returning the current value
+     */
+    void callbackGauge(const std::string& name, const std::string& help, std::function<double()> fn);
+
+    /**
+     * @brief Render all metrics in Prometheus text exposition format
+     * @return Exposition text
+     */
+    std::string renderPrometheus() const;
+
+private:
+    Metrics() = default;
+
+    enum class Type { Counter, Gauge, Summary, Callback };
+
+    struct Entry {
+        Type type;
+        std::unique_ptr<Counter> counter;
+        std::unique_ptr<Gauge> gauge;
+        std::unique_ptr<Summary> summary;
+        std::function<double()> callback;
+    };
+
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::map<std::string, std::string> help_;
+
+    Entry& getOrCreate(const std::string& name, const std::string& help, Type type);
+};
+
+} // namespace imgstore
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief Second copy of every image and name mapping on another storage root
+ *
+ * The mirror uses the same shard layout as the primary root but always
+ * holds whole images, never chunk manifests, so it stays readable when the
+ * primary disk and its chunk store are gone. Writes reach it either before
+ * the request completes or through a bounded replication queue applied in
+ * order by one worker. A write that is dropped because the queue is full,
+ * or that fails, removes the marker below and schedules a repair pass a
+ * short delay later, so a burst of lost writes costs one pass.
+ *
+ * The repair pass itself belongs to the storage manager, which knows what
+ * the primary should hold; the mirror runs it on a thread of its own and
+ * records a completed pass in a `.mirror` marker, so a new or swapped
+ * mirror disk, or one that lost writes before a restart, is recognised by
+ * the marker's absence.
+ */
+class Mirror {
+public:
+    /**
+     * @brief Counts from one repair pass
+     */
+    struct RepairResult {
+        bool completed = false;
+        uint64_t imagesCopied = 0;   // primary -> mirror
+        uint64_t imagesRestored = 0; // mirror -> primary
+        uint64_t namesCopied = 0;
+        uint64_t namesRestored = 0;
+        uint64_t removed = 0;        // mirror entries the primary no longer has
+        uint64_t errors = 0;
+    };
+
+    /**
+     * @brief Snapshot of replication state
+     */
+    struct Status {
+        std::string root;
+        bool async = false;
+        size_t queued = 0;
+        uint64_t dropped = 0;
+        uint64_t failoverReads = 0;
+        bool repairing = false;
+        RepairResult lastRepair;
+    };
+
+    /**
+     * @brief Callback running one repair pass
+     */
+    using RepairPass = std::function<RepairResult()>;
+
+    /**
+     * @brief Open a mirror root
+     * @param root Mirror directory
+     * @param layout Shard directory layout, the same as the primary's
+     * @param async Replicate through the queue instead of before returning
+     * @param queueSize Writes the queue holds before dropping
+     */
+    Mirror(const std::filesystem::path& root, const ShardLayout& layout, bool async, size_t queueSize);
+
+    ~Mirror();
+
+    Mirror(const Mirror&) = delete;
+    Mirror& operator=(const Mirror&) = delete;
+
+    const std::filesystem::path& root() const { return root_; }
+
+    /**
+     * @brief Replicate a stored image
+     * @param imageId Unique identifier for the image
+     * @param data Image data
+     * @param writtenAt Unix time in milliseconds to keep as the copy's mtime; nullopt for the current time
+     */
+    void putImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                  std::optional<int64_t> writtenAt = std::nullopt);
+
+    /**
+     * @brief Replicate a name mapping
+     * @param name Image name
+     * @param imageHash Hash the name points at
+     */
+    void putName(const std::string& name, const std::string& imageHash);
+
+    /**
+     * @brief Replicate an image deletion
+     * @param imageId Unique identifier for the image
+     */
+    void removeImage(const std::string& imageId);
+
+    /**
+     * @brief Replicate a name mapping deletion
+     * @param name Image name
+     */
+    void removeName(const std::string& name);
+
+    /**
+     * @brief Write an image to the mirror now
+     * @param imageId Unique identifier for the image
+     * @param data Image data
+     * @param writtenAt Unix time in milliseconds to keep as the copy's mtime; nullopt for the current time
+     * @return true on success
+     */
+    bool writeImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                    std::optional<int64_t> writtenAt = std::nullopt);
+
+    /**
+     * @brief Write a name mapping to the mirror now
+     * @param name Image name
+     * @param imageHash Hash the name points at
+     * @return true on success
+     */
+    bool writeName(const std::string& name, const std::string& imageHash);
+
+    /**
+     * @brief Remove an image from the mirror now
+     * @param imageId Unique identifier for the image
+     * @return true unless the removal failed
+     */
+    bool eraseImage(const std::string& imageId);
+
+    /**
+     * @brief Remove a name mapping from the mirror now
+     * @param name Image name
+     * @return true unless the removal failed
+     */
+    bool eraseName(const std::string& name);
+
+    /**
+     * @brief Read an image from the mirror
+     * @param imageId Unique identifier for the image
+     * @return Image data, or nullopt if the mirror does not have it
+     */
+    std::optional<std::vector<uint8_t>> readImage(const std::string& imageId);
+
+    /**
+     * @brief When the mirrored copy of an image was uploaded
+     * @param imageId Unique identifier for the image
+     * @return Unix time in milliseconds of the copy's mtime, or nullopt if the mirror does not have it
+     */
+    std::optional<int64_t> imageWrittenAt(const std::string& imageId) const;
+
+    /**
+     * @brief Read a name mapping from the mirror
+     * @param name Image name
+     * @return Image hash, or nullopt if the mirror does not have it
+     */
+    std::optional<std::string> readName(const std::string& name);
+
+    /**
+     * @brief Path of an image on the mirror
+     * @param imageId Unique identifier for the image
+     * @return Sharded path below the mirror root
+     */
+    std::filesystem::path imagePath(const std::string& imageId) const;
+
+    /**
+     * @brief Path of a name mapping on the mirror
+     * @param name Image name
+     * @return Sharded path below the mirror's names/ tree
+     */
+    std::filesystem::path namePath(const std::string& name) const;
+
+    /**
+     * @brief Start the repair thread
+     * @param pass Repair pass to run
+     * @param runNow Run a pass immediately, e.g. because the mirror is new or was swapped
+     */
+    void startRepair(RepairPass pass, bool runNow);
+
+    /**
+     * @brief Request a repair pass
+     * @return false if one is already running
+     */
+    bool triggerRepair();
+
+    /**
+     * @brief Whether the mirror has never been fully synced, e.g. a new or swapped disk
+     * @return true if no repair pass has completed on this root
+     */
+    bool needsRepair() const;
+
+    /**
+     * @brief Whether a repair pass should give up
+     * @return true once the mirror is shutting down
+     */
+    bool stopping() const { return stopping_.load(); }
+
+    /**
+     * @brief Count a read served by the mirror because the primary failed
+     */
+    void recordFailover() { failoverReads_.increment(); }
+
+    /**
+     * @brief Describe the replication state
+     * @return Status snapshot
+     */
+
+    Status status() const;
+
+    /**
+     * @brief Drain the replication queue and stop the threads
+     */
+    void stop();
+
+private:
+    enum class OpKind { PutImage, PutName, RemoveImage, RemoveName };
+
+    struct Op {
+        OpKind kind;
+        std::string key;
+        std::vector<uint8_t> data;
+        std::string value;
+        std::chrono::steady_clock::time_point enqueued;
+        std::optional<int64_t> writtenAt;
+    };
+
+    std::filesystem::path root_;
+    ShardLayout layout_;
+    bool async_;
+    size_t queueSize_;
+    std::atomic<uint64_t> tempCounter_{0};
+
+    mutable std::mutex queueMutex_;
+    std::condition_variable queueCv_;
+    std::deque<Op> queue_;
+    bool draining_ = false;
+    std::thread worker_;
+
+    mutable std::mutex repairMutex_;
+    std::condition_variable repairCv_;
+    RepairPass pass_;
+    bool repairRequested_ = false;
+    std::optional<std::chrono::steady_clock::time_point> repairDue_; // set after lost writes
+    uint64_t lostWrites_ = 0;   // writes dropped or failed, guarded by repairMutex_
+    bool markerPresent_ = true; // whether the marker may exist, guarded by repairMutex_
+    std::atomic<bool> repairing_{false};
+    std::atomic<bool> stopping_{false};
+    RepairResult lastRepair_;
+    std::thread repairThread_;
+
+    Counter& writes_;
+    Counter& writeFailures_;
+    Counter& dropped_;
+    Counter& failoverReads_;
+    Counter& repaired_;
+
+    std::filesystem::path markerPath() const { return root_ / ".mirror"; }
+
+    void enqueue(Op op);
+    void apply(const Op& op);
+    void workerLoop();
+    void repairLoop();
+
+    /**
+     * @brief Record a write the mirror missed and schedule a repair for it
+     */
+    void markStale();
+    bool writeFile(const std::filesystem::path& path, const void* data, size_t size,
+                   std::optional<int64_t> writtenAt = std::nullopt);
+    bool eraseFile(const std::filesystem::path& path);
+};
+
+} // namespace imgstore
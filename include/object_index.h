@@ -0,0 +1,232 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "content_sniffer.h"
+#include "merkle_tree.h"
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Per-image entry kept in the in-memory index
+ */
+struct ObjectRecord {
+    uint64_t size = 0; // 0 when unknown (entry recovered by a directory scan)
+    ImageFormat format = ImageFormat::Unknown; // sniffed at ingest; Unknown for scanned entries
+    uint8_t tier = 0; // storage tier holding the file; 0 is the fastest
+};
+
+/**
+ * @brief In-memory index of stored images and name mappings
+ *
+ * The index is persisted as a checksummed snapshot plus an append-only
+ * journal of later mutations. Mutations are journaled before the caller
+ * touches the filesystem, so after a crash the index may list an entry whose
+ * file was never written, but it never misses one that was.
+ */
+class ObjectIndex {
+public:
+    /**
+     * @brief Contents of the index at one point in its history
+     */
+    struct Capture {
+        uint64_t seq = 0;                                     // last journal sequence included
+        std::vector<uint64_t> images;                         // image hashes, sorted
+        std::vector<std::pair<std::string, uint64_t>> names;  // name and image hash, sorted by name
+    };
+
+    /**
+     * @brief Construct an index persisted under the given directory
+     * @param dir Directory holding the snapshot and journal files
+     */
+    explicit ObjectIndex(const std::filesystem::path& dir);
+
+    ~ObjectIndex();
+
+    ObjectIndex(const ObjectIndex&) = delete;
+    ObjectIndex& operator=(const ObjectIndex&) = delete;
+
+    /**
+     * @brief Load the snapshot and replay the journal written after it
+     * @return false if the snapshot is missing or fails its checksum
+     */
+    bool load();
+
+    /**
+     * @brief Drop all entries and journals before repopulating from a scan
+     */
+    void reset();
+
+    /**
+     * @brief Open the journal for appending
+     * @return true if the journal is ready
+     */
+    bool openJournal();
+
+    /**
+     * @brief Record a stored image
+     *
+     * New images always land on tier 0.
+     * @param hash Image hash
+     * @param size Image size in bytes
+     * @param format Content format detected at ingest
+     * @param journal Whether to journal the change; false is only safe while
+     *                populating from a scan, before any concurrent writers
+     */
+    void addImage(uint64_t hash, uint64_t size, ImageFormat format, bool journal = true);
+
+    /**
+     * @brief Record a deleted image
+     * @param hash Image hash
+     */
+    void removeImage(uint64_t hash);
+
+    /**
+     * @brief Record that an image's file moved to another storage tier
+     * @param hash Image hash
+     * @param tier Tier now holding the file
+     * @param journal Whether to journal the change; see addImage()
+     */
+    void setTier(uint64_t hash, uint8_t tier, bool journal = true);
+
+    /**
+     * @brief Record a name mapping
+     * @param name Image name
+     * @param hash Image hash the name points to
+     * @param journal Whether to journal the change; see addImage()
+     */
+    void setName(const std::string& name, uint64_t hash, bool journal = true);
+
+    /**
+     * @brief Record a deleted name mapping
+     * @param name Image name
+     */
+    void removeName(const std::string& name);
+
+    /**
+     * @brief Look up an image
+     * @param hash Image hash
+     * @return Record if the image is indexed
+     */
+    std::optional<ObjectRecord> findImage(uint64_t hash) const;
+
+    /**
+     * @brief Look up a name mapping
+     * @param name Image name
+     * @return Hash if the name is indexed
+     */
+    std::optional<uint64_t> findName(const std::string& name) const;
+
+    size_t imageCount() const { return imageCount_.load(std::memory_order_relaxed); }
+    size_t nameCount() const { return nameCount_.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Hash tree over the indexed images, kept current by every change
+     * @return The tree
+     */
+    const MerkleTree& merkle() const { return merkle_; }
+
+    /**
+     * @brief Visit every indexed image
+     * @param fn Callback receiving hash and record
+     */
+    void forEachImage(const std::function<void(uint64_t, const ObjectRecord&)>& fn) const;
+
+    /**
+     * @brief Visit every indexed name
+     * @param fn Callback receiving name and hash
+     */
+    void forEachName(const std::function<void(const std::string&, uint64_t)>& fn) const;
+
+    /**
+     * @brief Copy the images and names as of one journal sequence
+     *
+     * Journaled mutations wait while the copy is taken, so no change is
+     * half-included.
+     * @return Sorted copy of the index
+     */
+    Capture capture();
+
+    /**
+     * @brief Write a new snapshot and retire the journal it covers
+     * @return true if the snapshot was committed
+     */
+    bool writeSnapshot();
+
+    /**
+     * @brief Start the background thread that syncs the journal and snapshots periodically
+     * @param interval Time between snapshots
+     */
+    void startBackgroundSnapshots(std::chrono::seconds interval);
+
+    /**
+     * @brief Stop the background thread and close the journal
+     */
+    void stop();
+
+private:
+    static constexpr size_t kShardCount = 256;
+
+    struct Shard {
+        mutable std::shared_mutex mutex;
+        std::unordered_map<uint64_t, ObjectRecord> images;
+        std::unordered_map<std::string, uint64_t> names;
+    };
+
+    enum class Op : uint8_t { AddImage = 1, RemoveImage = 2, SetName = 3, RemoveName = 4, SetTier = 5 };
+
+    std::filesystem::path dir_;
+    std::array<Shard, kShardCount> shards_;
+    std::atomic<size_t> imageCount_{0};
+    std::atomic<size_t> nameCount_{0};
+    MerkleTree merkle_;
+
+    // Serialises journal appends with their in-memory application so the
+    // journal order matches the order changes became visible
+    std::mutex journalMutex_;
+    int journalFd_ = -1;
+    uint64_t lastSeq_ = 0;
+    uint64_t journalRecords_ = 0;
+    bool journalDirty_ = false;
+
+    std::mutex snapshotMutex_;
+    std::thread thread_;
+    std::mutex threadMutex_;
+    std::condition_variable cv_;
+    bool stopRequested_ = false;
+
+    Counter& snapshotsWritten_;
+    Counter& journalRecordsReplayed_;
+    Gauge& loadSeconds_;
+
+    static size_t shardOf(uint64_t hash) { return hash >> 56; }
+    static size_t shardOf(const std::string& name);
+
+    std::filesystem::path snapshotPath() const { return dir_ / "index.snapshot"; }
+    std::filesystem::path journalPath() const { return dir_ / "index.journal"; }
+    std::filesystem::path retiredJournalPath() const { return dir_ / "index.journal.old"; }
+
+    void appendJournal(Op op, uint64_t hash, uint64_t size, const std::string& name,
+                       ImageFormat format = ImageFormat::Unknown);
+    void apply(Op op, uint64_t hash, uint64_t size, const std::string& name,
+               ImageFormat format = ImageFormat::Unknown);
+    bool loadSnapshot(uint64_t& snapshotSeq);
+    uint64_t replayJournal(const std::filesystem::path& path, uint64_t afterSeq);
+    void backgroundLoop(std::chrono::seconds interval);
+};
+
+} // namespace imgstore
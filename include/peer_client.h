@@ -0,0 +1,66 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Minimal blocking HTTP/1.1 client for requests between nodes
+ *
+ * One connection per request, closed afterwards. Bodies are expected with a
+ * Content-Length or delimited by the close, which is all img-store itself
+ * sends. The timeout bounds connecting and every read and write, so a dead
+ * peer costs at most a few timeouts, never a hung request thread.
+ */
+class PeerClient {
+public:
+    using Headers = std::vector<std::pair<std::string, std::string>>;
+
+    /**
+     * @brief Marks requests sent by another node, which must not be passed on again
+     */
+    static constexpr const char* kHopHeader = "X-Imgstore-Hop";
+
+    /**
+     * @brief Response from a peer
+     */
+    struct Response {
+        int status = 0;
+        Headers headers;
+        std::string body;
+
+        /**
+         * @brief Look up a header, ignoring case
+         * @param name Header name
+         * @return Value, or empty if absent
+         */
+        std::string header(const std::string& name) const;
+    };
+
+    /**
+     * @brief Create a client
+     * @param timeout Limit for connecting and for each socket read or write
+     */
+    explicit PeerClient(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief Send a request and wait for the whole response
+     * @param address Peer as host:port
+     * @param method HTTP method
+     * @param target Path and query string
+     * @param headers Extra request headers
+     * @param body Request body, sent with a Content-Length
+     * @return Response, or nullopt if the peer could not be reached or answered garbage
+     */
+    std::optional<Response> send(const std::string& address, const std::string& method, const std::string& target,
+                                 const Headers& headers, const std::string& body) const;
+
+private:
+    std::chrono::milliseconds timeout_;
+};
+
+} // namespace imgstore
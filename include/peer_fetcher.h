@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+#include "peer_client.h"
+
+namespace imgstore {
+
+/**
+ * @brief Fetches images this node does not have from a list of peers
+ *
+ * Meant for edge nodes that start empty and warm up from the requests they
+ * see. Only content-addressed IDs are fetched, and a fetched image is
+ * checked against its hash before use, so a confused or hostile peer can
+ * never plant wrong content. Concurrent misses for the same image share
+ * one fetch; the first caller does the work and the rest wait for it.
+ * Each image is tried on the peers in an order rotated by its hash, which
+ * spreads the fetches of many images across them.
+ */
+class PeerFetcher {
+public:
+    /**
+     * @brief Callback keeping a fetched image locally
+     */
+    using Store = std::function<void(const std::string& imageId, const std::vector<uint8_t>& data)>;
+
+    /**
+     * @brief Create a fetcher
+     * @param peers Peers as host:port
+     * @param timeout Connect and socket timeout per peer
+     * @param store Keeps fetched images; empty to serve them without keeping them
+     */
+    PeerFetcher(std::vector<std::string> peers, std::chrono::milliseconds timeout, Store store);
+
+    /**
+     * @brief Fetch the original bytes of an image
+     *
+     * Stored through the store callback, if any, before waiters are released.
+     * @param imageId Content hash of the image
+     * @return Verified image data, or nullopt if no peer has an intact copy
+     */
+    std::optional<std::vector<uint8_t>> fetch(const std::string& imageId);
+
+    /**
+     * @brief Pass a request for an image on to the first peer that has it
+     *
+     * Used for variants of images that are not kept locally.
+     * @param imageId Content hash of the image, choosing the peer order
+     * @param target Path and query to request
+     * @param headers Request headers to pass along
+     * @return Peer response, or nullopt if no peer answered with the image
+     */
+    std::optional<PeerClient::Response> relay(const std::string& imageId, const std::string& target,
+                                              const PeerClient::Headers& headers);
+
+    bool caching() const { return static_cast<bool>(store_); }
+    const std::vector<std::string>& peers() const { return peers_; }
+
+private:
+    using Result = std::optional<std::vector<uint8_t>>;
+
+    std::vector<std::string> peers_;
+    PeerClient client_;
+    Store store_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_future<Result>> inflight_;
+
+    Counter& found_;
+    Counter& missing_;
+    Counter& rejected_;
+    Counter& shared_;
+    Counter& bytes_;
+    Summary& seconds_;
+
+    /**
+     * @brief Peers in the order to try for a key
+     * @param hash Image hash
+     * @return Indices into peers_
+     */
+    std::vector<size_t> order(uint64_t hash) const;
+
+    /**
+     * @brief Ask the peers one after another
+     * @param imageId Content hash of the image
+     * @param hash Its parsed value
+     * @return Verified image data, or nullopt
+     */
+    Result fetchFromPeers(const std::string& imageId, uint64_t hash);
+};
+
+} // namespace imgstore
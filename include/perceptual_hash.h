@@ -0,0 +1,48 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+#include <optional>
+#include <vector>
+#include "image_codec.h"
+
+namespace imgstore {
+
+/**
+ * @brief 64-bit difference hash (dHash) of an image's appearance
+ *
+ * The image is flattened onto white, converted to luma and box-averaged
+ * onto a 9x8 grid; each bit records whether a cell is brighter than its
+ * right-hand neighbour. Re-encoding, resizing and mild recompression leave
+ * most bits unchanged, so copies of one picture end up a small Hamming
+ * distance apart.
+ */
+class PerceptualHash {
+public:
+    static constexpr int kGridWidth = 9;
+    static constexpr int kGridHeight = 8;
+
+    /**
+     * @brief Hash a decoded image
+     * @param image Decoded image, at least kGridWidth x kGridHeight
+     * @return Difference hash
+     */
+    static uint64_t dhash(const Image& image);
+
+    /**
+     * @brief Decode an encoded image at reduced size and hash it
+     * @param data Encoded image
+     * @return Difference hash, or nullopt if the image cannot be decoded or is too small
+     */
+    static std::optional<uint64_t> compute(const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Number of differing bits between two hashes
+     * @param a First hash
+     * @param b Second hash
+     * @return Hamming distance, 0-64
+     */
+    static int distance(uint64_t a, uint64_t b) { return std::popcount(a ^ b); }
+};
+
+} // namespace imgstore
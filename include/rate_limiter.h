@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+namespace imgstore {
+
+/**
+ * @brief Token bucket used to throttle background I/O
+ */
+class RateLimiter {
+public:
+    /**
+     * @brief Construct a rate limiter
+     * @param bytesPerSecond Sustained rate; 0 disables throttling
+     * @param burstBytes Maximum burst (defaults to one second of traffic)
+     */
+    explicit RateLimiter(double bytesPerSecond, double burstBytes = 0);
+
+    /**
+     * @brief Block until the given amount of bytes may be consumed
+     * @param bytes Number of bytes about to be read or written
+     */
+    void acquire(size_t bytes);
+
+    /**
+     * @brief Change the sustained rate
+     * @param bytesPerSecond New rate; 0 disables throttling
+     */
+    void setRate(double bytesPerSecond);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::mutex mutex_;
+    double rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_;
+};
+
+} // namespace imgstore
@@ -2,13 +2,27 @@
 
 #include <memory>
 #include <string>
+#include <functional>
 #include "crow_all.h"
 #include "storage_manager.h"
 #include "image_handler.h"
 #include "auth_middleware.h"
+#include "backup_manager.h"
+#include "cluster.h"
+#include "config.h"
+#include "integrity_scrubber.h"
+#include "io_executor.h"
+#include "variant_pipeline.h"
 
 namespace imgstore {
 
+/**
+ * @brief Storage layout and placement selected by a configuration
+ * @param config Runtime configuration
+ * @return Options to open the StorageManager with
+ */
+StorageOptions storageOptions(const ServerConfig& config);
+
 /**
  * @brief Main HTTP server for image storage
  */
@@ -16,11 +30,14 @@ class Server {
 public:
     /**
      * @brief Construct a new Server
-     * @param storageDir Base directory for image storage
-     * @param port HTTP server port
-     * @param apiKey API key for write operations (empty = no auth)
+     * @param config Runtime configuration (storage directory, port, API key, ...)
      */
-    Server(const std::string& storageDir, int port = 8080, const std::string& apiKey = "");
+    explicit Server(const ServerConfig& config);
+
+    /**
+     * @brief Drain in-flight I/O before Crow's connections are torn down
+     */
+    ~Server();
 
     /**
      * @brief Initialize and start the server
@@ -36,7 +53,14 @@ private:
     int port_;
     std::shared_ptr<StorageManager> storage_;
     std::shared_ptr<ImageHandler> handler_;
+    std::shared_ptr<IoExecutor> io_;
     std::shared_ptr<AuthMiddleware> auth_;
+    std::shared_ptr<IntegrityScrubber> scrubber_;
+    std::shared_ptr<VariantPipeline> pipeline_;
+    std::shared_ptr<Cluster> cluster_;
+    std::shared_ptr<AntiEntropy> sync_;
+    std::shared_ptr<ChangeFeed> feed_;
+    std::shared_ptr<BackupManager> backups_;
     crow::SimpleApp app_;
     bool authEnabled_;
 
@@ -45,6 +69,62 @@ private:
      */
     void setupRoutes();
 
+    /**
+     * @brief Parse preset definitions and start the eager variant pipeline
+     * @param config Runtime configuration
+     */
+    void setupVariantPresets(const ServerConfig& config);
+
+    /**
+     * @brief Read the cluster membership and join it
+     * @param config Runtime configuration
+     */
+    void setupCluster(const ServerConfig& config);
+
+    /**
+     * @brief Enable fetching images that miss locally from the configured peers
+     * @param config Runtime configuration
+     */
+    void setupPeerFetch(const ServerConfig& config);
+
+    /**
+     * @brief Start anti-entropy sync with the configured replicas
+     * @param config Runtime configuration
+     */
+    void setupAntiEntropy(const ServerConfig& config);
+
+    /**
+     * @brief Answer a change feed request, holding it open until an event arrives if asked to
+     *
+     * A waiting request occupies no thread: it is parked on the feed and on
+     * a timer of its connection's io_context, whichever fires first.
+     * @param req Request owned by Crow
+     * @param res Response owned by Crow, completed with end()
+     */
+    void serveFeed(const crow::request& req, crow::response& res);
+
+    /**
+     * @brief Serve an image request here, or on the nodes owning it in cluster mode
+     *
+     * The local part runs on the I/O pool like dispatch(); requests to other
+     * nodes run on the cluster's pool, which completes the response.
+     * @param req Request owned by Crow
+     * @param res Response owned by Crow, completed with end()
+     * @param key Ring key of the image or name
+     * @param local Handler invocation against this node's storage
+     * @param contentKey For named uploads, the ring key of the content
+     */
+    void clustered(const crow::request& req, crow::response& res, uint64_t key, std::function<crow::response()> local,
+                   std::optional<uint64_t> contentKey = std::nullopt);
+
+    /**
+     * @brief Run a handler on the I/O pool and complete the response asynchronously
+     * @param req Request owned by Crow (its io_context receives the completion)
+     * @param res Response owned by Crow, completed with end() once work returns
+     * @param work Handler invocation that may block on storage
+     */
+    void dispatch(const crow::request& req, crow::response& res, std::function<crow::response()> work);
+
     /**
      * @brief Check if request has valid authentication
      * @param req HTTP request
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+namespace imgstore {
+
+/**
+ * @brief Shape of the directory tree objects are sharded into
+ *
+ * An object lives `depth` directories below its root, each named by the
+ * next `width` hex digits of the hash of its key (an image ID, a name).
+ */
+struct ShardLayout {
+    int depth = 3;
+    int width = 2;
+
+    /**
+     * @brief Shard directories of a key, relative to a root
+     * @param key Image ID or name
+     * @return Path such as "ab/cd/ef"
+     */
+    std::string shardPath(const std::string& key) const;
+
+    /**
+     * @brief Path of an object under a root
+     * @param root Root of the tree
+     * @param key Key the shard directories derive from
+     * @param leaf File or directory name of the object
+     * @return Full path
+     */
+    std::filesystem::path pathOf(const std::filesystem::path& root, const std::string& key,
+                                 const std::string& leaf) const;
+
+    /**
+     * @brief Check whether a directory name is a shard component of this layout
+     * @param name Directory name
+     * @return true for exactly `width` hex digits
+     */
+    bool isComponent(const std::string& name) const;
+
+    /**
+     * @brief Check that the layout can be used
+     * @return true for a width of 1 to 4 and a depth that fits in the hash's 16 hex digits
+     */
+    bool valid() const { return width >= 1 && width <= 4 && depth >= 1 && depth * width <= 16; }
+
+    bool operator==(const ShardLayout& other) const = default;
+
+    /**
+     * @brief Human-readable form
+     * @return e.g. "depth 3, width 2"
+     */
+    std::string describe() const;
+};
+
+} // namespace imgstore
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Near-duplicate search over perceptual hashes
+ *
+ * Multi-index hashing: each 64-bit hash is split into four 16-bit blocks,
+ * and every block indexes its own table of 65536 buckets. Two hashes within
+ * distance r agree to within r/4 bits on at least one block, so a query
+ * only probes the buckets within that radius of each of its blocks instead
+ * of scanning every entry. Buckets keep their hashes contiguous so the
+ * final distance check runs as a vector popcount where the CPU has one.
+ *
+ * Entries are persisted in an append-only log that is replayed at startup
+ * and compacted when it holds mostly superseded records.
+ */
+class SimilarityIndex {
+public:
+    /**
+     * @brief Largest distance a query may ask for; beyond it the probe count explodes
+     */
+    static constexpr int kMaxDistance = 12;
+
+    /**
+     * @brief A near-duplicate found by search()
+     */
+    struct Match {
+        uint64_t id;
+        int distance;
+    };
+
+    /**
+     * @brief Construct an index persisted under the given directory
+     * @param dir Directory holding the log file
+     */
+    explicit SimilarityIndex(const std::filesystem::path& dir);
+
+    ~SimilarityIndex();
+
+    SimilarityIndex(const SimilarityIndex&) = delete;
+    SimilarityIndex& operator=(const SimilarityIndex&) = delete;
+
+    /**
+     * @brief Replay the log and open it for appending
+     * @return false if the log cannot be opened for writing
+     */
+    bool load();
+
+    /**
+     * @brief Record the perceptual hash of an image, replacing any earlier one
+     * @param id Image hash
+     * @param phash Perceptual hash
+     */
+    void add(uint64_t id, uint64_t phash);
+
+    /**
+     * @brief Forget an image
+     * @param id Image hash
+     */
+    void remove(uint64_t id);
+
+    /**
+     * @brief Look up the perceptual hash of an image
+     * @param id Image hash
+     * @return Perceptual hash if the image is indexed
+     */
+    std::optional<uint64_t> find(uint64_t id) const;
+
+    /**
+     * @brief Find images whose perceptual hash is close to a given one
+     * @param phash Perceptual hash to search around
+     * @param maxDistance Largest Hamming distance to report, at most kMaxDistance
+     * @param limit Maximum number of matches
+     * @param exclude Image to leave out (usually the query image itself)
+     * @return Matches ordered by distance, then ID
+     */
+    std::vector<Match> search(uint64_t phash, int maxDistance, size_t limit, uint64_t exclude) const;
+
+    size_t size() const;
+
+private:
+    static constexpr int kBlocks = 4;
+    static constexpr int kBlockBits = 64 / kBlocks;
+
+    struct Bucket {
+        std::vector<uint64_t> hashes;
+        std::vector<uint64_t> ids;
+    };
+
+    enum class Op : uint32_t { Add = 1, Remove = 2 };
+
+    std::filesystem::path dir_;
+    mutable std::shared_mutex mutex_;
+    std::array<std::vector<Bucket>, kBlocks> tables_;
+    std::unordered_map<uint64_t, uint64_t> entries_; // image hash -> perceptual hash
+
+    std::mutex logMutex_;
+    int logFd_ = -1;
+    uint64_t logRecords_ = 0;
+
+    Summary& querySeconds_;
+    Counter& candidates_;
+
+    static uint16_t block(uint64_t phash, int index) {
+        return static_cast<uint16_t>(phash >> (index * kBlockBits));
+    }
+
+    std::filesystem::path logPath() const { return dir_ / "similarity.log"; }
+
+    void insertLocked(uint64_t id, uint64_t phash);
+    void eraseLocked(uint64_t id);
+    void appendLog(Op op, uint64_t id, uint64_t phash);
+    bool compactLog();
+};
+
+} // namespace imgstore
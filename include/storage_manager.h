@@ -1,31 +1,107 @@
 #pragma once
 
+#include <array>
 #include <string>
 #include <vector>
 #include <optional>
 #include <filesystem>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include "bloom_filter.h"
+#include "chunk_store.h"
+#include "directory_cache.h"
+#include "disk_set.h"
+#include "erasure_store.h"
+#include "known_directories.h"
+#include "layout_migrator.h"
+#include "metrics.h"
+#include "mirror.h"
+#include "object_index.h"
+#include "shard_layout.h"
+#include "similarity_index.h"
+#include "tombstone_set.h"
+#include "tier_manager.h"
 
 namespace imgstore {
 
+/**
+ * @brief Tunables for the storage layout and its in-memory index
+ */
+struct StorageOptions {
+    int shardDepth = 3;                // shard directory levels; a change is migrated online
+    int shardWidth = 2;                // hex digits per shard directory name
+    double reshardRate = 1000;         // entries moved per second by a layout migration; 0 unthrottled
+    int snapshotIntervalSeconds = 300; // how often the index snapshot is rewritten
+    size_t dirCacheSize = 4096;        // shard directories kept open; 0 opens them per request
+    int tombstoneRetentionHours = 720; // how long deletes are remembered for anti-entropy; 0 forever
+    bool knownDirs = true;             // track existing shard directories so writes skip checking them
+    bool chunking = false;             // store large images as deduplicated chunks
+    size_t chunkMinSize = 1024 * 1024; // smaller images are always stored whole
+    std::vector<std::string> diskDirs; // more disks to stripe the primary tier across
+    size_t diskQueueDepth = 8;         // operations each disk runs at once
+    std::vector<std::string> coldDirs; // colder storage roots, in tier order after baseDir
+    TierPolicy tierPolicy;
+    std::string mirrorDir;             // second root every write is replicated to; empty disables
+    bool mirrorAsync = false;          // replicate through a queue instead of before returning
+    size_t mirrorQueueSize = 1024;     // queued replication writes before new ones are dropped
+    std::chrono::milliseconds mirrorReadTimeout{1000}; // primary disk wait before a read fails over
+    std::vector<std::string> ecDirs;   // shard roots for erasure-coded images; empty disables
+    size_t ecParity = 2;               // parity shards; the other roots hold data shards
+    size_t ecMinSize = 4 * 1024 * 1024; // smaller images are stored whole
+};
+
 /**
  * @brief Manages image storage with sharded filesystem layout
  */
 class StorageManager {
 public:
+    /**
+     * @brief Callback for image walks; return false to stop
+     */
+    using ImageVisitor = std::function<bool(const std::string& imageId, const std::filesystem::path& path)>;
+
+    /**
+     * @brief Outcome of a verified read
+     */
+    enum class ReadStatus { Ok, NotFound, Corrupt };
+
     /**
      * @brief Construct a new Storage Manager
+     *
+     * Loads the index snapshot and journal, falling back to a parallel scan
+     * of the shard tree when no valid snapshot exists.
      * @param baseDir Base directory for storage
-     * @param shardDepth Depth of sharding hierarchy
+     * @param options Layout and index options
      */
-    explicit StorageManager(const std::string& baseDir, int shardDepth = 3);
+    explicit StorageManager(const std::string& baseDir, const StorageOptions& options = StorageOptions());
+
+    ~StorageManager();
 
     /**
      * @brief Store image data
+     *
+     * The write time recorded in the file's mtime orders the image against
+     * deletes on other replicas, so copies keep the time of the original upload.
      * @param imageId Unique identifier for the image
      * @param data Image binary data
+     * @param writtenAt Unix time in milliseconds of the original upload, for a
+     *                  copy from another replica; nullopt for a new upload
      * @return true if successful, false otherwise
      */
-    bool storeImage(const std::string& imageId, const std::vector<uint8_t>& data);
+    bool storeImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                    std::optional<int64_t> writtenAt = std::nullopt);
+
+    /**
+     * @brief Flush everything written so far to the disks of every storage root
+     *
+     * Plain writes are not synced one by one; bulk writers call this once
+     * per batch instead.
+     * @return false if any root could not be synced
+     */
+    bool syncToDisk();
 
     /**
      * @brief Retrieve image data
@@ -34,8 +110,24 @@ public:
      */
     std::optional<std::vector<uint8_t>> retrieveImage(const std::string& imageId);
 
+    /**
+     * @brief Retrieve image data, optionally checking it against its hash
+     *
+     * Verification is fused into the read loop: each chunk is hashed right
+     * after it lands in the buffer, while it is still cache-hot. A mismatch
+     * quarantines the file and reports ReadStatus::Corrupt.
+     * @param imageId Unique identifier for the image
+     * @param verify Check the XXH3 of the content against the ID
+     * @param status Set to the outcome of the read
+     * @return Optional containing image data if found and intact
+     */
+    std::optional<std::vector<uint8_t>> retrieveImage(const std::string& imageId, bool verify, ReadStatus& status);
+
     /**
      * @brief Delete image
+     *
+     * Leaves a tombstone, so anti-entropy does not copy the image back
+     * from a replica that still has it.
      * @param imageId Unique identifier for the image
      * @return true if successful, false otherwise
      */
@@ -48,6 +140,14 @@ public:
      */
     bool imageExists(const std::string& imageId);
 
+    /**
+     * @brief Get the content format recorded when the image was stored
+     * @param imageId Unique identifier for the image
+     * @return Stored format, or ImageFormat::Unknown if the image is not
+     *         indexed or was recovered by a directory scan
+     */
+    ImageFormat getImageFormat(const std::string& imageId) const;
+
     /**
      * @brief Store name-to-hash mapping
      * @param imageName User-friendly name for the image
@@ -90,9 +190,443 @@ public:
      */
     std::filesystem::path getImagePath(const std::string& imageId) const;
 
+    /**
+     * @brief Rebuild the negative-lookup filters from the index
+     *
+     * Lookups keep using the previous filters until the rebuild completes;
+     * writes made meanwhile are recorded in both generations. Filters never
+     * forget deleted keys, so a rebuild restores their accuracy.
+     * @return true on success
+     */
+    bool rebuildFilters();
+
+    /**
+     * @brief Visit every stored image in shard order, one storage tier after another
+     * @param fn Callback receiving the image ID and its path
+     * @return true if the walk completed, false if stopped or on error
+     */
+    bool forEachImage(const ImageVisitor& fn) const;
+
+    /**
+     * @brief Hash tree over the stored images, for comparing replicas
+     * @return Tree maintained by the index
+     */
+    const MerkleTree& merkleTree() const { return index_->merkle(); }
+
+    /**
+     * @brief Shard layout new entries are written with
+     * @return Current layout
+     */
+    const ShardLayout& layout() const { return layout_; }
+
+    /**
+     * @brief Migration from the layout the store had before this start
+     * @return Migrator, or nullptr if the layout did not change
+     */
+    const LayoutMigrator* layoutMigration() const { return migrator_.get(); }
+
+    /**
+     * @brief Consistent copy of the stored images and names, for backups
+     * @return Index contents as of one journal sequence
+     */
+    ObjectIndex::Capture captureIndex() { return index_->capture(); }
+
+    /**
+     * @brief Function run before an image is erased, while it can still be read
+     */
+    using EraseHook = std::function<void(const std::string& imageId)>;
+
+    /**
+     * @brief Set the function run before each image is erased
+     *
+     * Backups use it to keep a copy of captured images that are deleted
+     * before their export reaches them.
+     *
+     * @param hook Function to run, or nullptr for none
+     */
+    void setEraseHook(EraseHook hook);
+
+    /**
+     * @brief Keep a near-duplicate index in step with deletes
+     *
+     * Every erased image, whether deleted here, by anti-entropy or by an
+     * import, is also removed from the index.
+     *
+     * @param index Index to update, or nullptr for none
+     */
+    void setSimilarityIndex(std::shared_ptr<SimilarityIndex> index);
+
+    /**
+     * @brief List the images under some leaves of the hash tree
+     *
+     * Answered from the index in one pass, without touching the disks.
+     * @param buckets Leaves to list
+     * @return Image IDs in those leaves
+     */
+    std::vector<std::string> imagesInBuckets(const std::vector<uint16_t>& buckets) const;
+
+    /**
+     * @brief List the deletes remembered under some leaves of the hash tree
+     * @param buckets Leaves to list
+     * @return Image ID and unix time in milliseconds of each delete
+     */
+    std::vector<std::pair<std::string, int64_t>> deletesInBuckets(const std::vector<uint16_t>& buckets) const;
+
+    /**
+     * @brief Look up the delete of an image
+     * @param imageId Unique identifier for the image
+     * @return Unix time of the delete in milliseconds, or nullopt if it was not deleted or has been stored again
+     */
+    std::optional<int64_t> deletedAt(const std::string& imageId) const;
+
+    /**
+     * @brief When an image was uploaded
+     *
+     * Read from the primary file's mtime, which tier moves, disk rebalancing,
+     * mirror restores and copies from peers all carry over.
+     * @param imageId Unique identifier for the image
+     * @return Unix time in milliseconds, or nullopt if it is not on the primary
+     */
+    std::optional<int64_t> imageWrittenAt(const std::string& imageId) const;
+
+    /**
+     * @brief Apply a delete that happened on another replica
+     *
+     * The local copy is deleted unless it was written after the delete, and
+     * the tombstone is kept either way so the image is not pulled back.
+     * @param imageId Unique identifier for the image
+     * @param deletedAt Unix time of the delete in milliseconds
+     * @return true if a local copy was deleted
+     */
+    bool applyDelete(const std::string& imageId, int64_t deletedAt);
+
+    /**
+     * @brief Files that hold an image's bytes, in order
+     * @param path Image path as passed to an ImageVisitor
+     * @return The file itself, or the chunk files of a chunked image; empty
+     *         if the image is gone, nullopt if its chunk manifest is damaged
+     */
+    std::optional<std::vector<std::filesystem::path>> imageFiles(const std::filesystem::path& path) const;
+
+    /**
+     * @brief Delete chunks that no stored image references any more
+     * @return Counts for the pass
+     */
+    ChunkStore::GcResult collectChunkGarbage();
+
+    /**
+     * @brief Move an image to another storage tier now, as demotion and promotion do
+     * @param imageId Unique identifier for the image
+     * @param tier Destination tier; 0 is the primary disks
+     * @return true if the image now lives on the destination tier
+     */
+    bool moveImage(const std::string& imageId, uint8_t tier) { return tiers_->moveImage(imageId, tier); }
+
+    /**
+     * @brief Add a disk to the primary tier and start moving the images it wins
+     * @param dir Root directory of the new disk
+     * @param error Set to the reason on failure
+     * @return true if the disk was added
+     */
+    bool addDisk(const std::string& dir, std::string& error);
+
+    /**
+     * @brief Describe the primary tier's disks
+     * @return One entry per disk
+     */
+    std::vector<DiskSet::DiskStatus> diskStatus() const;
+
+    /**
+     * @brief Whether images are still being moved onto a newly added disk
+     * @return true while a rebalance is pending
+     */
+    bool disksRebalancing() const;
+
+    /**
+     * @brief Whether writes are replicated to a mirror root
+     * @return true if a mirror is configured
+     */
+    bool hasMirror() const { return mirror_ != nullptr; }
+
+    /**
+     * @brief Describe the mirror's replication state
+     * @return Status snapshot; only meaningful when hasMirror()
+     */
+    Mirror::Status mirrorStatus() const;
+
+    /**
+     * @brief Start a mirror repair pass in the background
+     * @return false without a mirror or if a pass is already running
+     */
+    bool triggerMirrorRepair();
+
+    /**
+     * @brief Whether large images are erasure-coded across shard roots
+     * @return true if shard roots are configured
+     */
+    bool hasErasure() const { return erasure_ != nullptr; }
+
+    /**
+     * @brief Describe the erasure-coded store
+     * @return Status snapshot; only meaningful when hasErasure()
+     */
+    ErasureStore::Status erasureStatus() const;
+
+    /**
+     * @brief Start a sweep over the shard roots in the background
+     * @return false without erasure coding or if a sweep is already running
+     */
+    bool triggerErasureSweep();
+
+    /**
+     * @brief Verify an erasure-coded image from every one of its shards
+     *
+     * Damaged shards are rewritten from the others along the way.
+     * @param imageId Unique identifier for the image
+     * @param path Image path as passed to an ImageVisitor
+     * @param bytesRead Set to the shard bytes read
+     * @return Whether the image is intact, or nullopt if it is not erasure-coded
+     */
+    std::optional<bool> verifyErasureCoded(const std::string& imageId, const std::filesystem::path& path,
+                                           uint64_t& bytesRead);
+
+    /**
+     * @brief Move a damaged image out of the serving tree
+     *
+     * The file is kept under `quarantine/` for inspection. Name mappings
+     * that point at it are left in place and start returning 404. The file
+     * is verified again under the image's lock first, so a read that raced
+     * a rewrite leaves a good copy where it is.
+     * @param imageId Unique identifier for the image
+     * @return true if the image was moved
+     */
+    bool quarantineImage(const std::string& imageId);
+
 private:
     std::string baseDir_;
-    int shardDepth_;
+    std::vector<std::string> syncRoots_; // every root written to, for syncToDisk()
+    ShardLayout layout_;
+    std::unique_ptr<LayoutMigrator> migrator_; // set while entries may be under an older layout
+    bool chunking_;
+    size_t chunkMinSize_;
+    std::unique_ptr<ObjectIndex> index_;
+    std::unique_ptr<ChunkStore> chunks_;
+    std::unique_ptr<DirectoryCache> dirs_; // open shard directories, for *at() calls on the request path
+    std::unique_ptr<DiskSet> disks_;
+    std::unique_ptr<TierManager> tiers_;
+    std::unique_ptr<KnownDirectories> knownDirs_; // leaf shard directories writes need not check
+    std::unique_ptr<Mirror> mirror_;
+    std::chrono::milliseconds mirrorReadTimeout_;
+    std::atomic<bool> trustMirror_{false}; // index was rebuilt from a scan; the mirror may know more
+    std::unique_ptr<ErasureStore> erasure_;
+    std::unique_ptr<TombstoneSet> tombstones_;
+    size_t erasureMinSize_;
+    std::atomic<uint64_t> tempCounter_{0}; // names temporary files of writes in flight
+
+    // Striped locks serialising writes and deletes of one name mapping
+    static constexpr size_t kNameLocks = 256;
+    std::array<std::mutex, kNameLocks> nameLocks_;
+    std::mutex& nameLock(const std::string& name);
+
+    /**
+     * @brief Bloom filter generation plus the metrics describing its accuracy
+     */
+    struct LookupFilter {
+        std::atomic<std::shared_ptr<BloomFilter>> current;
+        std::atomic<std::shared_ptr<BloomFilter>> pending;
+        Counter* lookups = nullptr;
+        Counter* rejections = nullptr;
+        Counter* falsePositives = nullptr;
+        Gauge* estimatedRate = nullptr;
+        Gauge* entries = nullptr;
+    };
+
+    Summary& verifySeconds_;
+    Counter& verifyFailures_;
+    Summary& sniffSeconds_;
+
+    LookupFilter hashFilter_;
+    LookupFilter nameFilter_;
+    std::mutex rebuildMutex_;
+
+    std::atomic<std::shared_ptr<const EraseHook>> eraseHook_;
+    std::atomic<std::shared_ptr<SimilarityIndex>> similarity_;
+
+    /**
+     * @brief Register metrics for a lookup filter
+     * @param filter Filter to initialise
+     * @param label Value of the `filter` label
+     */
+    static void initFilterMetrics(LookupFilter& filter, const std::string& label);
+
+    /**
+     * @brief Check a key against a filter
+     * @param filter Filter to consult
+     * @param key Image ID or name
+     * @return false if the key is definitely not stored
+     */
+    static bool filterMayContain(LookupFilter& filter, const std::string& key);
+
+    /**
+     * @brief Record a stored key in the current and any in-progress filter
+     * @param filter Filter to update
+     * @param key Image ID or name
+     */
+    static void filterAdd(LookupFilter& filter, const std::string& key);
+
+    /**
+     * @brief Re-resolve an image whose file was not at the expected path
+     *
+     * A tier move may have completed between the index lookup and the open,
+     * or a disk rebalance may not have reached the image yet.
+     * @param imageId Unique identifier for the image
+     * @param path Path that was tried; replaced by the new location
+     * @param tier Tier that was tried; replaced by the new tier
+     * @return true if there is somewhere else to look
+     */
+    bool relocated(const std::string& imageId, std::filesystem::path& path, uint8_t& tier) const;
+
+    /**
+     * @brief Decide the shard layout from the LAYOUT file and the configured one
+     *
+     * A configured layout that differs from the recorded one becomes the
+     * current layout and the recorded one the layout to migrate from.
+     * @param options Configured layout and the roots that cannot be migrated
+     * @return Layout to migrate from, if any
+     */
+    std::optional<ShardLayout> resolveLayout(const StorageOptions& options);
+
+    /**
+     * @brief Layouts entries may be found under
+     * @return The current layout, then the previous one while migrating
+     */
+    std::vector<ShardLayout> layoutsOnDisk() const;
+
+    /**
+     * @brief Find the file of an image, under the previous layout too
+     *
+     * Callers hold the image's move lock so the answer stays valid.
+     * @param imageId Unique identifier for the image
+     * @return Path of the file, or the current-layout path if there is none
+     */
+    std::filesystem::path findImageFile(const std::string& imageId) const;
+
+    /**
+     * @brief Move every primary-tier image that is not on the disk owning it
+     * @return true if every image was visited and moved
+     */
+    bool rebalanceDisks();
+
+    /**
+     * @brief Write an image to the primary storage only
+     * @param imageId Unique identifier for the image
+     * @param data Image binary data
+     * @param writtenAt Unix time in milliseconds to set as the file's mtime; nullopt keeps the current time
+     * @return true if successful
+     */
+    bool storePrimary(const std::string& imageId, const std::vector<uint8_t>& data,
+                      std::optional<int64_t> writtenAt = std::nullopt);
+
+    /**
+     * @brief Write a name mapping to the primary storage only
+     * @param imageName User-friendly name for the image
+     * @param imageHash Hash identifier for the image
+     * @return true if successful
+     */
+    bool storeNamePrimary(const std::string& imageName, const std::string& imageHash);
+
+    /**
+     * @brief Read an image from the primary storage only
+     *
+     * A copy that fails verification is quarantined, unless a second look
+     * under the image's move lock finds it intact; then it is read again.
+     * @param imageId Unique identifier for the image
+     * @param verify Check the content against expected
+     * @param expected Content hash to check against
+     * @param status Set to the outcome of the read
+     * @param timeout Longest wait for the disk; zero waits indefinitely
+     * @param timedOut Set if the disk did not admit the read in time
+     * @return Image data if found and intact
+     */
+    std::optional<std::vector<uint8_t>> readPrimary(const std::string& imageId, bool verify, uint64_t expected,
+                                                    ReadStatus& status, std::chrono::milliseconds timeout,
+                                                    bool& timedOut);
+
+    /**
+     * @brief Read the primary copy once, holding its disk slot only for the read
+     *
+     * Parameters as for readPrimary(); a mismatch sets ReadStatus::Corrupt
+     * and leaves the file in place.
+     */
+    std::optional<std::vector<uint8_t>> readPrimaryFile(const std::string& imageId, bool verify, uint64_t expected,
+                                                        ReadStatus& status, std::chrono::milliseconds timeout,
+                                                        bool& timedOut);
+
+    /**
+     * @brief Serve a read from the mirror after the primary failed
+     *
+     * The replica is always checked against its hash; a good copy replaces
+     * a primary copy that is missing or was quarantined.
+     * @param imageId Unique identifier for the image
+     * @param status Set to Ok if the mirror had an intact copy
+     * @param restore Write the replica back to the primary
+     * @return Image data, or nullopt if the mirror cannot help
+     */
+    std::optional<std::vector<uint8_t>> readMirror(const std::string& imageId, ReadStatus& status, bool restore);
+
+    /**
+     * @brief Re-sync the primary and the mirror
+     *
+     * The index decides what should exist: indexed images and names missing
+     * from either side are copied from the other, and mirror entries the
+     * index no longer has are removed. After the index was rebuilt from a
+     * scan, everything on the mirror is first restored to the primary, since
+     * the scan only saw what survived there.
+     * @return Counts for the pass
+     */
+    Mirror::RepairResult repairMirror();
+
+    /**
+     * @brief Read a chunked image given its manifest file
+     * @param imageId Unique identifier for the image
+     * @param fd Open manifest
+     * @param size Manifest size
+     * @param verify Check the reassembled content against expected
+     * @param expected Content hash to check against
+     * @param status Set to the outcome of the read
+     * @return Image data if all chunks were read (and verified)
+     */
+    std::optional<std::vector<uint8_t>> readChunked(const std::string& imageId, int fd, size_t size, bool verify,
+                                                    uint64_t expected, ReadStatus& status);
+
+    /**
+     * @brief Read an erasure-coded image given its stub file
+     * @param imageId Unique identifier for the image
+     * @param fd Open stub
+     * @param size Stub size
+     * @param verify Check the decoded content against expected
+     * @param expected Content hash to check against
+     * @param status Set to the outcome of the read
+     * @return Image data if enough shards were intact (and the content verified)
+     */
+    std::optional<std::vector<uint8_t>> readErasure(const std::string& imageId, int fd, size_t size, bool verify,
+                                                    uint64_t expected, ReadStatus& status);
+
+    /**
+     * @brief Read a file that may be a chunk manifest
+     * @param path File path
+     * @param manifest Receives the file if it is a manifest
+     * @return true if the file exists and is a manifest
+     */
+    static bool readManifest(const std::filesystem::path& path, std::vector<uint8_t>& manifest);
+
+    /**
+     * @brief Populate the index by scanning the shard trees with one task per top-level shard
+     *
+     * Images found below a cold root are recorded on that tier.
+     * @return true if the scan completed
+     */
+    bool scanIntoIndex();
 
     /**
      * @brief Ensure directory exists for given path
@@ -101,6 +635,33 @@ private:
      */
     bool ensureDirectory(const std::filesystem::path& path);
 
+    /**
+     * @brief Delete an image without leaving a tombstone
+     * @param imageId Unique identifier for the image
+     * @return true if it was deleted
+     */
+    bool eraseImage(const std::string& imageId);
+
+    /**
+     * @brief Hash an image as stored, following a manifest or stub to its data
+     * @param imageId Unique identifier for the image
+     * @param path Image file
+     * @return true if the content matches the ID
+     */
+    bool storedImageIntact(const std::string& imageId, const std::filesystem::path& path);
+
+    /**
+     * @brief Create or truncate a stored file for writing
+     *
+     * A file whose shard directory is known to exist is opened directly,
+     * without resolving or checking the directory first; otherwise the
+     * directory is opened through the cache and created if missing.
+     *
+     * @param path File path
+     * @return File descriptor, or -1 with errno set
+     */
+    int createFile(const std::filesystem::path& path);
+
     /**
      * @brief Get full path for name mapping file
      * @param imageName User-friendly name for the image
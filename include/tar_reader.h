@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace imgstore {
+
+/**
+ * @brief Reads the regular files of a tar archive in order, from a file or a pipe
+ *
+ * Understands ustar, pax extended headers (for long paths and sizes), GNU
+ * long names and base-256 sizes. Directories, links and other special
+ * members are skipped. The archive is read strictly sequentially, so it
+ * can come from standard input.
+ */
+class TarReader {
+public:
+    /**
+     * @brief One regular file in the archive
+     */
+    struct Entry {
+        std::string path;
+        uint64_t size = 0;
+    };
+
+    /**
+     * @brief Open an archive
+     * @param path Archive file, or "-" for standard input
+     */
+    explicit TarReader(const std::filesystem::path& path);
+
+    ~TarReader();
+
+    TarReader(const TarReader&) = delete;
+    TarReader& operator=(const TarReader&) = delete;
+
+    /**
+     * @brief Check that the archive opened and no read or format error occurred
+     * @return true while the archive is readable
+     */
+    bool good() const { return fd_ >= 0 && error_.empty(); }
+
+    /**
+     * @brief Describe the error that stopped reading
+     * @return Error message, empty if none
+     */
+    const std::string& error() const { return error_; }
+
+    /**
+     * @brief Advance to the next regular file, skipping what is left of the current one
+     * @param entry Set to the file's path and size
+     * @return false at the end of the archive or on error
+     */
+    bool next(Entry& entry);
+
+    /**
+     * @brief Read the contents of the current file
+     * @param data Receives the bytes
+     * @return false on a read error
+     */
+    bool read(std::vector<uint8_t>& data);
+
+private:
+    int fd_;
+    bool ownsFd_;
+    std::string error_;
+    uint64_t size_ = 0;      // size of the current file
+    uint64_t remaining_ = 0; // unread bytes of the current file, padding included
+
+    bool readExact(void* buffer, size_t size);
+    bool skip(uint64_t size);
+    bool readString(uint64_t size, std::string& value);
+};
+
+} // namespace imgstore
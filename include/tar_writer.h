@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+
+namespace imgstore {
+
+/**
+ * @brief Writes a POSIX tar archive to a file, one member at a time
+ *
+ * Members are plain files. Paths longer than the ustar header allows get a
+ * pax extended header, and sizes beyond the octal field use the base-256
+ * encoding GNU tar reads, so any standard tar can extract the result.
+ */
+class TarWriter {
+public:
+    /**
+     * @brief Create or truncate the archive file
+     * @param path Archive to write
+     */
+    explicit TarWriter(const std::filesystem::path& path);
+
+    /**
+     * @brief Close the file; an archive that was not finished is left incomplete
+     */
+    ~TarWriter();
+
+    TarWriter(const TarWriter&) = delete;
+    TarWriter& operator=(const TarWriter&) = delete;
+
+    /**
+     * @brief Check that the file opened and every write so far succeeded
+     * @return true if the archive is still good
+     */
+    bool good() const { return fd_ >= 0 && ok_; }
+
+    /**
+     * @brief Append a file
+     * @param name Path of the member inside the archive
+     * @param data File contents
+     * @param size Number of bytes
+     * @param mtime Modification time in Unix seconds
+     * @return false if the write failed
+     */
+    bool add(const std::string& name, const void* data, size_t size, int64_t mtime);
+
+    /**
+     * @brief Write the end-of-archive marker and flush the file to disk
+     * @return false if any write failed
+     */
+    bool finish();
+
+    /**
+     * @brief Bytes written so far, headers and padding included
+     */
+    uint64_t bytes() const { return bytes_; }
+
+private:
+    int fd_;
+    bool ok_ = true;
+    uint64_t bytes_ = 0;
+
+    bool writeHeader(const std::string& name, uint64_t size, int64_t mtime, char type);
+    bool writePadded(const void* data, size_t size);
+    bool writeAll(const void* data, size_t size);
+};
+
+} // namespace imgstore
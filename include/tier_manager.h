@@ -0,0 +1,187 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "disk_set.h"
+#include "metrics.h"
+#include "object_index.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief When images move between storage tiers
+ */
+struct TierPolicy {
+    std::chrono::seconds demoteAfter{72 * 3600}; // idle time before an image moves one tier colder
+    uint32_t promoteAfterReads = 1;              // reads of a cold image before it moves back to tier 0
+};
+
+/**
+ * @brief Places images on hot and cold storage roots
+ *
+ * Tier 0 is the primary storage disks and takes every new image; the cold
+ * roots follow in the order configured. Each root has the same shard
+ * layout, and the index records which tier holds each image, so a lookup
+ * costs no more than with a single root.
+ *
+ * Reads are counted in memory. A background thread demotes images idle for
+ * longer than the policy allows and promotes cold images once they have
+ * been read often enough. Idle time counts from the last read or from
+ * startup, whichever is later, so a restart never triggers a burst of
+ * demotions.
+ *
+ * A move copies the file into the destination root, flushes it, records the
+ * new tier in the index journal and only then unlinks the source. Readers
+ * that race with a move retry at the new location.
+ */
+class TierManager {
+public:
+    /**
+     * @brief Construct a tier manager
+     * @param hot Disks making up tier 0
+     * @param coldRoots Roots of tiers 1 and up, fastest first
+     * @param layout Shard directory layout used below every root
+     * @param index Object index recording the tier of each image
+     * @param policy Demotion and promotion thresholds
+     */
+    TierManager(DiskSet& hot, std::vector<std::filesystem::path> coldRoots, const ShardLayout& layout,
+                ObjectIndex& index, const TierPolicy& policy);
+
+    ~TierManager();
+
+    TierManager(const TierManager&) = delete;
+    TierManager& operator=(const TierManager&) = delete;
+
+    /**
+     * @brief Start the background thread; does nothing without cold roots
+     */
+    void start();
+
+    /**
+     * @brief Stop the background thread, abandoning queued promotions
+     */
+    void stop();
+
+    size_t tierCount() const { return cold_.size() + 1; }
+
+    /**
+     * @brief Storage roots of a tier
+     * @param tier Tier number
+     * @return One root per disk for tier 0, the single cold root otherwise
+     */
+    std::vector<std::filesystem::path> roots(uint8_t tier) const;
+
+    /**
+     * @brief Path of an image on a given tier
+     * @param imageId Unique identifier for the image
+     * @param tier Tier number
+     * @return Sharded path below the tier's root; on tier 0, the owning disk's
+     */
+    std::filesystem::path pathFor(const std::string& imageId, uint8_t tier) const;
+
+    /**
+     * @brief Path an image is stored at right now
+     * @param imageId Unique identifier for the image
+     * @return Path on the tier the index records, following a pending disk rebalance
+     */
+    std::filesystem::path locate(const std::string& imageId) const;
+
+    /**
+     * @brief Tier holding an image according to the index
+     * @param imageId Unique identifier for the image
+     * @return Tier number; 0 for images the index does not know
+     */
+    uint8_t tierOf(const std::string& imageId) const;
+
+    /**
+     * @brief Record a successful read, queueing a promotion if it was cold enough
+     * @param imageId Unique identifier for the image
+     * @param tier Tier the image was read from
+     */
+    void recordRead(const std::string& imageId, uint8_t tier);
+
+    /**
+     * @brief Forget the read history of a deleted image
+     * @param imageId Unique identifier for the image
+     */
+    void forget(const std::string& imageId);
+
+    /**
+     * @brief Lock serialising moves with writes and deletes of one image
+     * @param imageId Unique identifier for the image
+     * @return Striped mutex covering the image
+     */
+    std::mutex& moveLock(const std::string& imageId);
+
+    /**
+     * @brief Move an image to another tier
+     * @param imageId Unique identifier for the image
+     * @param tier Destination tier
+     * @return true if the image now lives on the destination tier
+     */
+    bool moveImage(const std::string& imageId, uint8_t tier);
+
+    /**
+     * @brief Demote every image that has been idle for longer than the policy allows
+     * @return Number of images moved
+     */
+    size_t runDemotionPass();
+
+private:
+    static constexpr size_t kAccessShards = 64;
+    static constexpr size_t kMoveLocks = 256;
+
+    /**
+     * @brief Read history of one image
+     */
+    struct Access {
+        int64_t lastRead = 0; // seconds since startup
+        uint32_t reads = 0;   // reads since the image last changed tier
+    };
+
+    struct AccessShard {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Access> entries;
+    };
+
+    DiskSet& hot_;
+    std::vector<std::filesystem::path> cold_;
+    ShardLayout layout_;
+    ObjectIndex& index_;
+    TierPolicy policy_;
+    std::chrono::steady_clock::time_point startTime_;
+
+    std::array<AccessShard, kAccessShards> access_;
+    std::array<std::mutex, kMoveLocks> moveLocks_;
+
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopRequested_ = false;
+    std::deque<std::string> pending_; // images waiting for promotion
+    std::unordered_set<std::string> queued_;
+
+    Counter& demotions_;
+    Counter& promotions_;
+    Counter& demotedBytes_;
+    Counter& promotedBytes_;
+    Counter& moveFailures_;
+    std::vector<Counter*> reads_;
+
+    int64_t now() const;
+    AccessShard& accessShard(uint64_t hash) { return access_[(hash >> 8) % kAccessShards]; }
+    void loop();
+};
+
+} // namespace imgstore
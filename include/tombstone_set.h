@@ -0,0 +1,100 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Record of deleted images, so replicas can tell a delete from a miss
+ *
+ * Anti-entropy compares which images two replicas hold. Without a record
+ * of deletes, an image deleted on one replica looks merely missing there
+ * and is copied straight back from the others. Each delete therefore
+ * leaves a tombstone with the time it happened, which replicas exchange
+ * with their listings, and which a later upload of the same image clears.
+ *
+ * Tombstones are appended to `tombstones.log` in the storage directory and
+ * kept for a retention period: a replica that is down for longer than that
+ * brings its deleted images back. The log is compacted on every start and
+ * whenever it grows to several times the live set.
+ */
+class TombstoneSet {
+public:
+    /**
+     * @brief Construct the set and load its log
+     * @param baseDir Storage directory
+     * @param retention How long a tombstone is kept
+     */
+    TombstoneSet(const std::filesystem::path& baseDir, std::chrono::seconds retention);
+
+    ~TombstoneSet();
+
+    TombstoneSet(const TombstoneSet&) = delete;
+    TombstoneSet& operator=(const TombstoneSet&) = delete;
+
+    /**
+     * @brief Record a delete
+     * @param hash Image hash
+     * @param deletedAt Unix time of the delete in milliseconds; a later one for the same image wins
+     */
+    void add(uint64_t hash, int64_t deletedAt);
+
+    /**
+     * @brief Forget the delete of an image stored again
+     * @param hash Image hash
+     */
+    void clear(uint64_t hash);
+
+    /**
+     * @brief Look up a delete
+     * @param hash Image hash
+     * @return Unix time of the delete in milliseconds, or nullopt if none is recorded or it expired
+     */
+    std::optional<int64_t> deletedAt(uint64_t hash) const;
+
+    /**
+     * @brief List unexpired deletes
+     * @param wanted Decides which hashes to list
+     * @return Hash and unix time in milliseconds of each delete
+     */
+    std::vector<std::pair<uint64_t, int64_t>> list(const std::function<bool(uint64_t)>& wanted) const;
+
+    /**
+     * @brief Current wall-clock time as stored in tombstones
+     *
+     * Milliseconds, like the write times deletes are compared against, so a
+     * delete and a re-upload within the same second still order correctly.
+     * @return Unix time in milliseconds
+     */
+    static int64_t now();
+
+private:
+    std::filesystem::path path_;
+    std::chrono::seconds retention_;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<uint64_t, int64_t> entries_;
+    int fd_ = -1;
+    size_t records_ = 0; // lines in the log, live or not
+
+    void load();
+    void append(uint64_t hash, const char* value);
+
+    /**
+     * @brief Rewrite the log with only unexpired entries; mutex_ must be held
+     */
+    void compactLocked();
+
+    bool expired(int64_t deletedAt) const;
+};
+
+} // namespace imgstore
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "metrics.h"
+#include "shard_layout.h"
+
+namespace imgstore {
+
+/**
+ * @brief A derived image, or the reason it could not be produced
+ */
+struct Variant {
+    // Original: the source itself should be served (e.g. a conversion that
+    // would not have been smaller); data holds the source bytes when the
+    // producer already had them, and is empty when read from the cache
+    enum class Status { Ok, Original, SourceNotFound, SourceCorrupt, Unsupported, Undecodable, Failed };
+
+    Status status = Status::Failed;
+    std::vector<uint8_t> data;
+};
+
+/**
+ * @brief On-disk cache of derived images keyed by (source hash, transform)
+ *
+ * Variants live under `variants/<shard>/<source id>/<transform hash>`, so all
+ * variants of a source can be dropped with its directory. Sources are
+ * content-addressed, which makes a cached variant valid for as long as its
+ * source ID exists. Concurrent requests for the same missing variant share
+ * a single producer call. An Original result is remembered as an empty
+ * file so later requests skip straight to the source.
+ *
+ * Each source keeps at most a fixed number of variants; storing one more
+ * evicts the oldest written, so requests cycling through parameters cannot
+ * fill the disk.
+ */
+class VariantCache {
+public:
+    using Producer = std::function<Variant()>;
+
+    /**
+     * @brief Construct a variant cache
+     * @param baseDir Storage base directory
+     * @param layout Shard layout of the source directories
+     * @param maxPerSource Variants kept per source image; 0 keeps every one
+     */
+    VariantCache(const std::string& baseDir, const ShardLayout& layout, size_t maxPerSource = 64);
+
+    /**
+     * @brief Return a cached variant, producing and storing it on a miss
+     * @param sourceId Hash of the source image
+     * @param transformKey Canonical transform key
+     * @param produce Called at most once per concurrent miss; Ok and Original results are stored
+     * @param cached Set to true if the variant came from disk or another in-flight request
+     * @return Variant (never null)
+     */
+    std::shared_ptr<const Variant> getOrCreate(const std::string& sourceId, const std::string& transformKey,
+                                               const Producer& produce, bool& cached);
+
+    /**
+     * @brief Drop every variant of a source image
+     * @param sourceId Hash of the source image
+     * @return Number of variants removed
+     */
+    size_t removeVariants(const std::string& sourceId);
+
+    /**
+     * @brief Get the path of a variant
+     * @param sourceId Hash of the source image
+     * @param transformKey Canonical transform key
+     * @return Filesystem path of the variant
+     */
+    std::filesystem::path variantPath(const std::string& sourceId, const std::string& transformKey) const;
+
+private:
+    using Result = std::shared_ptr<const Variant>;
+
+    std::filesystem::path root_;
+    ShardLayout layout_;
+    size_t maxPerSource_;
+
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_future<Result>> inflight_;
+
+    Counter& hits_;
+    Counter& misses_;
+    Counter& joins_;
+    Counter& bytesWritten_;
+    Counter& evictions_;
+
+    std::filesystem::path sourceDirectory(const std::string& sourceId) const;
+    std::optional<std::vector<uint8_t>> readVariant(const std::filesystem::path& path) const;
+    bool writeVariant(const std::filesystem::path& path, const std::vector<uint8_t>& data);
+
+    /**
+     * @brief Remove the oldest variants of a source beyond the per-source limit
+     * @param dir Directory holding the source's variants
+     */
+    void evictOldest(const std::filesystem::path& dir);
+};
+
+} // namespace imgstore
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "metrics.h"
+
+namespace imgstore {
+
+/**
+ * @brief Bounded background queue that pre-generates variants after upload
+ *
+ * Eager generation is an optimisation, never a requirement: a variant that
+ * was not pre-built is still produced on its first download. The pipeline
+ * therefore sheds work instead of queueing it without bound. A job is
+ * refused when the queue is full or the pressure check reports the server
+ * is busy, and a job that is already running stops between steps once
+ * pressure appears. Workers run at a lower CPU priority than request
+ * handling.
+ */
+class VariantPipeline {
+public:
+    /**
+     * @brief One unit of generation work
+     *
+     * Called with a stop check that the job should consult between steps
+     * (it returns true when the job should give up). The job returns false
+     * if it stopped early.
+     */
+    using Job = std::function<bool(const std::function<bool()>& shouldStop)>;
+
+    /**
+     * @brief Start the pipeline
+     * @param threads Number of worker threads
+     * @param capacity Maximum number of queued jobs
+     * @param underPressure Returns true while variant work should be shed; may be empty
+     */
+    VariantPipeline(size_t threads, size_t capacity, std::function<bool()> underPressure);
+
+    /**
+     * @brief Stop the workers, dropping queued jobs
+     */
+    ~VariantPipeline();
+
+    VariantPipeline(const VariantPipeline&) = delete;
+    VariantPipeline& operator=(const VariantPipeline&) = delete;
+
+    /**
+     * @brief Queue a job if the pipeline has room and the server is not busy
+     * @param sourceId Image the job works on, used for logging
+     * @param job Work to run on a pipeline thread
+     * @return false if the job was shed
+     */
+    bool submit(const std::string& sourceId, Job job);
+
+    /**
+     * @brief Number of jobs waiting to start
+     * @return Queue depth
+     */
+    size_t queueDepth() const;
+
+    /**
+     * @brief Stop the workers; queued jobs are dropped, running ones are asked to stop
+     */
+    void shutdown();
+
+private:
+    struct Entry {
+        std::string sourceId;
+        Job job;
+    };
+
+    size_t capacity_;
+    std::function<bool()> underPressure_;
+
+    std::vector<std::thread> threads_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<Entry> queue_;
+    std::atomic<bool> stopping_{false};
+
+    Counter& accepted_;
+    Counter& shedQueueFull_;
+    Counter& shedPressure_;
+    Counter& abandoned_;
+    Counter& completed_;
+
+    bool pressure() const;
+    void workerLoop();
+};
+
+} // namespace imgstore
@@ -0,0 +1,444 @@
+#include "anti_entropy.h"
+#include "crow_all.h"
+#include "hash_utils.h"
+#include "merkle_tree.h"
+#include <algorithm>
+#include <iostream>
+#include <unordered_set>
+
+namespace imgstore {
+
+namespace {
+
+// Keeps request lines and listing responses a sensible size
+constexpr size_t kPrefixesPerRequest = 64;
+constexpr size_t kBucketsPerRequest = 4096;
+constexpr size_t kIdsPerRequest = 1024;
+
+std::string hex2(size_t value) {
+    static constexpr char kDigits[] = "0123456789abcdef";
+    return {kDigits[(value >> 4) & 0xf], kDigits[value & 0xf]};
+}
+
+// Children arrive as one string of 16-digit digests
+bool parseDigests(const std::string& text, std::vector<uint64_t>& digests) {
+    if (text.size() != MerkleTree::kFanout * 16) {
+        return false;
+    }
+    digests.resize(MerkleTree::kFanout);
+    for (size_t i = 0; i < MerkleTree::kFanout; ++i) {
+        if (!HashUtils::hexToHash(text.substr(i * 16, 16), digests[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+std::string joinBatch(const std::vector<T>& items, size_t begin, size_t end, char separator,
+                      const std::function<std::string(const T&)>& format) {
+    std::string result;
+    for (size_t i = begin; i < end; ++i) {
+        if (i > begin) {
+            result += separator;
+        }
+        result += format(items[i]);
+    }
+    return result;
+}
+
+} // namespace
+
+AntiEntropy::AntiEntropy(std::shared_ptr<StorageManager> storage, Options options, Filter filter)
+    : storage_(storage), options_(std::move(options)), filter_(std::move(filter)), client_(options_.timeout),
+      rounds_(Metrics::instance().counter("imgstore_sync_rounds_total",
+                                          "Completed anti-entropy rounds")),
+      bucketsDiffering_(Metrics::instance().counter("imgstore_sync_buckets_differing_total",
+                                                    "Hash tree leaves that differed from a peer's")),
+      objectsPulled_(Metrics::instance().counter("imgstore_sync_objects_pulled_total",
+                                                 "Images copied from peers by anti-entropy")),
+      objectsDeleted_(Metrics::instance().counter("imgstore_sync_objects_deleted_total",
+                                                  "Images deleted because a peer remembered deleting them")),
+      bytesPulled_(Metrics::instance().counter("imgstore_sync_bytes_pulled_total",
+                                               "Image bytes copied from peers by anti-entropy")),
+      treeBytes_(Metrics::instance().counter("imgstore_sync_tree_bytes_total",
+                                             "Bytes of digests and listings received while comparing with peers")),
+      peerErrors_(Metrics::instance().counter("imgstore_sync_peer_errors_total",
+                                              "Anti-entropy requests that failed or got a bad answer")),
+      roundSeconds_(Metrics::instance().summary("imgstore_sync_round_seconds",
+                                                "Duration of anti-entropy rounds")) {
+    Metrics::instance().callbackGauge("imgstore_sync_running", "1 while an anti-entropy round is in progress",
+                                      [this]() { return running_.load() ? 1.0 : 0.0; });
+}
+
+AntiEntropy::~AntiEntropy() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_sync_running", "", nullptr);
+}
+
+void AntiEntropy::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (thread_.joinable()) {
+        return;
+    }
+    stopRequested_ = false;
+    thread_ = std::thread(&AntiEntropy::loop, this);
+}
+
+void AntiEntropy::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopRequested_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool AntiEntropy::trigger() {
+    if (running_.load()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        triggerRequested_ = true;
+    }
+    cv_.notify_all();
+    return true;
+}
+
+AntiEntropy::Status AntiEntropy::status() const {
+    Status status;
+    status.running = running_.load();
+    status.rounds = rounds_.value();
+    status.bucketsDiffering = bucketsDiffering_.value();
+    status.objectsPulled = objectsPulled_.value();
+    status.objectsDeleted = objectsDeleted_.value();
+    status.bytesPulled = bytesPulled_.value();
+    status.treeBytes = treeBytes_.value();
+    status.peerErrors = peerErrors_.value();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    status.lastError = lastError_;
+    return status;
+}
+
+void AntiEntropy::loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopRequested_) {
+        auto wake = [this]() { return stopRequested_ || triggerRequested_; };
+        if (options_.interval.count() > 0) {
+            cv_.wait_for(lock, options_.interval, wake);
+        } else {
+            cv_.wait(lock, wake);
+        }
+        if (stopRequested_) {
+            break;
+        }
+        triggerRequested_ = false;
+
+        lock.unlock();
+        runRound();
+        lock.lock();
+    }
+}
+
+bool AntiEntropy::stopping() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stopRequested_;
+}
+
+void AntiEntropy::runRound() {
+    running_ = true;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t pulledBefore = objectsPulled_.value();
+    uint64_t deletedBefore = objectsDeleted_.value();
+
+    for (const auto& peer : options_.peers) {
+        if (stopping()) {
+            break;
+        }
+        syncWith(peer);
+    }
+
+    rounds_.increment();
+    roundSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (objectsPulled_.value() > pulledBefore) {
+        std::cout << "Anti-entropy round copied " << objectsPulled_.value() - pulledBefore << " images from peers"
+                  << std::endl;
+    }
+    if (objectsDeleted_.value() > deletedBefore) {
+        std::cout << "Anti-entropy round applied " << objectsDeleted_.value() - deletedBefore
+                  << " deletes from peers" << std::endl;
+    }
+    running_ = false;
+}
+
+bool AntiEntropy::syncWith(const std::string& peer) {
+    const MerkleTree& tree = storage_->merkleTree();
+
+    uint64_t peerRoot = 0;
+    std::vector<std::vector<uint64_t>> children;
+    if (!fetchNodes(peer, {}, peerRoot, children)) {
+        return false;
+    }
+    if (peerRoot == tree.root()) {
+        return true;
+    }
+
+    // Walk down one level at a time, following only the digests that differ
+    std::vector<std::string> differing = {""};
+    for (int level = 0; level < 2; ++level) {
+        std::vector<std::string> next;
+        for (size_t begin = 0; begin < differing.size(); begin += kPrefixesPerRequest) {
+            if (stopping()) {
+                return false;
+            }
+            std::vector<std::string> batch(differing.begin() + begin,
+                                           differing.begin() + std::min(differing.size(), begin + kPrefixesPerRequest));
+            if (!fetchNodes(peer, batch, peerRoot, children)) {
+                return false;
+            }
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto mine = tree.children(batch[i]);
+                for (size_t child = 0; mine && child < MerkleTree::kFanout; ++child) {
+                    if ((*mine)[child] != children[i][child]) {
+                        next.push_back(batch[i] + hex2(child));
+                    }
+                }
+            }
+        }
+        differing = std::move(next);
+    }
+
+    std::vector<uint16_t> buckets;
+    for (const auto& prefix : differing) {
+        uint16_t bucket = 0;
+        if (MerkleTree::parseBucket(prefix, bucket)) {
+            buckets.push_back(bucket);
+        }
+    }
+    bucketsDiffering_.increment(buckets.size());
+    if (buckets.empty()) {
+        return true;
+    }
+
+    std::vector<std::string> theirs;
+    std::vector<std::pair<std::string, int64_t>> theirDeletes;
+    for (size_t begin = 0; begin < buckets.size(); begin += kBucketsPerRequest) {
+        std::vector<uint16_t> batch(buckets.begin() + begin,
+                                    buckets.begin() + std::min(buckets.size(), begin + kBucketsPerRequest));
+        if (!fetchListing(peer, batch, theirs, theirDeletes)) {
+            return false;
+        }
+    }
+
+    // Deletes this node missed; a copy uploaded again since the delete stays
+    for (const auto& [id, deletedAt] : theirDeletes) {
+        if (storage_->applyDelete(id, deletedAt)) {
+            objectsDeleted_.increment();
+        }
+    }
+
+    auto ours = storage_->imagesInBuckets(buckets);
+    std::unordered_set<std::string> have(ours.begin(), ours.end());
+    std::vector<std::string> missing;
+    std::vector<std::string> deletedHere;
+    for (const auto& id : theirs) {
+        if (have.count(id) || (filter_ && !filter_(id))) {
+            continue;
+        }
+        (storage_->deletedAt(id) ? deletedHere : missing).push_back(id);
+    }
+
+    // An image deleted here only comes back if the peer's copy was written after the delete
+    for (size_t begin = 0; begin < deletedHere.size(); begin += kIdsPerRequest) {
+        std::vector<std::string> batch(deletedHere.begin() + begin,
+                                       deletedHere.begin() + std::min(deletedHere.size(), begin + kIdsPerRequest));
+        std::unordered_map<std::string, int64_t> written;
+        if (!fetchWritten(peer, batch, written)) {
+            return false;
+        }
+        for (const auto& id : batch) {
+            auto deletedAt = storage_->deletedAt(id);
+            auto it = written.find(id);
+            if (it != written.end() && (!deletedAt || it->second > *deletedAt)) {
+                missing.push_back(id);
+            }
+        }
+    }
+    return missing.empty() || pullImages(peer, missing);
+}
+
+bool AntiEntropy::fetchNodes(const std::string& peer, const std::vector<std::string>& prefixes, uint64_t& root,
+                             std::vector<std::vector<uint64_t>>& children) {
+    std::string target = "/admin/merkle";
+    if (!prefixes.empty()) {
+        target += "?children=" + joinBatch<std::string>(prefixes, 0, prefixes.size(), ',', [](const std::string& p) {
+            return p.empty() ? std::string("root") : p;
+        });
+    }
+    auto response = request(peer, "GET", target, "");
+    if (!response) {
+        return false;
+    }
+    treeBytes_.increment(response->body.size());
+
+    auto json = crow::json::load(response->body);
+    if (!json || !json.has("root") || !HashUtils::hexToHash(std::string(json["root"].s()), root)) {
+        recordError("Bad hash tree answer from " + peer);
+        return false;
+    }
+    children.assign(prefixes.size(), {});
+    for (size_t i = 0; i < prefixes.size(); ++i) {
+        std::string key = prefixes[i].empty() ? "root" : prefixes[i];
+        if (!json.has("children") || !json["children"].has(key) ||
+            !parseDigests(std::string(json["children"][key].s()), children[i])) {
+            recordError("Bad hash tree answer from " + peer);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool AntiEntropy::fetchListing(const std::string& peer, const std::vector<uint16_t>& buckets,
+                               std::vector<std::string>& ids, std::vector<std::pair<std::string, int64_t>>& deleted) {
+    std::string body = joinBatch<uint16_t>(buckets, 0, buckets.size(), '\n', &MerkleTree::bucketToHex);
+    auto response = request(peer, "POST", "/admin/merkle/objects", body);
+    if (!response) {
+        return false;
+    }
+    treeBytes_.increment(response->body.size());
+
+    auto json = crow::json::load(response->body);
+    if (!json || !json.has("ids") || json["ids"].t() != crow::json::type::List) {
+        recordError("Bad listing answer from " + peer);
+        return false;
+    }
+    for (const auto& id : json["ids"]) {
+        ids.emplace_back(id.s());
+    }
+    // Absent from peers that predate tombstones
+    if (json.has("deleted") && json["deleted"].t() == crow::json::type::Object) {
+        for (const auto& entry : json["deleted"]) {
+            deleted.emplace_back(entry.key(), entry.i());
+        }
+    }
+    return true;
+}
+
+bool AntiEntropy::fetchWritten(const std::string& peer, const std::vector<std::string>& ids,
+                               std::unordered_map<std::string, int64_t>& written) {
+    std::string body = joinBatch<std::string>(ids, 0, ids.size(), '\n', [](const std::string& id) { return id; });
+    auto response = request(peer, "POST", "/admin/merkle/written", body);
+    if (!response) {
+        return false;
+    }
+    treeBytes_.increment(response->body.size());
+
+    auto json = crow::json::load(response->body);
+    if (!json || !json.has("written") || json["written"].t() != crow::json::type::Object) {
+        recordError("Bad write-time answer from " + peer);
+        return false;
+    }
+    for (const auto& entry : json["written"]) {
+        written[entry.key()] = entry.i();
+    }
+    return true;
+}
+
+bool AntiEntropy::pullImages(const std::string& peer, const std::vector<std::string>& ids) {
+    size_t next = 0;
+    while (next < ids.size()) {
+        if (stopping()) {
+            return false;
+        }
+        size_t end = std::min(ids.size(), next + kIdsPerRequest);
+        std::string body = joinBatch<std::string>(ids, next, end, '\n', [](const std::string& id) { return id; });
+        auto response = request(peer, "POST", "/admin/merkle/fetch?max=" + std::to_string(options_.batchBytes), body);
+        if (!response) {
+            return false;
+        }
+
+        // Frames are "<id> <size> [<written>]\n<bytes>", or "<id> -\n" for an image the peer no longer has
+        const std::string& data = response->body;
+        size_t pos = 0;
+        size_t answered = 0;
+        while (pos < data.size()) {
+            size_t eol = data.find('\n', pos);
+            size_t space = data.find(' ', pos);
+            if (eol == std::string::npos || space == std::string::npos || space > eol) {
+                break;
+            }
+            std::string id = data.substr(pos, space - pos);
+            std::string size = data.substr(space + 1, eol - space - 1);
+            std::optional<int64_t> writtenAt;
+            if (size_t second = size.find(' '); second != std::string::npos) {
+                try {
+                    writtenAt = std::stoll(size.substr(second + 1));
+                } catch (const std::exception&) {
+                }
+                size.resize(second);
+            }
+            pos = eol + 1;
+            ++answered;
+            if (size == "-") {
+                continue;
+            }
+
+            size_t length = 0;
+            try {
+                length = std::stoull(size);
+            } catch (const std::exception&) {
+                break;
+            }
+            if (length > data.size() - pos) {
+                break;
+            }
+            uint64_t expected = 0;
+            bool intact = HashUtils::hexToHash(id, expected) && HashUtils::xxh3_64(data.data() + pos, length) == expected;
+            if (intact) {
+                std::vector<uint8_t> image(data.begin() + pos, data.begin() + pos + length);
+                if (storage_->storeImage(id, image, writtenAt)) {
+                    objectsPulled_.increment();
+                    bytesPulled_.increment(length);
+                }
+            } else {
+                std::cerr << "Peer " << peer << " sent image " << id << " with the wrong content" << std::endl;
+            }
+            pos += length;
+        }
+
+        if (answered == 0) {
+            recordError("Bad fetch answer from " + peer);
+            return false;
+        }
+        next += answered;
+    }
+    return true;
+}
+
+std::optional<PeerClient::Response> AntiEntropy::request(const std::string& peer, const std::string& method,
+                                                         const std::string& target, const std::string& body) {
+    PeerClient::Headers headers = {{PeerClient::kHopHeader, "sync"}};
+    if (!options_.apiKey.empty()) {
+        headers.emplace_back("Authorization", "Bearer " + options_.apiKey);
+    }
+    auto response = client_.send(peer, method, target, headers, body);
+    if (!response || response->status != 200) {
+        peerErrors_.increment();
+        recordError(response ? "Peer " + peer + " answered " + std::to_string(response->status) + " to " + target
+                             : "Peer " + peer + " did not answer");
+        return std::nullopt;
+    }
+    return response;
+}
+
+void AntiEntropy::recordError(const std::string& error) {
+    std::cerr << "Anti-entropy: " << error << std::endl;
+    std::lock_guard<std::mutex> lock(mutex_);
+    lastError_ = error;
+}
+
+} // namespace imgstore
@@ -0,0 +1,544 @@
+#include "backup_manager.h"
+#include "crow_all.h"
+#include "hash_utils.h"
+#include "tar_writer.h"
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+namespace imgstore {
+
+namespace {
+
+constexpr char kCaptureMagic[8] = {'I', 'M', 'G', 'B', 'K', 'C', 'P', '1'};
+
+int64_t nowSeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// IDs sort in creation order and are safe as file names
+std::string makeId(int64_t seconds) {
+    std::time_t time = static_cast<std::time_t>(seconds);
+    std::tm utc{};
+    gmtime_r(&time, &utc);
+    char buffer[32];
+    std::strftime(buffer, sizeof(buffer), "%Y%m%dT%H%M%SZ", &utc);
+    return buffer;
+}
+
+crow::json::wvalue toJson(const BackupManager::Info& info) {
+    crow::json::wvalue json;
+    json["id"] = info.id;
+    json["base"] = info.base;
+    json["state"] = BackupManager::stateName(info.state);
+    json["created"] = info.created;
+    json["finished"] = info.finished;
+    json["seq"] = info.seq;
+    json["images"] = info.images;
+    json["images_total"] = info.imagesTotal;
+    json["names"] = info.names;
+    json["deleted_images"] = info.deletedImages;
+    json["deleted_names"] = info.deletedNames;
+    json["missing"] = info.missing;
+    json["bytes"] = info.bytes;
+    json["error"] = info.error;
+    return json;
+}
+
+std::optional<BackupManager::Info> fromJson(const std::string& text) {
+    auto json = crow::json::load(text);
+    if (!json || !json.has("id") || !json.has("state")) {
+        return std::nullopt;
+    }
+
+    BackupManager::Info info;
+    info.id = json["id"].s();
+    std::string state = json["state"].s();
+    info.state = state == "complete" ? BackupManager::State::Complete
+               : state == "running"  ? BackupManager::State::Running
+                                     : BackupManager::State::Failed;
+    auto number = [&](const char* key) { return json.has(key) ? json[key].u() : 0; };
+    info.base = json.has("base") ? std::string(json["base"].s()) : "";
+    info.created = json.has("created") ? json["created"].i() : 0;
+    info.finished = json.has("finished") ? json["finished"].i() : 0;
+    info.seq = number("seq");
+    info.images = number("images");
+    info.imagesTotal = number("images_total");
+    info.names = number("names");
+    info.deletedImages = number("deleted_images");
+    info.deletedNames = number("deleted_names");
+    info.missing = number("missing");
+    info.bytes = number("bytes");
+    info.error = json.has("error") ? std::string(json["error"].s()) : "";
+    return info;
+}
+
+} // namespace
+
+BackupManager::BackupManager(std::shared_ptr<StorageManager> storage, const std::filesystem::path& dir,
+                             double bytesPerSecond)
+    : storage_(storage), dir_(dir), limiter_(bytesPerSecond),
+      completed_(Metrics::instance().counter("imgstore_backups_total{result=\"complete\"}",
+                                             "Backup exports, by outcome")),
+      failed_(Metrics::instance().counter("imgstore_backups_total{result=\"failed\"}",
+                                          "Backup exports, by outcome")),
+      imagesWritten_(Metrics::instance().counter("imgstore_backup_images_total",
+                                                 "Images written to backup archives")),
+      bytesWritten_(Metrics::instance().counter("imgstore_backup_bytes_total",
+                                                "Bytes written to backup archives")),
+      exportSeconds_(Metrics::instance().summary("imgstore_backup_seconds",
+                                                 "Duration of backup exports")) {
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    for (const auto& entry : std::filesystem::directory_iterator(dir_, ec)) {
+        const auto& path = entry.path();
+        if (path.extension() == ".partial" || path.extension() == ".hold") {
+            std::filesystem::remove_all(path, ec);
+            continue;
+        }
+        if (path.extension() != ".json") {
+            continue;
+        }
+        std::ifstream in(path);
+        std::stringstream text;
+        text << in.rdbuf();
+        auto info = fromJson(text.str());
+        if (!info || info->id != path.stem().string()) {
+            continue;
+        }
+        if (info->state == State::Running) {
+            // The process died mid-export; its partial archive is gone
+            info->state = State::Failed;
+            info->error = "interrupted by restart";
+            writeInfo(*info);
+        }
+        backups_[info->id] = *info;
+    }
+
+    Metrics::instance().callbackGauge("imgstore_backup_running", "1 while a backup export is in progress",
+                                      [this]() { return running_.load() ? 1.0 : 0.0; });
+    storage_->setEraseHook([this](const std::string& imageId) { holdImage(imageId); });
+}
+
+BackupManager::~BackupManager() {
+    storage_->setEraseHook(nullptr);
+    stop();
+    Metrics::instance().callbackGauge("imgstore_backup_running", "", nullptr);
+}
+
+BackupManager::StartResult BackupManager::start(const std::string& base, std::string& id) {
+    if (running_.exchange(true)) {
+        return StartResult::AlreadyRunning;
+    }
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+    stopRequested_ = false;
+
+    std::optional<ObjectIndex::Capture> baseCapture;
+    if (!base.empty()) {
+        auto info = find(base);
+        if (info && info->state == State::Complete) {
+            baseCapture = readCapture(capturePath(base));
+        }
+        if (!baseCapture) {
+            running_ = false;
+            return StartResult::UnknownBase;
+        }
+    }
+
+    Info info;
+    info.created = nowSeconds();
+    info.base = base;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        info.id = makeId(info.created);
+        for (int suffix = 2; backups_.count(info.id); ++suffix) {
+            info.id = makeId(info.created) + "-" + std::to_string(suffix);
+        }
+    }
+
+    auto capture = storage_->captureIndex();
+    info.seq = capture.seq;
+    if (!writeInfo(info)) {
+        running_ = false;
+        return StartResult::Failed;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        backups_[info.id] = info;
+    }
+
+    id = info.id;
+    thread_ = std::thread(&BackupManager::exportBackup, this, info.id, std::move(capture), std::move(baseCapture));
+    return StartResult::Started;
+}
+
+void BackupManager::stop() {
+    stopRequested_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+std::vector<BackupManager::Info> BackupManager::list() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::vector<Info> result;
+    for (const auto& [id, info] : backups_) {
+        result.push_back(info);
+    }
+    return result;
+}
+
+std::optional<BackupManager::Info> BackupManager::find(const std::string& id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = backups_.find(id);
+    if (it == backups_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<std::filesystem::path> BackupManager::archivePath(const std::string& id) const {
+    auto info = find(id);
+    if (!info || info->state != State::Complete) {
+        return std::nullopt;
+    }
+    return tarPath(id);
+}
+
+bool BackupManager::remove(const std::string& id) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = backups_.find(id);
+    if (it == backups_.end() || it->second.state == State::Running) {
+        return false;
+    }
+    std::error_code ec;
+    std::filesystem::remove(tarPath(id), ec);
+    std::filesystem::remove(capturePath(id), ec);
+    std::filesystem::remove(infoPath(id), ec);
+    backups_.erase(it);
+    return true;
+}
+
+const char* BackupManager::stateName(State state) {
+    switch (state) {
+        case State::Running: return "running";
+        case State::Complete: return "complete";
+        case State::Failed: return "failed";
+    }
+    return "failed";
+}
+
+void BackupManager::holdImage(const std::string& imageId) {
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash)) {
+        return;
+    }
+    // Held across the read, so the export cannot miss both the image and its copy
+    std::lock_guard<std::mutex> lock(holdMutex_);
+    if (pending_.erase(hash) == 0) {
+        return;
+    }
+    auto data = storage_->retrieveImage(imageId);
+    if (!data) {
+        return;
+    }
+    std::ofstream out(holdDir_ / imageId, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(data->data()), static_cast<std::streamsize>(data->size()));
+    if (!out.flush()) {
+        std::cerr << "Failed to hold deleted image " << imageId << " for backup" << std::endl;
+        return;
+    }
+    held_.insert(hash);
+}
+
+std::optional<std::vector<uint8_t>> BackupManager::releaseImage(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(holdMutex_);
+    pending_.erase(hash);
+    if (held_.erase(hash) == 0) {
+        return std::nullopt;
+    }
+    auto path = holdDir_ / HashUtils::hashToHex(hash);
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    if (!in.good() && !in.eof()) {
+        return std::nullopt;
+    }
+    return data;
+}
+
+template <typename Fn>
+void BackupManager::update(const std::string& id, Fn&& fn) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = backups_.find(id);
+    if (it != backups_.end()) {
+        fn(it->second);
+    }
+}
+
+void BackupManager::exportBackup(const std::string& id, ObjectIndex::Capture capture,
+                                 std::optional<ObjectIndex::Capture> base) {
+    auto started = std::chrono::steady_clock::now();
+    int64_t created = find(id)->created;
+
+    // An incremental backup holds what changed between the base's capture and this one
+    std::vector<uint64_t> images;
+    std::vector<std::pair<std::string, uint64_t>> names;
+    std::vector<uint64_t> deletedImages;
+    std::vector<std::string> deletedNames;
+    if (!base) {
+        images = capture.images;
+        names = capture.names;
+    } else {
+        std::set_difference(capture.images.begin(), capture.images.end(), base->images.begin(),
+                            base->images.end(), std::back_inserter(images));
+        std::set_difference(base->images.begin(), base->images.end(), capture.images.begin(),
+                            capture.images.end(), std::back_inserter(deletedImages));
+        auto old = base->names.begin();
+        for (const auto& entry : capture.names) {
+            for (; old != base->names.end() && old->first < entry.first; ++old) {
+                deletedNames.push_back(old->first);
+            }
+            if (old != base->names.end() && old->first == entry.first) {
+                if (old->second != entry.second) {
+                    names.push_back(entry);
+                }
+                ++old;
+            } else {
+                names.push_back(entry);
+            }
+        }
+        for (; old != base->names.end(); ++old) {
+            deletedNames.push_back(old->first);
+        }
+    }
+    update(id, [&](Info& info) {
+        info.imagesTotal = images.size();
+        info.names = names.size();
+        info.deletedImages = deletedImages.size();
+        info.deletedNames = deletedNames.size();
+    });
+
+    // From here a delete of a captured image copies it aside until the export has read it
+    {
+        std::lock_guard<std::mutex> lock(holdMutex_);
+        holdDir_ = holdPath(id);
+        std::error_code ec;
+        std::filesystem::create_directories(holdDir_, ec);
+        pending_.insert(images.begin(), images.end());
+    }
+
+    auto partial = dir_ / (id + ".tar.partial");
+    std::string error;
+    std::vector<uint64_t> missing;
+    std::vector<std::string> danglingNames;
+    {
+        TarWriter tar(partial);
+
+        std::string lines;
+        for (const auto& [name, hash] : names) {
+            crow::json::wvalue line;
+            line["name"] = name;
+            line["id"] = HashUtils::hashToHex(hash);
+            lines += line.dump() + "\n";
+        }
+        tar.add("names.jsonl", lines.data(), lines.size(), created);
+
+        for (uint64_t hash : images) {
+            if (stopRequested_) {
+                error = "interrupted by shutdown";
+                break;
+            }
+            std::string imageId = HashUtils::hashToHex(hash);
+            auto data = storage_->retrieveImage(imageId);
+            if (auto held = releaseImage(hash); !data) {
+                data = std::move(held);
+            }
+            if (!data) {
+                // Unreadable; the next incremental must not count it as present
+                missing.push_back(hash);
+                update(id, [](Info& info) { ++info.missing; });
+                continue;
+            }
+            limiter_.acquire(data->size());
+            uint64_t before = tar.bytes();
+            if (!tar.add("images/" + imageId, data->data(), data->size(), created)) {
+                break;
+            }
+            imagesWritten_.increment();
+            bytesWritten_.increment(tar.bytes() - before);
+            update(id, [&](Info& info) {
+                ++info.images;
+                info.bytes = tar.bytes();
+            });
+        }
+
+        // names.jsonl is already written, so names of missing images are deleted again on restore
+        for (const auto& [name, hash] : names) {
+            if (std::binary_search(missing.begin(), missing.end(), hash)) {
+                danglingNames.push_back(name);
+            }
+        }
+        if (error.empty() && (base || !danglingNames.empty())) {
+            lines.clear();
+            for (uint64_t hash : deletedImages) {
+                crow::json::wvalue line;
+                line["id"] = HashUtils::hashToHex(hash);
+                lines += line.dump() + "\n";
+            }
+            for (const auto* list : {&deletedNames, &danglingNames}) {
+                for (const auto& name : *list) {
+                    crow::json::wvalue line;
+                    line["name"] = name;
+                    lines += line.dump() + "\n";
+                }
+            }
+            tar.add("deleted.jsonl", lines.data(), lines.size(), created);
+            update(id, [&](Info& info) { info.deletedNames += danglingNames.size(); });
+        }
+
+        if (error.empty()) {
+            Info manifest = *find(id);
+            manifest.state = State::Complete;
+            manifest.finished = nowSeconds();
+            std::string text = toJson(manifest).dump();
+            tar.add("backup.json", text.data(), text.size(), created);
+            if (!tar.finish()) {
+                error = "failed to write archive";
+            }
+        }
+        update(id, [&](Info& info) { info.bytes = tar.bytes(); });
+    }
+
+    if (error.empty()) {
+        std::vector<uint64_t> present;
+        std::set_difference(capture.images.begin(), capture.images.end(), missing.begin(), missing.end(),
+                            std::back_inserter(present));
+        capture.images = std::move(present);
+        std::erase_if(capture.names, [&](const auto& entry) {
+            return std::binary_search(missing.begin(), missing.end(), entry.second);
+        });
+        std::error_code ec;
+        if (!writeCapture(capturePath(id), capture)) {
+            error = "failed to write capture";
+        } else if (std::filesystem::rename(partial, tarPath(id), ec); ec) {
+            error = "failed to rename archive: " + ec.message();
+        }
+    }
+
+    std::error_code ec;
+    {
+        std::lock_guard<std::mutex> lock(holdMutex_);
+        pending_.clear();
+        held_.clear();
+        holdDir_.clear();
+    }
+    std::filesystem::remove_all(holdPath(id), ec);
+    if (!error.empty()) {
+        std::filesystem::remove(partial, ec);
+        std::filesystem::remove(capturePath(id), ec);
+        failed_.increment();
+        std::cerr << "Backup " << id << " failed: " << error << std::endl;
+    } else {
+        completed_.increment();
+    }
+    exportSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+
+    update(id, [&](Info& info) {
+        info.state = error.empty() ? State::Complete : State::Failed;
+        info.finished = nowSeconds();
+        info.error = error;
+    });
+    writeInfo(*find(id));
+    running_ = false;
+}
+
+bool BackupManager::writeInfo(const Info& info) const {
+    auto path = infoPath(info.id);
+    auto tmpPath = dir_ / (info.id + ".json.tmp");
+    {
+        std::ofstream out(tmpPath, std::ios::trunc);
+        out << toJson(info).dump() << "\n";
+        if (!out) {
+            std::cerr << "Failed to write backup description " << tmpPath << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+bool BackupManager::writeCapture(const std::filesystem::path& path, const ObjectIndex::Capture& capture) {
+    auto tmpPath = path;
+    tmpPath += ".tmp";
+    {
+        std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+        uint64_t counts[3] = {capture.seq, capture.images.size(), capture.names.size()};
+        out.write(kCaptureMagic, sizeof(kCaptureMagic));
+        out.write(reinterpret_cast<const char*>(counts), sizeof(counts));
+        out.write(reinterpret_cast<const char*>(capture.images.data()),
+                  static_cast<std::streamsize>(capture.images.size() * sizeof(uint64_t)));
+        for (const auto& [name, hash] : capture.names) {
+            uint32_t length = static_cast<uint32_t>(name.size());
+            out.write(reinterpret_cast<const char*>(&hash), sizeof(hash));
+            out.write(reinterpret_cast<const char*>(&length), sizeof(length));
+            out.write(name.data(), length);
+        }
+        if (!out.flush()) {
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmpPath, path, ec);
+    return !ec;
+}
+
+std::optional<ObjectIndex::Capture> BackupManager::readCapture(const std::filesystem::path& path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(kCaptureMagic)];
+    uint64_t counts[3];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), kCaptureMagic) ||
+        !in.read(reinterpret_cast<char*>(counts), sizeof(counts))) {
+        return std::nullopt;
+    }
+
+    std::error_code ec;
+    uint64_t fileSize = std::filesystem::file_size(path, ec);
+    if (ec || counts[1] > fileSize / sizeof(uint64_t) || counts[2] > fileSize) {
+        return std::nullopt;
+    }
+
+    ObjectIndex::Capture capture;
+    capture.seq = counts[0];
+    capture.images.resize(counts[1]);
+    in.read(reinterpret_cast<char*>(capture.images.data()),
+            static_cast<std::streamsize>(capture.images.size() * sizeof(uint64_t)));
+    capture.names.reserve(counts[2]);
+    for (uint64_t i = 0; i < counts[2] && in; ++i) {
+        uint64_t hash = 0;
+        uint32_t length = 0;
+        in.read(reinterpret_cast<char*>(&hash), sizeof(hash));
+        in.read(reinterpret_cast<char*>(&length), sizeof(length));
+        if (!in || length > fileSize) {
+            return std::nullopt;
+        }
+        std::string name(length, '\0');
+        in.read(name.data(), length);
+        capture.names.emplace_back(std::move(name), hash);
+    }
+    if (!in) {
+        return std::nullopt;
+    }
+    return capture;
+}
+
+} // namespace imgstore
@@ -0,0 +1,74 @@
+#include "bloom_filter.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <cmath>
+
+namespace imgstore {
+
+namespace {
+
+constexpr uint64_t kGoldenRatio = 0x9E3779B97F4A7C15ULL;
+
+} // namespace
+
+BloomFilter::BloomFilter(size_t expectedItems, double falsePositiveRate)
+    : capacity_(std::max<size_t>(expectedItems, 1)) {
+    falsePositiveRate = std::clamp(falsePositiveRate, 1e-6, 0.5);
+
+    // Standard sizing plus ~20% headroom to offset the loss from blocking
+    const double ln2 = std::log(2.0);
+    double bitsPerKey = -std::log(falsePositiveRate) / (ln2 * ln2) * 1.2;
+    double totalBits = bitsPerKey * static_cast<double>(capacity_);
+
+    numBlocks_ = std::max<size_t>(1, static_cast<size_t>(std::ceil(totalBits / 512.0)));
+    numHashes_ = std::clamp(static_cast<int>(std::lround(bitsPerKey / 1.2 * ln2)), 1, 16);
+
+    size_t words = numBlocks_ * kWordsPerBlock;
+    bits_ = std::make_unique<std::atomic<uint64_t>[]>(words);
+    for (size_t i = 0; i < words; ++i) {
+        bits_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void BloomFilter::add(std::string_view key) {
+    uint64_t h = HashUtils::xxh3_64(key.data(), key.size());
+    std::atomic<uint64_t>* block = &bits_[(h % numBlocks_) * kWordsPerBlock];
+
+    uint64_t g = h * kGoldenRatio;
+    uint32_t a = static_cast<uint32_t>(g >> 32);
+    uint32_t b = static_cast<uint32_t>(g) | 1;
+
+    for (int i = 0; i < numHashes_; ++i) {
+        uint32_t pos = (a + static_cast<uint32_t>(i) * b) >> 23; // 0..511
+        block[pos >> 6].fetch_or(1ULL << (pos & 63), std::memory_order_relaxed);
+    }
+
+    insertions_.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool BloomFilter::mightContain(std::string_view key) const {
+    uint64_t h = HashUtils::xxh3_64(key.data(), key.size());
+    const std::atomic<uint64_t>* block = &bits_[(h % numBlocks_) * kWordsPerBlock];
+
+    uint64_t g = h * kGoldenRatio;
+    uint32_t a = static_cast<uint32_t>(g >> 32);
+    uint32_t b = static_cast<uint32_t>(g) | 1;
+
+    for (int i = 0; i < numHashes_; ++i) {
+        uint32_t pos = (a + static_cast<uint32_t>(i) * b) >> 23;
+        if ((block[pos >> 6].load(std::memory_order_relaxed) & (1ULL << (pos & 63))) == 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+double BloomFilter::estimatedFalsePositiveRate() const {
+    double m = static_cast<double>(numBlocks_) * 512.0;
+    double n = static_cast<double>(size());
+    double k = static_cast<double>(numHashes_);
+    return std::pow(1.0 - std::exp(-k * n / m), k);
+}
+
+} // namespace imgstore
@@ -0,0 +1,318 @@
+#include "bulk_importer.h"
+#include "crow_all.h"
+#include "hash_utils.h"
+#include "tar_reader.h"
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+constexpr auto kProgressInterval = std::chrono::seconds(5);
+
+std::string baseName(const std::string& path) {
+    size_t slash = path.find_last_of('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+} // namespace
+
+BulkImporter::BulkImporter(std::shared_ptr<StorageManager> storage, Options options)
+    : storage_(storage), options_(options), pool_(std::max<size_t>(options.threads, 1)),
+      started_(std::chrono::steady_clock::now()), lastProgress_(started_) {}
+
+bool BulkImporter::import(const std::filesystem::path& source) {
+    std::error_code ec;
+    bool ok = source != "-" && std::filesystem::is_directory(source, ec) ? importDirectory(source)
+                                                                          : importTar(source);
+    drain();
+    writeNames();
+    sync(true);
+    printProgress(true);
+    return ok;
+}
+
+BulkImporter::Stats BulkImporter::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+bool BulkImporter::importDirectory(const std::filesystem::path& dir) {
+    std::vector<std::filesystem::path> files;
+    std::error_code ec;
+    auto options = std::filesystem::directory_options::skip_permission_denied;
+    for (auto it = std::filesystem::recursive_directory_iterator(dir, options, ec);
+         !ec && it != std::filesystem::recursive_directory_iterator(); it.increment(ec)) {
+        if (it->is_regular_file(ec)) {
+            files.push_back(it->path());
+        }
+    }
+    if (ec) {
+        std::cerr << "Failed to list " << dir << ": " << ec.message() << std::endl;
+        return false;
+    }
+    // Sorted, so which of several files with the same name wins does not depend on the filesystem
+    std::sort(files.begin(), files.end());
+
+    for (size_t i = 0; i < files.size(); ++i) {
+        const auto& path = files[i];
+        size_t size = static_cast<size_t>(std::filesystem::file_size(path, ec));
+        std::optional<std::pair<uint64_t, std::string>> name;
+        if (options_.nameFiles) {
+            name.emplace(i, path.filename().string());
+        }
+        submit(ec ? 0 : size, [this, path, name]() {
+            std::ifstream in(path, std::ios::binary);
+            std::vector<uint8_t> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (!in.eof() && in.fail()) {
+                std::cerr << "Failed to read " << path << std::endl;
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++stats_.files;
+                ++stats_.errors;
+                return;
+            }
+            ingest(data, path.string(), "", name);
+        });
+    }
+    return true;
+}
+
+bool BulkImporter::importTar(const std::filesystem::path& path) {
+    TarReader reader(path);
+    if (!reader.good()) {
+        std::cerr << "Failed to open " << path << ": " << reader.error() << std::endl;
+        return false;
+    }
+
+    // A backup archive starts with names.jsonl; its images are named by their ID
+    bool backup = false;
+    std::vector<std::string> deletedImages;
+    std::vector<std::string> deletedNames;
+    uint64_t order = 0;
+    TarReader::Entry entry;
+    while (reader.next(entry)) {
+        auto data = std::make_shared<std::vector<uint8_t>>();
+        if (!reader.read(*data)) {
+            break;
+        }
+        ++order;
+
+        if (entry.path == "names.jsonl" || entry.path == "deleted.jsonl") {
+            backup = true;
+            std::string text(data->begin(), data->end());
+            for (size_t pos = 0; pos < text.size();) {
+                size_t end = std::min(text.find('\n', pos), text.size());
+                auto line = crow::json::load(text.substr(pos, end - pos));
+                pos = end + 1;
+                if (!line) {
+                    continue;
+                }
+                if (entry.path == "deleted.jsonl") {
+                    if (line.has("id")) {
+                        deletedImages.push_back(line["id"].s());
+                    } else if (line.has("name")) {
+                        deletedNames.push_back(line["name"].s());
+                    }
+                } else if (line.has("name") && line.has("id")) {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    names_.push_back({order++, line["name"].s(), line["id"].s()});
+                }
+            }
+            continue;
+        }
+        if (backup && entry.path == "backup.json") {
+            continue;
+        }
+
+        std::string expectedId;
+        std::optional<std::pair<uint64_t, std::string>> name;
+        if (backup && entry.path.rfind("images/", 0) == 0) {
+            expectedId = baseName(entry.path);
+        } else if (options_.nameFiles) {
+            name.emplace(order, baseName(entry.path));
+        }
+        submit(data->size(), [this, data, source = entry.path, expectedId, name]() {
+            ingest(*data, source, expectedId, name);
+        });
+    }
+
+    if (!reader.error().empty()) {
+        std::cerr << "Failed to read " << path << ": " << reader.error() << std::endl;
+        return false;
+    }
+    if (deletedImages.empty() && deletedNames.empty()) {
+        return true;
+    }
+
+    // Deletions come after this archive's content and names, which never overlap with them
+    drain();
+    writeNames();
+    uint64_t deleted = 0;
+    for (const auto& id : deletedImages) {
+        deleted += storage_->deleteImage(id) ? 1 : 0;
+    }
+    for (const auto& name : deletedNames) {
+        deleted += storage_->deleteNameMapping(name) ? 1 : 0;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.deleted += deleted;
+    return true;
+}
+
+void BulkImporter::submit(size_t bytes, std::function<void()> task) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        // A file bigger than the whole buffer still goes through, alone
+        cv_.wait(lock, [&]() { return bufferedBytes_ == 0 || bufferedBytes_ + bytes <= options_.bufferBytes; });
+        ++pending_;
+        bufferedBytes_ += bytes;
+    }
+
+    pool_.submit([this, bytes, task = std::move(task)]() {
+        task();
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            --pending_;
+            bufferedBytes_ -= bytes;
+        }
+        cv_.notify_all();
+    });
+
+    sync(false);
+    printProgress(false);
+}
+
+void BulkImporter::drain() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return pending_ == 0; });
+}
+
+void BulkImporter::ingest(const std::vector<uint8_t>& data, const std::string& source,
+                          const std::string& expectedId, std::optional<std::pair<uint64_t, std::string>> name) {
+    if (data.empty()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.files;
+        return;
+    }
+
+    uint64_t hash = HashUtils::xxh3_64(data.data(), data.size());
+    std::string id = HashUtils::hashToHex(hash);
+    if (!expectedId.empty() && id != expectedId) {
+        std::cerr << "Skipping " << source << ": content does not match its ID" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++stats_.files;
+        ++stats_.errors;
+        return;
+    }
+
+    bool fresh;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        fresh = seen_.insert(hash).second;
+    }
+    bool stored = false;
+    bool failed = false;
+    if (fresh && !storage_->imageExists(id)) {
+        stored = storage_->storeImage(id, data);
+        failed = !stored;
+        if (failed) {
+            std::cerr << "Failed to store " << source << std::endl;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.files;
+    if (failed) {
+        ++stats_.errors;
+        seen_.erase(hash);
+        return;
+    }
+    if (stored) {
+        ++stats_.imported;
+        stats_.bytes += data.size();
+        unsyncedBytes_ += data.size();
+    } else {
+        ++stats_.duplicates;
+    }
+    if (name) {
+        names_.push_back({name->first, std::move(name->second), id});
+    }
+}
+
+void BulkImporter::writeNames() {
+    std::vector<PendingName> names;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        names.swap(names_);
+    }
+    std::sort(names.begin(), names.end(), [](const PendingName& a, const PendingName& b) {
+        return a.name != b.name ? a.name < b.name : a.order < b.order;
+    });
+
+    uint64_t conflicts = 0;
+    std::vector<const PendingName*> unique;
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (i > 0 && names[i].name == names[i - 1].name) {
+            conflicts += names[i].id != names[i - 1].id ? 1 : 0;
+            continue;
+        }
+        unique.push_back(&names[i]);
+    }
+
+    // Each mapping is its own small file, so the pool writes them in parallel too
+    std::atomic<uint64_t> stored{0};
+    std::atomic<uint64_t> failed{0};
+    constexpr size_t kBatch = 256;
+    for (size_t begin = 0; begin < unique.size(); begin += kBatch) {
+        size_t end = std::min(begin + kBatch, unique.size());
+        submit(0, [this, &unique, &stored, &failed, begin, end]() {
+            for (size_t i = begin; i < end; ++i) {
+                if (storage_->storeNameMapping(unique[i]->name, unique[i]->id)) {
+                    ++stored;
+                } else {
+                    ++failed;
+                }
+            }
+        });
+    }
+    drain();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.names += stored;
+    stats_.nameConflicts += conflicts;
+    stats_.errors += failed;
+}
+
+void BulkImporter::sync(bool force) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!force && unsyncedBytes_ < options_.syncBytes) {
+            return;
+        }
+        unsyncedBytes_ = 0;
+    }
+    storage_->syncToDisk();
+}
+
+void BulkImporter::printProgress(bool force) {
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now - lastProgress_ < kProgressInterval) {
+        return;
+    }
+    lastProgress_ = now;
+
+    auto stats = this->stats();
+    double seconds = std::max(std::chrono::duration<double>(now - started_).count(), 1e-3);
+    std::cout << "Imported " << stats.files << " files (" << stats.imported << " new, " << stats.duplicates
+              << " duplicates, " << stats.errors << " errors), " << stats.names << " names, " << stats.deleted
+              << " deleted, "
+              << std::fixed << std::setprecision(1) << stats.bytes / 1048576.0 << " MB at "
+              << stats.files / seconds << " files/s, " << stats.bytes / 1048576.0 / seconds << " MB/s"
+              << std::defaultfloat << std::endl;
+}
+
+} // namespace imgstore
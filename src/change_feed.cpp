@@ -0,0 +1,339 @@
+#include "change_feed.h"
+#include "crow_all.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+namespace imgstore {
+
+namespace {
+
+// Consumers that keep up are served from memory
+constexpr size_t kTailEvents = 4096;
+
+// The age limit is checked on appends, but not more often than this
+constexpr auto kAgeCheckInterval = std::chrono::minutes(1);
+
+constexpr ChangeFeed::Type kTypes[] = {ChangeFeed::Type::Upload, ChangeFeed::Type::Delete, ChangeFeed::Type::Name,
+                                       ChangeFeed::Type::NameDelete};
+
+std::string segmentName(uint64_t firstSeq) {
+    std::ostringstream name;
+    name << std::setw(20) << std::setfill('0') << firstSeq << ".log";
+    return name.str();
+}
+
+int64_t nowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+} // namespace
+
+ChangeFeed::ChangeFeed(const std::filesystem::path& dir, Options options)
+    : dir_(dir), options_(options),
+      segmentBytes_(std::clamp<uint64_t>(options.maxBytes / 8, 64 * 1024, 64 * 1024 * 1024)),
+      lastAgeCheck_(std::chrono::steady_clock::now()),
+      retired_(Metrics::instance().counter("imgstore_feed_segments_retired_total",
+                                           "Change feed segments removed by the size or age limit")),
+      writeErrors_(Metrics::instance().counter("imgstore_feed_write_errors_total",
+                                               "Change feed events that could not be written to disk")) {
+    for (Type type : kTypes) {
+        appended_[static_cast<size_t>(type)] = &Metrics::instance().counter(
+            std::string("imgstore_feed_events_total{type=\"") + typeName(type) + "\"}",
+            "Events appended to the change feed, by type");
+    }
+
+    std::filesystem::create_directories(dir_);
+    for (const auto& entry : std::filesystem::directory_iterator(dir_)) {
+        const auto& path = entry.path();
+        std::string stem = path.stem().string();
+        if (path.extension() != ".log" || stem.empty() ||
+            !std::all_of(stem.begin(), stem.end(), [](char c) { return c >= '0' && c <= '9'; })) {
+            continue;
+        }
+        uint64_t bytes = entry.file_size();
+        segments_[std::stoull(stem)] = {path, bytes};
+        totalBytes_ += bytes;
+    }
+
+    if (!segments_.empty()) {
+        // A crash can leave half a line at the end; cut it off so appends start clean
+        auto& [firstSeq, segment] = *segments_.rbegin();
+        std::vector<Event> events;
+        uint64_t valid = readSegment(segment.path, 0, SIZE_MAX, events);
+        if (valid < segment.bytes) {
+            std::filesystem::resize_file(segment.path, valid);
+            totalBytes_ -= segment.bytes - valid;
+            segment.bytes = valid;
+        }
+        lastSeq_ = events.empty() ? firstSeq - 1 : events.back().seq;
+        size_t keep = std::min(events.size(), kTailEvents);
+        tail_.assign(std::make_move_iterator(events.end() - keep), std::make_move_iterator(events.end()));
+    }
+
+    if (segments_.empty() || segments_.rbegin()->second.bytes >= segmentBytes_) {
+        openSegment(lastSeq_ + 1);
+    } else {
+        fd_ = ::open(segments_.rbegin()->second.path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (fd_ < 0) {
+            std::cerr << "Failed to open change feed segment: " << std::strerror(errno) << std::endl;
+        }
+    }
+
+    Metrics::instance().callbackGauge("imgstore_feed_sequence", "Sequence number of the latest change feed event",
+                                      [this]() {
+                                          std::lock_guard<std::mutex> lock(mutex_);
+                                          return static_cast<double>(lastSeq_);
+                                      });
+    Metrics::instance().callbackGauge("imgstore_feed_bytes", "Size of the retained change feed segments",
+                                      [this]() {
+                                          std::lock_guard<std::mutex> lock(mutex_);
+                                          return static_cast<double>(totalBytes_);
+                                      });
+    Metrics::instance().callbackGauge("imgstore_feed_waiters", "Consumers waiting for the next change feed event",
+                                      [this]() {
+                                          std::lock_guard<std::mutex> lock(mutex_);
+                                          return static_cast<double>(waiters_.size());
+                                      });
+}
+
+ChangeFeed::~ChangeFeed() {
+    Metrics::instance().callbackGauge("imgstore_feed_sequence", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_feed_bytes", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_feed_waiters", "", nullptr);
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+uint64_t ChangeFeed::append(Type type, const std::string& id, const std::string& name) {
+    std::vector<Waiter> woken;
+    uint64_t seq = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Event event;
+        event.seq = seq = ++lastSeq_;
+        event.timeMs = nowMs();
+        event.type = type;
+        event.id = id;
+        event.name = name;
+
+        std::string line = serialize(event);
+        auto& active = segments_.rbegin()->second;
+        if (active.bytes > 0 && active.bytes + line.size() > segmentBytes_) {
+            openSegment(seq);
+            enforceRetention();
+        } else if (options_.retention.count() > 0 &&
+                   std::chrono::steady_clock::now() - lastAgeCheck_ >= kAgeCheckInterval) {
+            enforceRetention();
+        }
+
+        auto& segment = segments_.rbegin()->second;
+        if (fd_ < 0 || ::write(fd_, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+            // The event is still served from memory; only a restart loses it
+            writeErrors_.increment();
+            std::cerr << "Failed to write change feed event " << seq << std::endl;
+        } else {
+            segment.bytes += line.size();
+            totalBytes_ += line.size();
+        }
+
+        tail_.push_back(std::move(event));
+        if (tail_.size() > kTailEvents) {
+            tail_.pop_front();
+        }
+        appended_[static_cast<size_t>(type)]->increment();
+
+        for (auto it = waiters_.begin(); it != waiters_.end();) {
+            if (it->second.first < seq) {
+                woken.push_back(std::move(it->second.second));
+                it = waiters_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    for (auto& waiter : woken) {
+        waiter();
+    }
+    return seq;
+}
+
+ChangeFeed::Page ChangeFeed::read(uint64_t since, size_t limit) const {
+    Page page;
+    std::vector<std::filesystem::path> files;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        page.latest = lastSeq_;
+        page.oldest = segments_.empty() ? lastSeq_ + 1 : segments_.begin()->first;
+
+        // A cursor ahead of the log means the log was wiped; the consumer must start over too
+        if (since + 1 < page.oldest || since > lastSeq_) {
+            page.expired = true;
+            return page;
+        }
+        if (since == lastSeq_ || limit == 0) {
+            return page;
+        }
+
+        if (!tail_.empty() && tail_.front().seq <= since + 1) {
+            auto first = static_cast<std::ptrdiff_t>(since + 1 - tail_.front().seq);
+            for (auto it = tail_.begin() + first;
+                 it != tail_.end() && page.events.size() < limit; ++it) {
+                page.events.push_back(*it);
+            }
+            return page;
+        }
+
+        auto it = segments_.upper_bound(since + 1);
+        if (it != segments_.begin()) {
+            --it;
+        }
+        for (; it != segments_.end(); ++it) {
+            files.push_back(it->second.path);
+        }
+    }
+
+    // Old segments are read without the lock; one retired meanwhile just ends the page early
+    for (const auto& path : files) {
+        readSegment(path, since, limit - page.events.size(), page.events);
+        if (page.events.size() >= limit) {
+            break;
+        }
+    }
+    return page;
+}
+
+std::optional<uint64_t> ChangeFeed::wait(uint64_t since, Waiter waiter) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Only a cursor at the end has anything to wait for; read() answers any other at once
+    if (since != lastSeq_) {
+        return std::nullopt;
+    }
+    uint64_t token = nextToken_++;
+    waiters_.emplace(token, std::make_pair(since, std::move(waiter)));
+    return token;
+}
+
+void ChangeFeed::cancel(uint64_t token) {
+    Waiter waiter;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = waiters_.find(token);
+        if (it == waiters_.end()) {
+            return;
+        }
+        // Destroyed outside the lock, in case it owns something that calls back in
+        waiter = std::move(it->second.second);
+        waiters_.erase(it);
+    }
+}
+
+const char* ChangeFeed::typeName(Type type) {
+    switch (type) {
+        case Type::Upload: return "upload";
+        case Type::Delete: return "delete";
+        case Type::Name: return "name";
+        case Type::NameDelete: return "name_delete";
+    }
+    return "upload";
+}
+
+void ChangeFeed::openSegment(uint64_t firstSeq) {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    auto path = dir_ / segmentName(firstSeq);
+    fd_ = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "Failed to create change feed segment " << path << ": " << std::strerror(errno) << std::endl;
+    }
+    segments_[firstSeq] = {path, 0};
+}
+
+void ChangeFeed::enforceRetention() {
+    lastAgeCheck_ = std::chrono::steady_clock::now();
+    auto cutoff = std::filesystem::file_time_type::clock::now() - options_.retention;
+    while (segments_.size() > 1) {
+        auto& oldest = segments_.begin()->second;
+        std::error_code ec;
+        // Room is kept for the active segment to fill up, so the limit holds between rolls
+        bool tooBig = totalBytes_ + segmentBytes_ > options_.maxBytes;
+        // A segment's last write is its newest event, so its mtime says when all of it expired
+        bool tooOld = options_.retention.count() > 0 && std::filesystem::last_write_time(oldest.path, ec) < cutoff;
+        if (!tooBig && !tooOld && !ec) {
+            break;
+        }
+        std::filesystem::remove(oldest.path, ec);
+        totalBytes_ -= oldest.bytes;
+        segments_.erase(segments_.begin());
+        retired_.increment();
+    }
+}
+
+uint64_t ChangeFeed::readSegment(const std::filesystem::path& path, uint64_t since, size_t limit,
+                                 std::vector<Event>& events) {
+    std::ifstream in(path, std::ios::binary);
+    uint64_t valid = 0;
+    std::string line;
+    size_t collected = 0;
+    while (collected < limit && std::getline(in, line)) {
+        if (in.eof()) {
+            break; // no newline: the write of this line never finished
+        }
+        auto event = parse(line);
+        if (!event) {
+            break;
+        }
+        valid += line.size() + 1;
+        if (event->seq > since) {
+            events.push_back(std::move(*event));
+            ++collected;
+        }
+    }
+    return valid;
+}
+
+std::string ChangeFeed::serialize(const Event& event) {
+    crow::json::wvalue json;
+    json["seq"] = event.seq;
+    json["time"] = event.timeMs;
+    json["type"] = typeName(event.type);
+    json["id"] = event.id;
+    if (!event.name.empty()) {
+        json["name"] = event.name;
+    }
+    return json.dump() + "\n";
+}
+
+std::optional<ChangeFeed::Event> ChangeFeed::parse(const std::string& line) {
+    auto json = crow::json::load(line);
+    if (!json || !json.has("seq") || !json.has("type") || !json.has("id")) {
+        return std::nullopt;
+    }
+
+    Event event;
+    event.seq = json["seq"].u();
+    event.timeMs = json.has("time") ? json["time"].i() : 0;
+    event.id = json["id"].s();
+    if (json.has("name")) {
+        event.name = json["name"].s();
+    }
+    std::string type = json["type"].s();
+    auto known = std::find_if(std::begin(kTypes), std::end(kTypes), [&](Type t) { return type == typeName(t); });
+    if (known == std::end(kTypes)) {
+        return std::nullopt;
+    }
+    event.type = *known;
+    return event;
+}
+
+} // namespace imgstore
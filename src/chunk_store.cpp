@@ -0,0 +1,401 @@
+#include "chunk_store.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <unordered_set>
+
+namespace imgstore {
+
+namespace {
+
+constexpr char kManifestMagic[8] = {'I', 'M', 'G', 'C', 'D', 'C', '\0', '\1'};
+
+// Manifest layout: header | ManifestEntry[chunkCount]
+struct ManifestHeader {
+    char magic[8];
+    uint32_t chunkCount;
+    uint32_t reserved;
+    uint64_t totalSize;
+    uint64_t checksum; // XXH3 over the entries
+};
+
+struct ManifestEntry {
+    uint64_t high;
+    uint64_t low;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(ManifestHeader) == 32);
+static_assert(sizeof(ManifestEntry) == 24);
+
+// Chunks younger than this survive a GC pass even when unreferenced: an
+// upload may have written or reused them before its manifest exists
+constexpr auto kGcGracePeriod = std::chrono::minutes(10);
+
+// Normalised chunking: a stricter mask before the average size and a
+// looser one after it pull chunk sizes towards the average
+constexpr int kAverageBits = 16;
+static_assert(ChunkStore::kAverageChunkSize == size_t{1} << kAverageBits);
+constexpr uint64_t topBits(int bits) {
+    return ~uint64_t{0} << (64 - bits);
+}
+constexpr uint64_t kMaskSmall = topBits(kAverageBits + 2);
+constexpr uint64_t kMaskLarge = topBits(kAverageBits - 2);
+
+// Gear table: one pseudo-random 64-bit value per byte (splitmix64)
+constexpr std::array<uint64_t, 256> kGear = [] {
+    std::array<uint64_t, 256> table{};
+    uint64_t state = 0x6A09E667F3BCC908ull;
+    for (auto& value : table) {
+        state += 0x9E3779B97F4A7C15ull;
+        uint64_t z = state;
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        value = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+// Length of the chunk starting at data
+size_t cutPoint(const uint8_t* data, size_t size) {
+    if (size <= ChunkStore::kMinChunkSize) {
+        return size;
+    }
+    size_t normal = std::min(ChunkStore::kAverageChunkSize, size);
+    size_t end = std::min(ChunkStore::kMaxChunkSize, size);
+
+    // Boundaries inside the minimum size are never taken, so hashing starts there
+    uint64_t fingerprint = 0;
+    size_t i = ChunkStore::kMinChunkSize;
+    for (; i < normal; ++i) {
+        fingerprint = (fingerprint << 1) + kGear[data[i]];
+        if ((fingerprint & kMaskSmall) == 0) {
+            return i + 1;
+        }
+    }
+    for (; i < end; ++i) {
+        fingerprint = (fingerprint << 1) + kGear[data[i]];
+        if ((fingerprint & kMaskLarge) == 0) {
+            return i + 1;
+        }
+    }
+    return end;
+}
+
+struct Hash128Hasher {
+    size_t operator()(const Hash128& hash) const { return static_cast<size_t>(hash.low); }
+};
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+ChunkStore::ChunkStore(const std::filesystem::path& baseDir)
+    : dir_(baseDir / "chunks"),
+      ingestLogical_(Metrics::instance().counter("imgstore_chunk_ingest_bytes_total{kind=\"logical\"}",
+                                                 "Bytes of chunked uploads, and the part of them not already stored")),
+      ingestStored_(Metrics::instance().counter("imgstore_chunk_ingest_bytes_total{kind=\"stored\"}",
+                                                "Bytes of chunked uploads, and the part of them not already stored")),
+      gcRemoved_(Metrics::instance().counter("imgstore_chunk_gc_removed_total",
+                                             "Unreferenced chunks deleted by garbage collection")) {
+    loadUsage();
+
+    auto& metrics = Metrics::instance();
+    metrics.callbackGauge("imgstore_chunk_logical_bytes", "Total size of chunked images",
+                          [this]() { return static_cast<double>(logicalBytes_.load()); });
+    metrics.callbackGauge("imgstore_chunk_stored_bytes", "Bytes of chunk files on disk",
+                          [this]() { return static_cast<double>(storedBytes_.load()); });
+    metrics.callbackGauge("imgstore_chunk_dedup_ratio", "Size of chunked images divided by the chunk bytes storing them",
+                          [this]() {
+        double stored = static_cast<double>(storedBytes_.load());
+        return stored > 0 ? static_cast<double>(logicalBytes_.load()) / stored : 1.0;
+    });
+}
+
+ChunkStore::~ChunkStore() {
+    saveUsage();
+    auto& metrics = Metrics::instance();
+    metrics.callbackGauge("imgstore_chunk_logical_bytes", "", nullptr);
+    metrics.callbackGauge("imgstore_chunk_stored_bytes", "", nullptr);
+    metrics.callbackGauge("imgstore_chunk_dedup_ratio", "", nullptr);
+}
+
+std::vector<size_t> ChunkStore::split(const uint8_t* data, size_t size) {
+    std::vector<size_t> lengths;
+    lengths.reserve(size / kAverageChunkSize + 1);
+    for (size_t pos = 0; pos < size;) {
+        size_t length = cutPoint(data + pos, size - pos);
+        lengths.push_back(length);
+        pos += length;
+    }
+    return lengths;
+}
+
+bool ChunkStore::isManifest(const uint8_t* data, size_t size) {
+    return size >= sizeof(kManifestMagic) && std::memcmp(data, kManifestMagic, sizeof(kManifestMagic)) == 0;
+}
+
+std::optional<std::vector<ChunkRef>> ChunkStore::parseManifest(const std::vector<uint8_t>& manifest,
+                                                               uint64_t& totalSize) {
+    if (manifest.size() < sizeof(ManifestHeader) || !isManifest(manifest.data(), manifest.size())) {
+        return std::nullopt;
+    }
+    ManifestHeader header;
+    std::memcpy(&header, manifest.data(), sizeof(header));
+
+    const uint8_t* entries = manifest.data() + sizeof(header);
+    size_t entryBytes = static_cast<size_t>(header.chunkCount) * sizeof(ManifestEntry);
+    if (manifest.size() != sizeof(header) + entryBytes ||
+        HashUtils::xxh3_64(entries, entryBytes) != header.checksum) {
+        return std::nullopt;
+    }
+
+    std::vector<ChunkRef> chunks(header.chunkCount);
+    uint64_t sum = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        ManifestEntry entry;
+        std::memcpy(&entry, entries + i * sizeof(entry), sizeof(entry));
+        chunks[i].hash = {entry.high, entry.low};
+        chunks[i].size = entry.size;
+        sum += entry.size;
+    }
+    if (sum != header.totalSize) {
+        return std::nullopt;
+    }
+    totalSize = header.totalSize;
+    return chunks;
+}
+
+std::optional<std::vector<uint8_t>> ChunkStore::write(const std::vector<uint8_t>& data) {
+    std::shared_lock<std::shared_mutex> lock(gcMutex_);
+
+    auto lengths = split(data.data(), data.size());
+    std::vector<ManifestEntry> entries;
+    entries.reserve(lengths.size());
+
+    uint64_t newBytes = 0;
+    size_t offset = 0;
+    for (size_t length : lengths) {
+        const uint8_t* chunk = data.data() + offset;
+        offset += length;
+
+        Hash128 hash = HashUtils::xxh3_128(chunk, length);
+        entries.push_back({hash.high, hash.low, static_cast<uint32_t>(length), 0});
+
+        auto path = chunkPath(hash);
+        // Reusing a chunk refreshes its mtime so a concurrent GC pass keeps it
+        if (::utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0) {
+            continue;
+        }
+
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        auto tmpPath = path.string() + ".tmp" + std::to_string(tempCounter_++);
+        int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            std::cerr << "Failed to create chunk " << path << ": " << std::strerror(errno) << std::endl;
+            return std::nullopt;
+        }
+        bool ok = writeAll(fd, chunk, length);
+        ok = ::close(fd) == 0 && ok;
+        // Two uploads may race to store the same chunk; either copy will do
+        if (!ok || ::rename(tmpPath.c_str(), path.c_str()) != 0) {
+            std::cerr << "Failed to write chunk " << path << ": " << std::strerror(errno) << std::endl;
+            ::unlink(tmpPath.c_str());
+            return std::nullopt;
+        }
+        newBytes += length;
+    }
+
+    ManifestHeader header{};
+    std::memcpy(header.magic, kManifestMagic, sizeof(kManifestMagic));
+    header.chunkCount = static_cast<uint32_t>(entries.size());
+    header.totalSize = data.size();
+    header.checksum = HashUtils::xxh3_64(entries.data(), entries.size() * sizeof(ManifestEntry));
+
+    std::vector<uint8_t> manifest(sizeof(header) + entries.size() * sizeof(ManifestEntry));
+    std::memcpy(manifest.data(), &header, sizeof(header));
+    std::memcpy(manifest.data() + sizeof(header), entries.data(), entries.size() * sizeof(ManifestEntry));
+
+    ingestLogical_.increment(data.size());
+    ingestStored_.increment(newBytes);
+    logicalBytes_ += data.size();
+    storedBytes_ += newBytes;
+    return manifest;
+}
+
+bool ChunkStore::read(const std::vector<ChunkRef>& chunks, uint64_t totalSize, std::vector<uint8_t>& out,
+                      Xxh3Stream* hasher) const {
+    out.resize(totalSize);
+    uint64_t offset = 0;
+    for (const auto& chunk : chunks) {
+        if (offset + chunk.size > totalSize) {
+            return false;
+        }
+
+        auto path = chunkPath(chunk.hash);
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            std::cerr << "Missing chunk " << path << std::endl;
+            return false;
+        }
+        uint8_t* target = out.data() + offset;
+        size_t done = 0;
+        while (done < chunk.size) {
+            ssize_t n = ::pread(fd, target + done, chunk.size - done, static_cast<off_t>(done));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            done += static_cast<size_t>(n);
+        }
+        ::close(fd);
+        if (done != chunk.size) {
+            std::cerr << "Short chunk " << path << std::endl;
+            return false;
+        }
+
+        if (hasher) {
+            hasher->update(target, chunk.size);
+        }
+        offset += chunk.size;
+    }
+    return offset == totalSize;
+}
+
+void ChunkStore::release(uint64_t totalSize) {
+    uint64_t current = logicalBytes_.load();
+    while (!logicalBytes_.compare_exchange_weak(current, current - std::min(current, totalSize))) {
+    }
+}
+
+ChunkStore::GcResult ChunkStore::collectGarbage(const std::function<bool(const ManifestVisitor&)>& walkManifests) {
+    GcResult result;
+
+    // Mark
+    std::unordered_set<Hash128, Hash128Hasher> referenced;
+    bool walked = walkManifests([&](const std::vector<ChunkRef>& chunks, uint64_t totalSize) {
+        ++result.manifests;
+        result.logicalBytes += totalSize;
+        for (const auto& chunk : chunks) {
+            referenced.insert(chunk.hash);
+        }
+    });
+    if (!walked) {
+        std::cerr << "Chunk GC aborted: manifest walk failed" << std::endl;
+        return result;
+    }
+
+    // Sweep
+    auto cutoff = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now() - kGcGracePeriod);
+    std::error_code ec;
+    if (std::filesystem::exists(dir_, ec)) {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(dir_, ec)) {
+            if (!entry.is_regular_file(ec)) {
+                continue;
+            }
+            std::string name = entry.path().filename().string();
+            Hash128 hash;
+            bool isChunk = name.size() == 32 && HashUtils::hexToHash(name.substr(0, 16), hash.high) &&
+                           HashUtils::hexToHash(name.substr(16), hash.low);
+            if (!isChunk && name.find(".tmp") == std::string::npos) {
+                continue; // usage file and anything else that is not ours
+            }
+
+            struct stat st{};
+            if (isChunk && referenced.contains(hash)) {
+                if (::stat(entry.path().c_str(), &st) == 0) {
+                    ++result.chunksKept;
+                    result.storedBytes += static_cast<uint64_t>(st.st_size);
+                }
+                continue;
+            }
+
+            std::unique_lock<std::shared_mutex> lock(gcMutex_);
+            if (::stat(entry.path().c_str(), &st) != 0) {
+                continue;
+            }
+            if (st.st_mtime > cutoff) {
+                if (isChunk) {
+                    ++result.chunksKept;
+                    result.storedBytes += static_cast<uint64_t>(st.st_size);
+                }
+                continue;
+            }
+            if (::unlink(entry.path().c_str()) == 0 && isChunk) {
+                ++result.chunksRemoved;
+                result.bytesRemoved += static_cast<uint64_t>(st.st_size);
+            }
+        }
+    }
+    if (ec) {
+        std::cerr << "Chunk GC sweep incomplete: " << ec.message() << std::endl;
+        return result;
+    }
+
+    result.completed = true;
+    logicalBytes_ = result.logicalBytes;
+    storedBytes_ = result.storedBytes;
+    saveUsage();
+    gcRemoved_.increment(result.chunksRemoved);
+    std::cout << "Chunk GC: " << result.manifests << " manifests, " << result.chunksKept << " chunks kept, "
+              << result.chunksRemoved << " removed (" << result.bytesRemoved << " bytes)" << std::endl;
+    return result;
+}
+
+std::filesystem::path ChunkStore::chunkPath(const Hash128& hash) const {
+    std::string hex = HashUtils::hashToHex(hash);
+    return dir_ / hex.substr(0, 2) / hex.substr(2, 2) / hex;
+}
+
+void ChunkStore::loadUsage() {
+    std::ifstream file(usagePath(), std::ios::binary);
+    uint64_t usage[2] = {0, 0};
+    if (file.read(reinterpret_cast<char*>(usage), sizeof(usage))) {
+        logicalBytes_ = usage[0];
+        storedBytes_ = usage[1];
+    }
+}
+
+void ChunkStore::saveUsage() const {
+    uint64_t usage[2] = {logicalBytes_.load(), storedBytes_.load()};
+    if (usage[0] == 0 && usage[1] == 0 && !std::filesystem::exists(dir_)) {
+        return; // chunking never used; leave no trace
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(dir_, ec);
+    auto tmpPath = usagePath().string() + ".new";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(usage), sizeof(usage));
+        if (!file) {
+            return;
+        }
+    }
+    std::filesystem::rename(tmpPath, usagePath(), ec);
+}
+
+} // namespace imgstore
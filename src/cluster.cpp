@@ -0,0 +1,359 @@
+#include "cluster.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <strings.h>
+#include <unordered_set>
+
+namespace imgstore {
+
+namespace {
+
+// Hop-by-hop and framing headers are the client's own; everything else is passed along
+bool forwardable(const std::string& name) {
+    for (const char* skip :
+         {"Host", "Content-Length", "Connection", "Transfer-Encoding", "Expect", PeerClient::kHopHeader,
+          Cluster::kSecretHeader}) {
+        if (::strcasecmp(name.c_str(), skip) == 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool isSuccess(int code) {
+    return code >= 200 && code < 300;
+}
+
+} // namespace
+
+// Acknowledgements of one write, filled in by the pool threads forwarding it
+struct Cluster::PendingWrite {
+    std::mutex mutex;
+    crow::response mine;
+    Reply reply;
+    bool isDelete = false;
+    size_t waiting = 0;
+    size_t acks = 0;
+    std::optional<PeerClient::Response> success;
+
+    bool acknowledged(int code) const { return isSuccess(code) || (isDelete && code == 404); }
+};
+
+Cluster::Cluster(Options options)
+    : ring_(options.nodes, options.virtualNodes), self_(options.nodes.size()),
+      replicas_(std::clamp<size_t>(options.replicas, 1, std::max<size_t>(options.nodes.size(), 1))),
+      writeQuorum_(options.writeQuorum == 0 ? replicas_ / 2 + 1 : options.writeQuorum),
+      readQuorum_(std::max<size_t>(options.readQuorum, 1)), redirect_(options.redirect),
+      client_(options.timeout), secret_(options.secret), members_(options.secret),
+      servedLocal_(Metrics::instance().counter("imgstore_cluster_requests_total{route=\"local\"}",
+                                               "Image requests by where they were served")),
+      proxied_(Metrics::instance().counter("imgstore_cluster_requests_total{route=\"proxied\"}",
+                                           "Image requests by where they were served")),
+      redirected_(Metrics::instance().counter("imgstore_cluster_requests_total{route=\"redirected\"}",
+                                              "Image requests by where they were served")),
+      replicaWrites_(Metrics::instance().counter("imgstore_cluster_replica_writes_total",
+                                                 "Writes forwarded to other owners")),
+      replicaFailures_(Metrics::instance().counter("imgstore_cluster_replica_failures_total",
+                                                   "Forwarded writes that other owners did not acknowledge")),
+      peerErrors_(Metrics::instance().counter("imgstore_cluster_peer_errors_total",
+                                              "Requests to other nodes that got no answer")),
+      readQuorumFailures_(Metrics::instance().counter("imgstore_cluster_quorum_failures_total{op=\"read\"}",
+                                                      "Requests failed because too few owners answered")),
+      writeQuorumFailures_(Metrics::instance().counter("imgstore_cluster_quorum_failures_total{op=\"write\"}",
+                                                       "Requests failed because too few owners answered")),
+      peerSeconds_(Metrics::instance().summary("imgstore_cluster_peer_seconds",
+                                               "Latency of requests to other nodes")),
+      pool_(options.threads, "cluster_pool") {
+    std::unordered_set<std::string> ids;
+    for (size_t i = 0; i < ring_.nodes().size(); ++i) {
+        if (!ids.insert(ring_.nodes()[i].id).second) {
+            throw std::invalid_argument("Cluster node '" + ring_.nodes()[i].id + "' is listed twice");
+        }
+        if (ring_.nodes()[i].id == options.self) {
+            self_ = i;
+        }
+    }
+    if (self_ == ring_.nodes().size()) {
+        throw std::invalid_argument("This node ('" + options.self + "') is not a cluster member");
+    }
+    if (writeQuorum_ > replicas_ || readQuorum_ > replicas_) {
+        throw std::invalid_argument("Quorums cannot exceed the " + std::to_string(replicas_) + " replicas");
+    }
+}
+
+uint64_t Cluster::imageKey(const std::string& imageId) {
+    uint64_t hash = 0;
+    return HashUtils::hexToHash(imageId, hash) ? hash : HashUtils::xxh3_64(imageId);
+}
+
+uint64_t Cluster::nameKey(const std::string& name) {
+    return HashUtils::xxh3_64(name);
+}
+
+std::vector<ClusterRing::Node> Cluster::owners(uint64_t key) const {
+    std::vector<ClusterRing::Node> result;
+    for (size_t i : ring_.owners(key, replicas_)) {
+        result.push_back(ring_.nodes()[i]);
+    }
+    return result;
+}
+
+void Cluster::route(const crow::request& req, uint64_t key, const std::function<crow::response()>& local,
+                    const Reply& reply, std::optional<uint64_t> contentKey) {
+    std::string hop = trustedHop(req);
+    auto owners = ring_.owners(key, replicas_);
+    bool owner = std::find(owners.begin(), owners.end(), self_) != owners.end();
+
+    // Forwarded requests stop here, even if this node disagrees about the ring
+    if (hop == "replica" || (!hop.empty() && !owner)) {
+        servedLocal_.increment();
+        reply(local());
+        return;
+    }
+
+    if (!owner) {
+        if (redirect_) {
+            redirected_.increment();
+            crow::response res(307);
+            res.set_header("Location", "http://" + ring_.nodes()[owners.front()].address + req.raw_url);
+            reply(std::move(res));
+            return;
+        }
+        proxied_.increment();
+        onPool(reply, [this, &req, owners]() { return proxy(req, owners); });
+        return;
+    }
+
+    servedLocal_.increment();
+    if (req.method == crow::HTTPMethod::GET || req.method == crow::HTTPMethod::HEAD) {
+        read(req, owners, local, reply);
+        return;
+    }
+    write(req, owners, local, reply, contentKey);
+}
+
+Cluster::Status Cluster::status() const {
+    Status status;
+    status.self = ring_.nodes()[self_].id;
+    status.nodes = ring_.nodes();
+    status.replicas = replicas_;
+    status.writeQuorum = writeQuorum_;
+    status.readQuorum = readQuorum_;
+    status.virtualNodes = ring_.virtualNodes();
+    status.redirect = redirect_;
+    return status;
+}
+
+std::string Cluster::trustedHop(const crow::request& req) const {
+    std::string hop = req.get_header_value(PeerClient::kHopHeader);
+    if (hop.empty() || secret_.empty()) {
+        return hop;
+    }
+    return members_.validateApiKey(req.get_header_value(kSecretHeader)) ? hop : "";
+}
+
+void Cluster::onPool(const Reply& reply, std::function<crow::response()> work) {
+    pool_.submit([reply, work = std::move(work)]() {
+        crow::response result;
+        try {
+            result = work();
+        } catch (const std::exception& e) {
+            std::cerr << "Cluster request error: " << e.what() << std::endl;
+            result = crow::response(500, "Internal server error");
+        }
+        reply(std::move(result));
+    });
+}
+
+std::optional<PeerClient::Response> Cluster::forward(const crow::request& req, const ClusterRing::Node& node,
+                                                     const std::string& hop, const std::string& target) {
+    PeerClient::Headers headers;
+    for (const auto& [name, value] : req.headers) {
+        if (forwardable(name)) {
+            headers.emplace_back(name, value);
+        }
+    }
+    headers.emplace_back(PeerClient::kHopHeader, hop);
+    if (!secret_.empty()) {
+        headers.emplace_back(kSecretHeader, secret_);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto response = client_.send(node.address, crow::method_name(req.method), target.empty() ? req.raw_url : target,
+                                 headers, req.body);
+    peerSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (!response) {
+        peerErrors_.increment();
+        std::cerr << "Cluster node " << node.id << " (" << node.address << ") did not answer" << std::endl;
+    }
+    return response;
+}
+
+void Cluster::read(const crow::request& req, const std::vector<size_t>& owners,
+                   const std::function<crow::response()>& local, const Reply& reply) {
+    crow::response mine = local();
+    if (readQuorum_ <= 1 && isSuccess(mine.code)) {
+        reply(std::move(mine));
+        return;
+    }
+
+    // std::function needs a copyable capture, and responses only move
+    auto shared = std::make_shared<crow::response>(std::move(mine));
+    onPool(reply, [this, &req, owners, shared]() { return readOthers(req, owners, std::move(*shared)); });
+}
+
+crow::response Cluster::readOthers(const crow::request& req, const std::vector<size_t>& owners,
+                                   crow::response mine) {
+    // Keep asking until the quorum has answered; a miss is only final once
+    // every owner was asked, since one may have been down for the write
+    size_t answered = 1;
+    std::vector<PeerClient::Response> found;
+    for (size_t i : owners) {
+        if (i == self_) {
+            continue;
+        }
+        bool haveCopy = isSuccess(mine.code) || !found.empty();
+        if (answered >= readQuorum_ && haveCopy) {
+            break;
+        }
+        auto response = forward(req, ring_.nodes()[i], "replica");
+        if (!response) {
+            continue;
+        }
+        ++answered;
+        if (isSuccess(response->status)) {
+            found.push_back(std::move(*response));
+        }
+    }
+
+    if (answered < readQuorum_) {
+        readQuorumFailures_.increment();
+        crow::json::wvalue result;
+        result["error"] = "Read quorum not reached";
+        result["answered"] = answered;
+        result["required"] = readQuorum_;
+        return crow::response(503, result);
+    }
+
+    if (isSuccess(mine.code) || found.empty()) {
+        return mine;
+    }
+    return toResponse(found.front());
+}
+
+void Cluster::write(const crow::request& req, const std::vector<size_t>& owners,
+                    const std::function<crow::response()>& local, const Reply& reply,
+                    std::optional<uint64_t> contentKey) {
+    crow::response mine = local();
+    // Malformed or rejected uploads fail the same way everywhere
+    if (mine.code >= 400 && mine.code < 500 && mine.code != 404) {
+        reply(std::move(mine));
+        return;
+    }
+
+    std::vector<size_t> replicas;
+    for (size_t i : owners) {
+        if (i != self_) {
+            replicas.push_back(i);
+        }
+    }
+
+    // Named uploads also reach the owners of the content, so /images/<hash> finds it
+    std::vector<size_t> copies;
+    if (contentKey && isSuccess(mine.code)) {
+        for (size_t i : ring_.owners(*contentKey, replicas_)) {
+            if (std::find(owners.begin(), owners.end(), i) == owners.end()) {
+                copies.push_back(i);
+            }
+        }
+    }
+
+    // A delete that finds nothing has still reached the state it asked for
+    auto pending = std::make_shared<PendingWrite>();
+    pending->reply = reply;
+    pending->isDelete = req.method == crow::HTTPMethod::Delete;
+    pending->acks = pending->acknowledged(mine.code) ? 1 : 0;
+    pending->mine = std::move(mine);
+    pending->waiting = replicas.size() + copies.size();
+    if (pending->waiting == 0) {
+        finishWrite(*pending);
+        return;
+    }
+
+    // Whichever forward answers last replies to the client
+    auto send = [this, &req, pending](size_t node, bool replica) {
+        std::optional<PeerClient::Response> response;
+        try {
+            response = forward(req, ring_.nodes()[node], "replica", replica ? "" : "/images");
+        } catch (const std::exception& e) {
+            std::cerr << "Cluster request error: " << e.what() << std::endl;
+        }
+
+        replicaWrites_.increment();
+        std::unique_lock<std::mutex> lock(pending->mutex);
+        if (replica && response && pending->acknowledged(response->status)) {
+            ++pending->acks;
+            if (!pending->success && isSuccess(response->status)) {
+                pending->success = std::move(response);
+            }
+        } else if (replica || !response || !isSuccess(response->status)) {
+            replicaFailures_.increment();
+        }
+        if (--pending->waiting == 0) {
+            lock.unlock();
+            finishWrite(*pending);
+        }
+    };
+    for (size_t i : replicas) {
+        pool_.submit([send, i]() { send(i, true); });
+    }
+    for (size_t i : copies) {
+        pool_.submit([send, i]() { send(i, false); });
+    }
+}
+
+void Cluster::finishWrite(PendingWrite& write) {
+    if (write.acks < writeQuorum_) {
+        // The copies that did land stay; a retry or anti-entropy completes them
+        writeQuorumFailures_.increment();
+        crow::json::wvalue result;
+        result["error"] = "Write quorum not reached";
+        result["acknowledged"] = write.acks;
+        result["required"] = writeQuorum_;
+        write.reply(crow::response(503, result));
+        return;
+    }
+
+    crow::response res =
+        isSuccess(write.mine.code) || !write.success ? std::move(write.mine) : toResponse(*write.success);
+    res.set_header("X-Imgstore-Replicas", std::to_string(write.acks));
+    write.reply(std::move(res));
+}
+
+crow::response Cluster::proxy(const crow::request& req, const std::vector<size_t>& owners) {
+    for (size_t i : owners) {
+        if (auto response = forward(req, ring_.nodes()[i], "proxy")) {
+            return toResponse(*response);
+        }
+    }
+    crow::json::wvalue result;
+    result["error"] = "No owner reachable";
+    return crow::response(503, result);
+}
+
+crow::response Cluster::toResponse(const PeerClient::Response& peer) {
+    crow::response res(peer.status);
+    for (const auto& [name, value] : peer.headers) {
+        if (forwardable(name) && ::strcasecmp(name.c_str(), "Server") != 0 &&
+            ::strcasecmp(name.c_str(), "Date") != 0) {
+            res.add_header(name, value);
+        }
+    }
+    res.body = peer.body;
+    return res;
+}
+
+} // namespace imgstore
@@ -0,0 +1,78 @@
+#include "cluster_ring.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+namespace imgstore {
+
+ClusterRing::ClusterRing(std::vector<Node> nodes, size_t virtualNodes)
+    : nodes_(std::move(nodes)), virtualNodes_(std::max<size_t>(virtualNodes, 1)) {
+    points_.reserve(nodes_.size() * virtualNodes_);
+    for (size_t i = 0; i < nodes_.size(); ++i) {
+        for (size_t v = 0; v < virtualNodes_; ++v) {
+            points_.emplace_back(HashUtils::xxh3_64(nodes_[i].id + "#" + std::to_string(v)), i);
+        }
+    }
+    std::sort(points_.begin(), points_.end());
+}
+
+std::vector<size_t> ClusterRing::owners(uint64_t key, size_t count) const {
+    std::vector<size_t> result;
+    count = std::min(count, nodes_.size());
+    if (points_.empty() || count == 0) {
+        return result;
+    }
+
+    auto it = std::lower_bound(points_.begin(), points_.end(), std::make_pair(key, size_t{0}));
+    for (size_t step = 0; step < points_.size() && result.size() < count; ++step, ++it) {
+        if (it == points_.end()) {
+            it = points_.begin();
+        }
+        if (std::find(result.begin(), result.end(), it->second) == result.end()) {
+            result.push_back(it->second);
+        }
+    }
+    return result;
+}
+
+bool ClusterRing::parseNode(const std::string& spec, Node& node) {
+    auto equals = spec.find('=');
+    if (equals == std::string::npos || equals == 0) {
+        return false;
+    }
+    auto colon = spec.rfind(':');
+    if (colon == std::string::npos || colon < equals + 2 || colon + 1 == spec.size()) {
+        return false;
+    }
+    node.id = spec.substr(0, equals);
+    node.address = spec.substr(equals + 1);
+    return true;
+}
+
+bool ClusterRing::loadFile(const std::string& path, std::vector<Node>& nodes, std::string& error) {
+    std::ifstream file(path);
+    if (!file) {
+        error = "cannot open " + path;
+        return false;
+    }
+
+    std::string line;
+    for (int lineNumber = 1; std::getline(file, line); ++lineNumber) {
+        std::istringstream fields(line);
+        std::string id;
+        std::string address;
+        if (!(fields >> id) || id[0] == '#') {
+            continue;
+        }
+        Node node;
+        if (!(fields >> address) || !parseNode(id + "=" + address, node)) {
+            error = path + ":" + std::to_string(lineNumber) + ": expected 'id host:port'";
+            return false;
+        }
+        nodes.push_back(std::move(node));
+    }
+    return true;
+}
+
+} // namespace imgstore
@@ -0,0 +1,237 @@
+#include "content_sniffer.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <iterator>
+#include <string_view>
+
+namespace imgstore {
+
+namespace {
+
+constexpr size_t kMaxSignatureLength = 12;
+
+// Inspects a matched file further; returns Unknown to let later signatures try
+using Refine = ImageFormat (*)(const uint8_t* data, size_t size);
+
+struct Signature {
+    ImageFormat format = ImageFormat::Unknown;
+    Refine refine = nullptr;
+    uint8_t length = 0;
+    std::array<uint8_t, kMaxSignatureLength> bytes{};
+    std::array<uint8_t, kMaxSignatureLength> mask{}; // 0x00 where any byte matches
+};
+
+constexpr uint8_t hexDigit(char c) {
+    if (c >= '0' && c <= '9') {
+        return static_cast<uint8_t>(c - '0');
+    }
+    if (c >= 'A' && c <= 'F') {
+        return static_cast<uint8_t>(c - 'A' + 10);
+    }
+    throw "signature pattern: invalid hex digit";
+}
+
+/**
+ * @brief Build a signature from a pattern such as "'RIFF' ?? ?? ?? ?? 'WEBP'"
+ *
+ * Tokens are hex bytes ("89"), wildcards ("??") or quoted ASCII ('PNG').
+ * Evaluated at compile time; a malformed pattern fails the build.
+ */
+constexpr Signature signature(ImageFormat format, std::string_view pattern, Refine refine = nullptr) {
+    Signature sig;
+    sig.format = format;
+    sig.refine = refine;
+
+    auto push = [&sig](uint8_t byte, uint8_t mask) {
+        if (sig.length == kMaxSignatureLength) {
+            throw "signature pattern: too long";
+        }
+        sig.bytes[sig.length] = byte;
+        sig.mask[sig.length] = mask;
+        ++sig.length;
+    };
+
+    size_t i = 0;
+    while (i < pattern.size()) {
+        if (pattern[i] == ' ') {
+            ++i;
+        } else if (pattern[i] == '\'') {
+            size_t close = pattern.find('\'', i + 1);
+            if (close == std::string_view::npos) {
+                throw "signature pattern: unterminated literal";
+            }
+            for (size_t j = i + 1; j < close; ++j) {
+                push(static_cast<uint8_t>(pattern[j]), 0xFF);
+            }
+            i = close + 1;
+        } else if (i + 1 < pattern.size() && pattern[i] == '?' && pattern[i + 1] == '?') {
+            push(0x00, 0x00);
+            i += 2;
+        } else if (i + 1 < pattern.size()) {
+            push(static_cast<uint8_t>(hexDigit(pattern[i]) << 4 | hexDigit(pattern[i + 1])), 0xFF);
+            i += 2;
+        } else {
+            throw "signature pattern: dangling character";
+        }
+    }
+    return sig;
+}
+
+uint32_t readBigEndian32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | static_cast<uint32_t>(p[3]);
+}
+
+/**
+ * @brief Classify an ISO-BMFF file by the brands in its leading ftyp box
+ *
+ * AVIF and HEIC share the HEIF container; an avif/avis brand anywhere in
+ * the list wins, otherwise any HEVC or generic HEIF brand means HEIC.
+ */
+ImageFormat isoBmffBrand(const uint8_t* data, size_t size) {
+    // size(4) 'ftyp'(4) major_brand(4) minor_version(4) compatible_brands(4 each)
+    uint32_t boxSize = readBigEndian32(data);
+    if (boxSize != 0 && boxSize < 16) {
+        return ImageFormat::Unknown; // 64-bit box sizes never appear on ftyp in practice
+    }
+    size_t end = boxSize == 0 ? size : std::min<size_t>(boxSize, size);
+
+    bool heif = false;
+    for (size_t pos = 8; pos + 4 <= end; pos += 4) {
+        if (pos == 12) {
+            continue; // minor_version, not a brand
+        }
+        std::string_view brand(reinterpret_cast<const char*>(data + pos), 4);
+        if (brand == "avif" || brand == "avis") {
+            return ImageFormat::Avif;
+        }
+        if (brand == "heic" || brand == "heix" || brand == "heim" || brand == "heis" ||
+            brand == "hevc" || brand == "hevx" || brand == "mif1" || brand == "msf1") {
+            heif = true;
+        }
+    }
+    return heif ? ImageFormat::Heic : ImageFormat::Unknown;
+}
+
+/**
+ * @brief Recognise an SVG document by its root element
+ *
+ * Skips a byte-order mark, whitespace, the XML declaration, comments and
+ * a doctype, then expects `<svg`.
+ */
+ImageFormat svgRoot(const uint8_t* data, size_t size) {
+    std::string_view text(reinterpret_cast<const char*>(data), size);
+    if (text.starts_with("\xEF\xBB\xBF")) {
+        text.remove_prefix(3);
+    }
+
+    while (true) {
+        size_t start = text.find_first_not_of(" \t\r\n");
+        if (start == std::string_view::npos) {
+            return ImageFormat::Unknown;
+        }
+        text.remove_prefix(start);
+
+        std::string_view close;
+        if (text.starts_with("<?")) {
+            close = "?>";
+        } else if (text.starts_with("<!--")) {
+            close = "-->";
+        } else if (text.starts_with("<!")) {
+            // A doctype with an internal subset ends at "]>"
+            size_t bracket = text.find('[');
+            close = bracket != std::string_view::npos && bracket < text.find('>') ? "]>" : ">";
+        } else {
+            break;
+        }
+
+        size_t end = text.find(close);
+        if (end == std::string_view::npos) {
+            return ImageFormat::Unknown;
+        }
+        text.remove_prefix(end + close.size());
+    }
+
+    if (text.size() < 5 || !text.starts_with("<svg")) {
+        return ImageFormat::Unknown;
+    }
+    char next = text[4];
+    bool boundary = next == ' ' || next == '\t' || next == '\r' || next == '\n' || next == '>' || next == '/';
+    return boundary ? ImageFormat::Svg : ImageFormat::Unknown;
+}
+
+// Earlier entries win when several match
+constexpr Signature kSignatures[] = {
+    signature(ImageFormat::Jpeg, "FF D8 FF"),
+    signature(ImageFormat::Png, "89 'PNG' 0D 0A 1A 0A"),
+    signature(ImageFormat::Gif, "'GIF8' ?? 'a'"),
+    signature(ImageFormat::Webp, "'RIFF' ?? ?? ?? ?? 'WEBP'"),
+    signature(ImageFormat::Jxl, "FF 0A"),
+    signature(ImageFormat::Jxl, "00 00 00 0C 'JXL ' 0D 0A 87 0A"),
+    signature(ImageFormat::Tiff, "'II' 2A 00"),
+    signature(ImageFormat::Tiff, "'MM' 00 2A"),
+    signature(ImageFormat::Ico, "00 00 01 00"),
+    signature(ImageFormat::Unknown, "?? ?? ?? ?? 'ftyp'", isoBmffBrand),
+    signature(ImageFormat::Bmp, "'BM'"),
+    signature(ImageFormat::Unknown, "'<'", svgRoot),
+    signature(ImageFormat::Unknown, "EF BB BF", svgRoot),
+    signature(ImageFormat::Unknown, "20", svgRoot),
+    signature(ImageFormat::Unknown, "09", svgRoot),
+    signature(ImageFormat::Unknown, "0A", svgRoot),
+    signature(ImageFormat::Unknown, "0D", svgRoot),
+};
+
+constexpr size_t kSignatureCount = std::size(kSignatures);
+static_assert(kSignatureCount <= 32, "candidate sets are 32-bit masks");
+static_assert(std::all_of(std::begin(kSignatures), std::end(kSignatures),
+                          [](const Signature& sig) { return sig.length > 0; }),
+              "every signature needs at least one byte");
+
+// For each possible first byte, the set of signatures that can start with it
+constexpr std::array<uint32_t, 256> kCandidates = [] {
+    std::array<uint32_t, 256> table{};
+    for (size_t byte = 0; byte < table.size(); ++byte) {
+        for (size_t i = 0; i < kSignatureCount; ++i) {
+            if ((byte & kSignatures[i].mask[0]) == kSignatures[i].bytes[0]) {
+                table[byte] |= 1u << i;
+            }
+        }
+    }
+    return table;
+}();
+
+} // namespace
+
+ImageFormat ContentSniffer::sniff(const uint8_t* data, size_t size) {
+    if (size == 0) {
+        return ImageFormat::Unknown;
+    }
+    size = std::min(size, kSniffLength);
+
+    for (uint32_t candidates = kCandidates[data[0]]; candidates != 0; candidates &= candidates - 1) {
+        const Signature& sig = kSignatures[std::countr_zero(candidates)];
+        if (sig.length > size) {
+            continue;
+        }
+
+        bool match = true;
+        for (size_t i = 1; i < sig.length && match; ++i) {
+            match = (data[i] & sig.mask[i]) == sig.bytes[i];
+        }
+        if (!match) {
+            continue;
+        }
+
+        if (!sig.refine) {
+            return sig.format;
+        }
+        ImageFormat refined = sig.refine(data, size);
+        if (refined != ImageFormat::Unknown) {
+            return refined;
+        }
+    }
+    return ImageFormat::Unknown;
+}
+
+} // namespace imgstore
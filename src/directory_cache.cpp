@@ -0,0 +1,185 @@
+#include "directory_cache.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <functional>
+
+namespace imgstore {
+
+namespace {
+
+constexpr int kDirectoryFlags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+
+// Sockets and open files must always find a descriptor left over
+size_t capForDescriptorLimit(size_t capacity) {
+    struct rlimit limit{};
+    if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY) {
+        capacity = std::min<size_t>(capacity, limit.rlim_cur / 4);
+    }
+    return capacity;
+}
+
+} // namespace
+
+DirectoryCache::Directory::~Directory() {
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+DirectoryCache::DirectoryCache(size_t capacity)
+    : shardCapacity_(capacity == 0 ? 0 : std::max<size_t>(capForDescriptorLimit(capacity) / kShards, 1)),
+      hits_(Metrics::instance().counter("imgstore_dir_cache_hits_total",
+                                        "Directory lookups answered by an open descriptor")),
+      misses_(Metrics::instance().counter("imgstore_dir_cache_misses_total",
+                                          "Directory lookups that had to open the directory")),
+      created_(Metrics::instance().counter("imgstore_dir_cache_created_total",
+                                           "Shard directories created on first use")),
+      syscalls_(Metrics::instance().counter("imgstore_dir_cache_syscalls_total",
+                                            "open, mkdirat and openat calls made to resolve directories")) {
+    Metrics::instance().callbackGauge("imgstore_dir_cache_open", "Directory descriptors held open by the cache",
+                                      [this]() {
+        size_t open = 0;
+        for (auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            open += shard.lru.size();
+        }
+        return static_cast<double>(open);
+    });
+}
+
+DirectoryCache::~DirectoryCache() {
+    Metrics::instance().callbackGauge("imgstore_dir_cache_open", "", nullptr);
+}
+
+std::shared_ptr<const DirectoryCache::Directory> DirectoryCache::open(const std::filesystem::path& dir, bool create) {
+    const std::string& key = dir.native();
+    if (auto directory = lookup(key)) {
+        hits_.increment();
+        return directory;
+    }
+    misses_.increment();
+
+    auto directory = std::make_shared<Directory>();
+    syscalls_.increment();
+    directory->fd = ::open(key.c_str(), kDirectoryFlags);
+    if (directory->fd < 0 && errno == ENOENT && create) {
+        auto parentPath = dir.parent_path();
+        if (parentPath.empty() || parentPath == dir) {
+            return nullptr;
+        }
+        // The parent is cached too, so siblings created later cost one mkdirat each
+        auto parent = open(parentPath, true);
+        if (!parent) {
+            return nullptr;
+        }
+        auto name = dir.filename();
+        syscalls_.increment(2);
+        if (::mkdirat(parent->fd, name.c_str(), 0755) == 0) {
+            created_.increment();
+        } else if (errno != EEXIST) {
+            return nullptr;
+        }
+        directory->fd = ::openat(parent->fd, name.c_str(), kDirectoryFlags);
+    }
+    if (directory->fd < 0) {
+        return nullptr;
+    }
+    insert(key, directory);
+    return directory;
+}
+
+std::shared_ptr<const DirectoryCache::Directory> DirectoryCache::cached(const std::filesystem::path& dir) {
+    auto directory = lookup(dir.native());
+    if (directory) {
+        hits_.increment();
+    }
+    return directory;
+}
+
+int DirectoryCache::openFile(const std::filesystem::path& path, int flags, mode_t mode) {
+    bool create = (flags & O_CREAT) != 0;
+    auto dir = path.parent_path();
+    for (int attempt = 0; attempt < 2; ++attempt) {
+        auto directory = open(dir, create);
+        if (!directory) {
+            return -1;
+        }
+        int fd = ::openat(directory->fd, path.filename().c_str(), flags | O_CLOEXEC, mode);
+        if (fd >= 0 || errno != ENOENT || !create) {
+            return fd;
+        }
+        // The directory was removed while cached; open it afresh
+        forget(dir);
+    }
+    return -1;
+}
+
+bool DirectoryCache::stat(const std::filesystem::path& path, struct stat& st) {
+    auto directory = open(path.parent_path(), false);
+    return directory && ::fstatat(directory->fd, path.filename().c_str(), &st, 0) == 0;
+}
+
+bool DirectoryCache::exists(const std::filesystem::path& path) {
+    struct stat st{};
+    return stat(path, st);
+}
+
+bool DirectoryCache::unlink(const std::filesystem::path& path) {
+    auto directory = open(path.parent_path(), false);
+    return directory && ::unlinkat(directory->fd, path.filename().c_str(), 0) == 0;
+}
+
+bool DirectoryCache::rename(const std::filesystem::path& from, const std::filesystem::path& to) {
+    auto source = open(from.parent_path(), false);
+    auto target = source ? open(to.parent_path(), false) : nullptr;
+    return target && ::renameat(source->fd, from.filename().c_str(), target->fd, to.filename().c_str()) == 0;
+}
+
+void DirectoryCache::forget(const std::filesystem::path& dir) {
+    auto& shard = shardOf(dir.native());
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(dir.native());
+    if (it != shard.entries.end()) {
+        shard.lru.erase(it->second);
+        shard.entries.erase(it);
+    }
+}
+
+DirectoryCache::Shard& DirectoryCache::shardOf(const std::string& dir) {
+    return shards_[std::hash<std::string>{}(dir) % kShards];
+}
+
+std::shared_ptr<const DirectoryCache::Directory> DirectoryCache::lookup(const std::string& dir) {
+    auto& shard = shardOf(dir);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto it = shard.entries.find(dir);
+    if (it == shard.entries.end()) {
+        return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    return it->second->second;
+}
+
+void DirectoryCache::insert(const std::string& dir, std::shared_ptr<const Directory> directory) {
+    if (shardCapacity_ == 0) {
+        return;
+    }
+    auto& shard = shardOf(dir);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    // Another thread may have opened the same directory meanwhile; either descriptor will do
+    if (shard.entries.count(dir)) {
+        return;
+    }
+    shard.lru.emplace_front(dir, std::move(directory));
+    shard.entries[dir] = shard.lru.begin();
+    if (shard.lru.size() > shardCapacity_) {
+        shard.entries.erase(shard.lru.back().first);
+        shard.lru.pop_back();
+    }
+}
+
+} // namespace imgstore
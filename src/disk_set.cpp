@@ -0,0 +1,592 @@
+#include "disk_set.h"
+#include "hash_utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace imgstore {
+
+namespace {
+
+// A disk is reported unhealthy after this many I/O errors in a row
+constexpr uint32_t kUnhealthyAfterErrors = 3;
+
+bool syncFile(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = ::fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+} // namespace
+
+struct DiskSet::Disk {
+    uint64_t id = 0;
+    std::filesystem::path root;
+    std::string label; // value of the `disk` metric label
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    size_t depth = 1;
+    size_t inFlight = 0;
+    uint64_t nextTicket = 0; // FIFO admission: tickets are served in order
+    uint64_t serving = 0;
+    std::unordered_set<uint64_t> abandoned; // tickets whose holders gave up waiting
+
+    std::atomic<bool> identified{true}; // false if the root's .disk-id does not match the map
+    std::atomic<uint32_t> consecutiveErrors{0};
+
+    Summary* waitSeconds = nullptr;
+    Summary* opSeconds = nullptr;
+    Counter* errors = nullptr;
+    Gauge* healthy = nullptr;
+
+    void updateHealth() {
+        healthy->set(identified && consecutiveErrors < kUnhealthyAfterErrors ? 1.0 : 0.0);
+    }
+
+    // Hand the turn to the next ticket whose holder is still waiting
+    void advanceLocked() {
+        ++serving;
+        while (abandoned.erase(serving) > 0) {
+            ++serving;
+        }
+    }
+
+    size_t queuedLocked() const { return nextTicket - serving - abandoned.size(); }
+};
+
+DiskSet::Slot::Slot(Slot&& other) noexcept
+    : disk_(other.disk_), start_(other.start_), failed_(other.failed_), timedOut_(other.timedOut_) {
+    other.disk_ = nullptr;
+}
+
+DiskSet::Slot::~Slot() {
+    if (!disk_) {
+        return;
+    }
+    disk_->opSeconds->observe(
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start_).count());
+    if (failed_) {
+        disk_->errors->increment();
+        ++disk_->consecutiveErrors;
+    } else {
+        disk_->consecutiveErrors = 0;
+    }
+    disk_->updateHealth();
+
+    {
+        std::lock_guard<std::mutex> lock(disk_->mutex);
+        --disk_->inFlight;
+    }
+    disk_->cv.notify_all();
+}
+
+DiskSet::DiskSet(const std::filesystem::path& baseDir, const std::vector<std::string>& extraDirs,
+                 const ShardLayout& layout, size_t queueDepth)
+    : baseDir_(normalize(baseDir.string())), layout_(layout), queueDepth_(std::max<size_t>(queueDepth, 1)),
+      rebalanceMoved_(Metrics::instance().counter("imgstore_disk_rebalance_moved_total",
+                                                  "Images moved to the disk that owns them after a disk was added")),
+      rebalanceBytes_(Metrics::instance().counter("imgstore_disk_rebalance_moved_bytes_total",
+                                                  "Bytes moved by disk rebalancing")) {
+    auto baseId = claimDisk(baseDir_);
+    registerDisk(baseId.value_or(0), baseDir_, baseId.has_value());
+
+    std::vector<std::pair<uint64_t, std::filesystem::path>> mapped;
+    bool haveMap = loadMap(mapped);
+    for (const auto& [id, root] : mapped) {
+        auto found = readDiskId(root);
+        if (found != id) {
+            std::cerr << "Disk " << root << " does not carry ID " << HashUtils::hashToHex(id)
+                      << "; its images are unavailable until it is mounted there again" << std::endl;
+        }
+        registerDisk(id, root, found == id);
+    }
+
+    bool changed = false;
+    for (const auto& dir : extraDirs) {
+        auto root = normalize(dir);
+        bool known = false;
+        for (auto& disk : disks_) {
+            if (disk->root == root) {
+                known = true;
+                break;
+            }
+            // Same disk, mounted somewhere new
+            if (!disk->identified && readDiskId(root) == disk->id) {
+                std::cout << "Disk " << HashUtils::hashToHex(disk->id) << " moved from " << disk->root
+                          << " to " << root << std::endl;
+                disk->root = root;
+                disk->identified = true;
+                disk->updateHealth();
+                known = changed = true;
+                break;
+            }
+        }
+        if (known) {
+            continue;
+        }
+
+        auto id = claimDisk(root);
+        if (!id) {
+            std::cerr << "Cannot use " << root << " as a storage disk" << std::endl;
+            continue;
+        }
+        registerDisk(*id, root, true);
+        changed = true;
+        std::cout << "Added storage disk " << root << std::endl;
+    }
+
+    if (!haveMap) {
+        settled_ = 1;
+    }
+    if (changed || (!haveMap && disks_.size() > 1)) {
+        saveMapLocked();
+    }
+}
+
+DiskSet::~DiskSet() {
+    stop();
+    for (const auto& disk : disks_) {
+        Metrics::instance().callbackGauge("imgstore_disk_queue_depth" + disk->label, "", nullptr);
+        Metrics::instance().callbackGauge("imgstore_disk_in_flight" + disk->label, "", nullptr);
+    }
+}
+
+size_t DiskSet::diskCount() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return disks_.size();
+}
+
+std::filesystem::path DiskSet::root(size_t disk) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return disks_[disk]->root;
+}
+
+std::filesystem::path DiskSet::pathFor(const std::string& imageId) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return pathOnLocked(imageId, placeLocked(imageId, disks_.size()));
+}
+
+std::optional<std::filesystem::path> DiskSet::alternatePath(const std::string& imageId,
+                                                            const std::filesystem::path& tried) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (settled_ >= disks_.size()) {
+        return std::nullopt;
+    }
+
+    // Everywhere the image may be: its owner under the current set and under
+    // every smaller set back to the last balanced one
+    std::vector<std::filesystem::path> candidates;
+    for (size_t count = disks_.size(); count >= settled_ && count > 0; --count) {
+        auto path = pathOnLocked(imageId, placeLocked(imageId, count));
+        if (std::find(candidates.begin(), candidates.end(), path) == candidates.end()) {
+            candidates.push_back(std::move(path));
+        }
+    }
+    if (candidates.size() < 2) {
+        return std::nullopt;
+    }
+
+    // Cycle, so a reader that raced a move past every candidate gets another look
+    auto it = std::find(candidates.begin(), candidates.end(), tried);
+    if (it == candidates.end() || ++it == candidates.end()) {
+        return candidates.front();
+    }
+    return *it;
+}
+
+std::filesystem::path DiskSet::locate(const std::string& imageId) const {
+    auto path = pathFor(imageId);
+    std::error_code ec;
+    if (!rebalancing() || std::filesystem::exists(path, ec)) {
+        return path;
+    }
+    // Only candidates other than the current placement can hold it
+    for (auto other = alternatePath(imageId, path); other && *other != path; other = alternatePath(imageId, *other)) {
+        if (std::filesystem::exists(*other, ec)) {
+            return *other;
+        }
+    }
+    return path;
+}
+
+DiskSet::Slot DiskSet::acquire(const std::filesystem::path& path, std::chrono::milliseconds timeout) {
+    Slot slot;
+    Disk* disk = nullptr;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        disk = diskOfLocked(path);
+    }
+    if (!disk) {
+        return slot;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::unique_lock<std::mutex> lock(disk->mutex);
+        uint64_t ticket = disk->nextTicket++;
+        auto admissible = [&]() { return ticket == disk->serving && disk->inFlight < disk->depth; };
+        if (timeout.count() <= 0) {
+            disk->cv.wait(lock, admissible);
+        } else if (!disk->cv.wait_until(lock, start + timeout, admissible)) {
+            // Give the turn up without holding back the tickets behind this one
+            if (ticket == disk->serving) {
+                disk->advanceLocked();
+            } else {
+                disk->abandoned.insert(ticket);
+            }
+            lock.unlock();
+            disk->cv.notify_all();
+            disk->waitSeconds->observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+            slot.timedOut_ = true;
+            return slot;
+        }
+        disk->advanceLocked();
+        ++disk->inFlight;
+    }
+    // The next ticket may be admissible too
+    disk->cv.notify_all();
+
+    slot.disk_ = disk;
+    slot.start_ = std::chrono::steady_clock::now();
+    disk->waitSeconds->observe(std::chrono::duration<double>(slot.start_ - start).count());
+    return slot;
+}
+
+bool DiskSet::addDisk(const std::string& dir, std::string& error) {
+    auto root = normalize(dir);
+    if (root.empty()) {
+        error = "Disk path is empty";
+        return false;
+    }
+
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        for (const auto& disk : disks_) {
+            if (disk->root == root) {
+                error = "Disk is already part of the set";
+                return false;
+            }
+        }
+        if (disks_.size() >= 255) {
+            error = "Too many disks";
+            return false;
+        }
+
+        auto id = claimDisk(root);
+        if (!id) {
+            error = "Cannot create " + (root / ".disk-id").string();
+            return false;
+        }
+        for (const auto& disk : disks_) {
+            if (disk->id == *id) {
+                error = "Disk carries the same ID as " + disk->root.string();
+                return false;
+            }
+        }
+
+        registerDisk(*id, root, true);
+        if (!saveMapLocked()) {
+            error = "Cannot write placement map";
+        }
+    }
+
+    std::cout << "Added storage disk " << root << std::endl;
+    launchRebalance();
+    return true;
+}
+
+void DiskSet::startRebalance(RebalancePass pass) {
+    {
+        std::lock_guard<std::mutex> lock(rebalanceMutex_);
+        pass_ = std::move(pass);
+    }
+    if (rebalancing()) {
+        launchRebalance();
+    }
+}
+
+void DiskSet::stop() {
+    stopping_ = true;
+    std::thread thread;
+    {
+        // The pass takes this lock on its way out, so join outside it
+        std::lock_guard<std::mutex> lock(rebalanceMutex_);
+        thread = std::move(rebalanceThread_);
+    }
+    if (thread.joinable()) {
+        thread.join();
+    }
+}
+
+bool DiskSet::rebalancing() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return settled_ < disks_.size();
+}
+
+void DiskSet::recordMove(uint64_t bytes) {
+    rebalanceMoved_.increment();
+    rebalanceBytes_.increment(bytes);
+}
+
+std::vector<DiskSet::DiskStatus> DiskSet::status() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    std::vector<DiskStatus> result;
+    for (size_t i = 0; i < disks_.size(); ++i) {
+        auto& disk = *disks_[i];
+        DiskStatus status;
+        status.disk = i;
+        status.path = disk.root.string();
+        status.id = HashUtils::hashToHex(disk.id);
+        status.healthy = disk.healthy->value() > 0;
+        status.errors = disk.errors->value();
+        {
+            std::lock_guard<std::mutex> diskLock(disk.mutex);
+            status.queued = disk.queuedLocked();
+            status.inFlight = disk.inFlight;
+        }
+        result.push_back(status);
+    }
+    return result;
+}
+
+bool DiskSet::copyDurably(const std::filesystem::path& source, const std::filesystem::path& target,
+                          uint64_t& bytes) {
+    auto temp = target;
+    temp += ".moving";
+    try {
+        std::filesystem::create_directories(target.parent_path());
+        std::filesystem::copy_file(source, temp, std::filesystem::copy_options::overwrite_existing);
+        // The mtime is the image's upload time, which deletes on other replicas are ordered against
+        std::filesystem::last_write_time(temp, std::filesystem::last_write_time(source));
+        if (!syncFile(temp)) {
+            throw std::runtime_error("fsync failed");
+        }
+        bytes = std::filesystem::file_size(temp);
+        std::filesystem::rename(temp, target);
+        return true;
+    } catch (const std::exception& e) {
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        std::cerr << "Failed to copy " << source << " to " << target << ": " << e.what() << std::endl;
+        return false;
+    }
+}
+
+std::filesystem::path DiskSet::normalize(const std::string& dir) {
+    auto path = std::filesystem::path(dir).lexically_normal();
+    if (!path.empty() && !path.has_filename()) {
+        path = path.parent_path(); // drop the trailing separator
+    }
+    return path;
+}
+
+std::optional<uint64_t> DiskSet::readDiskId(const std::filesystem::path& root) {
+    std::ifstream file(root / ".disk-id");
+    std::string hex;
+    uint64_t id = 0;
+    if (!file || !std::getline(file, hex) || !HashUtils::hexToHash(hex, id)) {
+        return std::nullopt;
+    }
+    return id;
+}
+
+std::optional<uint64_t> DiskSet::claimDisk(const std::filesystem::path& root) {
+    if (auto id = readDiskId(root)) {
+        return id;
+    }
+
+    try {
+        std::filesystem::create_directories(root);
+        std::random_device random;
+        uint64_t id = (static_cast<uint64_t>(random()) << 32) | random();
+
+        auto temp = root / ".disk-id.tmp";
+        {
+            std::ofstream file(temp, std::ios::trunc);
+            file << HashUtils::hashToHex(id) << "\n";
+            if (!file) {
+                return std::nullopt;
+            }
+        }
+        std::filesystem::rename(temp, root / ".disk-id");
+        return id;
+    } catch (const std::exception& e) {
+        std::cerr << "Error claiming disk " << root << ": " << e.what() << std::endl;
+        return std::nullopt;
+    }
+}
+
+bool DiskSet::loadMap(std::vector<std::pair<uint64_t, std::filesystem::path>>& disks) {
+    std::ifstream file(mapPath());
+    if (!file) {
+        return false;
+    }
+
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "settled") {
+            fields >> settled_;
+        } else if (kind == "disk") {
+            std::string hex;
+            uint64_t id = 0;
+            fields >> hex >> std::ws;
+            std::string path;
+            std::getline(fields, path);
+            if (HashUtils::hexToHash(hex, id) && !path.empty()) {
+                disks.emplace_back(id, normalize(path));
+            }
+        }
+    }
+    settled_ = std::clamp<size_t>(settled_, 1, disks.size() + 1);
+    return true;
+}
+
+bool DiskSet::saveMapLocked() const {
+    auto temp = mapPath();
+    temp += ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        file << "settled " << settled_ << "\n";
+        // Disk 0 is the main storage directory and is not listed
+        for (size_t i = 1; i < disks_.size(); ++i) {
+            file << "disk " << HashUtils::hashToHex(disks_[i]->id) << " " << disks_[i]->root.string() << "\n";
+        }
+        if (!file) {
+            std::cerr << "Failed to write placement map " << temp << std::endl;
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, mapPath(), ec);
+    return !ec;
+}
+
+void DiskSet::registerDisk(uint64_t id, const std::filesystem::path& root, bool identified) {
+    auto disk = std::make_unique<Disk>();
+    disk->id = id;
+    disk->root = root;
+    disk->depth = queueDepth_;
+    disk->label = "{disk=\"" + std::to_string(disks_.size()) + "\"}";
+    disk->identified = identified;
+
+    auto& metrics = Metrics::instance();
+    disk->waitSeconds = &metrics.summary("imgstore_disk_wait_seconds" + disk->label,
+                                         "Time operations waited in a disk's queue");
+    disk->opSeconds = &metrics.summary("imgstore_disk_op_seconds" + disk->label,
+                                       "Time operations held a disk slot");
+    disk->errors = &metrics.counter("imgstore_disk_errors_total" + disk->label,
+                                    "I/O errors per disk");
+    disk->healthy = &metrics.gauge("imgstore_disk_healthy" + disk->label,
+                                   "1 if the disk is identified and not failing");
+    disk->updateHealth();
+
+    Disk* raw = disk.get();
+    metrics.callbackGauge("imgstore_disk_queue_depth" + disk->label, "Operations waiting for a disk", [raw]() {
+        std::lock_guard<std::mutex> lock(raw->mutex);
+        return static_cast<double>(raw->queuedLocked());
+    });
+    metrics.callbackGauge("imgstore_disk_in_flight" + disk->label, "Operations running on a disk", [raw]() {
+        std::lock_guard<std::mutex> lock(raw->mutex);
+        return static_cast<double>(raw->inFlight);
+    });
+
+    disks_.push_back(std::move(disk));
+}
+
+size_t DiskSet::placeLocked(const std::string& imageId, size_t count) const {
+    if (count <= 1) {
+        return 0;
+    }
+
+    uint64_t key = 0;
+    if (!HashUtils::hexToHash(imageId, key)) {
+        key = HashUtils::xxh3_64(imageId);
+    }
+
+    size_t best = 0;
+    uint64_t bestScore = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const uint64_t input[2] = {key, disks_[i]->id};
+        uint64_t score = HashUtils::xxh3_64(input, sizeof(input));
+        if (i == 0 || score > bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    return best;
+}
+
+std::filesystem::path DiskSet::pathOnLocked(const std::string& imageId, size_t disk) const {
+    return layout_.pathOf(disks_[disk]->root, imageId, imageId);
+}
+
+DiskSet::Disk* DiskSet::diskOfLocked(const std::filesystem::path& path) const {
+    // Matched by the longest root prefix, as paths of the layout being migrated from sit at another depth
+    Disk* match = nullptr;
+    size_t matchLength = 0;
+    for (const auto& disk : disks_) {
+        auto [rootEnd, pathIt] = std::mismatch(disk->root.begin(), disk->root.end(), path.begin(), path.end());
+        size_t length = std::distance(disk->root.begin(), disk->root.end());
+        if (rootEnd == disk->root.end() && length > matchLength) {
+            match = disk.get();
+            matchLength = length;
+        }
+    }
+    return match;
+}
+
+void DiskSet::launchRebalance() {
+    std::lock_guard<std::mutex> lock(rebalanceMutex_);
+    if (!pass_ || stopping_) {
+        return;
+    }
+    if (running_) {
+        rerun_ = true; // picks up disks added while the pass runs
+        return;
+    }
+    if (rebalanceThread_.joinable()) {
+        rebalanceThread_.join();
+    }
+
+    running_ = true;
+    rebalanceThread_ = std::thread([this]() {
+        while (true) {
+            size_t target = diskCount();
+            auto start = std::chrono::steady_clock::now();
+            std::cout << "Disk rebalance started across " << target << " disks" << std::endl;
+
+            bool completed = pass_();
+            if (completed && !stopping_) {
+                std::unique_lock<std::shared_mutex> lock(mutex_);
+                settled_ = std::max(settled_, target);
+                saveMapLocked();
+            }
+            std::cout << "Disk rebalance " << (completed ? "finished" : "incomplete") << " after "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s"
+                      << std::endl;
+
+            std::lock_guard<std::mutex> lock(rebalanceMutex_);
+            if (!rerun_ || stopping_) {
+                running_ = false;
+                return;
+            }
+            rerun_ = false;
+        }
+    });
+}
+
+} // namespace imgstore
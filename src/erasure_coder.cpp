@@ -0,0 +1,298 @@
+#include "erasure_coder.h"
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace imgstore {
+
+namespace {
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1, generator 2
+constexpr unsigned kPolynomial = 0x11d;
+
+struct Tables {
+    std::array<uint8_t, 512> exp{};
+    std::array<uint8_t, 256> log{};
+    std::array<std::array<uint8_t, 256>, 256> mul{};
+    // Products with every low and high nibble, for the vector kernels
+    std::array<std::array<uint8_t, 16>, 256> mulLow{};
+    std::array<std::array<uint8_t, 16>, 256> mulHigh{};
+
+    Tables() {
+        unsigned x = 1;
+        for (unsigned i = 0; i < 255; ++i) {
+            exp[i] = static_cast<uint8_t>(x);
+            exp[i + 255] = static_cast<uint8_t>(x);
+            log[x] = static_cast<uint8_t>(i);
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= kPolynomial;
+            }
+        }
+        for (unsigned a = 0; a < 256; ++a) {
+            for (unsigned b = 0; b < 256; ++b) {
+                mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+            }
+            for (unsigned n = 0; n < 16; ++n) {
+                mulLow[a][n] = mul[a][n];
+                mulHigh[a][n] = mul[a][n << 4];
+            }
+        }
+    }
+};
+
+const Tables& tables() {
+    static const Tables t;
+    return t;
+}
+
+uint8_t gfMul(uint8_t a, uint8_t b) {
+    return tables().mul[a][b];
+}
+
+uint8_t gfInverse(uint8_t a) {
+    const auto& t = tables();
+    return t.exp[255 - t.log[a]];
+}
+
+uint8_t gfPow(uint8_t a, size_t n) {
+    if (n == 0) {
+        return 1;
+    }
+    if (a == 0) {
+        return 0;
+    }
+    const auto& t = tables();
+    return t.exp[(t.log[a] * n) % 255];
+}
+
+// Invert a k x k matrix in place by Gauss-Jordan elimination
+bool invert(std::vector<uint8_t>& m, size_t k) {
+    std::vector<uint8_t> inv(k * k, 0);
+    for (size_t i = 0; i < k; ++i) {
+        inv[i * k + i] = 1;
+    }
+    for (size_t col = 0; col < k; ++col) {
+        size_t pivot = col;
+        while (pivot < k && m[pivot * k + col] == 0) {
+            ++pivot;
+        }
+        if (pivot == k) {
+            return false;
+        }
+        if (pivot != col) {
+            for (size_t j = 0; j < k; ++j) {
+                std::swap(m[pivot * k + j], m[col * k + j]);
+                std::swap(inv[pivot * k + j], inv[col * k + j]);
+            }
+        }
+        uint8_t scale = gfInverse(m[col * k + col]);
+        for (size_t j = 0; j < k; ++j) {
+            m[col * k + j] = gfMul(m[col * k + j], scale);
+            inv[col * k + j] = gfMul(inv[col * k + j], scale);
+        }
+        for (size_t row = 0; row < k; ++row) {
+            uint8_t factor = m[row * k + col];
+            if (row == col || factor == 0) {
+                continue;
+            }
+            for (size_t j = 0; j < k; ++j) {
+                m[row * k + j] ^= gfMul(factor, m[col * k + j]);
+                inv[row * k + j] ^= gfMul(factor, inv[col * k + j]);
+            }
+        }
+    }
+    m = std::move(inv);
+    return true;
+}
+
+// dst ^= c * src over size bytes
+using MulAddFn = void (*)(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size);
+
+void mulAddPortable(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size) {
+    const auto& row = tables().mul[c];
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#if defined(__x86_64__)
+
+// Each byte is split into nibbles; PSHUFB looks both products up in 16-entry tables
+__attribute__((target("ssse3")))
+void mulAddSsse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size) {
+    const auto& t = tables();
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.mulLow[c].data()));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.mulHigh[c].data()));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i lo = _mm_shuffle_epi8(low, _mm_and_si128(s, mask));
+        __m128i hi = _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(s, 4), mask));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_xor_si128(d, _mm_xor_si128(lo, hi)));
+    }
+    mulAddPortable(dst + i, src + i, c, size - i);
+}
+
+// Same lookups, 32 bytes at a time
+__attribute__((target("avx2")))
+void mulAddAvx2(uint8_t* dst, const uint8_t* src, uint8_t c, size_t size) {
+    const auto& t = tables();
+    const __m256i low = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.mulLow[c].data())));
+    const __m256i high = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(t.mulHigh[c].data())));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i lo = _mm256_shuffle_epi8(low, _mm256_and_si256(s, mask));
+        __m256i hi = _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask));
+        __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_xor_si256(d, _mm256_xor_si256(lo, hi)));
+    }
+    mulAddPortable(dst + i, src + i, c, size - i);
+}
+
+MulAddFn selectMulAdd(const char*& name) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        name = "avx2";
+        return mulAddAvx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        name = "ssse3";
+        return mulAddSsse3;
+    }
+    name = "portable";
+    return mulAddPortable;
+}
+
+#else
+
+MulAddFn selectMulAdd(const char*& name) {
+    name = "portable";
+    return mulAddPortable;
+}
+
+#endif
+
+const char* kernel = nullptr;
+const MulAddFn mulAdd = selectMulAdd(kernel);
+
+// dst = sum of coefficients[i] * sources[i]
+void combine(uint8_t* dst, const std::vector<const uint8_t*>& sources, const uint8_t* coefficients, size_t size) {
+    std::memset(dst, 0, size);
+    for (size_t i = 0; i < sources.size(); ++i) {
+        uint8_t c = coefficients[i];
+        if (c == 1) {
+            for (size_t j = 0; j < size; ++j) {
+                dst[j] ^= sources[i][j];
+            }
+        } else if (c != 0) {
+            mulAdd(dst, sources[i], c, size);
+        }
+    }
+}
+
+} // namespace
+
+ErasureCoder::ErasureCoder(size_t dataShards, size_t parityShards) : k_(dataShards), m_(parityShards) {
+    if (k_ == 0 || m_ == 0 || k_ + m_ > 255) {
+        throw std::invalid_argument("Erasure code needs 1 to 254 data and parity shards, at most 255 in total");
+    }
+
+    size_t n = k_ + m_;
+    std::vector<uint8_t> vandermonde(n * k_);
+    for (size_t row = 0; row < n; ++row) {
+        for (size_t col = 0; col < k_; ++col) {
+            vandermonde[row * k_ + col] = gfPow(static_cast<uint8_t>(row), col);
+        }
+    }
+
+    // Multiply by the inverse of the top square so the data rows become the identity
+    std::vector<uint8_t> top(vandermonde.begin(), vandermonde.begin() + static_cast<std::ptrdiff_t>(k_ * k_));
+    if (!invert(top, k_)) {
+        throw std::logic_error("Vandermonde matrix is singular");
+    }
+    matrix_.assign(n * k_, 0);
+    for (size_t row = 0; row < n; ++row) {
+        for (size_t col = 0; col < k_; ++col) {
+            uint8_t sum = 0;
+            for (size_t i = 0; i < k_; ++i) {
+                sum ^= gfMul(vandermonde[row * k_ + i], top[i * k_ + col]);
+            }
+            matrix_[row * k_ + col] = sum;
+        }
+    }
+}
+
+void ErasureCoder::encode(const std::vector<const uint8_t*>& data, const std::vector<uint8_t*>& parity,
+                          size_t size) const {
+    for (size_t p = 0; p < m_; ++p) {
+        combine(parity[p], data, &matrix_[(k_ + p) * k_], size);
+    }
+}
+
+bool ErasureCoder::reconstruct(const std::vector<uint8_t*>& shards, const std::vector<bool>& present, size_t size,
+                               bool withParity) const {
+    std::vector<size_t> rows;
+    for (size_t i = 0; i < k_ + m_ && rows.size() < k_; ++i) {
+        if (present[i]) {
+            rows.push_back(i);
+        }
+    }
+    if (rows.size() < k_) {
+        return false;
+    }
+
+    bool dataMissing = false;
+    for (size_t i = 0; i < k_; ++i) {
+        dataMissing = dataMissing || !present[i];
+    }
+
+    if (dataMissing) {
+        // The rows of the shards we have, inverted, map them back to the data
+        std::vector<uint8_t> decode(k_ * k_);
+        for (size_t r = 0; r < k_; ++r) {
+            std::memcpy(&decode[r * k_], &matrix_[rows[r] * k_], k_);
+        }
+        if (!invert(decode, k_)) {
+            return false;
+        }
+
+        std::vector<const uint8_t*> sources;
+        for (size_t row : rows) {
+            sources.push_back(shards[row]);
+        }
+        for (size_t i = 0; i < k_; ++i) {
+            if (!present[i]) {
+                combine(shards[i], sources, &decode[i * k_], size);
+            }
+        }
+    }
+
+    if (withParity) {
+        std::vector<const uint8_t*> data(shards.begin(), shards.begin() + static_cast<std::ptrdiff_t>(k_));
+        for (size_t p = 0; p < m_; ++p) {
+            if (!present[k_ + p]) {
+                combine(shards[k_ + p], data, &matrix_[(k_ + p) * k_], size);
+            }
+        }
+    }
+    return true;
+}
+
+const char* ErasureCoder::kernelName() {
+    return kernel;
+}
+
+} // namespace imgstore
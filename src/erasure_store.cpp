@@ -0,0 +1,605 @@
+#include "erasure_store.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <unordered_map>
+
+namespace imgstore {
+
+namespace {
+
+constexpr char kStubMagic[8] = {'I', 'M', 'G', 'E', 'C', 'S', '\0', '\1'};
+constexpr char kShardMagic[8] = {'I', 'M', 'G', 'E', 'C', 'D', '\0', '\1'};
+
+// Stands in for the image in the primary tree
+struct StubRecord {
+    char magic[8];
+    uint64_t size;
+    uint8_t dataShards;
+    uint8_t parityShards;
+    uint8_t reserved[6];
+    uint64_t checksum; // XXH3 over the fields above
+};
+
+static_assert(sizeof(StubRecord) == 32);
+
+// Precedes the payload of every shard file
+struct ShardHeader {
+    char magic[8];
+    uint64_t size; // size of the whole image
+    uint32_t shardSize;
+    uint8_t shard;
+    uint8_t dataShards;
+    uint8_t parityShards;
+    uint8_t reserved;
+    uint64_t checksum; // XXH3 of the payload
+};
+
+static_assert(sizeof(ShardHeader) == 32);
+
+// A sweep tracks the shards of each image in one 64-bit mask
+constexpr size_t kMaxShards = 64;
+
+// Shards are padded to whole vector widths so the kernels never take the scalar tail
+constexpr size_t kShardAlignment = 64;
+
+// Shards of deleted images are only removed once this old, so a sweep never
+// races with an upload whose index entry it has not seen yet
+constexpr std::chrono::minutes kOrphanGrace{10};
+
+size_t shardSizeFor(uint64_t size, size_t dataShards) {
+    size_t perShard = static_cast<size_t>((size + dataShards - 1) / dataShards);
+    return std::max<size_t>((perShard + kShardAlignment - 1) / kShardAlignment * kShardAlignment, kShardAlignment);
+}
+
+// Split "<image id>.<shard>" shard file names
+bool parseShardName(const std::string& name, std::string& imageId, size_t& shard) {
+    auto dot = name.find('.');
+    uint64_t hash = 0;
+    if (dot == std::string::npos || dot + 1 == name.size() ||
+        !HashUtils::hexToHash(name.substr(0, dot), hash)) {
+        return false;
+    }
+    shard = 0;
+    for (size_t i = dot + 1; i < name.size(); ++i) {
+        if (name[i] < '0' || name[i] > '9') {
+            return false; // temporary files of writes in progress
+        }
+        shard = shard * 10 + static_cast<size_t>(name[i] - '0');
+    }
+    imageId = name.substr(0, dot);
+    return true;
+}
+
+} // namespace
+
+struct ErasureStore::Loaded {
+    uint64_t size = 0;
+    size_t shardSize = 0;
+    std::vector<uint8_t> data;   // data shards back to back, so the image is a prefix
+    std::vector<uint8_t> parity; // parity shards back to back
+    std::vector<bool> present;
+    size_t intact = 0;
+    uint64_t bytesRead = 0;
+
+    uint8_t* shard(size_t i, size_t dataShards) {
+        return i < dataShards ? data.data() + i * shardSize : parity.data() + (i - dataShards) * shardSize;
+    }
+};
+
+ErasureStore::ErasureStore(const std::vector<std::string>& roots, size_t parityShards, const ShardLayout& layout,
+                           ObjectIndex& index)
+    : roots_(roots.begin(), roots.end()), layout_(layout), index_(index),
+      coder_(roots.size() > parityShards ? roots.size() - parityShards : 0, parityShards),
+      encodeSeconds_(Metrics::instance().summary("imgstore_ec_encode_seconds",
+                                                 "Time spent computing parity for erasure-coded images")),
+      decodeSeconds_(Metrics::instance().summary("imgstore_ec_decode_seconds",
+                                                 "Time spent reconstructing missing erasure-coded shards")),
+      degradedReads_(Metrics::instance().counter("imgstore_ec_degraded_reads_total",
+                                                 "Erasure-coded reads that had to decode around lost shards")),
+      degradedWrites_(Metrics::instance().counter("imgstore_ec_degraded_writes_total",
+                                                  "Erasure-coded writes that could not write every shard")),
+      shardErrors_(Metrics::instance().counter("imgstore_ec_shard_errors_total",
+                                               "Shards found missing or damaged")),
+      shardsRebuilt_(Metrics::instance().counter("imgstore_ec_shards_rebuilt_total",
+                                                 "Shards rewritten from the surviving ones")),
+      unrecoverable_(Metrics::instance().counter("imgstore_ec_unrecoverable_total",
+                                                 "Erasure-coded images with fewer intact shards than data shards")) {
+    if (roots_.size() > kMaxShards) {
+        throw std::invalid_argument("Erasure coding supports at most " + std::to_string(kMaxShards) + " roots");
+    }
+    for (const auto& root : roots_) {
+        std::filesystem::create_directories(root);
+        auto marker = root / ".ec-root";
+        if (!std::filesystem::exists(marker)) {
+            // A new or replaced disk: its shards have to be rebuilt
+            std::ofstream(marker) << "erasure shard root\n";
+            needsSweep_ = true;
+        }
+    }
+
+    Metrics::instance().callbackGauge("imgstore_ec_rebuild_queue_depth",
+                                      "Erasure-coded images waiting for lost shards to be rebuilt",
+                                      [this]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return static_cast<double>(pending_.size());
+    });
+}
+
+ErasureStore::~ErasureStore() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_ec_rebuild_queue_depth", "", nullptr);
+}
+
+bool ErasureStore::isStub(const uint8_t* data, size_t size) {
+    return size >= sizeof(kStubMagic) && std::memcmp(data, kStubMagic, sizeof(kStubMagic)) == 0;
+}
+
+std::optional<ErasureStore::Stub> ErasureStore::parseStub(const std::vector<uint8_t>& stub) {
+    if (stub.size() != sizeof(StubRecord) || !isStub(stub.data(), stub.size())) {
+        return std::nullopt;
+    }
+    StubRecord record;
+    std::memcpy(&record, stub.data(), sizeof(record));
+    if (record.checksum != HashUtils::xxh3_64(&record, offsetof(StubRecord, checksum))) {
+        return std::nullopt;
+    }
+    return Stub{record.size, record.dataShards, record.parityShards};
+}
+
+std::optional<ErasureStore::Stub> ErasureStore::readStub(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<uint8_t> stub(sizeof(StubRecord));
+    if (!file.read(reinterpret_cast<char*>(stub.data()), static_cast<std::streamsize>(stub.size())) ||
+        file.peek() != std::char_traits<char>::eof()) {
+        return std::nullopt;
+    }
+    return parseStub(stub);
+}
+
+std::optional<std::vector<uint8_t>> ErasureStore::write(const std::string& imageId,
+                                                        const std::vector<uint8_t>& data) {
+    size_t k = coder_.dataShards();
+    size_t m = coder_.parityShards();
+    size_t shardSize = shardSizeFor(data.size(), k);
+
+    // Data shards point into the image; only the ones running past its end are copied and padded
+    std::vector<const uint8_t*> shards(k);
+    std::vector<uint8_t> tail;
+    size_t whole = std::min(k, data.size() / shardSize);
+    if (whole < k) {
+        tail.assign((k - whole) * shardSize, 0);
+        std::memcpy(tail.data(), data.data() + whole * shardSize, data.size() - whole * shardSize);
+    }
+    for (size_t i = 0; i < k; ++i) {
+        shards[i] = i < whole ? data.data() + i * shardSize : tail.data() + (i - whole) * shardSize;
+    }
+
+    std::vector<uint8_t> parity(m * shardSize);
+    std::vector<uint8_t*> parityShards(m);
+    for (size_t p = 0; p < m; ++p) {
+        parityShards[p] = parity.data() + p * shardSize;
+    }
+    auto start = std::chrono::steady_clock::now();
+    coder_.encode(shards, parityShards, shardSize);
+    encodeSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    size_t written = 0;
+    for (size_t i = 0; i < k + m; ++i) {
+        const uint8_t* payload = i < k ? shards[i] : parityShards[i - k];
+        if (writeShard(imageId, i, data.size(), shardSize, payload)) {
+            ++written;
+        }
+    }
+    if (written < k) {
+        std::cerr << "Only " << written << " of " << k + m << " shards of image " << imageId
+                  << " could be written" << std::endl;
+        remove(imageId);
+        return std::nullopt;
+    }
+    if (written < k + m) {
+        degradedWrites_.increment();
+        queueRebuild(imageId);
+    }
+
+    StubRecord record{};
+    std::memcpy(record.magic, kStubMagic, sizeof(kStubMagic));
+    record.size = data.size();
+    record.dataShards = static_cast<uint8_t>(k);
+    record.parityShards = static_cast<uint8_t>(m);
+    record.checksum = HashUtils::xxh3_64(&record, offsetof(StubRecord, checksum));
+
+    std::vector<uint8_t> stub(sizeof(record));
+    std::memcpy(stub.data(), &record, sizeof(record));
+    return stub;
+}
+
+bool ErasureStore::read(const std::string& imageId, const Stub& stub, std::vector<uint8_t>& out) {
+    if (stub.dataShards != coder_.dataShards() || stub.parityShards != coder_.parityShards()) {
+        std::cerr << "Image " << imageId << " was coded " << int(stub.dataShards) << "+" << int(stub.parityShards)
+                  << " but the shard roots are configured for " << coder_.dataShards() << "+"
+                  << coder_.parityShards() << std::endl;
+        return false;
+    }
+
+    Loaded loaded;
+    if (!load(imageId, stub.size, false, loaded)) {
+        return false;
+    }
+    out = std::move(loaded.data);
+    out.resize(stub.size);
+    return true;
+}
+
+bool ErasureStore::scrub(const std::string& imageId, const Stub& stub, std::vector<uint8_t>& out,
+                         uint64_t& bytesRead) {
+    bytesRead = 0;
+    if (stub.dataShards != coder_.dataShards() || stub.parityShards != coder_.parityShards()) {
+        return false;
+    }
+
+    Loaded loaded;
+    bool ok = load(imageId, stub.size, true, loaded);
+    bytesRead = loaded.bytesRead;
+    if (!ok) {
+        return false;
+    }
+    if (loaded.intact < coder_.totalShards()) {
+        // Rebuilt in line: the scrubber is already paying for the reads
+        size_t rebuilt = 0;
+        rebuild(imageId, stub.size, rebuilt);
+    }
+    out = std::move(loaded.data);
+    out.resize(stub.size);
+    return true;
+}
+
+void ErasureStore::remove(const std::string& imageId) {
+    for (size_t i = 0; i < coder_.totalShards(); ++i) {
+        std::error_code ec;
+        std::filesystem::remove(shardPath(imageId, i), ec);
+    }
+}
+
+void ErasureStore::start(bool sweepNow) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (thread_.joinable()) {
+        return;
+    }
+    stopRequested_ = false;
+    sweepRequested_ = sweepNow;
+    thread_ = std::thread(&ErasureStore::loop, this);
+}
+
+void ErasureStore::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopRequested_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+bool ErasureStore::triggerSweep() {
+    if (sweeping_.load()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sweepRequested_ = true;
+    }
+    cv_.notify_all();
+    return true;
+}
+
+ErasureStore::Status ErasureStore::status() const {
+    Status status;
+    status.dataShards = coder_.dataShards();
+    status.parityShards = coder_.parityShards();
+    for (const auto& root : roots_) {
+        status.roots.push_back(root.string());
+    }
+    status.kernel = ErasureCoder::kernelName();
+    status.sweeping = sweeping_.load();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    status.queued = pending_.size();
+    status.lastSweep = lastSweep_;
+    return status;
+}
+
+std::filesystem::path ErasureStore::shardPath(const std::string& imageId, size_t shard) const {
+    uint64_t hash = HashUtils::xxh3_64(imageId);
+    std::string shardDir = layout_.shardPath(imageId);
+    // Rotating by the hash spreads parity across every root
+    size_t root = (shard + hash % roots_.size()) % roots_.size();
+    return roots_[root] / shardDir / (imageId + "." + std::to_string(shard));
+}
+
+bool ErasureStore::writeShard(const std::string& imageId, size_t shard, uint64_t size, size_t shardSize,
+                              const uint8_t* payload) {
+    auto path = shardPath(imageId, shard);
+    auto temp = path;
+    temp += ".tmp." + std::to_string(tempCounter_++);
+    try {
+        std::filesystem::create_directories(path.parent_path());
+
+        ShardHeader header{};
+        std::memcpy(header.magic, kShardMagic, sizeof(kShardMagic));
+        header.size = size;
+        header.shardSize = static_cast<uint32_t>(shardSize);
+        header.shard = static_cast<uint8_t>(shard);
+        header.dataShards = static_cast<uint8_t>(coder_.dataShards());
+        header.parityShards = static_cast<uint8_t>(coder_.parityShards());
+        header.checksum = HashUtils::xxh3_64(payload, shardSize);
+
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(payload), static_cast<std::streamsize>(shardSize));
+        file.close();
+        if (!file.good()) {
+            std::cerr << "Failed to write shard " << path << std::endl;
+            std::error_code ec;
+            std::filesystem::remove(temp, ec);
+            return false;
+        }
+        std::filesystem::rename(temp, path);
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Error writing shard " << path << ": " << e.what() << std::endl;
+        std::error_code ec;
+        std::filesystem::remove(temp, ec);
+        return false;
+    }
+}
+
+bool ErasureStore::readShard(const std::string& imageId, size_t shard, uint64_t size, size_t shardSize,
+                             uint8_t* payload) {
+    std::ifstream file(shardPath(imageId, shard), std::ios::binary);
+    ShardHeader header{};
+    if (!file || !file.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+        return false;
+    }
+    if (std::memcmp(header.magic, kShardMagic, sizeof(kShardMagic)) != 0 || header.size != size ||
+        header.shardSize != shardSize || header.shard != shard || header.dataShards != coder_.dataShards() ||
+        header.parityShards != coder_.parityShards()) {
+        return false;
+    }
+    if (!file.read(reinterpret_cast<char*>(payload), static_cast<std::streamsize>(shardSize))) {
+        return false;
+    }
+    return HashUtils::xxh3_64(payload, shardSize) == header.checksum;
+}
+
+bool ErasureStore::load(const std::string& imageId, uint64_t size, bool everyShard, Loaded& loaded) {
+    size_t k = coder_.dataShards();
+    size_t n = coder_.totalShards();
+
+    loaded.size = size;
+    loaded.shardSize = shardSizeFor(size, k);
+    loaded.data.resize(k * loaded.shardSize);
+    loaded.parity.resize((n - k) * loaded.shardSize);
+    loaded.present.assign(n, false);
+
+    // Data shards first: when they are all intact nothing needs decoding
+    for (size_t i = 0; i < n; ++i) {
+        if (!everyShard && i >= k && loaded.intact >= k) {
+            break;
+        }
+        if (readShard(imageId, i, size, loaded.shardSize, loaded.shard(i, k))) {
+            loaded.present[i] = true;
+            ++loaded.intact;
+            loaded.bytesRead += sizeof(ShardHeader) + loaded.shardSize;
+        } else {
+            shardErrors_.increment();
+        }
+    }
+
+    if (loaded.intact < k) {
+        std::cerr << "Image " << imageId << " has " << loaded.intact << " intact shards, " << k
+                  << " are needed" << std::endl;
+        unrecoverable_.increment();
+        return false;
+    }
+
+    bool dataLost = !std::all_of(loaded.present.begin(), loaded.present.begin() + static_cast<std::ptrdiff_t>(k),
+                                 [](bool present) { return present; });
+    if (dataLost) {
+        std::vector<uint8_t*> shards(n);
+        for (size_t i = 0; i < n; ++i) {
+            shards[i] = loaded.shard(i, k);
+        }
+        auto start = std::chrono::steady_clock::now();
+        coder_.reconstruct(shards, loaded.present, loaded.shardSize, false);
+        decodeSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        degradedReads_.increment();
+    }
+    if (dataLost && !everyShard) {
+        queueRebuild(imageId);
+    }
+    return true;
+}
+
+bool ErasureStore::rebuild(const std::string& imageId, std::optional<uint64_t> size, size_t& rebuilt) {
+    size_t k = coder_.dataShards();
+    size_t n = coder_.totalShards();
+    rebuilt = 0;
+
+    if (!size) {
+        // Without the stub, any shard's header tells the image size
+        for (size_t i = 0; i < n && !size; ++i) {
+            std::ifstream file(shardPath(imageId, i), std::ios::binary);
+            ShardHeader header{};
+            if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+                std::memcmp(header.magic, kShardMagic, sizeof(kShardMagic)) == 0) {
+                size = header.size;
+            }
+        }
+        if (!size) {
+            unrecoverable_.increment();
+            return false;
+        }
+    }
+
+    Loaded loaded;
+    loaded.size = *size;
+    loaded.shardSize = shardSizeFor(*size, k);
+    loaded.data.resize(k * loaded.shardSize);
+    loaded.parity.resize((n - k) * loaded.shardSize);
+    loaded.present.assign(n, false);
+    for (size_t i = 0; i < n; ++i) {
+        if (readShard(imageId, i, *size, loaded.shardSize, loaded.shard(i, k))) {
+            loaded.present[i] = true;
+            ++loaded.intact;
+        }
+    }
+    if (loaded.intact == n) {
+        return true;
+    }
+
+    std::vector<uint8_t*> shards(n);
+    for (size_t i = 0; i < n; ++i) {
+        shards[i] = loaded.shard(i, k);
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (!coder_.reconstruct(shards, loaded.present, loaded.shardSize, true)) {
+        std::cerr << "Cannot rebuild image " << imageId << ": " << loaded.intact << " intact shards, " << k
+                  << " are needed" << std::endl;
+        unrecoverable_.increment();
+        return false;
+    }
+    decodeSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    // Deleted while its shards were being decoded
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash) || !index_.findImage(hash)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        if (!loaded.present[i] && writeShard(imageId, i, *size, loaded.shardSize, shards[i])) {
+            ++rebuilt;
+        }
+    }
+    shardsRebuilt_.increment(rebuilt);
+    return true;
+}
+
+void ErasureStore::queueRebuild(const std::string& imageId) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!queued_.insert(imageId).second) {
+            return;
+        }
+        pending_.push_back(imageId);
+    }
+    cv_.notify_all();
+}
+
+ErasureStore::SweepResult ErasureStore::sweep() {
+    SweepResult result;
+    size_t n = coder_.totalShards();
+
+    // Which shards of each image survive anywhere
+    std::unordered_map<std::string, uint64_t> present;
+    try {
+        for (const auto& root : roots_) {
+            for (auto it = std::filesystem::recursive_directory_iterator(root);
+                 it != std::filesystem::recursive_directory_iterator(); ++it) {
+                std::string imageId;
+                size_t shard = 0;
+                if (it->is_regular_file() && parseShardName(it->path().filename().string(), imageId, shard) &&
+                    shard < n) {
+                    present[imageId] |= uint64_t{1} << shard;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopRequested_) {
+                return result;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error listing shard roots: " << e.what() << std::endl;
+        return result;
+    }
+
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const auto& [imageId, mask] : present) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopRequested_) {
+                return result;
+            }
+        }
+        ++result.objects;
+
+        uint64_t hash = 0;
+        if (HashUtils::hexToHash(imageId, hash) && !index_.findImage(hash)) {
+            for (size_t i = 0; i < n; ++i) {
+                auto path = shardPath(imageId, i);
+                std::error_code ec;
+                auto modified = std::filesystem::last_write_time(path, ec);
+                if (!ec && now - modified > kOrphanGrace && std::filesystem::remove(path, ec)) {
+                    ++result.orphansRemoved;
+                }
+            }
+            continue;
+        }
+
+        size_t rebuilt = 0;
+        if (static_cast<size_t>(std::popcount(mask)) < n && !rebuild(imageId, std::nullopt, rebuilt)) {
+            ++result.unrecoverable;
+        }
+        result.shardsRebuilt += rebuilt;
+    }
+
+    result.completed = true;
+    return result;
+}
+
+void ErasureStore::loop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopRequested_) {
+        cv_.wait(lock, [this]() { return stopRequested_ || sweepRequested_ || !pending_.empty(); });
+        if (stopRequested_) {
+            break;
+        }
+
+        if (!pending_.empty()) {
+            std::string imageId = std::move(pending_.front());
+            pending_.pop_front();
+            queued_.erase(imageId);
+
+            lock.unlock();
+            size_t rebuilt = 0;
+            rebuild(imageId, std::nullopt, rebuilt);
+            lock.lock();
+            continue;
+        }
+
+        sweepRequested_ = false;
+        sweeping_ = true;
+        lock.unlock();
+
+        std::cout << "Erasure shard sweep started" << std::endl;
+        SweepResult result = sweep();
+        std::cout << "Erasure shard sweep " << (result.completed ? "finished" : "interrupted") << ": "
+                  << result.objects << " images, " << result.shardsRebuilt << " shards rebuilt, "
+                  << result.unrecoverable << " unrecoverable, " << result.orphansRemoved
+                  << " orphaned shards removed" << std::endl;
+
+        lock.lock();
+        lastSweep_ = result;
+        sweeping_ = false;
+    }
+}
+
+} // namespace imgstore
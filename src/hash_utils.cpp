@@ -2,6 +2,7 @@
 #include <xxhash.h>
 #include <sstream>
 #include <iomanip>
+#include <new>
 
 namespace imgstore {
 
@@ -13,6 +14,11 @@ uint64_t HashUtils::xxh3_64(const std::string& str) {
     return XXH3_64bits(str.data(), str.size());
 }
 
+Hash128 HashUtils::xxh3_128(const void* data, size_t size) {
+    XXH128_hash_t hash = XXH3_128bits(data, size);
+    return {hash.high64, hash.low64};
+}
+
 std::string HashUtils::generateShardPath(uint64_t hash, int depth, int width) {
     std::string hexHash = hashToHex(hash);
     std::string path;
@@ -35,4 +41,53 @@ std::string HashUtils::hashToHex(uint64_t hash) {
     return ss.str();
 }
 
+std::string HashUtils::hashToHex(const Hash128& hash) {
+    return hashToHex(hash.high) + hashToHex(hash.low);
+}
+
+bool HashUtils::hexToHash(const std::string& hex, uint64_t& hash) {
+    if (hex.size() != 16) {
+        return false;
+    }
+
+    uint64_t value = 0;
+    for (char c : hex) {
+        value <<= 4;
+        if (c >= '0' && c <= '9') {
+            value |= static_cast<uint64_t>(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            value |= static_cast<uint64_t>(c - 'a' + 10);
+        } else {
+            return false;
+        }
+    }
+
+    hash = value;
+    return true;
+}
+
+Xxh3Stream::Xxh3Stream()
+    : state_(XXH3_createState()) {
+    if (!state_) {
+        throw std::bad_alloc();
+    }
+    reset();
+}
+
+Xxh3Stream::~Xxh3Stream() {
+    XXH3_freeState(state_);
+}
+
+void Xxh3Stream::reset() {
+    XXH3_64bits_reset(state_);
+}
+
+void Xxh3Stream::update(const void* data, size_t size) {
+    XXH3_64bits_update(state_, data, size);
+}
+
+uint64_t Xxh3Stream::digest() const {
+    return XXH3_64bits_digest(state_);
+}
+
 } // namespace imgstore
@@ -0,0 +1,582 @@
+#include "image_codec.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <csetjmp>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#ifdef IMGSTORE_HAVE_JPEG
+#include <jpeglib.h>
+#endif
+
+#ifdef IMGSTORE_HAVE_PNG
+#include <png.h>
+#endif
+
+#ifdef IMGSTORE_HAVE_WEBP
+#include <webp/decode.h>
+#include <webp/encode.h>
+#endif
+
+#ifdef IMGSTORE_HAVE_AVIF
+#include <avif/avif.h>
+#endif
+
+namespace imgstore {
+
+namespace {
+
+// Per-format quality used when the caller passes 0. AVIF reaches the same
+// visual quality as JPEG at a much lower setting.
+constexpr int kDefaultJpegQuality = 82;
+constexpr int kDefaultWebpQuality = 80;
+constexpr int kDefaultAvifQuality = 55;
+
+// libavif speed 0-10; on-the-fly encoding needs the fast end
+constexpr int kAvifSpeed = 8;
+
+#ifdef IMGSTORE_HAVE_JPEG
+
+// libjpeg reports fatal errors through error_exit, which must not return.
+// Unwinding a C++ exception through libjpeg's C frames is not safe, so the
+// handler longjmps back to the caller instead.
+struct JpegErrorManager {
+    jpeg_error_mgr base;
+    std::jmp_buf jump;
+};
+
+void jpegErrorExit(j_common_ptr cinfo) {
+    auto* manager = reinterpret_cast<JpegErrorManager*>(cinfo->err);
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    std::cerr << "JPEG codec error: " << message << std::endl;
+    std::longjmp(manager->jump, 1);
+}
+
+void jpegSilentMessage(j_common_ptr, int) {}
+
+// Everything libjpeg or the error path touches after setjmp lives on the
+// heap, so its state is well-defined if libjpeg jumps back; only the
+// pointer, set before setjmp and never changed, sits in this frame.
+struct JpegDecoder {
+    jpeg_decompress_struct cinfo;
+    JpegErrorManager error;
+};
+
+struct JpegEncoder {
+    jpeg_compress_struct cinfo;
+    JpegErrorManager error;
+    unsigned char* buffer = nullptr;
+    unsigned long size = 0;
+};
+
+bool decodeJpeg(const std::vector<uint8_t>& data, Image* image, int minWidth, int minHeight) {
+    auto jpeg = std::make_unique<JpegDecoder>();
+    jpeg_decompress_struct& cinfo = jpeg->cinfo;
+    cinfo.err = jpeg_std_error(&jpeg->error.base);
+    jpeg->error.base.error_exit = jpegErrorExit;
+    jpeg->error.base.emit_message = jpegSilentMessage;
+
+    if (setjmp(jpeg->error.jump)) {
+        jpeg_destroy_decompress(&jpeg->cinfo);
+        return false;
+    }
+
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, data.data(), static_cast<unsigned long>(data.size()));
+    jpeg_read_header(&cinfo, TRUE);
+
+    if (static_cast<uint64_t>(cinfo.image_width) * cinfo.image_height > ImageCodec::kMaxPixels) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+
+    cinfo.out_color_space = JCS_RGB;
+    if (minWidth > 0 || minHeight > 0) {
+        for (unsigned denom : {8u, 4u, 2u}) {
+            if (cinfo.image_width / denom >= static_cast<unsigned>(minWidth) &&
+                cinfo.image_height / denom >= static_cast<unsigned>(minHeight)) {
+                cinfo.scale_num = 1;
+                cinfo.scale_denom = denom;
+                break;
+            }
+        }
+    }
+    jpeg_start_decompress(&cinfo);
+
+    image->width = static_cast<int>(cinfo.output_width);
+    image->height = static_cast<int>(cinfo.output_height);
+    image->channels = 3;
+    image->pixels.resize(static_cast<size_t>(image->width) * image->height * 3);
+
+    size_t stride = static_cast<size_t>(image->width) * 3;
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = image->pixels.data() + cinfo.output_scanline * stride;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool encodeJpeg(const Image& image, int quality, std::vector<uint8_t>* out) {
+    auto jpeg = std::make_unique<JpegEncoder>();
+    jpeg_compress_struct& cinfo = jpeg->cinfo;
+    cinfo.err = jpeg_std_error(&jpeg->error.base);
+    jpeg->error.base.error_exit = jpegErrorExit;
+    jpeg->error.base.emit_message = jpegSilentMessage;
+
+    if (setjmp(jpeg->error.jump)) {
+        jpeg_destroy_compress(&jpeg->cinfo);
+        std::free(jpeg->buffer);
+        return false;
+    }
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg->buffer, &jpeg->size);
+
+    cinfo.image_width = static_cast<JDIMENSION>(image.width);
+    cinfo.image_height = static_cast<JDIMENSION>(image.height);
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    cinfo.optimize_coding = TRUE;
+    jpeg_start_compress(&cinfo, TRUE);
+
+    size_t stride = static_cast<size_t>(image.width) * 3;
+    while (cinfo.next_scanline < cinfo.image_height) {
+        auto row = const_cast<JSAMPROW>(image.pixels.data() + cinfo.next_scanline * stride);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    out->assign(jpeg->buffer, jpeg->buffer + jpeg->size);
+    std::free(jpeg->buffer);
+    return true;
+}
+
+#endif // IMGSTORE_HAVE_JPEG
+
+#ifdef IMGSTORE_HAVE_PNG
+
+bool decodePng(const std::vector<uint8_t>& data, Image& image) {
+    png_image png;
+    std::memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&png, data.data(), data.size())) {
+        std::cerr << "PNG codec error: " << png.message << std::endl;
+        return false;
+    }
+
+    if (static_cast<uint64_t>(png.width) * png.height > ImageCodec::kMaxPixels) {
+        png_image_free(&png);
+        return false;
+    }
+
+    bool alpha = (png.format & PNG_FORMAT_FLAG_ALPHA) != 0;
+    png.format = alpha ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+
+    image.width = static_cast<int>(png.width);
+    image.height = static_cast<int>(png.height);
+    image.channels = alpha ? 4 : 3;
+    image.pixels.resize(PNG_IMAGE_SIZE(png));
+
+    if (!png_image_finish_read(&png, nullptr, image.pixels.data(), 0, nullptr)) {
+        std::cerr << "PNG codec error: " << png.message << std::endl;
+        png_image_free(&png);
+        return false;
+    }
+    return true;
+}
+
+bool encodePng(const Image& image, std::vector<uint8_t>& out) {
+    png_image png;
+    std::memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    png.width = static_cast<png_uint_32>(image.width);
+    png.height = static_cast<png_uint_32>(image.height);
+    png.format = image.channels == 4 ? PNG_FORMAT_RGBA : PNG_FORMAT_RGB;
+
+    png_alloc_size_t size = 0;
+    if (!png_image_write_get_memory_size(png, size, 0, image.pixels.data(), 0, nullptr)) {
+        std::cerr << "PNG codec error: " << png.message << std::endl;
+        return false;
+    }
+
+    out.resize(size);
+    if (!png_image_write_to_memory(&png, out.data(), &size, 0, image.pixels.data(), 0, nullptr)) {
+        std::cerr << "PNG codec error: " << png.message << std::endl;
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+
+#endif // IMGSTORE_HAVE_PNG
+
+#ifdef IMGSTORE_HAVE_WEBP
+
+bool decodeWebp(const std::vector<uint8_t>& data, Image& image) {
+    WebPBitstreamFeatures features;
+    if (WebPGetFeatures(data.data(), data.size(), &features) != VP8_STATUS_OK || features.has_animation) {
+        return false;
+    }
+    if (static_cast<uint64_t>(features.width) * features.height > ImageCodec::kMaxPixels) {
+        return false;
+    }
+
+    image.width = features.width;
+    image.height = features.height;
+    image.channels = features.has_alpha ? 4 : 3;
+    image.pixels.resize(static_cast<size_t>(image.width) * image.height * image.channels);
+
+    int stride = image.width * image.channels;
+    uint8_t* decoded = features.has_alpha
+        ? WebPDecodeRGBAInto(data.data(), data.size(), image.pixels.data(), image.pixels.size(), stride)
+        : WebPDecodeRGBInto(data.data(), data.size(), image.pixels.data(), image.pixels.size(), stride);
+    return decoded != nullptr;
+}
+
+bool encodeWebp(const Image& image, int quality, std::vector<uint8_t>& out) {
+    uint8_t* buffer = nullptr;
+    int stride = image.width * image.channels;
+    size_t size = image.channels == 4
+        ? WebPEncodeRGBA(image.pixels.data(), image.width, image.height, stride, static_cast<float>(quality), &buffer)
+        : WebPEncodeRGB(image.pixels.data(), image.width, image.height, stride, static_cast<float>(quality), &buffer);
+
+    if (size == 0) {
+        WebPFree(buffer);
+        return false;
+    }
+    out.assign(buffer, buffer + size);
+    WebPFree(buffer);
+    return true;
+}
+
+#endif // IMGSTORE_HAVE_WEBP
+
+#ifdef IMGSTORE_HAVE_AVIF
+
+bool decodeAvif(const std::vector<uint8_t>& data, Image& image) {
+    avifDecoder* decoder = avifDecoderCreate();
+    if (!decoder) {
+        return false;
+    }
+    decoder->imageSizeLimit = static_cast<uint32_t>(ImageCodec::kMaxPixels);
+
+    bool ok = avifDecoderSetIOMemory(decoder, data.data(), data.size()) == AVIF_RESULT_OK &&
+              avifDecoderParse(decoder) == AVIF_RESULT_OK &&
+              avifDecoderNextImage(decoder) == AVIF_RESULT_OK;
+    if (ok) {
+        avifRGBImage rgb;
+        avifRGBImageSetDefaults(&rgb, decoder->image);
+        rgb.depth = 8;
+        rgb.format = decoder->alphaPresent ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
+
+        image.width = static_cast<int>(rgb.width);
+        image.height = static_cast<int>(rgb.height);
+        image.channels = decoder->alphaPresent ? 4 : 3;
+        image.pixels.resize(static_cast<size_t>(image.width) * image.height * image.channels);
+
+        rgb.pixels = image.pixels.data();
+        rgb.rowBytes = static_cast<uint32_t>(image.width * image.channels);
+        ok = avifImageYUVToRGB(decoder->image, &rgb) == AVIF_RESULT_OK;
+    }
+
+    avifDecoderDestroy(decoder);
+    return ok;
+}
+
+bool encodeAvif(const Image& image, int quality, std::vector<uint8_t>& out) {
+    avifImage* avif = avifImageCreate(image.width, image.height, 8, AVIF_PIXEL_FORMAT_YUV420);
+    if (!avif) {
+        return false;
+    }
+
+    avifRGBImage rgb;
+    avifRGBImageSetDefaults(&rgb, avif);
+    rgb.depth = 8;
+    rgb.format = image.channels == 4 ? AVIF_RGB_FORMAT_RGBA : AVIF_RGB_FORMAT_RGB;
+    rgb.pixels = const_cast<uint8_t*>(image.pixels.data());
+    rgb.rowBytes = static_cast<uint32_t>(image.width * image.channels);
+
+    avifEncoder* encoder = nullptr;
+    avifRWData output = AVIF_DATA_EMPTY;
+    bool ok = avifImageRGBToYUV(avif, &rgb) == AVIF_RESULT_OK;
+    if (ok) {
+        encoder = avifEncoderCreate();
+        ok = encoder != nullptr;
+    }
+    if (ok) {
+        // Quantizers rather than `quality` so this builds against libavif 0.11 as well as 1.x
+        int quantizer = (100 - quality) * AVIF_QUANTIZER_WORST_QUALITY / 100;
+        encoder->minQuantizer = quantizer;
+        encoder->maxQuantizer = quantizer;
+        encoder->minQuantizerAlpha = quantizer;
+        encoder->maxQuantizerAlpha = quantizer;
+        encoder->speed = kAvifSpeed;
+        ok = avifEncoderWrite(encoder, avif, &output) == AVIF_RESULT_OK;
+    }
+    if (ok) {
+        out.assign(output.data, output.data + output.size);
+    }
+
+    avifRWDataFree(&output);
+    if (encoder) {
+        avifEncoderDestroy(encoder);
+    }
+    avifImageDestroy(avif);
+    return ok;
+}
+
+#endif // IMGSTORE_HAVE_AVIF
+
+std::string trim(const std::string& value) {
+    size_t begin = value.find_first_not_of(" \t");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    size_t end = value.find_last_not_of(" \t");
+    return value.substr(begin, end - begin + 1);
+}
+
+// q-value of each media type in an Accept header; missing q means 1
+std::vector<std::pair<std::string, double>> parseAccept(const std::string& accept) {
+    std::vector<std::pair<std::string, double>> entries;
+    size_t pos = 0;
+    while (pos <= accept.size()) {
+        size_t comma = accept.find(',', pos);
+        std::string item = accept.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+        pos = comma == std::string::npos ? accept.size() + 1 : comma + 1;
+
+        size_t semicolon = item.find(';');
+        std::string type = trim(item.substr(0, semicolon));
+        std::transform(type.begin(), type.end(), type.begin(),
+                       [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        if (type.empty()) {
+            continue;
+        }
+
+        double q = 1.0;
+        while (semicolon != std::string::npos) {
+            size_t next = item.find(';', semicolon + 1);
+            std::string param = trim(item.substr(semicolon + 1, next == std::string::npos ? std::string::npos
+                                                                                            : next - semicolon - 1));
+            if (param.size() > 2 && (param[0] == 'q' || param[0] == 'Q') && param[1] == '=') {
+                q = std::strtod(param.c_str() + 2, nullptr);
+            }
+            semicolon = next;
+        }
+        entries.emplace_back(type, q);
+    }
+    return entries;
+}
+
+// Composite RGBA over white for formats without an alpha channel
+[[maybe_unused]] Image flattenAlpha(const Image& image) {
+    Image flat;
+    flat.width = image.width;
+    flat.height = image.height;
+    flat.channels = 3;
+    flat.pixels.resize(static_cast<size_t>(image.width) * image.height * 3);
+
+    size_t count = static_cast<size_t>(image.width) * image.height;
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t* src = &image.pixels[i * 4];
+        uint8_t* dst = &flat.pixels[i * 3];
+        unsigned alpha = src[3];
+        for (int c = 0; c < 3; ++c) {
+            dst[c] = static_cast<uint8_t>((src[c] * alpha + 255 * (255 - alpha) + 127) / 255);
+        }
+    }
+    return flat;
+}
+
+} // namespace
+
+ImageFormat ImageCodec::detectFormat(const std::vector<uint8_t>& data) {
+    return ContentSniffer::sniff(data);
+}
+
+bool ImageCodec::canDecode(ImageFormat format) {
+    switch (format) {
+#ifdef IMGSTORE_HAVE_JPEG
+        case ImageFormat::Jpeg:
+            return true;
+#endif
+#ifdef IMGSTORE_HAVE_PNG
+        case ImageFormat::Png:
+            return true;
+#endif
+#ifdef IMGSTORE_HAVE_WEBP
+        case ImageFormat::Webp:
+            return true;
+#endif
+#ifdef IMGSTORE_HAVE_AVIF
+        case ImageFormat::Avif:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+bool ImageCodec::canEncode(ImageFormat format) {
+    return canDecode(format);
+}
+
+std::optional<Image> ImageCodec::decode(const std::vector<uint8_t>& data, [[maybe_unused]] int minWidth,
+                                       [[maybe_unused]] int minHeight) {
+    Image image;
+    bool ok = false;
+
+    switch (detectFormat(data)) {
+#ifdef IMGSTORE_HAVE_JPEG
+        case ImageFormat::Jpeg: {
+            auto decoded = std::make_unique<Image>();
+            ok = decodeJpeg(data, decoded.get(), minWidth, minHeight);
+            image = std::move(*decoded);
+            break;
+        }
+#endif
+#ifdef IMGSTORE_HAVE_PNG
+        case ImageFormat::Png:
+            ok = decodePng(data, image);
+            break;
+#endif
+#ifdef IMGSTORE_HAVE_WEBP
+        case ImageFormat::Webp:
+            ok = decodeWebp(data, image);
+            break;
+#endif
+#ifdef IMGSTORE_HAVE_AVIF
+        case ImageFormat::Avif:
+            ok = decodeAvif(data, image);
+            break;
+#endif
+        default:
+            break;
+    }
+
+    if (!ok || image.width <= 0 || image.height <= 0) {
+        return std::nullopt;
+    }
+    return image;
+}
+
+std::optional<std::vector<uint8_t>> ImageCodec::encode(const Image& image, ImageFormat format, int quality) {
+    std::vector<uint8_t> out;
+    bool ok = false;
+
+    switch (format) {
+#ifdef IMGSTORE_HAVE_JPEG
+        case ImageFormat::Jpeg: {
+            auto result = std::make_unique<std::vector<uint8_t>>();
+            quality = quality > 0 ? quality : kDefaultJpegQuality;
+            if (image.channels == 4) {
+                ok = encodeJpeg(flattenAlpha(image), quality, result.get());
+            } else {
+                ok = encodeJpeg(image, quality, result.get());
+            }
+            out = std::move(*result);
+            break;
+        }
+#endif
+#ifdef IMGSTORE_HAVE_PNG
+        case ImageFormat::Png:
+            ok = encodePng(image, out);
+            break;
+#endif
+#ifdef IMGSTORE_HAVE_WEBP
+        case ImageFormat::Webp:
+            ok = encodeWebp(image, quality > 0 ? quality : kDefaultWebpQuality, out);
+            break;
+#endif
+#ifdef IMGSTORE_HAVE_AVIF
+        case ImageFormat::Avif:
+            ok = encodeAvif(image, quality > 0 ? quality : kDefaultAvifQuality, out);
+            break;
+#endif
+        default:
+            (void)quality;
+            break;
+    }
+
+    if (!ok) {
+        return std::nullopt;
+    }
+    return out;
+}
+
+ImageFormat ImageCodec::negotiate(const std::string& accept, const std::vector<ImageFormat>& candidates) {
+    ImageFormat best = ImageFormat::Unknown;
+    double bestQ = 0.0;
+
+    auto entries = parseAccept(accept);
+    for (ImageFormat candidate : candidates) {
+        if (!canEncode(candidate)) {
+            continue;
+        }
+        std::string type = mimeType(candidate);
+        for (const auto& [entryType, q] : entries) {
+            // Strictly greater keeps the earlier candidate on ties
+            if (entryType == type && q > bestQ) {
+                best = candidate;
+                bestQ = q;
+            }
+        }
+    }
+    return best;
+}
+
+ImageFormat ImageCodec::parseFormat(const std::string& name) {
+    if (name == "jpeg" || name == "jpg") return ImageFormat::Jpeg;
+    if (name == "png") return ImageFormat::Png;
+    if (name == "webp") return ImageFormat::Webp;
+    if (name == "avif") return ImageFormat::Avif;
+    return ImageFormat::Unknown;
+}
+
+std::string ImageCodec::formatName(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::Jpeg: return "jpeg";
+        case ImageFormat::Png:  return "png";
+        case ImageFormat::Gif:  return "gif";
+        case ImageFormat::Bmp:  return "bmp";
+        case ImageFormat::Webp: return "webp";
+        case ImageFormat::Avif: return "avif";
+        case ImageFormat::Heic: return "heic";
+        case ImageFormat::Tiff: return "tiff";
+        case ImageFormat::Ico:  return "ico";
+        case ImageFormat::Svg:  return "svg";
+        case ImageFormat::Jxl:  return "jxl";
+        default:                return "original";
+    }
+}
+
+std::string ImageCodec::mimeType(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::Jpeg: return "image/jpeg";
+        case ImageFormat::Png:  return "image/png";
+        case ImageFormat::Gif:  return "image/gif";
+        case ImageFormat::Bmp:  return "image/bmp";
+        case ImageFormat::Webp: return "image/webp";
+        case ImageFormat::Avif: return "image/avif";
+        case ImageFormat::Heic: return "image/heic";
+        case ImageFormat::Tiff: return "image/tiff";
+        case ImageFormat::Ico:  return "image/x-icon";
+        case ImageFormat::Svg:  return "image/svg+xml";
+        case ImageFormat::Jxl:  return "image/jxl";
+        default:                return "application/octet-stream";
+    }
+}
+
+} // namespace imgstore
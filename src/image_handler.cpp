@@ -1,11 +1,34 @@
 #include "image_handler.h"
 #include "hash_utils.h"
+#include "metrics.h"
+#include "perceptual_hash.h"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <sstream>
 
 namespace imgstore {
 
+namespace {
+
+// Background perceptual hashing; uploads beyond the queue limit hash inline
+constexpr size_t kHashThreads = 2;
+constexpr size_t kHashQueueLimit = 64;
+
+} // namespace
+
 ImageHandler::ImageHandler(std::shared_ptr<StorageManager> storage)
-    : storage_(storage) {}
+    : storage_(storage),
+      validateSeconds_(Metrics::instance().summary("imgstore_upload_validate_seconds",
+                                                   "Time spent checking the structure of uploads")),
+      rejectedCorrupt_(Metrics::instance().counter("imgstore_upload_rejected_total{reason=\"corrupt\"}",
+                                                   "Uploads refused by structural validation, by reason")),
+      rejectedTruncated_(Metrics::instance().counter("imgstore_upload_rejected_total{reason=\"truncated\"}",
+                                                     "Uploads refused by structural validation, by reason")),
+      rejectedUnknown_(Metrics::instance().counter("imgstore_upload_rejected_total{reason=\"unrecognised\"}",
+                                                   "Uploads refused by structural validation, by reason")),
+      phashSeconds_(Metrics::instance().summary("imgstore_similarity_hash_seconds",
+                                                "Time spent computing perceptual hashes")) {}
 
 crow::response ImageHandler::handleUpload(const crow::request& req) {
     try {
@@ -30,6 +53,11 @@ crow::response ImageHandler::handleUpload(const crow::request& req) {
         
         std::cout << "Processing image upload (" << imageData.size() << " bytes)" << std::endl;
 
+        ImageValidator::Result validation;
+        if (auto rejection = validateUpload(imageData, validation)) {
+            return std::move(*rejection);
+        }
+
         // Generate unique ID based on content
         std::string imageId = generateImageId(imageData);
 
@@ -47,6 +75,10 @@ crow::response ImageHandler::handleUpload(const crow::request& req) {
             result["id"] = imageId;
             result["status"] = "uploaded";
             result["size"] = imageData.size();
+            recordChange(ChangeFeed::Type::Upload, imageId);
+            addImageInfo(validation, result);
+            queuePerceptualHash(imageId, std::move(imageData));
+            queuePresetVariants(imageId, result);
             return crow::response(201, result);
         } else {
             return crow::response(500, "Failed to store image");
@@ -57,20 +89,37 @@ crow::response ImageHandler::handleUpload(const crow::request& req) {
     }
 }
 
-crow::response ImageHandler::handleDownload(const std::string& imageId) {
+crow::response ImageHandler::handleDownload(const std::string& imageId, const crow::request& req) {
     try {
-        auto imageData = storage_->retrieveImage(imageId);
+        TransformSpec spec;
+        std::string transformError;
+        bool transform = parseTransform(req, spec, transformError);
+        if (!transformError.empty()) {
+            return invalidTransformResponse(transformError);
+        }
+        if (auto fetched = serveFromPeers(imageId, req, transform)) {
+            return std::move(*fetched);
+        }
+        if (transform) {
+            return serveVariant(imageId, spec, verifyReads_.hashRoutes);
+        }
 
+        StorageManager::ReadStatus status;
+        auto imageData = storage_->retrieveImage(imageId, verifyReads_.hashRoutes, status);
+
+        if (status == StorageManager::ReadStatus::Corrupt) {
+            return corruptImageResponse(imageId);
+        }
         if (!imageData) {
             return crow::response(404, "Image not found");
         }
 
-        // Detect content type
-        std::string contentType = detectContentType(*imageData);
-
         // Create response with image data
         crow::response res(200);
-        res.set_header("Content-Type", contentType);
+        setContentType(res, imageId, *imageData);
+        if (!transcodeFormats_.empty()) {
+            res.set_header("Vary", "Accept");
+        }
         res.body = std::string(imageData->begin(), imageData->end());
         
         return res;
@@ -87,6 +136,11 @@ crow::response ImageHandler::handleDelete(const std::string& imageId) {
         }
 
         if (storage_->deleteImage(imageId)) {
+            recordChange(ChangeFeed::Type::Delete, imageId);
+            if (variants_) {
+                variants_->removeVariants(imageId);
+            }
+
             crow::json::wvalue result;
             result["id"] = imageId;
             result["status"] = "deleted";
@@ -129,6 +183,11 @@ crow::response ImageHandler::handleNamedUpload(const crow::request& req, const s
         
         std::cout << "Processing named upload: '" << imageName << "' (" << imageData.size() << " bytes)" << std::endl;
 
+        ImageValidator::Result validation;
+        if (auto rejection = validateUpload(imageData, validation)) {
+            return std::move(*rejection);
+        }
+
         // Generate unique ID based on content
         std::string imageHash = generateImageId(imageData);
 
@@ -142,17 +201,26 @@ crow::response ImageHandler::handleNamedUpload(const crow::request& req, const s
             if (!storage_->storeImage(imageHash, imageData)) {
                 return crow::response(500, "Failed to store image");
             }
+            recordChange(ChangeFeed::Type::Upload, imageHash);
         }
 
         // Store or update the name mapping
         if (!storage_->storeNameMapping(imageName, imageHash)) {
             return crow::response(500, "Failed to store name mapping");
         }
+        if (!nameExists || existingHash != imageHash) {
+            recordChange(ChangeFeed::Type::Name, imageHash, imageName);
+        }
 
         crow::json::wvalue result;
         result["name"] = imageName;
         result["hash"] = imageHash;
         result["size"] = imageData.size();
+        addImageInfo(validation, result);
+        if (!imageStored) {
+            queuePerceptualHash(imageHash, imageData);
+            queuePresetVariants(imageHash, result);
+        }
         
         if (nameExists) {
             result["status"] = "updated";
@@ -168,8 +236,15 @@ crow::response ImageHandler::handleNamedUpload(const crow::request& req, const s
     }
 }
 
-crow::response ImageHandler::handleNamedDownload(const std::string& imageName) {
+crow::response ImageHandler::handleNamedDownload(const std::string& imageName, const crow::request& req) {
     try {
+        TransformSpec spec;
+        std::string transformError;
+        bool transform = parseTransform(req, spec, transformError);
+        if (!transformError.empty()) {
+            return invalidTransformResponse(transformError);
+        }
+
         // Get hash by name
         auto imageHash = storage_->getHashByName(imageName);
         
@@ -177,21 +252,32 @@ crow::response ImageHandler::handleNamedDownload(const std::string& imageName) {
             return crow::response(404, "Image name not found");
         }
 
+        if (transform) {
+            auto res = serveVariant(*imageHash, spec, shouldVerifyName(imageName));
+            res.set_header("X-Image-Hash", *imageHash);
+            res.set_header("X-Image-Name", imageName);
+            return res;
+        }
+
         // Retrieve image data using hash
-        auto imageData = storage_->retrieveImage(*imageHash);
+        StorageManager::ReadStatus status;
+        auto imageData = storage_->retrieveImage(*imageHash, shouldVerifyName(imageName), status);
 
+        if (status == StorageManager::ReadStatus::Corrupt) {
+            return corruptImageResponse(*imageHash);
+        }
         if (!imageData) {
             return crow::response(404, "Image data not found");
         }
 
-        // Detect content type
-        std::string contentType = detectContentType(*imageData);
-
         // Create response with image data
         crow::response res(200);
-        res.set_header("Content-Type", contentType);
+        setContentType(res, *imageHash, *imageData);
         res.set_header("X-Image-Hash", *imageHash);
         res.set_header("X-Image-Name", imageName);
+        if (!transcodeFormats_.empty()) {
+            res.set_header("Vary", "Accept");
+        }
         res.body = std::string(imageData->begin(), imageData->end());
         
         return res;
@@ -214,6 +300,7 @@ crow::response ImageHandler::handleNamedDelete(const std::string& imageName) {
         if (!storage_->deleteNameMapping(imageName)) {
             return crow::response(500, "Failed to delete name mapping");
         }
+        recordChange(ChangeFeed::Type::NameDelete, *imageHash, imageName);
 
         // Note: We don't delete the actual image data as it might be referenced by other names
         // or accessed directly by hash
@@ -258,36 +345,1017 @@ crow::response ImageHandler::handleListNames() {
     }
 }
 
+crow::response ImageHandler::handleMetrics() {
+    crow::response res(200);
+    res.set_header("Content-Type", "text/plain; version=0.0.4");
+    res.body = Metrics::instance().renderPrometheus();
+    return res;
+}
+
+crow::response ImageHandler::handleSimilar(const std::string& imageId, const crow::request& req) {
+    if (!similarity_) {
+        return crow::response(501, "Near-duplicate search is not enabled");
+    }
+
+    int maxDistance = 10;
+    size_t limit = 20;
+    try {
+        if (const char* value = req.url_params.get("distance")) {
+            maxDistance = std::stoi(value);
+        }
+        if (const char* value = req.url_params.get("limit")) {
+            limit = std::stoul(value);
+        }
+    } catch (const std::exception&) {
+        maxDistance = -1;
+    }
+    if (maxDistance < 0 || maxDistance > SimilarityIndex::kMaxDistance || limit == 0 || limit > 1000) {
+        crow::json::wvalue error;
+        error["error"] = "Invalid query";
+        error["message"] = "distance must be 0-" + std::to_string(SimilarityIndex::kMaxDistance) +
+                           " and limit 1-1000";
+        return crow::response(400, error);
+    }
+
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash)) {
+        return crow::response(404, "Image not found");
+    }
+
+    auto phash = similarity_->find(hash);
+    if (!phash) {
+        // Stored before the index was enabled; hash it now
+        auto imageData = storage_->retrieveImage(imageId);
+        if (!imageData) {
+            return crow::response(404, "Image not found");
+        }
+        phash = indexPerceptualHash(imageId, *imageData);
+        if (!phash) {
+            crow::json::wvalue error;
+            error["error"] = "Image could not be decoded";
+            error["id"] = imageId;
+            return crow::response(415, error);
+        }
+    }
+
+    auto matches = similarity_->search(*phash, maxDistance, limit, hash);
+
+    crow::json::wvalue result;
+    result["id"] = imageId;
+    result["phash"] = HashUtils::hashToHex(*phash);
+    result["distance"] = maxDistance;
+    result["count"] = matches.size();
+    result["matches"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < matches.size(); ++i) {
+        result["matches"][i]["id"] = HashUtils::hashToHex(matches[i].id);
+        result["matches"][i]["distance"] = matches[i].distance;
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleRebuildFilters() {
+    if (!storage_->rebuildFilters()) {
+        return crow::response(500, "Failed to rebuild lookup filters");
+    }
+
+    crow::json::wvalue result;
+    result["status"] = "rebuilt";
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleChunkGc() {
+    auto gc = storage_->collectChunkGarbage();
+    if (!gc.completed) {
+        return crow::response(500, "Chunk garbage collection failed");
+    }
+
+    crow::json::wvalue result;
+    result["status"] = "completed";
+    result["manifests"] = gc.manifests;
+    result["chunks_kept"] = gc.chunksKept;
+    result["chunks_removed"] = gc.chunksRemoved;
+    result["bytes_removed"] = gc.bytesRemoved;
+    result["logical_bytes"] = gc.logicalBytes;
+    result["stored_bytes"] = gc.storedBytes;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleListDisks() {
+    auto disks = storage_->diskStatus();
+
+    crow::json::wvalue result;
+    result["rebalancing"] = storage_->disksRebalancing();
+    result["disks"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < disks.size(); ++i) {
+        result["disks"][i]["disk"] = disks[i].disk;
+        result["disks"][i]["path"] = disks[i].path;
+        result["disks"][i]["id"] = disks[i].id;
+        result["disks"][i]["healthy"] = disks[i].healthy;
+        result["disks"][i]["queued"] = disks[i].queued;
+        result["disks"][i]["in_flight"] = disks[i].inFlight;
+        result["disks"][i]["errors"] = disks[i].errors;
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleAddDisk(const crow::request& req) {
+    const char* path = req.url_params.get("path");
+    if (!path || *path == '\0') {
+        return crow::response(400, "Missing path parameter");
+    }
+
+    std::string error;
+    if (!storage_->addDisk(path, error)) {
+        crow::json::wvalue result;
+        result["error"] = error;
+        return crow::response(409, result);
+    }
+
+    crow::json::wvalue result;
+    result["status"] = "added";
+    result["path"] = path;
+    result["rebalancing"] = storage_->disksRebalancing();
+    return crow::response(202, result);
+}
+
+crow::response ImageHandler::handleLayoutStatus() {
+    const auto& layout = storage_->layout();
+    crow::json::wvalue result;
+    result["depth"] = layout.depth;
+    result["width"] = layout.width;
+
+    const auto* migration = storage_->layoutMigration();
+    result["migrating"] = migration && migration->active();
+    if (migration) {
+        auto status = migration->status();
+        result["migration"]["from"]["depth"] = migration->from().depth;
+        result["migration"]["from"]["width"] = migration->from().width;
+        result["migration"]["running"] = status.running;
+        result["migration"]["complete"] = status.complete;
+        result["migration"]["shards"] = status.shards;
+        result["migration"]["shards_done"] = status.shardsDone;
+        result["migration"]["scanned"] = status.scanned;
+        result["migration"]["moved"] = status.moved;
+        result["migration"]["merged"] = status.merged;
+        result["migration"]["errors"] = status.errors;
+        result["migration"]["seconds"] = status.seconds;
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleMirrorStatus() {
+    if (!storage_->hasMirror()) {
+        return crow::response(503, "Storage mirror not configured");
+    }
+
+    auto status = storage_->mirrorStatus();
+    crow::json::wvalue result;
+    result["root"] = status.root;
+    result["mode"] = status.async ? "async" : "sync";
+    result["queued"] = status.queued;
+    result["dropped"] = status.dropped;
+    result["failover_reads"] = status.failoverReads;
+    result["repairing"] = status.repairing;
+    result["last_repair"]["completed"] = status.lastRepair.completed;
+    result["last_repair"]["images_copied"] = status.lastRepair.imagesCopied;
+    result["last_repair"]["images_restored"] = status.lastRepair.imagesRestored;
+    result["last_repair"]["names_copied"] = status.lastRepair.namesCopied;
+    result["last_repair"]["names_restored"] = status.lastRepair.namesRestored;
+    result["last_repair"]["removed"] = status.lastRepair.removed;
+    result["last_repair"]["errors"] = status.lastRepair.errors;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleMirrorRepair() {
+    if (!storage_->hasMirror()) {
+        return crow::response(503, "Storage mirror not configured");
+    }
+
+    crow::json::wvalue result;
+    if (!storage_->triggerMirrorRepair()) {
+        result["status"] = "already_running";
+        return crow::response(409, result);
+    }
+
+    result["status"] = "started";
+    return crow::response(202, result);
+}
+
+crow::response ImageHandler::handleMerkle(const crow::request& req) {
+    const MerkleTree& tree = storage_->merkleTree();
+    crow::json::wvalue result;
+    result["root"] = HashUtils::hashToHex(tree.root());
+    result["buckets"] = MerkleTree::kBuckets;
+
+    if (const char* param = req.url_params.get("children")) {
+        std::stringstream list(param);
+        std::string node;
+        while (std::getline(list, node, ',')) {
+            auto children = tree.children(node == "root" ? "" : node);
+            if (!children) {
+                crow::json::wvalue error;
+                error["error"] = "Unknown hash tree node";
+                error["node"] = node;
+                return crow::response(400, error);
+            }
+            std::string digests;
+            digests.reserve(children->size() * 16);
+            for (uint64_t digest : *children) {
+                digests += HashUtils::hashToHex(digest);
+            }
+            result["children"][node] = digests;
+        }
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleMerkleObjects(const crow::request& req) {
+    std::vector<uint16_t> buckets;
+    std::stringstream list(req.body);
+    std::string prefix;
+    while (list >> prefix) {
+        uint16_t bucket = 0;
+        if (!MerkleTree::parseBucket(prefix, bucket)) {
+            crow::json::wvalue error;
+            error["error"] = "Expected four-digit hash tree leaves";
+            error["leaf"] = prefix;
+            return crow::response(400, error);
+        }
+        buckets.push_back(bucket);
+    }
+
+    auto ids = storage_->imagesInBuckets(buckets);
+    crow::json::wvalue result;
+    result["buckets"] = buckets.size();
+    result["ids"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < ids.size(); ++i) {
+        result["ids"][i] = ids[i];
+    }
+    // Lets a replica that still has one of these images tell a delete from a miss
+    result["deleted"] = crow::json::wvalue::object();
+    for (const auto& [imageId, deletedAt] : storage_->deletesInBuckets(buckets)) {
+        result["deleted"][imageId] = deletedAt;
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleMerkleWritten(const crow::request& req) {
+    crow::json::wvalue result;
+    result["written"] = crow::json::wvalue::object();
+    std::stringstream list(req.body);
+    std::string imageId;
+    while (list >> imageId) {
+        if (auto writtenAt = storage_->imageWrittenAt(imageId)) {
+            result["written"][imageId] = *writtenAt;
+        }
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleMerkleFetch(const crow::request& req) {
+    constexpr size_t kDefaultBytes = 16 * 1024 * 1024;
+    constexpr size_t kMaxBytes = 256 * 1024 * 1024;
+    size_t budget = kDefaultBytes;
+    if (const char* max = req.url_params.get("max")) {
+        try {
+            budget = std::clamp<size_t>(std::stoull(max), 1, kMaxBytes);
+        } catch (const std::exception&) {
+            return crow::response(400, "Invalid max");
+        }
+    }
+
+    // At least one image goes out per response, however large, so a caller always makes progress
+    crow::response res(200);
+    res.set_header("Content-Type", "application/octet-stream");
+    std::stringstream list(req.body);
+    std::string imageId;
+    while (list >> imageId && (res.body.empty() || res.body.size() < budget)) {
+        auto data = storage_->retrieveImage(imageId);
+        if (!data) {
+            res.body += imageId + " -\n";
+            continue;
+        }
+        // The upload time travels with the copy, so it keeps its order against deletes
+        auto writtenAt = storage_->imageWrittenAt(imageId);
+        res.body += imageId + " " + std::to_string(data->size());
+        res.body += writtenAt ? " " + std::to_string(*writtenAt) + "\n" : "\n";
+        res.body.append(data->begin(), data->end());
+    }
+    return res;
+}
+
+crow::response ImageHandler::handleSyncStatus() {
+    if (!sync_) {
+        return crow::response(503, "Anti-entropy sync not configured");
+    }
+
+    auto status = sync_->status();
+    crow::json::wvalue result;
+    result["peers"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < sync_->peers().size(); ++i) {
+        result["peers"][i] = sync_->peers()[i];
+    }
+    result["root"] = HashUtils::hashToHex(storage_->merkleTree().root());
+    result["running"] = status.running;
+    result["rounds"] = status.rounds;
+    result["buckets_differing"] = status.bucketsDiffering;
+    result["objects_pulled"] = status.objectsPulled;
+    result["objects_deleted"] = status.objectsDeleted;
+    result["bytes_pulled"] = status.bytesPulled;
+    result["tree_bytes"] = status.treeBytes;
+    result["peer_errors"] = status.peerErrors;
+    result["last_error"] = status.lastError;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleSyncStart() {
+    if (!sync_) {
+        return crow::response(503, "Anti-entropy sync not configured");
+    }
+
+    crow::json::wvalue result;
+    if (!sync_->trigger()) {
+        result["status"] = "already_running";
+        return crow::response(409, result);
+    }
+
+    result["status"] = "started";
+    return crow::response(202, result);
+}
+
+crow::response ImageHandler::handleFeed(uint64_t since, size_t limit) {
+    if (!feed_) {
+        return crow::response(503, "Change feed not configured");
+    }
+
+    auto page = feed_->read(since, limit);
+    crow::json::wvalue result;
+    result["oldest"] = page.oldest;
+    result["latest"] = page.latest;
+    if (page.expired) {
+        result["error"] = "Cursor is no longer retained";
+        return crow::response(410, result);
+    }
+
+    result["events"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < page.events.size(); ++i) {
+        const auto& event = page.events[i];
+        auto& entry = result["events"][i];
+        entry["seq"] = event.seq;
+        entry["time"] = event.timeMs;
+        entry["type"] = ChangeFeed::typeName(event.type);
+        entry["id"] = event.id;
+        if (!event.name.empty()) {
+            entry["name"] = event.name;
+        }
+    }
+    result["next"] = page.events.empty() ? since : page.events.back().seq;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleBackupList() {
+    if (!backups_) {
+        return crow::response(503, "Backups not configured");
+    }
+
+    auto backups = backups_->list();
+    crow::json::wvalue result;
+    result["backups"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < backups.size(); ++i) {
+        const auto& info = backups[i];
+        auto& entry = result["backups"][i];
+        entry["id"] = info.id;
+        entry["base"] = info.base;
+        entry["state"] = BackupManager::stateName(info.state);
+        entry["created"] = info.created;
+        entry["finished"] = info.finished;
+        entry["seq"] = info.seq;
+        entry["images"] = info.images;
+        entry["images_total"] = info.imagesTotal;
+        entry["names"] = info.names;
+        entry["deleted_images"] = info.deletedImages;
+        entry["deleted_names"] = info.deletedNames;
+        entry["missing"] = info.missing;
+        entry["bytes"] = info.bytes;
+        entry["error"] = info.error;
+    }
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleBackupStart(const crow::request& req) {
+    if (!backups_) {
+        return crow::response(503, "Backups not configured");
+    }
+
+    const char* base = req.url_params.get("base");
+    std::string id;
+    crow::json::wvalue result;
+    switch (backups_->start(base ? base : "", id)) {
+        case BackupManager::StartResult::Started:
+            result["status"] = "started";
+            result["id"] = id;
+            return crow::response(202, result);
+        case BackupManager::StartResult::AlreadyRunning:
+            result["status"] = "already_running";
+            return crow::response(409, result);
+        case BackupManager::StartResult::UnknownBase:
+            result["error"] = "Base backup not found or not complete";
+            return crow::response(404, result);
+        case BackupManager::StartResult::Failed:
+            break;
+    }
+    result["error"] = "Failed to start backup";
+    return crow::response(500, result);
+}
+
+crow::response ImageHandler::handleBackupDownload(const std::string& id) {
+    if (!backups_) {
+        return crow::response(503, "Backups not configured");
+    }
+
+    auto info = backups_->find(id);
+    if (!info) {
+        return crow::response(404, "Backup not found");
+    }
+    auto path = backups_->archivePath(id);
+    if (!path) {
+        crow::json::wvalue result;
+        result["error"] = "Backup is not complete";
+        result["state"] = BackupManager::stateName(info->state);
+        return crow::response(409, result);
+    }
+
+    crow::response res;
+    res.set_static_file_info_unsafe(path->string(), "application/x-tar");
+    res.set_header("Content-Disposition", "attachment; filename=\"" + id + ".tar\"");
+    return res;
+}
+
+crow::response ImageHandler::handleBackupDelete(const std::string& id) {
+    if (!backups_) {
+        return crow::response(503, "Backups not configured");
+    }
+
+    auto info = backups_->find(id);
+    if (!info) {
+        return crow::response(404, "Backup not found");
+    }
+    if (!backups_->remove(id)) {
+        crow::json::wvalue error;
+        error["error"] = "Backup is still running";
+        return crow::response(409, error);
+    }
+
+    crow::json::wvalue result;
+    result["id"] = id;
+    result["status"] = "deleted";
+    return crow::response(200, result);
+}
+
+void ImageHandler::setBackups(std::shared_ptr<BackupManager> backups) {
+    backups_ = backups;
+}
+
+void ImageHandler::setChangeFeed(std::shared_ptr<ChangeFeed> feed) {
+    feed_ = feed;
+}
+
+void ImageHandler::setAntiEntropy(std::shared_ptr<AntiEntropy> sync) {
+    sync_ = sync;
+}
+
+crow::response ImageHandler::handleErasureStatus() {
+    if (!storage_->hasErasure()) {
+        return crow::response(503, "Erasure coding not configured");
+    }
+
+    auto status = storage_->erasureStatus();
+    crow::json::wvalue result;
+    result["data_shards"] = status.dataShards;
+    result["parity_shards"] = status.parityShards;
+    result["roots"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < status.roots.size(); ++i) {
+        result["roots"][i] = status.roots[i];
+    }
+    result["kernel"] = status.kernel;
+    result["rebuild_queue"] = status.queued;
+    result["sweeping"] = status.sweeping;
+    result["last_sweep"]["completed"] = status.lastSweep.completed;
+    result["last_sweep"]["images"] = status.lastSweep.objects;
+    result["last_sweep"]["shards_rebuilt"] = status.lastSweep.shardsRebuilt;
+    result["last_sweep"]["unrecoverable"] = status.lastSweep.unrecoverable;
+    result["last_sweep"]["orphans_removed"] = status.lastSweep.orphansRemoved;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleErasureSweep() {
+    if (!storage_->hasErasure()) {
+        return crow::response(503, "Erasure coding not configured");
+    }
+
+    crow::json::wvalue result;
+    if (!storage_->triggerErasureSweep()) {
+        result["status"] = "already_running";
+        return crow::response(409, result);
+    }
+
+    result["status"] = "started";
+    return crow::response(202, result);
+}
+
+void ImageHandler::setScrubber(std::shared_ptr<IntegrityScrubber> scrubber) {
+    scrubber_ = scrubber;
+}
+
+void ImageHandler::setCluster(std::shared_ptr<Cluster> cluster) {
+    cluster_ = cluster;
+}
+
+void ImageHandler::setPeerFetcher(std::shared_ptr<PeerFetcher> fetcher) {
+    peers_ = fetcher;
+}
+
+bool ImageHandler::keepPeerImage(const std::string& imageId, const std::vector<uint8_t>& data) {
+    if (storage_->deletedAt(imageId)) {
+        return false;
+    }
+    if (!storage_->storeImage(imageId, data)) {
+        return false;
+    }
+    recordChange(ChangeFeed::Type::Upload, imageId);
+    queuePerceptualHash(imageId, data);
+    return true;
+}
+
+crow::response ImageHandler::handleClusterStatus(const crow::request& req) {
+    if (!cluster_) {
+        return crow::response(503, "Cluster mode not configured");
+    }
+
+    auto status = cluster_->status();
+    crow::json::wvalue result;
+    result["self"] = status.self;
+    result["nodes"] = crow::json::wvalue::list();
+    for (size_t i = 0; i < status.nodes.size(); ++i) {
+        result["nodes"][i]["id"] = status.nodes[i].id;
+        result["nodes"][i]["address"] = status.nodes[i].address;
+    }
+    result["replicas"] = status.replicas;
+    result["write_quorum"] = status.writeQuorum;
+    result["read_quorum"] = status.readQuorum;
+    result["virtual_nodes"] = status.virtualNodes;
+    result["mode"] = status.redirect ? "redirect" : "proxy";
+
+    const char* id = req.url_params.get("id");
+    const char* name = req.url_params.get("name");
+    if (id || name) {
+        auto owners = cluster_->owners(id ? Cluster::imageKey(id) : Cluster::nameKey(name));
+        result["owners"] = crow::json::wvalue::list();
+        for (size_t i = 0; i < owners.size(); ++i) {
+            result["owners"][i] = owners[i].id;
+        }
+    }
+    return crow::response(200, result);
+}
+
+void ImageHandler::setTransforms(std::shared_ptr<ImageTransformer> transformer,
+                                 std::shared_ptr<VariantCache> variants) {
+    transformer_ = transformer;
+    variants_ = variants;
+}
+
+void ImageHandler::setTranscodeFormats(const std::vector<ImageFormat>& formats) {
+    transcodeFormats_ = formats;
+}
+
+void ImageHandler::setPresets(const std::map<std::string, TransformSpec>& presets) {
+    presets_ = presets;
+}
+
+void ImageHandler::setVariantPipeline(std::shared_ptr<VariantPipeline> pipeline) {
+    pipeline_ = pipeline;
+}
+
+void ImageHandler::setSimilarityIndex(std::shared_ptr<SimilarityIndex> index) {
+    similarity_ = index;
+    if (similarity_ && !hashPool_) {
+        hashPool_ = std::make_unique<IoExecutor>(kHashThreads, "similarity_pool");
+    }
+}
+
+void ImageHandler::setReadVerification(const ReadVerifyConfig& config) {
+    verifyReads_ = config;
+}
+
+void ImageHandler::setUploadValidation(bool enabled, bool rejectUnknown) {
+    validateUploads_ = enabled;
+    rejectUnknownUploads_ = enabled && rejectUnknown;
+}
+
+std::optional<crow::response> ImageHandler::validateUpload(const std::vector<uint8_t>& data,
+                                                           ImageValidator::Result& result) {
+    if (!validateUploads_) {
+        return std::nullopt;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    result = ImageValidator::validate(data);
+    validateSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    switch (result.verdict) {
+        case ImageValidator::Verdict::Valid:
+            return std::nullopt;
+        case ImageValidator::Verdict::Unchecked:
+            // The validator only looks at a short prefix; text formats such as
+            // SVG need the sniffer's full window
+            if (!rejectUnknownUploads_ || ContentSniffer::sniff(data) != ImageFormat::Unknown) {
+                return std::nullopt;
+            }
+            rejectedUnknown_.increment();
+            {
+                crow::json::wvalue error;
+                error["error"] = "Unsupported media type";
+                error["message"] = "Content is not a recognised image format";
+                return crow::response(415, error);
+            }
+        case ImageValidator::Verdict::Truncated:
+            rejectedTruncated_.increment();
+            break;
+        case ImageValidator::Verdict::Corrupt:
+            rejectedCorrupt_.increment();
+            break;
+    }
+
+    std::cerr << "Upload rejected (" << ImageValidator::verdictName(result.verdict) << "): "
+              << result.error << std::endl;
+    crow::json::wvalue error;
+    error["error"] = "Invalid image";
+    error["reason"] = ImageValidator::verdictName(result.verdict);
+    error["message"] = result.error;
+    return crow::response(400, error);
+}
+
+std::optional<uint64_t> ImageHandler::indexPerceptualHash(const std::string& imageId,
+                                                         const std::vector<uint8_t>& data) {
+    uint64_t hash = 0;
+    if (!similarity_ || !HashUtils::hexToHash(imageId, hash)) {
+        return std::nullopt;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto phash = PerceptualHash::compute(data);
+    phashSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    if (phash) {
+        similarity_->add(hash, *phash);
+    }
+    return phash;
+}
+
+void ImageHandler::queuePerceptualHash(const std::string& imageId, std::vector<uint8_t> data) {
+    if (!similarity_) {
+        return;
+    }
+    if (!hashPool_ || hashPool_->queueDepth() >= kHashQueueLimit) {
+        indexPerceptualHash(imageId, data);
+        return;
+    }
+    hashPool_->submit([this, imageId, data = std::move(data)]() {
+        indexPerceptualHash(imageId, data);
+        // Deleted while queued: the delete already cleared the entry it expected
+        if (!storage_->imageExists(imageId)) {
+            uint64_t hash = 0;
+            if (HashUtils::hexToHash(imageId, hash)) {
+                similarity_->remove(hash);
+            }
+        }
+    });
+}
+
+void ImageHandler::addImageInfo(const ImageValidator::Result& validation, crow::json::wvalue& result) {
+    if (validation.verdict != ImageValidator::Verdict::Valid) {
+        return;
+    }
+    result["image"]["format"] = ImageCodec::formatName(validation.format);
+    result["image"]["width"] = validation.width;
+    result["image"]["height"] = validation.height;
+    result["image"]["frames"] = validation.frames;
+}
+
+bool ImageHandler::shouldVerifyName(const std::string& imageName) const {
+    if (verifyReads_.namedRoutes) {
+        return true;
+    }
+    for (const auto& prefix : verifyReads_.namePrefixes) {
+        if (imageName.compare(0, prefix.size(), prefix) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ImageHandler::parseTransform(const crow::request& req, TransformSpec& spec, std::string& error) const {
+    bool present = false;
+    for (const char* param : {"w", "h", "fit", "q"}) {
+        const char* value = req.url_params.get(param);
+        if (!value) {
+            continue;
+        }
+        present = true;
+        if (error.empty()) {
+            spec.set(param, value, error);
+        }
+    }
+
+    if (const char* preset = req.url_params.get("preset")) {
+        // Presets are fixed so that eagerly generated variants get reused
+        if (present) {
+            error = "'preset' cannot be combined with w, h, fit or q";
+            return false;
+        }
+        auto it = presets_.find(preset);
+        if (it == presets_.end()) {
+            error = "Unknown preset '" + std::string(preset) + "'";
+            return false;
+        }
+        spec = it->second;
+        present = true;
+    }
+
+    if (!transcodeFormats_.empty()) {
+        spec.format = ImageCodec::negotiate(req.get_header_value("Accept"), transcodeFormats_);
+        present = present || spec.format != ImageFormat::Unknown;
+    }
+    return present;
+}
+
+crow::response ImageHandler::invalidTransformResponse(const std::string& message) {
+    crow::json::wvalue error;
+    error["error"] = "Invalid transform";
+    error["message"] = message;
+    return crow::response(400, error);
+}
+
+crow::response ImageHandler::serveVariant(const std::string& imageId, const TransformSpec& spec, bool verify) {
+    if (!transformer_ || !variants_) {
+        return crow::response(501, "Image transforms are not enabled");
+    }
+    if (!storage_->imageExists(imageId)) {
+        return crow::response(404, "Image not found");
+    }
+
+    bool cached = false;
+    auto variant = variants_->getOrCreate(imageId, spec.key(), [&]() {
+        return produceVariant(imageId, spec, verify);
+    }, cached);
+
+    const std::vector<uint8_t>* body = &variant->data;
+    std::optional<std::vector<uint8_t>> original;
+
+    switch (variant->status) {
+        case Variant::Status::Ok:
+            break;
+        case Variant::Status::Original:
+            if (variant->data.empty()) {
+                StorageManager::ReadStatus status;
+                original = storage_->retrieveImage(imageId, verify, status);
+                if (status == StorageManager::ReadStatus::Corrupt) {
+                    return corruptImageResponse(imageId);
+                }
+                if (!original) {
+                    return crow::response(404, "Image not found");
+                }
+                body = &*original;
+            }
+            break;
+        case Variant::Status::SourceNotFound:
+            return crow::response(404, "Image not found");
+        case Variant::Status::SourceCorrupt:
+            return corruptImageResponse(imageId);
+        case Variant::Status::Unsupported: {
+            crow::json::wvalue error;
+            error["error"] = "Transforms are not supported for this image format";
+            error["id"] = imageId;
+            return crow::response(415, error);
+        }
+        case Variant::Status::Undecodable: {
+            crow::json::wvalue error;
+            error["error"] = "Image could not be decoded";
+            error["id"] = imageId;
+            return crow::response(415, error);
+        }
+        default:
+            return crow::response(500, "Failed to transform image");
+    }
+
+    crow::response res(200);
+    if (variant->status == Variant::Status::Original) {
+        setContentType(res, imageId, *body);
+    } else {
+        res.set_header("Content-Type", ImageCodec::mimeType(ImageCodec::detectFormat(*body)));
+    }
+    res.set_header("X-Variant-Cache", cached ? "hit" : "miss");
+    if (!transcodeFormats_.empty()) {
+        res.set_header("Vary", "Accept");
+    }
+    res.body = std::string(body->begin(), body->end());
+    return res;
+}
+
+Variant ImageHandler::produceVariant(const std::string& imageId, const TransformSpec& spec, bool verify) {
+    Variant result;
+    StorageManager::ReadStatus status;
+    auto source = storage_->retrieveImage(imageId, verify, status);
+    if (status == StorageManager::ReadStatus::Corrupt) {
+        result.status = Variant::Status::SourceCorrupt;
+        return result;
+    }
+    if (!source) {
+        result.status = Variant::Status::SourceNotFound;
+        return result;
+    }
+
+    // A negotiated format change is only worth serving if it is smaller;
+    // otherwise, or if the source cannot be converted, fall back to it
+    bool convertOnly = !spec.resizes();
+    if (convertOnly && ImageCodec::detectFormat(*source) == spec.format) {
+        result.status = Variant::Status::Original;
+        result.data = std::move(*source);
+        return result;
+    }
+
+    auto outcome = transformer_->apply(*source, spec, result.data);
+    if (convertOnly && (outcome != ImageTransformer::Status::Ok || result.data.size() >= source->size())) {
+        result.status = Variant::Status::Original;
+        result.data = std::move(*source);
+        return result;
+    }
+
+    switch (outcome) {
+        case ImageTransformer::Status::Ok:
+            result.status = Variant::Status::Ok;
+            break;
+        case ImageTransformer::Status::Unsupported:
+            result.status = Variant::Status::Unsupported;
+            break;
+        case ImageTransformer::Status::Undecodable:
+            result.status = Variant::Status::Undecodable;
+            break;
+        default:
+            result.status = Variant::Status::Failed;
+            break;
+    }
+    return result;
+}
+
+void ImageHandler::queuePresetVariants(const std::string& imageId, crow::json::wvalue& result) {
+    if (!pipeline_ || presets_.empty() || !transformer_ || !variants_) {
+        return;
+    }
+
+    // Every preset in the source format first, then in each format Accept
+    // negotiation can pick, so a job cut short by load still leaves the
+    // variants every client can use
+    std::vector<ImageFormat> formats = {ImageFormat::Unknown};
+    formats.insert(formats.end(), transcodeFormats_.begin(), transcodeFormats_.end());
+
+    std::vector<TransformSpec> specs;
+    for (ImageFormat format : formats) {
+        for (const auto& preset : presets_) {
+            specs.push_back(preset.second);
+            specs.back().format = format;
+        }
+    }
+
+    bool queued = pipeline_->submit(imageId, [this, imageId, specs](const std::function<bool()>& shouldStop) {
+        for (const auto& spec : specs) {
+            if (shouldStop()) {
+                return false;
+            }
+            bool cached = false;
+            auto variant = variants_->getOrCreate(imageId, spec.key(), [&]() {
+                return produceVariant(imageId, spec, false);
+            }, cached);
+            if (variant->status == Variant::Status::SourceNotFound) {
+                // Deleted while queued
+                return true;
+            }
+        }
+        return true;
+    });
+    result["variants"] = queued ? "queued" : "deferred";
+}
+
+crow::response ImageHandler::corruptImageResponse(const std::string& imageId) {
+    crow::json::wvalue error;
+    error["error"] = "Image failed integrity check";
+    error["id"] = imageId;
+    error["status"] = "quarantined";
+    return crow::response(500, error);
+}
+
+crow::response ImageHandler::handleScrubStatus() {
+    if (!scrubber_) {
+        return crow::response(503, "Integrity scrubber not available");
+    }
+
+    auto status = scrubber_->status();
+    crow::json::wvalue result;
+    result["running"] = status.running;
+    result["progress"] = status.progress;
+    result["passes_completed"] = status.passesCompleted;
+    result["objects_checked"] = status.objectsChecked;
+    result["bytes_checked"] = status.bytesChecked;
+    result["corrupt_objects"] = status.corruptObjects;
+    result["skipped_objects"] = status.skippedObjects;
+    result["last_corrupt_id"] = status.lastCorruptId;
+    return crow::response(200, result);
+}
+
+crow::response ImageHandler::handleScrubStart() {
+    if (!scrubber_) {
+        return crow::response(503, "Integrity scrubber not available");
+    }
+
+    crow::json::wvalue result;
+    if (!scrubber_->trigger()) {
+        result["status"] = "already_running";
+        return crow::response(409, result);
+    }
+
+    result["status"] = "started";
+    return crow::response(202, result);
+}
+
 std::string ImageHandler::generateImageId(const std::vector<uint8_t>& data) {
     uint64_t hash = HashUtils::xxh3_64(data.data(), data.size());
     return HashUtils::hashToHex(hash);
 }
 
-std::string ImageHandler::detectContentType(const std::vector<uint8_t>& data) {
-    if (data.size() < 4) {
-        return "application/octet-stream";
+std::optional<crow::response> ImageHandler::serveFromPeers(const std::string& imageId, const crow::request& req,
+                                                         bool transform) {
+    // Requests from other nodes are answered from local storage only, so a miss never loops
+    if (!peers_ || !req.get_header_value(PeerClient::kHopHeader).empty() || storage_->imageExists(imageId)) {
+        return std::nullopt;
+    }
+    // A delete here outranks the copies peers have not dropped yet
+    if (storage_->deletedAt(imageId)) {
+        return std::nullopt;
     }
 
-    // Check magic numbers for common image formats
-    if (data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
-        return "image/jpeg";
+    if (peers_->caching()) {
+        peers_->fetch(imageId);
+        return std::nullopt;
     }
-    if (data[0] == 0x89 && data[1] == 0x50 && data[2] == 0x4E && data[3] == 0x47) {
-        return "image/png";
+
+    if (transform) {
+        PeerClient::Headers headers;
+        std::string accept = req.get_header_value("Accept");
+        if (!accept.empty()) {
+            headers.emplace_back("Accept", accept);
+        }
+        auto peer = peers_->relay(imageId, req.raw_url, headers);
+        if (!peer) {
+            return std::nullopt;
+        }
+        crow::response res(peer->status);
+        for (const char* name : {"Content-Type", "Content-Security-Policy", "Vary"}) {
+            std::string value = peer->header(name);
+            if (!value.empty()) {
+                res.set_header(name, value);
+            }
+        }
+        res.body = std::move(peer->body);
+        return res;
     }
-    if (data[0] == 0x47 && data[1] == 0x49 && data[2] == 0x46) {
-        return "image/gif";
+
+    auto imageData = peers_->fetch(imageId);
+    if (!imageData) {
+        return std::nullopt;
     }
-    if (data[0] == 0x42 && data[1] == 0x4D) {
-        return "image/bmp";
+    crow::response res(200);
+    setContentType(res, imageId, *imageData);
+    res.body = std::string(imageData->begin(), imageData->end());
+    return res;
+}
+
+void ImageHandler::recordChange(ChangeFeed::Type type, const std::string& imageId, const std::string& imageName) {
+    if (feed_) {
+        feed_->append(type, imageId, imageName);
     }
-    if (data.size() >= 12 && 
-        data[0] == 0x52 && data[1] == 0x49 && data[2] == 0x46 && data[3] == 0x46 &&
-        data[8] == 0x57 && data[9] == 0x45 && data[10] == 0x42 && data[11] == 0x50) {
-        return "image/webp";
+}
+
+void ImageHandler::setContentType(crow::response& res, const std::string& imageId,
+                                  const std::vector<uint8_t>& data) {
+    ImageFormat format = storage_->getImageFormat(imageId);
+    if (format == ImageFormat::Unknown) {
+        format = ContentSniffer::sniff(data);
     }
+    res.set_header("Content-Type", ImageCodec::mimeType(format));
 
-    return "application/octet-stream";
+    if (format == ImageFormat::Svg) {
+        // Uploaded SVG may carry script; never let it run in this origin
+        res.set_header("Content-Security-Policy", "default-src 'none'; style-src 'unsafe-inline'; sandbox");
+    }
 }
 
 } // namespace imgstore
@@ -0,0 +1,257 @@
+#include "image_resizer.h"
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+namespace imgstore {
+
+namespace {
+
+// One pixel as four float lanes (RGBA; the fourth lane is unused for RGB).
+// GCC/Clang lower this to SSE on x86-64 and NEON on AArch64 without any
+// runtime dispatch.
+typedef float Vec4 __attribute__((vector_size(16)));
+
+constexpr double kLanczosRadius = 3.0;
+constexpr double kPi = 3.14159265358979323846;
+
+// Below this many source pixels a resize is cheaper than starting threads
+constexpr uint64_t kParallelPixelThreshold = 512 * 512;
+constexpr int kMinRowsPerThread = 32;
+
+double lanczos(double x) {
+    x = std::fabs(x);
+    if (x < 1e-8) {
+        return 1.0;
+    }
+    if (x >= kLanczosRadius) {
+        return 0.0;
+    }
+    double px = kPi * x;
+    return kLanczosRadius * std::sin(px) * std::sin(px / kLanczosRadius) / (px * px);
+}
+
+// Filter taps for one axis: output i reads count[i] source samples starting
+// at first[i], weighted by weights[i * maxTaps ...]
+struct Taps {
+    int maxTaps = 0;
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights;
+};
+
+// Map dstSize outputs onto the source span [offset, offset + extent)
+Taps computeTaps(int srcSize, double offset, double extent, int dstSize) {
+    double scale = extent / dstSize;
+    double filterScale = std::max(scale, 1.0);
+    double support = kLanczosRadius * filterScale;
+
+    Taps taps;
+    taps.maxTaps = static_cast<int>(std::ceil(support)) * 2 + 1;
+    taps.first.resize(dstSize);
+    taps.count.resize(dstSize);
+    taps.weights.assign(static_cast<size_t>(dstSize) * taps.maxTaps, 0.0f);
+
+    for (int i = 0; i < dstSize; ++i) {
+        double center = offset + (i + 0.5) * scale;
+        int left = std::max(static_cast<int>(std::floor(center - support)), 0);
+        int right = std::min(static_cast<int>(std::ceil(center + support)), srcSize);
+        right = std::min(right, left + taps.maxTaps);
+
+        float* w = &taps.weights[static_cast<size_t>(i) * taps.maxTaps];
+        double sum = 0.0;
+        for (int j = left; j < right; ++j) {
+            double value = lanczos((j + 0.5 - center) / filterScale);
+            w[j - left] = static_cast<float>(value);
+            sum += value;
+        }
+        if (sum != 0.0) {
+            for (int j = 0; j < right - left; ++j) {
+                w[j] = static_cast<float>(w[j] / sum);
+            }
+        }
+
+        taps.first[i] = left;
+        taps.count[i] = right - left;
+    }
+    return taps;
+}
+
+template <typename Fn>
+void parallelRows(int rows, int threads, Fn&& fn) {
+    int workers = std::min(threads, std::max(1, rows / kMinRowsPerThread));
+    if (workers <= 1) {
+        fn(0, rows);
+        return;
+    }
+
+    int chunk = (rows + workers - 1) / workers;
+    std::vector<std::thread> pool;
+    for (int begin = chunk; begin < rows; begin += chunk) {
+        pool.emplace_back([&fn, begin, end = std::min(begin + chunk, rows)]() { fn(begin, end); });
+    }
+    fn(0, std::min(chunk, rows));
+    for (auto& thread : pool) {
+        thread.join();
+    }
+}
+
+uint8_t toByte(float value) {
+    return static_cast<uint8_t>(std::clamp(value + 0.5f, 0.0f, 255.0f));
+}
+
+} // namespace
+
+ImageResizer::ImageResizer(int threads) : threads_(std::max(threads, 1)) {}
+
+Image ImageResizer::resize(const Image& src, int width, int height, ResizeFit fit) const {
+    const int srcW = src.width;
+    const int srcH = src.height;
+    const int channels = src.channels;
+
+    if (width <= 0 && height <= 0) {
+        width = srcW;
+        height = srcH;
+    }
+
+    // No fit enlarges: a box larger than the source shrinks, keeping its aspect
+    // ratio, until it fits, so a tiny source cannot be blown up to a huge canvas
+    if (width > 0 && height > 0 && fit != ResizeFit::Contain && (width > srcW || height > srcH)) {
+        double shrink = std::min(static_cast<double>(srcW) / width, static_cast<double>(srcH) / height);
+        width = std::max(1, static_cast<int>(std::lround(width * shrink)));
+        height = std::max(1, static_cast<int>(std::lround(height * shrink)));
+    }
+
+    // Source region to sample and output size
+    double cropX = 0.0, cropY = 0.0, cropW = srcW, cropH = srcH;
+    int outW, outH;
+
+    if (width <= 0 || height <= 0) {
+        // One side given: every fit mode reduces to scaling down by that side
+        double scale = width > 0 ? static_cast<double>(width) / srcW : static_cast<double>(height) / srcH;
+        scale = std::min(scale, 1.0);
+        outW = std::max(1, static_cast<int>(std::lround(srcW * scale)));
+        outH = std::max(1, static_cast<int>(std::lround(srcH * scale)));
+    } else if (fit == ResizeFit::Contain) {
+        double scale = std::min({static_cast<double>(width) / srcW, static_cast<double>(height) / srcH, 1.0});
+        outW = std::max(1, static_cast<int>(std::lround(srcW * scale)));
+        outH = std::max(1, static_cast<int>(std::lround(srcH * scale)));
+    } else if (fit == ResizeFit::Cover) {
+        double scale = std::max(static_cast<double>(width) / srcW, static_cast<double>(height) / srcH);
+        outW = width;
+        outH = height;
+        cropW = std::min(width / scale, static_cast<double>(srcW));
+        cropH = std::min(height / scale, static_cast<double>(srcH));
+        cropX = (srcW - cropW) / 2.0;
+        cropY = (srcH - cropH) / 2.0;
+    } else {
+        outW = width;
+        outH = height;
+    }
+
+    Image out;
+    out.width = outW;
+    out.height = outH;
+    out.channels = channels;
+    out.pixels.resize(static_cast<size_t>(outW) * outH * channels);
+
+    Taps hTaps = computeTaps(srcW, cropX, cropW, outW);
+    Taps vTaps = computeTaps(srcH, cropY, cropH, outH);
+
+    // Only the source rows some output row reads need a horizontal pass
+    int rowFirst = vTaps.first.front();
+    int rowLast = rowFirst;
+    for (int y = 0; y < outH; ++y) {
+        rowLast = std::max(rowLast, vTaps.first[y] + vTaps.count[y]);
+    }
+    int rows = rowLast - rowFirst;
+
+    int threads = static_cast<uint64_t>(srcW) * srcH >= kParallelPixelThreshold ? threads_ : 1;
+
+    // Horizontal pass: source rows -> intermediate rows of outW pixels
+    std::vector<Vec4> intermediate(static_cast<size_t>(rows) * outW);
+    parallelRows(rows, threads, [&](int begin, int end) {
+        std::vector<Vec4> line(srcW);
+        for (int r = begin; r < end; ++r) {
+            const uint8_t* in = &src.pixels[static_cast<size_t>(rowFirst + r) * srcW * channels];
+            for (int x = 0; x < srcW; ++x) {
+                const uint8_t* p = in + static_cast<size_t>(x) * channels;
+                Vec4 pixel = {static_cast<float>(p[0]), static_cast<float>(p[1]), static_cast<float>(p[2]), 255.0f};
+                if (channels == 4) {
+                    // Premultiply so transparent pixels do not bleed their colour into edges
+                    float alpha = static_cast<float>(p[3]);
+                    pixel *= alpha * (1.0f / 255.0f);
+                    pixel[3] = alpha;
+                }
+                line[x] = pixel;
+            }
+
+            Vec4* dst = &intermediate[static_cast<size_t>(r) * outW];
+            for (int x = 0; x < outW; ++x) {
+                const float* w = &hTaps.weights[static_cast<size_t>(x) * hTaps.maxTaps];
+                const Vec4* s = &line[hTaps.first[x]];
+                Vec4 acc = {0.0f, 0.0f, 0.0f, 0.0f};
+                for (int t = 0; t < hTaps.count[x]; ++t) {
+                    acc += w[t] * s[t];
+                }
+                dst[x] = acc;
+            }
+        }
+    });
+
+    // Vertical pass: weighted sums of whole intermediate rows
+    parallelRows(outH, threads, [&](int begin, int end) {
+        std::vector<Vec4> acc(outW);
+        for (int y = begin; y < end; ++y) {
+            std::fill(acc.begin(), acc.end(), Vec4{0.0f, 0.0f, 0.0f, 0.0f});
+
+            const float* w = &vTaps.weights[static_cast<size_t>(y) * vTaps.maxTaps];
+            for (int t = 0; t < vTaps.count[y]; ++t) {
+                const Vec4* row = &intermediate[static_cast<size_t>(vTaps.first[y] + t - rowFirst) * outW];
+                const float weight = w[t];
+                for (int x = 0; x < outW; ++x) {
+                    acc[x] += weight * row[x];
+                }
+            }
+
+            uint8_t* dst = &out.pixels[static_cast<size_t>(y) * outW * channels];
+            for (int x = 0; x < outW; ++x) {
+                Vec4 pixel = acc[x];
+                if (channels == 4 && pixel[3] > 0.5f) {
+                    float alpha = pixel[3];
+                    pixel *= 255.0f / alpha;
+                    pixel[3] = alpha;
+                }
+                for (int c = 0; c < channels; ++c) {
+                    dst[static_cast<size_t>(x) * channels + c] = toByte(pixel[c]);
+                }
+            }
+        }
+    });
+
+    return out;
+}
+
+bool ImageResizer::parseFit(const std::string& name, ResizeFit& fit) {
+    if (name == "contain") {
+        fit = ResizeFit::Contain;
+    } else if (name == "cover") {
+        fit = ResizeFit::Cover;
+    } else if (name == "fill") {
+        fit = ResizeFit::Fill;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string ImageResizer::fitName(ResizeFit fit) {
+    switch (fit) {
+        case ResizeFit::Cover: return "cover";
+        case ResizeFit::Fill:  return "fill";
+        default:               return "contain";
+    }
+}
+
+} // namespace imgstore
@@ -0,0 +1,133 @@
+#include "image_transform.h"
+#include <chrono>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+bool parseInt(const std::string& value, int min, int max, int& out) {
+    try {
+        size_t consumed = 0;
+        int parsed = std::stoi(value, &consumed);
+        if (consumed != value.size() || parsed < min || parsed > max) {
+            return false;
+        }
+        out = parsed;
+        return true;
+    } catch (const std::exception&) {
+        return false;
+    }
+}
+
+double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+bool TransformSpec::set(const std::string& param, const std::string& value, std::string& error) {
+    if (param == "w" || param == "h") {
+        int& target = param == "w" ? width : height;
+        if (!parseInt(value, 1, ImageTransformer::kMaxDimension, target)) {
+            error = "'" + param + "' must be between 1 and " + std::to_string(ImageTransformer::kMaxDimension);
+            return false;
+        }
+        return true;
+    }
+    if (param == "q") {
+        if (!parseInt(value, 1, 100, quality)) {
+            error = "'q' must be between 1 and 100";
+            return false;
+        }
+        return true;
+    }
+    if (param == "fit") {
+        if (!ImageResizer::parseFit(value, fit)) {
+            error = "'fit' must be one of contain, cover, fill";
+            return false;
+        }
+        return true;
+    }
+
+    error = "Unknown transform parameter '" + param + "'";
+    return false;
+}
+
+bool TransformSpec::parse(const std::string& params, std::string& error) {
+    size_t pos = 0;
+    while (pos <= params.size()) {
+        size_t end = params.find_first_of(",&", pos);
+        if (end == std::string::npos) {
+            end = params.size();
+        }
+        std::string pair = params.substr(pos, end - pos);
+        pos = end + 1;
+        if (pair.empty()) {
+            continue;
+        }
+
+        size_t eq = pair.find('=');
+        if (eq == std::string::npos) {
+            error = "Expected name=value, got '" + pair + "'";
+            return false;
+        }
+        if (!set(pair.substr(0, eq), pair.substr(eq + 1), error)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string TransformSpec::key() const {
+    return "w=" + std::to_string(width) + "&h=" + std::to_string(height) +
+           "&fit=" + ImageResizer::fitName(fit) +
+           "&q=" + std::to_string(quality) + "&f=" + ImageCodec::formatName(format);
+}
+
+ImageTransformer::ImageTransformer(int threads)
+    : resizer_(threads),
+      decodeSeconds_(Metrics::instance().summary("imgstore_transform_seconds{stage=\"decode\"}",
+                                                 "Time spent producing image variants, by stage")),
+      resizeSeconds_(Metrics::instance().summary("imgstore_transform_seconds{stage=\"resize\"}",
+                                                 "Time spent producing image variants, by stage")),
+      encodeSeconds_(Metrics::instance().summary("imgstore_transform_seconds{stage=\"encode\"}",
+                                                 "Time spent producing image variants, by stage")),
+      failures_(Metrics::instance().counter("imgstore_transform_failures_total",
+                                            "Transforms that failed to decode or encode")) {}
+
+ImageTransformer::Status ImageTransformer::apply(const std::vector<uint8_t>& source, const TransformSpec& spec,
+                                                 std::vector<uint8_t>& out) {
+    ImageFormat sourceFormat = ImageCodec::detectFormat(source);
+    ImageFormat format = spec.format == ImageFormat::Unknown ? sourceFormat : spec.format;
+    if (!ImageCodec::canDecode(sourceFormat) || !ImageCodec::canEncode(format)) {
+        return Status::Unsupported;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto image = ImageCodec::decode(source);
+    decodeSeconds_.observe(secondsSince(start));
+    if (!image) {
+        failures_.increment();
+        return Status::Undecodable;
+    }
+
+    start = std::chrono::steady_clock::now();
+    if (spec.resizes()) {
+        *image = resizer_.resize(*image, spec.width, spec.height, spec.fit);
+        resizeSeconds_.observe(secondsSince(start));
+    }
+
+    start = std::chrono::steady_clock::now();
+    auto encoded = ImageCodec::encode(*image, format, spec.quality);
+    encodeSeconds_.observe(secondsSince(start));
+    if (!encoded) {
+        failures_.increment();
+        return Status::Failed;
+    }
+
+    out = std::move(*encoded);
+    return Status::Ok;
+}
+
+} // namespace imgstore
@@ -0,0 +1,631 @@
+#include "image_validator.h"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+
+namespace imgstore {
+
+namespace {
+
+// Enough for ContentSniffer to tell the validated formats apart
+constexpr size_t kDetectLength = 12;
+
+constexpr uint8_t kPngSignature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+
+constexpr uint32_t fourcc(const char (&s)[5]) {
+    return static_cast<uint32_t>(static_cast<uint8_t>(s[0])) << 24 |
+           static_cast<uint32_t>(static_cast<uint8_t>(s[1])) << 16 |
+           static_cast<uint32_t>(static_cast<uint8_t>(s[2])) << 8 |
+           static_cast<uint32_t>(static_cast<uint8_t>(s[3]));
+}
+
+// CRC-32 (ISO-HDLC, as used by PNG), slicing-by-8 tables built at compile time
+constexpr std::array<std::array<uint32_t, 256>, 8> kCrcTables = [] {
+    std::array<std::array<uint32_t, 256>, 8> tables{};
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        tables[0][i] = c;
+    }
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (size_t s = 1; s < tables.size(); ++s) {
+            tables[s][i] = (tables[s - 1][i] >> 8) ^ tables[0][tables[s - 1][i] & 0xFF];
+        }
+    }
+    return tables;
+}();
+
+uint32_t crc32Update(uint32_t crc, const uint8_t* p, size_t n) {
+    const auto& t = kCrcTables;
+    if constexpr (std::endian::native == std::endian::little) {
+        while (n >= 8) {
+            uint32_t lo;
+            uint32_t hi;
+            std::memcpy(&lo, p, 4);
+            std::memcpy(&hi, p + 4, 4);
+            lo ^= crc;
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+            p += 8;
+            n -= 8;
+        }
+    }
+    while (n-- > 0) {
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+uint16_t readBigEndian16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] << 8 | p[1]);
+}
+
+uint32_t readBigEndian32(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16 |
+           static_cast<uint32_t>(p[2]) << 8 | static_cast<uint32_t>(p[3]);
+}
+
+uint16_t readLittleEndian16(const uint8_t* p) {
+    return static_cast<uint16_t>(p[0] | p[1] << 8);
+}
+
+uint32_t readLittleEndian24(const uint8_t* p) {
+    return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 | static_cast<uint32_t>(p[2]) << 16;
+}
+
+uint32_t readLittleEndian32(const uint8_t* p) {
+    return readLittleEndian24(p) | static_cast<uint32_t>(p[3]) << 24;
+}
+
+bool isLetter(uint8_t c) {
+    return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+}
+
+// SOF0-SOF15, excluding DHT (C4), JPG (C8) and DAC (CC)
+bool isFrameMarker(uint8_t marker) {
+    return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+}
+
+bool validPngDepth(uint8_t colorType, uint8_t depth) {
+    switch (colorType) {
+        case 0: return depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16;
+        case 3: return depth == 1 || depth == 2 || depth == 4 || depth == 8;
+        case 2: case 4: case 6: return depth == 8 || depth == 16;
+        default: return false;
+    }
+}
+
+} // namespace
+
+ImageValidator::ImageValidator() {
+    expect(Stage::Detect, kDetectLength);
+}
+
+ImageValidator::Result ImageValidator::validate(const std::vector<uint8_t>& data) {
+    ImageValidator validator;
+    validator.update(data.data(), data.size());
+    return validator.finish();
+}
+
+const char* ImageValidator::verdictName(Verdict verdict) {
+    switch (verdict) {
+        case Verdict::Valid:     return "valid";
+        case Verdict::Truncated: return "truncated";
+        case Verdict::Corrupt:   return "corrupt";
+        default:                 return "unchecked";
+    }
+}
+
+void ImageValidator::expect(Stage stage, size_t bytes, uint64_t skipFirst) {
+    stage_ = stage;
+    want_ = bytes;
+    skip_ = skipFirst;
+    buffer_.clear();
+}
+
+void ImageValidator::fail(const std::string& error) {
+    stage_ = Stage::Failed;
+    result_.verdict = Verdict::Corrupt;
+    result_.error = error;
+}
+
+void ImageValidator::update(const uint8_t* data, size_t size) {
+    while (stage_ != Stage::Done && stage_ != Stage::Failed) {
+        // A WebP file ends where its RIFF header says, not at a marker
+        if (stage_ == Stage::WebpChunkHeader && skip_ == 0 && buffer_.empty() && position_ >= riffEnd_) {
+            finishWebp();
+            break;
+        }
+        if (size == 0) {
+            break;
+        }
+
+        size_t n;
+        if (skip_ > 0) {
+            n = static_cast<size_t>(std::min<uint64_t>(skip_, size));
+            if (crcActive_) {
+                crc_ = crc32Update(crc_, data, n);
+            }
+            skip_ -= n;
+        } else if (stage_ == Stage::JpegEntropy) {
+            n = scanEntropy(data, size);
+        } else {
+            n = std::min(want_ - buffer_.size(), size);
+            buffer_.insert(buffer_.end(), data, data + n);
+        }
+
+        data += n;
+        size -= n;
+        position_ += n;
+
+        if (skip_ == 0 && stage_ != Stage::JpegEntropy && buffer_.size() == want_ && want_ > 0) {
+            step();
+        }
+    }
+}
+
+ImageValidator::Result ImageValidator::finish() {
+    if (stage_ == Stage::Detect) {
+        // Shorter than the detection window
+        startFormat();
+    }
+    update(nullptr, 0);
+
+    if (stage_ != Stage::Done && stage_ != Stage::Failed) {
+        result_.verdict = Verdict::Truncated;
+        result_.error = "Image data ends before the end of the image";
+    }
+    return result_;
+}
+
+void ImageValidator::step() {
+    switch (stage_) {
+        case Stage::Detect:
+            startFormat();
+            break;
+        case Stage::PngSignature: case Stage::PngChunkHeader: case Stage::PngChunkBody: case Stage::PngCrc:
+            stepPng();
+            break;
+        case Stage::JpegSoi: case Stage::JpegMarkerPrefix: case Stage::JpegMarkerCode:
+        case Stage::JpegLength: case Stage::JpegFrameHeader:
+            stepJpeg();
+            break;
+        case Stage::GifHeader: case Stage::GifBlock: case Stage::GifExtensionLabel:
+        case Stage::GifImageDescriptor: case Stage::GifLzwCodeSize: case Stage::GifSubBlock:
+            stepGif();
+            break;
+        case Stage::WebpHeader: case Stage::WebpChunkHeader: case Stage::WebpChunkHead:
+            stepWebp();
+            break;
+        default:
+            break;
+    }
+}
+
+void ImageValidator::startFormat() {
+    // Replay the detection window through the format's own parser
+    std::vector<uint8_t> head = std::move(buffer_);
+    buffer_.clear();
+    position_ = 0;
+    result_.format = ContentSniffer::sniff(head);
+
+    switch (result_.format) {
+        case ImageFormat::Png:
+            expect(Stage::PngSignature, sizeof(kPngSignature));
+            break;
+        case ImageFormat::Jpeg:
+            expect(Stage::JpegSoi, 2);
+            break;
+        case ImageFormat::Gif:
+            expect(Stage::GifHeader, 13);
+            break;
+        case ImageFormat::Webp:
+            expect(Stage::WebpHeader, 12);
+            break;
+        default:
+            stage_ = Stage::Done;
+            result_.verdict = Verdict::Unchecked;
+            return;
+    }
+    update(head.data(), head.size());
+}
+
+void ImageValidator::stepPng() {
+    const uint8_t* b = buffer_.data();
+
+    switch (stage_) {
+        case Stage::PngSignature:
+            if (std::memcmp(b, kPngSignature, sizeof(kPngSignature)) != 0) {
+                fail("Invalid PNG signature");
+                return;
+            }
+            expect(Stage::PngChunkHeader, 8);
+            return;
+
+        case Stage::PngChunkHeader: {
+            uint32_t length = readBigEndian32(b);
+            chunkType_ = readBigEndian32(b + 4);
+            if (length > 0x7FFFFFFFu) {
+                fail("PNG chunk length out of range");
+                return;
+            }
+            if (!isLetter(b[4]) || !isLetter(b[5]) || !isLetter(b[6]) || !isLetter(b[7])) {
+                fail("Invalid PNG chunk type");
+                return;
+            }
+            bool first = position_ == sizeof(kPngSignature) + 8;
+            if (first != (chunkType_ == fourcc("IHDR"))) {
+                fail("PNG must start with exactly one IHDR chunk");
+                return;
+            }
+
+            crc_ = crc32Update(0xFFFFFFFFu, b + 4, 4);
+            if (chunkType_ == fourcc("IDAT")) {
+                seenIdat_ = true;
+            }
+
+            // Only the small header chunks are buffered; everything else is
+            // checksummed as it streams past
+            if (chunkType_ == fourcc("IHDR") || chunkType_ == fourcc("acTL")) {
+                if (length != (chunkType_ == fourcc("IHDR") ? 13u : 8u)) {
+                    fail("Invalid PNG header chunk length");
+                    return;
+                }
+                crcActive_ = false;
+                expect(Stage::PngChunkBody, length);
+            } else {
+                crcActive_ = true;
+                expect(Stage::PngCrc, 4, length);
+            }
+            return;
+        }
+
+        case Stage::PngChunkBody:
+            crc_ = crc32Update(crc_, b, buffer_.size());
+            if (chunkType_ == fourcc("IHDR")) {
+                result_.width = readBigEndian32(b);
+                result_.height = readBigEndian32(b + 4);
+                result_.frames = 1;
+                if (result_.width == 0 || result_.height == 0 ||
+                    result_.width > 0x7FFFFFFFu || result_.height > 0x7FFFFFFFu) {
+                    fail("Invalid PNG dimensions");
+                    return;
+                }
+                if (!validPngDepth(b[9], b[8]) || b[10] != 0 || b[11] != 0 || b[12] > 1) {
+                    fail("Invalid PNG header fields");
+                    return;
+                }
+            } else {
+                // acTL: animated PNG frame count
+                result_.frames = readBigEndian32(b);
+                if (result_.frames == 0) {
+                    fail("Animated PNG declares no frames");
+                    return;
+                }
+            }
+            expect(Stage::PngCrc, 4);
+            return;
+
+        case Stage::PngCrc:
+            crcActive_ = false;
+            if ((crc_ ^ 0xFFFFFFFFu) != readBigEndian32(b)) {
+                fail("PNG chunk CRC mismatch");
+                return;
+            }
+            if (chunkType_ == fourcc("IEND")) {
+                if (!seenIdat_) {
+                    fail("PNG has no image data");
+                    return;
+                }
+                stage_ = Stage::Done;
+                result_.verdict = Verdict::Valid;
+                return;
+            }
+            expect(Stage::PngChunkHeader, 8);
+            return;
+
+        default:
+            return;
+    }
+}
+
+void ImageValidator::stepJpeg() {
+    const uint8_t* b = buffer_.data();
+
+    switch (stage_) {
+        case Stage::JpegSoi:
+            if (b[0] != 0xFF || b[1] != 0xD8) {
+                fail("Invalid JPEG start of image");
+                return;
+            }
+            expect(Stage::JpegMarkerPrefix, 1);
+            return;
+
+        case Stage::JpegMarkerPrefix:
+            if (b[0] != 0xFF) {
+                fail("Expected a JPEG marker");
+                return;
+            }
+            expect(Stage::JpegMarkerCode, 1);
+            return;
+
+        case Stage::JpegMarkerCode:
+            if (b[0] == 0xFF) {
+                expect(Stage::JpegMarkerCode, 1); // fill byte
+                return;
+            }
+            jpegMarker(b[0]);
+            return;
+
+        case Stage::JpegLength: {
+            uint16_t length = readBigEndian16(b);
+            if (length < 2) {
+                fail("Invalid JPEG segment length");
+                return;
+            }
+            uint64_t payload = length - 2u;
+
+            if (isFrameMarker(marker_)) {
+                if (payload < 6) {
+                    fail("JPEG frame header too short");
+                    return;
+                }
+                remaining_ = payload - 6;
+                expect(Stage::JpegFrameHeader, 6);
+            } else if (marker_ == 0xDA) {
+                if (!seenFrame_) {
+                    fail("JPEG scan before frame header");
+                    return;
+                }
+                seenScan_ = true;
+                entropyMarker_ = false;
+                expect(Stage::JpegEntropy, 0, payload);
+            } else {
+                expect(Stage::JpegMarkerPrefix, 1, payload);
+            }
+            return;
+        }
+
+        case Stage::JpegFrameHeader:
+            if (!seenFrame_) {
+                result_.height = readBigEndian16(b + 1);
+                result_.width = readBigEndian16(b + 3);
+                result_.frames = 1;
+            }
+            if (readBigEndian16(b + 3) == 0 || b[5] == 0) {
+                fail("Invalid JPEG frame header");
+                return;
+            }
+            seenFrame_ = true;
+            expect(Stage::JpegMarkerPrefix, 1, remaining_);
+            return;
+
+        default:
+            return;
+    }
+}
+
+void ImageValidator::jpegMarker(uint8_t marker) {
+    marker_ = marker;
+
+    if (marker == 0x00 || marker == 0xD8) {
+        fail("Unexpected JPEG marker");
+    } else if (marker == 0xD9) {
+        if (!seenFrame_ || !seenScan_) {
+            fail("JPEG ends before any image data");
+            return;
+        }
+        stage_ = Stage::Done;
+        result_.verdict = Verdict::Valid;
+    } else if ((marker >= 0xD0 && marker <= 0xD7) || marker == 0x01) {
+        expect(Stage::JpegMarkerPrefix, 1); // standalone, no length
+    } else {
+        expect(Stage::JpegLength, 2);
+    }
+}
+
+size_t ImageValidator::scanEntropy(const uint8_t* data, size_t size) {
+    // Entropy-coded data has no length; it runs until a 0xFF that is not
+    // stuffing (FF 00), a restart marker or fill
+    size_t i = 0;
+    while (i < size) {
+        if (entropyMarker_) {
+            uint8_t byte = data[i++];
+            if (byte == 0xFF) {
+                continue;
+            }
+            entropyMarker_ = false;
+            if (byte == 0x00 || (byte >= 0xD0 && byte <= 0xD7)) {
+                continue;
+            }
+            jpegMarker(byte);
+            return i;
+        }
+
+        const void* found = std::memchr(data + i, 0xFF, size - i);
+        if (!found) {
+            return size;
+        }
+        i = static_cast<size_t>(static_cast<const uint8_t*>(found) - data) + 1;
+        entropyMarker_ = true;
+    }
+    return i;
+}
+
+void ImageValidator::stepGif() {
+    const uint8_t* b = buffer_.data();
+
+    switch (stage_) {
+        case Stage::GifHeader: {
+            if (std::memcmp(b, "GIF87a", 6) != 0 && std::memcmp(b, "GIF89a", 6) != 0) {
+                fail("Invalid GIF signature");
+                return;
+            }
+            result_.width = readLittleEndian16(b + 6);
+            result_.height = readLittleEndian16(b + 8);
+            uint8_t flags = b[10];
+            uint64_t colorTable = (flags & 0x80) ? 3u << ((flags & 0x07) + 1) : 0;
+            expect(Stage::GifBlock, 1, colorTable);
+            return;
+        }
+
+        case Stage::GifBlock:
+            if (b[0] == 0x21) {
+                expect(Stage::GifExtensionLabel, 1);
+            } else if (b[0] == 0x2C) {
+                expect(Stage::GifImageDescriptor, 9);
+            } else if (b[0] == 0x3B) {
+                if (result_.frames == 0) {
+                    fail("GIF has no frames");
+                    return;
+                }
+                stage_ = Stage::Done;
+                result_.verdict = Verdict::Valid;
+            } else {
+                fail("Invalid GIF block");
+            }
+            return;
+
+        case Stage::GifExtensionLabel:
+            expect(Stage::GifSubBlock, 1);
+            return;
+
+        case Stage::GifImageDescriptor: {
+            uint8_t flags = b[8];
+            uint64_t colorTable = (flags & 0x80) ? 3u << ((flags & 0x07) + 1) : 0;
+            ++result_.frames;
+            if (result_.width == 0 || result_.height == 0) {
+                // Some encoders leave the logical screen empty
+                result_.width = std::max<uint32_t>(result_.width, readLittleEndian16(b + 4));
+                result_.height = std::max<uint32_t>(result_.height, readLittleEndian16(b + 6));
+            }
+            expect(Stage::GifLzwCodeSize, 1, colorTable);
+            return;
+        }
+
+        case Stage::GifLzwCodeSize:
+            if (b[0] == 0 || b[0] > 11) {
+                fail("Invalid GIF LZW code size");
+                return;
+            }
+            expect(Stage::GifSubBlock, 1);
+            return;
+
+        case Stage::GifSubBlock:
+            if (b[0] == 0) {
+                expect(Stage::GifBlock, 1);
+            } else {
+                expect(Stage::GifSubBlock, 1, b[0]);
+            }
+            return;
+
+        default:
+            return;
+    }
+}
+
+void ImageValidator::stepWebp() {
+    const uint8_t* b = buffer_.data();
+
+    switch (stage_) {
+        case Stage::WebpHeader: {
+            if (std::memcmp(b, "RIFF", 4) != 0 || std::memcmp(b + 8, "WEBP", 4) != 0) {
+                fail("Invalid WebP RIFF header");
+                return;
+            }
+            uint32_t riffSize = readLittleEndian32(b + 4);
+            if (riffSize < 4 + 8) {
+                fail("WebP RIFF container too small");
+                return;
+            }
+            riffEnd_ = 8ull + riffSize;
+            expect(Stage::WebpChunkHeader, 8);
+            return;
+        }
+
+        case Stage::WebpChunkHeader: {
+            webpChunk_ = readBigEndian32(b);
+            uint32_t size = readLittleEndian32(b + 4);
+            uint64_t padded = size + (size & 1u);
+            if (position_ + padded > riffEnd_) {
+                fail("WebP chunk overruns the RIFF container");
+                return;
+            }
+
+            size_t head = 0;
+            if (webpChunk_ == fourcc("VP8 ") || webpChunk_ == fourcc("VP8X")) {
+                head = 10;
+            } else if (webpChunk_ == fourcc("VP8L")) {
+                head = 5;
+            } else if (webpChunk_ == fourcc("ANMF")) {
+                head = 16;
+            }
+
+            if (head == 0) {
+                expect(Stage::WebpChunkHeader, 8, padded);
+                return;
+            }
+            if (size < head) {
+                fail("WebP chunk too short");
+                return;
+            }
+            remaining_ = padded - head;
+            expect(Stage::WebpChunkHead, head);
+            return;
+        }
+
+        case Stage::WebpChunkHead:
+            if (webpChunk_ == fourcc("VP8X")) {
+                webpAnimated_ = (b[0] & 0x02) != 0;
+                result_.width = 1 + readLittleEndian24(b + 4);
+                result_.height = 1 + readLittleEndian24(b + 7);
+            } else if (webpChunk_ == fourcc("ANMF")) {
+                ++result_.frames;
+                seenWebpImage_ = true;
+            } else if (webpChunk_ == fourcc("VP8L")) {
+                if (b[0] != 0x2F) {
+                    fail("Invalid VP8L signature");
+                    return;
+                }
+                uint32_t bits = readLittleEndian32(b + 1);
+                if (result_.width == 0) {
+                    result_.width = (bits & 0x3FFF) + 1;
+                    result_.height = ((bits >> 14) & 0x3FFF) + 1;
+                }
+                seenWebpImage_ = true;
+            } else {
+                // VP8: 3-byte frame tag, then the key frame start code
+                if ((b[0] & 0x01) != 0 || b[3] != 0x9D || b[4] != 0x01 || b[5] != 0x2A) {
+                    fail("Invalid VP8 key frame header");
+                    return;
+                }
+                if (result_.width == 0) {
+                    result_.width = readLittleEndian16(b + 6) & 0x3FFF;
+                    result_.height = readLittleEndian16(b + 8) & 0x3FFF;
+                }
+                seenWebpImage_ = true;
+            }
+            expect(Stage::WebpChunkHeader, 8, remaining_);
+            return;
+
+        default:
+            return;
+    }
+}
+
+void ImageValidator::finishWebp() {
+    if (!seenWebpImage_) {
+        fail("WebP has no image data");
+        return;
+    }
+    if (!webpAnimated_ || result_.frames == 0) {
+        result_.frames = 1;
+    }
+    stage_ = Stage::Done;
+    result_.verdict = Verdict::Valid;
+}
+
+} // namespace imgstore
@@ -0,0 +1,133 @@
+#include "io_executor.h"
+#include <algorithm>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+// Set on pool threads so nested submissions stay on the submitting worker
+thread_local const IoExecutor* currentExecutor = nullptr;
+thread_local size_t currentWorker = 0;
+
+} // namespace
+
+IoExecutor::IoExecutor(size_t threads, const std::string& name)
+    : name_("imgstore_" + name),
+      waitSeconds_(Metrics::instance().summary(name_ + "_queue_wait_seconds",
+                                               "Time tasks spent queued before a worker picked them up")),
+      runSeconds_(Metrics::instance().summary(name_ + "_task_seconds", "Time tasks spent running on a worker")),
+      steals_(Metrics::instance().counter(name_ + "_steals_total", "Tasks taken from another worker's queue")) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        workers_.push_back(std::make_unique<Worker>());
+    }
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&IoExecutor::workerLoop, this, i);
+    }
+
+    Metrics::instance().callbackGauge(name_ + "_queue_depth", "Tasks waiting for a worker",
+                                      [this]() { return static_cast<double>(queueDepth()); });
+    Metrics::instance().callbackGauge(name_ + "_active_tasks", "Tasks currently running",
+                                      [this]() { return static_cast<double>(active_.load()); });
+    Metrics::instance().gauge(name_ + "_threads", "Worker threads in the pool").set(static_cast<double>(threads));
+}
+
+IoExecutor::~IoExecutor() {
+    shutdown();
+    Metrics::instance().callbackGauge(name_ + "_queue_depth", "", nullptr);
+    Metrics::instance().callbackGauge(name_ + "_active_tasks", "", nullptr);
+}
+
+void IoExecutor::submit(std::function<void()> task) {
+    size_t target = currentExecutor == this
+        ? currentWorker
+        : nextQueue_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+
+    // Count before publishing so a fast worker never decrements below zero
+    pending_.fetch_add(1);
+    {
+        std::lock_guard<std::mutex> lock(workers_[target]->mutex);
+        workers_[target]->queue.push_back({std::move(task), std::chrono::steady_clock::now()});
+    }
+
+    // Taking the sleep lock orders this notify after any worker's predicate check
+    std::lock_guard<std::mutex> lock(sleepMutex_);
+    cv_.notify_one();
+}
+
+void IoExecutor::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+bool IoExecutor::tryPop(size_t self, Task& task) {
+    {
+        auto& own = *workers_[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.queue.empty()) {
+            task = std::move(own.queue.front());
+            own.queue.pop_front();
+            return true;
+        }
+    }
+
+    // Steal from the back so the owner keeps draining its oldest tasks first
+    for (size_t i = 1; i < workers_.size(); ++i) {
+        auto& victim = *workers_[(self + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.queue.empty()) {
+            task = std::move(victim.queue.back());
+            victim.queue.pop_back();
+            steals_.increment();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void IoExecutor::workerLoop(size_t index) {
+    currentExecutor = this;
+    currentWorker = index;
+
+    while (true) {
+        Task task;
+        if (!tryPop(index, task)) {
+            std::unique_lock<std::mutex> lock(sleepMutex_);
+            cv_.wait(lock, [this]() { return stopping_ || pending_.load() > 0; });
+            if (stopping_ && pending_.load() == 0) {
+                return;
+            }
+            continue;
+        }
+
+        pending_.fetch_sub(1);
+        active_.fetch_add(1);
+
+        auto started = std::chrono::steady_clock::now();
+        waitSeconds_.observe(std::chrono::duration<double>(started - task.enqueued).count());
+
+        try {
+            task.fn();
+        } catch (const std::exception& e) {
+            std::cerr << "I/O task failed: " << e.what() << std::endl;
+        }
+
+        runSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count());
+        active_.fetch_sub(1);
+    }
+}
+
+} // namespace imgstore
@@ -0,0 +1,196 @@
+#include "known_directories.h"
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string_view>
+
+namespace imgstore {
+
+namespace {
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Leaf number contributed by one shard component; the layout checked it is hex
+uint64_t componentValue(const std::string& name) {
+    uint64_t value = 0;
+    for (char c : name) {
+        value = (value << 4) | static_cast<uint64_t>(hexValue(c));
+    }
+    return value;
+}
+
+} // namespace
+
+KnownDirectories::KnownDirectories(const ShardLayout& layout, const std::vector<std::filesystem::path>& roots,
+                                   bool enabled)
+    : layout_(layout),
+      hits_(Metrics::instance().counter("imgstore_known_dirs_hits_total",
+                                        "Writes whose shard directory was known to exist")),
+      misses_(Metrics::instance().counter("imgstore_known_dirs_misses_total",
+                                          "Writes whose shard directory had to be checked or created")) {
+    int bits = layout.depth * layout.width * 4;
+    if (enabled && bits > kMaxBits) {
+        std::cerr << "Known-directory map disabled: " << layout.describe() << " has more than 2^" << kMaxBits
+                  << " shard directories" << std::endl;
+    }
+    if (enabled && bits <= kMaxBits) {
+        words_ = std::max<size_t>((size_t{1} << bits) / 64, 1);
+        for (const auto& root : roots) {
+            Root tracked;
+            tracked.path = root.native();
+            tracked.words = std::make_unique<std::atomic<uint64_t>[]>(words_);
+            roots_.push_back(std::move(tracked));
+        }
+    }
+
+    Metrics::instance().callbackGauge("imgstore_known_dirs", "Shard directories known to exist",
+                                      [this]() { return static_cast<double>(count_.load()); });
+    Metrics::instance().callbackGauge("imgstore_known_dirs_scan_complete",
+                                      "1 once the startup scan for existing shard directories finished",
+                                      [this]() { return scanned_ ? 1.0 : 0.0; });
+    Metrics::instance().callbackGauge("imgstore_known_dirs_scan_seconds",
+                                      "Time the startup scan for existing shard directories took",
+                                      [this]() { return scanSeconds_.load(); });
+}
+
+KnownDirectories::~KnownDirectories() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_known_dirs", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_known_dirs_scan_complete", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_known_dirs_scan_seconds", "", nullptr);
+}
+
+void KnownDirectories::startScan() {
+    if (!scanners_.empty() || roots_.empty()) {
+        return;
+    }
+
+    // Top-level directories are the unit of work; the default layout has 256 per root
+    struct Work {
+        std::vector<std::pair<Root*, std::filesystem::path>> dirs;
+        std::atomic<size_t> next{0};
+        std::atomic<unsigned> running{0};
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    };
+    auto work = std::make_shared<Work>();
+    for (auto& root : roots_) {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(root.path, ec)) {
+            if (entry.is_directory(ec) && layout_.isComponent(entry.path().filename().string())) {
+                work->dirs.emplace_back(&root, entry.path());
+            }
+        }
+    }
+
+    unsigned threads = std::clamp(std::thread::hardware_concurrency(), 1u, 16u);
+    work->running = threads;
+    for (unsigned t = 0; t < threads; ++t) {
+        scanners_.emplace_back([this, work]() {
+            for (size_t i = work->next++; i < work->dirs.size() && !stopRequested_; i = work->next++) {
+                auto& [root, dir] = work->dirs[i];
+                scanDirectory(*root, dir, 1, componentValue(dir.filename().string()));
+            }
+            if (--work->running == 0 && !stopRequested_) {
+                scanSeconds_ = std::chrono::duration<double>(std::chrono::steady_clock::now() - work->start).count();
+                scanned_ = true;
+            }
+        });
+    }
+}
+
+void KnownDirectories::stop() {
+    stopRequested_ = true;
+    for (auto& scanner : scanners_) {
+        if (scanner.joinable()) {
+            scanner.join();
+        }
+    }
+}
+
+bool KnownDirectories::contains(const std::filesystem::path& dir) const {
+    std::atomic<uint64_t>* word = nullptr;
+    auto mask = bitOf(dir.native(), word);
+    bool known = mask && (word->load(std::memory_order_relaxed) & *mask) != 0;
+    (known ? hits_ : misses_).increment();
+    return known;
+}
+
+void KnownDirectories::add(const std::filesystem::path& dir) {
+    std::atomic<uint64_t>* word = nullptr;
+    if (auto mask = bitOf(dir.native(), word)) {
+        set(*word, *mask);
+    }
+}
+
+std::optional<uint64_t> KnownDirectories::bitOf(const std::string& dir, std::atomic<uint64_t>*& word) const {
+    if (roots_.empty()) {
+        return std::nullopt;
+    }
+    // A leaf directory is its root followed by "/" and a component, depth times
+    size_t tail = static_cast<size_t>(layout_.depth) * (layout_.width + 1);
+    if (dir.size() <= tail) {
+        return std::nullopt;
+    }
+    std::string_view root(dir.data(), dir.size() - tail);
+    auto tracked = std::find_if(roots_.begin(), roots_.end(), [&](const Root& r) { return r.path == root; });
+    if (tracked == roots_.end()) {
+        return std::nullopt;
+    }
+
+    uint64_t leaf = 0;
+    for (size_t i = 0; i < tail; ++i) {
+        char c = dir[root.size() + i];
+        if (i % (layout_.width + 1) == 0) {
+            if (c != '/') {
+                return std::nullopt;
+            }
+            continue;
+        }
+        int value = hexValue(c);
+        if (value < 0) {
+            return std::nullopt;
+        }
+        leaf = (leaf << 4) | static_cast<uint64_t>(value);
+    }
+    word = &tracked->words[leaf / 64];
+    return uint64_t{1} << (leaf % 64);
+}
+
+void KnownDirectories::set(std::atomic<uint64_t>& word, uint64_t mask) {
+    // Checked first so the common case of an already known directory writes nothing
+    if ((word.load(std::memory_order_relaxed) & mask) == 0 &&
+        (word.fetch_or(mask, std::memory_order_relaxed) & mask) == 0) {
+        ++count_;
+    }
+}
+
+void KnownDirectories::scanDirectory(Root& root, const std::filesystem::path& dir, int level, uint64_t leaf) {
+    if (level == layout_.depth) {
+        set(root.words[leaf / 64], uint64_t{1} << (leaf % 64));
+        return;
+    }
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        if (stopRequested_) {
+            return;
+        }
+        std::string name = entry.path().filename().string();
+        if (entry.is_directory(ec) && layout_.isComponent(name)) {
+            scanDirectory(root, entry.path(), level + 1,
+                          (leaf << (4 * layout_.width)) | componentValue(name));
+        }
+    }
+}
+
+} // namespace imgstore
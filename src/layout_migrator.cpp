@@ -0,0 +1,364 @@
+#include "layout_migrator.h"
+#include "hash_utils.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+namespace imgstore {
+
+namespace {
+
+const char* kLayoutFile = "LAYOUT";
+
+// Stores written before the layout was configurable
+constexpr ShardLayout kOriginalLayout{3, 2};
+
+// Strip a layout's shard directories and the leaf to get back the tree root
+std::optional<std::filesystem::path> rootUnder(const ShardLayout& layout, const std::filesystem::path& path,
+                                               const std::string& key) {
+    auto root = path;
+    for (int i = 0; i <= layout.depth; ++i) {
+        root = root.parent_path();
+    }
+    if (layout.pathOf(root, key, path.filename().string()) != path) {
+        return std::nullopt;
+    }
+    return root;
+}
+
+// Rename that fails with EEXIST instead of replacing the target
+bool renameNoReplace(const std::filesystem::path& from, const std::filesystem::path& to, int& error) {
+    if (::renameat2(AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0) {
+        return true;
+    }
+    error = errno;
+    if (error != EINVAL && error != ENOSYS) {
+        return false;
+    }
+    // Filesystems without RENAME_NOREPLACE: a hard link fails the same way for files
+    if (::link(from.c_str(), to.c_str()) == 0) {
+        ::unlink(from.c_str());
+        return true;
+    }
+    error = errno;
+    if (error != EPERM) {
+        return false;
+    }
+    // Directories cannot be linked, but rename refuses to replace one that has entries
+    std::error_code ec;
+    if (std::filesystem::exists(to, ec)) {
+        error = EEXIST;
+        return false;
+    }
+    if (::rename(from.c_str(), to.c_str()) == 0) {
+        return true;
+    }
+    error = errno == ENOTEMPTY ? EEXIST : errno;
+    return false;
+}
+
+void writeLayout(std::ostream& out, const char* kind, const ShardLayout& layout) {
+    out << kind << " " << layout.depth << " " << layout.width << "\n";
+}
+
+} // namespace
+
+LayoutMigrator::LayoutMigrator(const ShardLayout& from, const ShardLayout& to, std::vector<Tree> trees,
+                               double entriesPerSecond, LockFor lockFor, std::function<void()> done)
+    : from_(from), to_(to), trees_(std::move(trees)), limiter_(entriesPerSecond),
+      lockFor_(std::move(lockFor)), done_(std::move(done)),
+      movedTotal_(Metrics::instance().counter("imgstore_layout_moved_total",
+                                              "Entries moved to the new shard layout")),
+      mergedTotal_(Metrics::instance().counter("imgstore_layout_merged_total",
+                                               "Old-layout entries dropped because the new layout already had them")),
+      errorsTotal_(Metrics::instance().counter("imgstore_layout_errors_total",
+                                               "Entries that could not be moved to the new shard layout")) {
+    Metrics::instance().callbackGauge("imgstore_layout_migrating", "1 while entries may be under the old shard layout",
+                                      [this]() { return active() ? 1.0 : 0.0; });
+    Metrics::instance().callbackGauge("imgstore_layout_shards_done_ratio",
+                                      "Share of the old layout's top-level directories migrated", [this]() {
+        uint64_t shards = shards_.load();
+        return complete_ ? 1.0 : shards > 0 ? static_cast<double>(shardsDone_.load()) / shards : 0.0;
+    });
+}
+
+LayoutMigrator::~LayoutMigrator() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_layout_migrating", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_layout_shards_done_ratio", "", nullptr);
+}
+
+void LayoutMigrator::start() {
+    if (thread_.joinable() || complete_) {
+        return;
+    }
+    stopRequested_ = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        started_ = std::chrono::steady_clock::now();
+    }
+    running_ = true;
+    thread_ = std::thread(&LayoutMigrator::run, this);
+}
+
+void LayoutMigrator::stop() {
+    stopRequested_ = true;
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+std::optional<std::filesystem::path> LayoutMigrator::previousPath(const std::filesystem::path& path,
+                                                                  const std::string& key) const {
+    if (complete_) {
+        return std::nullopt;
+    }
+    auto root = rootUnder(to_, path, key);
+    if (!root) {
+        return std::nullopt;
+    }
+    return from_.pathOf(*root, key, path.filename().string());
+}
+
+std::optional<std::filesystem::path> LayoutMigrator::currentPath(const std::filesystem::path& path,
+                                                                 const std::string& key) const {
+    auto root = rootUnder(from_, path, key);
+    if (!root) {
+        return std::nullopt;
+    }
+    return to_.pathOf(*root, key, path.filename().string());
+}
+
+LayoutMigrator::Status LayoutMigrator::status() const {
+    Status status;
+    status.running = running_;
+    status.complete = complete_;
+    status.shards = shards_;
+    status.shardsDone = shardsDone_;
+    status.scanned = scanned_;
+    status.moved = moved_;
+    status.merged = merged_;
+    status.errors = errors_;
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (started_ != std::chrono::steady_clock::time_point{}) {
+        auto end = status.running ? std::chrono::steady_clock::now() : finished_;
+        status.seconds = std::chrono::duration<double>(end - started_).count();
+    }
+    return status;
+}
+
+LayoutMigrator::Stored LayoutMigrator::load(const std::filesystem::path& baseDir) {
+    Stored stored{kOriginalLayout, std::nullopt};
+    std::ifstream file(baseDir / kLayoutFile);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        ShardLayout layout;
+        if (!(fields >> kind >> layout.depth >> layout.width) || !layout.valid()) {
+            continue;
+        }
+        if (kind == "layout") {
+            stored.layout = layout;
+        } else if (kind == "previous") {
+            stored.previous = layout;
+        }
+    }
+    if (stored.previous == stored.layout) {
+        stored.previous.reset();
+    }
+    return stored;
+}
+
+bool LayoutMigrator::save(const std::filesystem::path& baseDir, const Stored& stored) {
+    auto path = baseDir / kLayoutFile;
+    auto temp = path;
+    temp += ".tmp";
+    {
+        std::ofstream file(temp, std::ios::trunc);
+        writeLayout(file, "layout", stored.layout);
+        if (stored.previous) {
+            writeLayout(file, "previous", *stored.previous);
+        }
+        file.flush();
+        if (!file) {
+            std::cerr << "Failed to write shard layout " << temp << std::endl;
+            return false;
+        }
+    }
+
+    // Reads fall back to the old layout only while the file says so; it must not be lost to a crash
+    int fd = ::open(temp.c_str(), O_RDONLY | O_CLOEXEC);
+    bool synced = fd >= 0 && ::fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (!synced || ec) {
+        std::cerr << "Failed to write shard layout " << path << std::endl;
+        return false;
+    }
+    fd = ::open(baseDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+    return true;
+}
+
+void LayoutMigrator::run() {
+    std::cout << "Migrating shard layout from " << from_.describe() << " to " << to_.describe() << std::endl;
+
+    // Counted up front so progress can be reported as a share of the walk
+    uint64_t shards = 0;
+    for (const auto& tree : trees_) {
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(tree.root, ec)) {
+            if (entry.is_directory(ec) && from_.isComponent(entry.path().filename().string())) {
+                ++shards;
+            }
+        }
+    }
+    shards_ = shards;
+
+    uint64_t errorsBefore = errors_;
+    bool completed = true;
+    for (const auto& tree : trees_) {
+        if (!migrateDirectory(tree, tree.root, 0)) {
+            completed = false;
+            break;
+        }
+    }
+
+    if (completed && errors_ == errorsBefore) {
+        complete_ = true;
+        std::cout << "Shard layout migration complete: " << moved_ << " moved, " << merged_ << " merged" << std::endl;
+        if (done_) {
+            done_();
+        }
+    } else if (completed) {
+        std::cerr << "Shard layout migration left " << errors_ - errorsBefore
+                  << " entries behind; it resumes on the next start" << std::endl;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = std::chrono::steady_clock::now();
+    }
+    running_ = false;
+}
+
+bool LayoutMigrator::migrateDirectory(const Tree& tree, const std::filesystem::path& dir, int level) {
+    // Listed before anything moves, so the walk never sees its own renames
+    std::vector<std::filesystem::directory_entry> entries;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        entries.push_back(entry);
+    }
+
+    for (const auto& entry : entries) {
+        if (stopRequested_) {
+            return false;
+        }
+        std::string name = entry.path().filename().string();
+        if (level < from_.depth) {
+            if (!entry.is_directory(ec) || !from_.isComponent(name)) {
+                continue;
+            }
+            if (!migrateDirectory(tree, entry.path(), level + 1)) {
+                return false;
+            }
+            if (level == 0) {
+                ++shardsDone_;
+            }
+            continue;
+        }
+
+        auto key = keyOf(tree.kind, entry);
+        // Entries of the new layout can sit at this level too when only the depth changed
+        if (!key || from_.pathOf(tree.root, *key, name) != entry.path()) {
+            continue;
+        }
+        ++scanned_;
+        limiter_.acquire(1);
+        moveEntry(tree, entry.path(), *key);
+    }
+
+    // Directories the new layout shares stay; writers may be about to use them
+    bool shared = from_.width == to_.width && level <= to_.depth;
+    if (level > 0 && !shared) {
+        std::filesystem::remove(dir, ec);
+    }
+    return true;
+}
+
+void LayoutMigrator::moveEntry(const Tree& tree, const std::filesystem::path& path, const std::string& key) {
+    auto target = to_.pathOf(tree.root, key, path.filename().string());
+    std::error_code ec;
+    std::filesystem::create_directories(target.parent_path(), ec);
+
+    // Deletes of an image take the same lock, so one never misses a copy in flight
+    std::unique_lock<std::mutex> lock;
+    if (tree.kind == Kind::Images) {
+        lock = std::unique_lock<std::mutex>(lockFor_(key));
+    }
+
+    int error = 0;
+    if (renameNoReplace(path, target, error)) {
+        ++moved_;
+        movedTotal_.increment();
+        return;
+    }
+    if (error == ENOENT) {
+        return; // deleted since the listing
+    }
+    if (error == EEXIST) {
+        // Written under the new layout meanwhile; that copy is the newer one
+        std::filesystem::remove_all(path, ec);
+        if (!ec) {
+            ++merged_;
+            mergedTotal_.increment();
+            return;
+        }
+        error = ec.value();
+    }
+    ++errors_;
+    errorsTotal_.increment();
+    std::cerr << "Failed to move " << path << " to " << target << ": " << std::strerror(error) << std::endl;
+}
+
+std::optional<std::string> LayoutMigrator::keyOf(Kind kind, const std::filesystem::directory_entry& entry) {
+    std::error_code ec;
+    std::string name = entry.path().filename().string();
+    uint64_t hash = 0;
+    switch (kind) {
+        case Kind::Images:
+            // Anything else is a temporary file of a write in progress
+            if (entry.is_regular_file(ec) && HashUtils::hexToHash(name, hash)) {
+                return name;
+            }
+            return std::nullopt;
+        case Kind::Names: {
+            const std::string suffix = ".mapping";
+            if (entry.is_regular_file(ec) && name.size() > suffix.size() &&
+                name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0) {
+                return name.substr(0, name.size() - suffix.size());
+            }
+            return std::nullopt;
+        }
+        case Kind::Variants:
+            if (entry.is_directory(ec) && HashUtils::hexToHash(name, hash)) {
+                return name;
+            }
+            return std::nullopt;
+    }
+    return std::nullopt;
+}
+
+} // namespace imgstore
@@ -1,44 +1,356 @@
+#include "bulk_importer.h"
 #include "server.h"
+#include <algorithm>
 #include <iostream>
 #include <string>
 #include <cstdlib>
+#include <vector>
 
 int main(int argc, char* argv[]) {
     // Default configuration
-    std::string storageDir = "./storage";
-    int port = 8080;
-    std::string apiKey;
+    imgstore::ServerConfig config;
 
     // Check for API key in environment variable
     if (const char* envApiKey = std::getenv("IMG_STORE_API_KEY")) {
-        apiKey = envApiKey;
+        config.apiKey = envApiKey;
     }
+    if (const char* envSecret = std::getenv("IMG_STORE_CLUSTER_SECRET")) {
+        config.clusterSecret = envSecret;
+    }
+
+    // `img-store import <source>...` seeds the store offline instead of serving it
+    bool importMode = argc > 1 && std::string(argv[1]) == "import";
+    std::vector<std::string> importSources;
+    bool importNames = false;
 
     // Parse command-line arguments
-    for (int i = 1; i < argc; ++i) {
+    bool customPresets = false;
+    for (int i = importMode ? 2 : 1; i < argc; ++i) {
         std::string arg = argv[i];
         
-        if (arg == "--port" || arg == "-p") {
+        if (importMode && (arg == "-" || arg[0] != '-')) {
+            importSources.push_back(arg);
+        } else if (arg == "--import-names") {
+            importNames = true;
+        } else if (arg == "--port" || arg == "-p") {
             if (i + 1 < argc) {
-                port = std::stoi(argv[++i]);
+                config.port = std::stoi(argv[++i]);
             }
         } else if (arg == "--storage" || arg == "-s") {
             if (i + 1 < argc) {
-                storageDir = argv[++i];
+                config.storageDir = argv[++i];
             }
         } else if (arg == "--api-key" || arg == "-k") {
             if (i + 1 < argc) {
-                apiKey = argv[++i];
+                config.apiKey = argv[++i];
+            }
+        } else if (arg == "--io-threads") {
+            if (i + 1 < argc) {
+                config.ioThreads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--resize-threads") {
+            if (i + 1 < argc) {
+                config.resizeThreads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--transcode") {
+            if (i + 1 < argc) {
+                std::string list = argv[++i];
+                config.transcodeFormats.clear();
+                size_t pos = 0;
+                while (list != "off" && pos <= list.size()) {
+                    size_t comma = list.find(',', pos);
+                    std::string format = list.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+                    if (!format.empty()) {
+                        config.transcodeFormats.push_back(format);
+                    }
+                    pos = comma == std::string::npos ? list.size() + 1 : comma + 1;
+                }
+            }
+        } else if (arg == "--preset") {
+            if (i + 1 < argc) {
+                if (!customPresets) {
+                    config.variantPresets.clear();
+                    customPresets = true;
+                }
+                std::string preset = argv[++i];
+                if (preset != "off") {
+                    config.variantPresets.push_back(preset);
+                }
+            }
+        } else if (arg == "--variant-queue") {
+            if (i + 1 < argc) {
+                config.variantQueueSize = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--variant-threads") {
+            if (i + 1 < argc) {
+                config.variantThreads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--variant-max-load") {
+            if (i + 1 < argc) {
+                config.variantMaxLoad = std::stod(argv[++i]);
+            }
+        } else if (arg == "--variant-limit") {
+            if (i + 1 < argc) {
+                config.variantsPerSource = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--validate-uploads") {
+            if (i + 1 < argc) {
+                std::string mode = argv[++i];
+                config.validateUploads = (mode == "on" || mode == "strict");
+                config.rejectUnknownUploads = (mode == "strict");
+            }
+        } else if (arg == "--similarity") {
+            config.similarityIndex = true;
+        } else if (arg == "--chunking") {
+            config.chunking = true;
+        } else if (arg == "--chunk-min-size") {
+            if (i + 1 < argc) {
+                config.chunkMinSizeKB = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--disk") {
+            if (i + 1 < argc) {
+                config.dataDisks.push_back(argv[++i]);
+            }
+        } else if (arg == "--disk-queue-depth") {
+            if (i + 1 < argc) {
+                config.diskQueueDepth = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--cold-storage") {
+            if (i + 1 < argc) {
+                config.coldStorageDirs.push_back(argv[++i]);
+            }
+        } else if (arg == "--demote-after") {
+            if (i + 1 < argc) {
+                config.demoteAfterHours = std::stod(argv[++i]);
+            }
+        } else if (arg == "--promote-after") {
+            if (i + 1 < argc) {
+                config.promoteAfterReads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--mirror") {
+            if (i + 1 < argc) {
+                config.mirrorDir = argv[++i];
+            }
+        } else if (arg == "--mirror-mode") {
+            if (i + 1 < argc) {
+                config.mirrorAsync = std::string(argv[++i]) == "async";
+            }
+        } else if (arg == "--mirror-queue") {
+            if (i + 1 < argc) {
+                config.mirrorQueueSize = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--mirror-timeout") {
+            if (i + 1 < argc) {
+                config.mirrorReadTimeoutMs = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--ec-dir") {
+            if (i + 1 < argc) {
+                config.ecDirs.push_back(argv[++i]);
+            }
+        } else if (arg == "--ec-parity") {
+            if (i + 1 < argc) {
+                config.ecParity = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--ec-min-size") {
+            if (i + 1 < argc) {
+                config.ecMinSizeKB = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--node") {
+            if (i + 1 < argc) {
+                config.clusterNodes.push_back(argv[++i]);
+            }
+        } else if (arg == "--cluster-config") {
+            if (i + 1 < argc) {
+                config.clusterConfigFile = argv[++i];
+            }
+        } else if (arg == "--node-id") {
+            if (i + 1 < argc) {
+                config.nodeId = argv[++i];
+            }
+        } else if (arg == "--replicas") {
+            if (i + 1 < argc) {
+                config.replicas = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--write-quorum") {
+            if (i + 1 < argc) {
+                config.writeQuorum = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--read-quorum") {
+            if (i + 1 < argc) {
+                config.readQuorum = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--vnodes") {
+            if (i + 1 < argc) {
+                config.virtualNodes = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--cluster-redirect") {
+            config.clusterRedirect = true;
+        } else if (arg == "--cluster-timeout") {
+            if (i + 1 < argc) {
+                config.clusterTimeoutMs = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--cluster-threads") {
+            if (i + 1 < argc) {
+                config.clusterThreads = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--cluster-secret") {
+            if (i + 1 < argc) {
+                config.clusterSecret = argv[++i];
+            }
+        } else if (arg == "--peer") {
+            if (i + 1 < argc) {
+                config.peers.push_back(argv[++i]);
+            }
+        } else if (arg == "--peer-cache") {
+            config.peerCache = true;
+        } else if (arg == "--peer-timeout") {
+            if (i + 1 < argc) {
+                config.peerTimeoutMs = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--sync-peer") {
+            if (i + 1 < argc) {
+                config.syncPeers.push_back(argv[++i]);
+            }
+        } else if (arg == "--sync-interval") {
+            if (i + 1 < argc) {
+                config.syncIntervalSeconds = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--tombstone-retention") {
+            if (i + 1 < argc) {
+                config.tombstoneRetentionHours = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--feed") {
+            config.feedEnabled = true;
+        } else if (arg == "--feed-retention") {
+            if (i + 1 < argc) {
+                config.feedRetentionHours = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--feed-max-size") {
+            if (i + 1 < argc) {
+                config.feedMaxSizeMB = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--backup-dir") {
+            if (i + 1 < argc) {
+                config.backupDir = argv[++i];
+            }
+        } else if (arg == "--backup-rate") {
+            if (i + 1 < argc) {
+                config.backupRateMBps = std::stod(argv[++i]);
+            }
+        } else if (arg == "--shard-depth") {
+            if (i + 1 < argc) {
+                config.shardDepth = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--shard-width") {
+            if (i + 1 < argc) {
+                config.shardWidth = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--reshard-rate") {
+            if (i + 1 < argc) {
+                config.reshardRate = std::stod(argv[++i]);
+            }
+        } else if (arg == "--dir-cache") {
+            if (i + 1 < argc) {
+                config.dirCacheSize = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--known-dirs") {
+            if (i + 1 < argc) {
+                config.knownDirs = std::string(argv[++i]) != "off";
+            }
+        } else if (arg == "--snapshot-interval") {
+            if (i + 1 < argc) {
+                config.snapshotIntervalSeconds = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--scrub") {
+            config.scrubEnabled = true;
+        } else if (arg == "--scrub-rate") {
+            if (i + 1 < argc) {
+                config.scrubRateMBps = std::stod(argv[++i]);
+            }
+        } else if (arg == "--scrub-interval") {
+            if (i + 1 < argc) {
+                config.scrubIntervalHours = std::stoi(argv[++i]);
+            }
+        } else if (arg == "--verify-reads") {
+            if (i + 1 < argc) {
+                std::string mode = argv[++i];
+                config.verifyReads.hashRoutes = (mode == "hash" || mode == "all");
+                config.verifyReads.namedRoutes = (mode == "named" || mode == "all");
+            }
+        } else if (arg == "--verify-prefix") {
+            if (i + 1 < argc) {
+                config.verifyReads.namePrefixes.push_back(argv[++i]);
             }
         } else if (arg == "--help" || arg == "-h") {
             std::cout << "Usage: " << argv[0] << " [OPTIONS]" << std::endl;
+            std::cout << "       " << argv[0] << " import [OPTIONS] <dir|archive.tar|->..." << std::endl;
             std::cout << "\nOptions:" << std::endl;
             std::cout << "  -p, --port <port>        Server port (default: 8080)" << std::endl;
             std::cout << "  -s, --storage <dir>      Storage directory (default: ./storage)" << std::endl;
             std::cout << "  -k, --api-key <key>      API key for write operations" << std::endl;
+            std::cout << "  --io-threads <n>         Threads for blocking storage I/O (default: 16)" << std::endl;
+            std::cout << "  --resize-threads <n>     Threads used to resize one image (default: 4)" << std::endl;
+            std::cout << "  --transcode <list>       Formats offered via Accept, e.g. avif,webp (default), or off" << std::endl;
+            std::cout << "  --preset <name:params>   Variant preset, e.g. thumb:w=200,h=200,fit=cover;" << std::endl;
+            std::cout << "                           repeatable, replaces the defaults; 'off' for none" << std::endl;
+            std::cout << "  --variant-queue <n>      Uploads queued for eager variants (default: 256, 0 = lazy only)" << std::endl;
+            std::cout << "  --variant-threads <n>    Threads generating eager variants (default: 2)" << std::endl;
+            std::cout << "  --variant-max-load <x>   Shed eager variants above this load per core (default: 1.0)" << std::endl;
+            std::cout << "  --variant-limit <n>      Cached variants kept per image (default: 64, 0 = unlimited)" << std::endl;
+            std::cout << "  --validate-uploads <m>   Check upload structure: off, on or strict (default: off)" << std::endl;
+            std::cout << "  --similarity             Hash uploads for near-duplicate search" << std::endl;
+            std::cout << "  --chunking               Store large images as deduplicated chunks" << std::endl;
+            std::cout << "  --chunk-min-size <KiB>   Smallest image that is chunked (default: 1024)" << std::endl;
+            std::cout << "  --disk <dir>             Another disk to spread images across; repeatable" << std::endl;
+            std::cout << "  --disk-queue-depth <n>   Operations each disk runs at once (default: 8)" << std::endl;
+            std::cout << "  --cold-storage <dir>     Colder storage tier for idle images; repeatable" << std::endl;
+            std::cout << "  --demote-after <hours>   Idle time before an image moves colder (default: 72)" << std::endl;
+            std::cout << "  --promote-after <reads>  Reads that bring a cold image back (default: 1, 0 = never)" << std::endl;
+            std::cout << "  --mirror <dir>           Replicate every write to a second storage root" << std::endl;
+            std::cout << "  --mirror-mode <mode>     Replication: sync or async (default: sync)" << std::endl;
+            std::cout << "  --mirror-queue <n>       Async writes queued before dropping (default: 1024)" << std::endl;
+            std::cout << "  --mirror-timeout <ms>    Disk wait before a read fails over (default: 1000)" << std::endl;
+            std::cout << "  --ec-dir <dir>           Shard root for erasure-coded images; repeatable" << std::endl;
+            std::cout << "  --ec-parity <n>          Shard roots holding parity (default: 2)" << std::endl;
+            std::cout << "  --ec-min-size <KiB>      Smallest image that is erasure-coded (default: 4096)" << std::endl;
+            std::cout << "  --node <id=host:port>    Cluster member; repeatable" << std::endl;
+            std::cout << "  --cluster-config <file>  File of 'id host:port' cluster members" << std::endl;
+            std::cout << "  --node-id <id>           This node's member id; enables clustering" << std::endl;
+            std::cout << "  --replicas <n>           Nodes holding each image and name (default: 3)" << std::endl;
+            std::cout << "  --write-quorum <n>       Replicas that must acknowledge a write (default: majority)" << std::endl;
+            std::cout << "  --read-quorum <n>        Replicas that must answer a read (default: 1)" << std::endl;
+            std::cout << "  --vnodes <n>             Ring points per node (default: 128)" << std::endl;
+            std::cout << "  --cluster-redirect       Redirect requests to the owner instead of proxying" << std::endl;
+            std::cout << "  --cluster-timeout <ms>   Timeout for requests to other nodes (default: 2000)" << std::endl;
+            std::cout << "  --cluster-threads <n>    Requests to other nodes in flight at once (default: 16)" << std::endl;
+            std::cout << "  --cluster-secret <s>     Secret shared by cluster members (default: the API key)" << std::endl;
+            std::cout << "  --peer <host:port>       Peer asked for images missing here; repeatable" << std::endl;
+            std::cout << "  --peer-cache             Keep images fetched from peers" << std::endl;
+            std::cout << "  --peer-timeout <ms>      Timeout for peer fetches and syncs (default: 2000)" << std::endl;
+            std::cout << "  --sync-peer <host:port>  Replica to sync missing images from; repeatable" << std::endl;
+            std::cout << "  --sync-interval <s>      Seconds between sync rounds (default: 600, 0 = on request)" << std::endl;
+            std::cout << "  --tombstone-retention <h> Hours deletes are remembered for sync (default: 720)" << std::endl;
+            std::cout << "  --feed                   Log uploads, deletes and name changes at GET /feed" << std::endl;
+            std::cout << "  --feed-retention <h>     Hours of change feed to keep (default: 168, 0 = no limit)" << std::endl;
+            std::cout << "  --feed-max-size <MB>     Change feed size limit (default: 1024)" << std::endl;
+            std::cout << "  --backup-dir <dir>       Directory for backup archives (default: <storage>/backups)" << std::endl;
+            std::cout << "  --backup-rate <MB/s>     Backup export read cap (default: 50, 0 = unlimited)" << std::endl;
+            std::cout << "  --shard-depth <n>        Shard directory levels; changes migrate online (default: 3)" << std::endl;
+            std::cout << "  --shard-width <n>        Hex digits per shard directory (default: 2)" << std::endl;
+            std::cout << "  --reshard-rate <n/s>     Entries moved per second by a layout change (default: 1000)" << std::endl;
+            std::cout << "  --dir-cache <n>          Shard directories kept open (default: 4096, 0 = none)" << std::endl;
+            std::cout << "  --known-dirs <on|off>    Skip the directory check on writes to known shards (default: on)" << std::endl;
+            std::cout << "  --snapshot-interval <s>  Seconds between index snapshots (default: 300)" << std::endl;
+            std::cout << "  --scrub                  Enable periodic integrity scrubbing" << std::endl;
+            std::cout << "  --scrub-rate <MB/s>      Scrubber read bandwidth cap (default: 50, 0 = unlimited)" << std::endl;
+            std::cout << "  --scrub-interval <hours> Pause between scrub passes (default: 24)" << std::endl;
+            std::cout << "  --verify-reads <mode>    Hash-check reads: off, hash, named or all (default: off)" << std::endl;
+            std::cout << "  --verify-prefix <prefix> Hash-check named reads for names with this prefix" << std::endl;
+            std::cout << "  --import-names           import: name each file after its file name" << std::endl;
             std::cout << "  -h, --help               Show this help message" << std::endl;
             std::cout << "\nEnvironment Variables:" << std::endl;
             std::cout << "  IMG_STORE_API_KEY        API key (alternative to --api-key)" << std::endl;
+            std::cout << "  IMG_STORE_CLUSTER_SECRET Cluster secret (alternative to --cluster-secret)" << std::endl;
             std::cout << "\nSecurity:" << std::endl;
             std::cout << "  • GET requests are always public (no authentication)" << std::endl;
             std::cout << "  • POST/DELETE require API key via:" << std::endl;
@@ -49,8 +361,38 @@ int main(int argc, char* argv[]) {
         }
     }
 
+    if (importMode) {
+        if (importSources.empty()) {
+            std::cerr << "Usage: " << argv[0] << " import [OPTIONS] <dir|archive.tar|->..." << std::endl;
+            return 1;
+        }
+        try {
+            auto storage = std::make_shared<imgstore::StorageManager>(config.storageDir,
+                                                                      imgstore::storageOptions(config));
+            // Deletes in the archives must leave the near-duplicate index too
+            if (config.similarityIndex) {
+                auto similarity = std::make_shared<imgstore::SimilarityIndex>(config.storageDir);
+                similarity->load();
+                storage->setSimilarityIndex(similarity);
+            }
+            imgstore::BulkImporter::Options options;
+            options.threads = static_cast<size_t>(std::max(config.ioThreads, 1));
+            options.nameFiles = importNames;
+            imgstore::BulkImporter importer(storage, options);
+            bool ok = true;
+            for (const auto& source : importSources) {
+                std::cout << "Importing " << source << std::endl;
+                ok = importer.import(source) && ok;
+            }
+            return ok && importer.stats().errors == 0 ? 0 : 1;
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+    }
+
     try {
-        imgstore::Server server(storageDir, port, apiKey);
+        imgstore::Server server(config);
         server.run();
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
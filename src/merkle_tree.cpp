@@ -0,0 +1,107 @@
+#include "merkle_tree.h"
+#include "hash_utils.h"
+
+namespace imgstore {
+
+namespace {
+
+constexpr char kHexDigits[] = "0123456789abcdef";
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+// An image's own hash is XORed in through a second hash, so structure in
+// the IDs (or a crafted set of them) cannot cancel out in the digests
+uint64_t leafValue(uint64_t hash) {
+    return HashUtils::xxh3_64(&hash, sizeof(hash));
+}
+
+} // namespace
+
+MerkleTree::MerkleTree()
+    : leaves_(new std::atomic<uint64_t>[kBuckets]) {
+    clear();
+}
+
+uint16_t MerkleTree::bucketOf(uint64_t hash) {
+    // Shard directories come from the hash of the ID's text, not the ID itself
+    char hex[16];
+    for (int i = 15; i >= 0; --i) {
+        hex[i] = kHexDigits[hash & 0xf];
+        hash >>= 4;
+    }
+    return static_cast<uint16_t>(HashUtils::xxh3_64(hex, sizeof(hex)) >> 48);
+}
+
+void MerkleTree::toggle(uint64_t hash) {
+    uint64_t value = leafValue(hash);
+    uint16_t bucket = bucketOf(hash);
+    leaves_[bucket].fetch_xor(value, std::memory_order_relaxed);
+    level1_[bucket >> 8].fetch_xor(value, std::memory_order_relaxed);
+    root_.fetch_xor(value, std::memory_order_relaxed);
+}
+
+void MerkleTree::clear() {
+    root_.store(0, std::memory_order_relaxed);
+    for (auto& node : level1_) {
+        node.store(0, std::memory_order_relaxed);
+    }
+    for (size_t i = 0; i < kBuckets; ++i) {
+        leaves_[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+std::optional<std::vector<uint64_t>> MerkleTree::children(const std::string& prefix) const {
+    std::vector<uint64_t> result(kFanout);
+    if (prefix.empty()) {
+        for (size_t i = 0; i < kFanout; ++i) {
+            result[i] = level1_[i].load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+
+    int high = prefix.size() == 2 ? hexValue(prefix[0]) : -1;
+    int low = prefix.size() == 2 ? hexValue(prefix[1]) : -1;
+    if (high < 0 || low < 0) {
+        return std::nullopt;
+    }
+    size_t first = static_cast<size_t>(high * 16 + low) * kFanout;
+    for (size_t i = 0; i < kFanout; ++i) {
+        result[i] = leaves_[first + i].load(std::memory_order_relaxed);
+    }
+    return result;
+}
+
+bool MerkleTree::parseBucket(const std::string& hex, uint16_t& bucket) {
+    if (hex.size() != 4) {
+        return false;
+    }
+    uint16_t value = 0;
+    for (char c : hex) {
+        int digit = hexValue(c);
+        if (digit < 0) {
+            return false;
+        }
+        value = static_cast<uint16_t>(value << 4 | digit);
+    }
+    bucket = value;
+    return true;
+}
+
+std::string MerkleTree::bucketToHex(uint16_t bucket) {
+    std::string hex(4, '0');
+    for (int i = 3; i >= 0; --i) {
+        hex[i] = kHexDigits[bucket & 0xf];
+        bucket >>= 4;
+    }
+    return hex;
+}
+
+} // namespace imgstore
@@ -0,0 +1,125 @@
+#include "metrics.h"
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace imgstore {
+
+namespace {
+
+std::string familyName(const std::string& name) {
+    auto brace = name.find('{');
+    return brace == std::string::npos ? name : name.substr(0, brace);
+}
+
+// Insert a suffix between the family name and the label set:
+// foo{a="b"} + _sum -> foo_sum{a="b"}
+std::string withSuffix(const std::string& name, const std::string& suffix) {
+    auto brace = name.find('{');
+    if (brace == std::string::npos) {
+        return name + suffix;
+    }
+    return name.substr(0, brace) + suffix + name.substr(brace);
+}
+
+} // namespace
+
+Metrics& Metrics::instance() {
+    static Metrics metrics;
+    return metrics;
+}
+
+Metrics::Entry& Metrics::getOrCreate(const std::string& name, const std::string& help, Type type) {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(name);
+    if (it != entries_.end()) {
+        if (it->second.type != type) {
+            throw std::logic_error("Metric registered with a different type: " + name);
+        }
+        return it->second;
+    }
+
+    Entry entry;
+    entry.type = type;
+    switch (type) {
+        case Type::Counter: entry.counter = std::make_unique<Counter>(); break;
+        case Type::Gauge: entry.gauge = std::make_unique<Gauge>(); break;
+        case Type::Summary: entry.summary = std::make_unique<Summary>(); break;
+        case Type::Callback: break;
+    }
+
+    auto family = familyName(name);
+    if (!help.empty() && help_.find(family) == help_.end()) {
+        help_[family] = help;
+    }
+
+    return entries_.emplace(name, std::move(entry)).first->second;
+}
+
+Counter& Metrics::counter(const std::string& name, const std::string& help) {
+    return *getOrCreate(name, help, Type::Counter).counter;
+}
+
+Gauge& Metrics::gauge(const std::string& name, const std::string& help) {
+    return *getOrCreate(name, help, Type::Gauge).gauge;
+}
+
+Summary& Metrics::summary(const std::string& name, const std::string& help) {
+    return *getOrCreate(name, help, Type::Summary).summary;
+}
+
+void Metrics::callbackGauge(const std::string& name, const std::string& help, std::function<double()> fn) {
+    auto& entry = getOrCreate(name, help, Type::Callback);
+    std::lock_guard<std::mutex> lock(mutex_);
+    entry.callback = std::move(fn);
+}
+
+std::string Metrics::renderPrometheus() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Group label sets by family so HELP/TYPE are emitted once per family
+    std::map<std::string, std::vector<const std::pair<const std::string, Entry>*>> families;
+    for (const auto& item : entries_) {
+        families[familyName(item.first)].push_back(&item);
+    }
+
+    std::ostringstream out;
+    for (const auto& [family, items] : families) {
+        auto help = help_.find(family);
+        if (help != help_.end()) {
+            out << "# HELP " << family << " " << help->second << "\n";
+        }
+
+        const char* type = "gauge";
+        if (items.front()->second.type == Type::Counter) {
+            type = "counter";
+        } else if (items.front()->second.type == Type::Summary) {
+            type = "summary";
+        }
+        out << "# TYPE " << family << " " << type << "\n";
+
+        for (const auto* item : items) {
+            const auto& [name, entry] = *item;
+            switch (entry.type) {
+                case Type::Counter:
+                    out << name << " " << entry.counter->value() << "\n";
+                    break;
+                case Type::Gauge:
+                    out << name << " " << entry.gauge->value() << "\n";
+                    break;
+                case Type::Summary:
+                    out << withSuffix(name, "_sum") << " " << entry.summary->sum() << "\n";
+                    out << withSuffix(name, "_count") << " " << entry.summary->count() << "\n";
+                    break;
+                case Type::Callback:
+                    out << name << " " << (entry.callback ? entry.callback() : 0.0) << "\n";
+                    break;
+            }
+        }
+    }
+
+    return out.str();
+}
+
+} // namespace imgstore
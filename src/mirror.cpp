@@ -0,0 +1,383 @@
+#include "mirror.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+// Wait after a lost write before repairing, so a burst of them costs one pass
+constexpr std::chrono::seconds kRepairDelay{30};
+
+// Set a file's access and modification times to a unix time in milliseconds
+bool setFileTime(const std::filesystem::path& path, int64_t unixMillis) {
+    struct timespec times[2];
+    times[0].tv_sec = static_cast<time_t>(unixMillis / 1000);
+    times[0].tv_nsec = static_cast<long>(unixMillis % 1000) * 1000000;
+    times[1] = times[0];
+    return ::utimensat(AT_FDCWD, path.c_str(), times, 0) == 0;
+}
+
+} // namespace
+
+Mirror::Mirror(const std::filesystem::path& root, const ShardLayout& layout, bool async, size_t queueSize)
+    : root_(root), layout_(layout), async_(async), queueSize_(std::max<size_t>(queueSize, 1)),
+      writes_(Metrics::instance().counter("imgstore_mirror_writes_total",
+                                          "Writes and deletes applied to the mirror")),
+      writeFailures_(Metrics::instance().counter("imgstore_mirror_write_failures_total",
+                                                 "Mirror writes that failed and were left to a repair")),
+      dropped_(Metrics::instance().counter("imgstore_mirror_dropped_total",
+                                           "Replication writes dropped because the queue was full")),
+      failoverReads_(Metrics::instance().counter("imgstore_mirror_failover_reads_total",
+                                                 "Reads served by the mirror because the primary failed")),
+      repaired_(Metrics::instance().counter("imgstore_mirror_repaired_total",
+                                            "Images and names copied or removed by mirror repair")) {
+    std::filesystem::create_directories(root_);
+
+    Metrics::instance().callbackGauge("imgstore_mirror_queue_depth",
+                                      "Writes waiting in the replication queue",
+                                      [this]() {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        return static_cast<double>(queue_.size());
+    });
+    Metrics::instance().callbackGauge("imgstore_mirror_lag_seconds",
+                                      "Age of the oldest write waiting in the replication queue",
+                                      [this]() {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (queue_.empty()) {
+            return 0.0;
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - queue_.front().enqueued).count();
+    });
+
+    if (async_) {
+        worker_ = std::thread(&Mirror::workerLoop, this);
+    }
+}
+
+Mirror::~Mirror() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_mirror_queue_depth", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_mirror_lag_seconds", "", nullptr);
+}
+
+void Mirror::putImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                      std::optional<int64_t> writtenAt) {
+    if (!async_) {
+        writeImage(imageId, data, writtenAt);
+        return;
+    }
+    enqueue(Op{OpKind::PutImage, imageId, data, {}, {}, writtenAt});
+}
+
+void Mirror::putName(const std::string& name, const std::string& imageHash) {
+    if (!async_) {
+        writeName(name, imageHash);
+        return;
+    }
+    enqueue(Op{OpKind::PutName, name, {}, imageHash, {}, {}});
+}
+
+void Mirror::removeImage(const std::string& imageId) {
+    if (!async_) {
+        eraseImage(imageId);
+        return;
+    }
+    enqueue(Op{OpKind::RemoveImage, imageId, {}, {}, {}, {}});
+}
+
+void Mirror::removeName(const std::string& name) {
+    if (!async_) {
+        eraseName(name);
+        return;
+    }
+    enqueue(Op{OpKind::RemoveName, name, {}, {}, {}, {}});
+}
+
+bool Mirror::writeImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                        std::optional<int64_t> writtenAt) {
+    return writeFile(imagePath(imageId), data.data(), data.size(), writtenAt);
+}
+
+bool Mirror::writeName(const std::string& name, const std::string& imageHash) {
+    return writeFile(namePath(name), imageHash.data(), imageHash.size());
+}
+
+bool Mirror::eraseImage(const std::string& imageId) {
+    return eraseFile(imagePath(imageId));
+}
+
+bool Mirror::eraseName(const std::string& name) {
+    return eraseFile(namePath(name));
+}
+
+std::optional<std::vector<uint8_t>> Mirror::readImage(const std::string& imageId) {
+    try {
+        std::ifstream file(imagePath(imageId), std::ios::binary | std::ios::ate);
+        if (!file) {
+            return std::nullopt;
+        }
+        auto size = static_cast<size_t>(file.tellg());
+        file.seekg(0, std::ios::beg);
+
+        std::vector<uint8_t> data(size);
+        if (!file.read(reinterpret_cast<char*>(data.data()), size)) {
+            return std::nullopt;
+        }
+        return data;
+    } catch (const std::exception& e) {
+        std::cerr << "Error reading mirrored image: " << e.what() << std::endl;
+        return std::nullopt;
+    }
+}
+
+std::optional<int64_t> Mirror::imageWrittenAt(const std::string& imageId) const {
+    struct stat st{};
+    if (::stat(imagePath(imageId).c_str(), &st) != 0) {
+        return std::nullopt;
+    }
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+}
+
+std::optional<std::string> Mirror::readName(const std::string& name) {
+    try {
+        std::ifstream file(namePath(name));
+        std::string imageHash;
+        if (!file || !std::getline(file, imageHash) || imageHash.empty()) {
+            return std::nullopt;
+        }
+        return imageHash;
+    } catch (const std::exception& e) {
+        std::cerr << "Error reading mirrored name mapping: " << e.what() << std::endl;
+        return std::nullopt;
+    }
+}
+
+std::filesystem::path Mirror::imagePath(const std::string& imageId) const {
+    return layout_.pathOf(root_, imageId, imageId);
+}
+
+std::filesystem::path Mirror::namePath(const std::string& name) const {
+    return layout_.pathOf(root_ / "names", name, name + ".mapping");
+}
+
+void Mirror::startRepair(RepairPass pass, bool runNow) {
+    std::lock_guard<std::mutex> lock(repairMutex_);
+    if (repairThread_.joinable()) {
+        return;
+    }
+    pass_ = std::move(pass);
+    repairRequested_ = runNow;
+    repairThread_ = std::thread(&Mirror::repairLoop, this);
+}
+
+bool Mirror::triggerRepair() {
+    if (repairing_.load()) {
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(repairMutex_);
+        repairRequested_ = true;
+    }
+    repairCv_.notify_all();
+    return true;
+}
+
+bool Mirror::needsRepair() const {
+    std::error_code ec;
+    return !std::filesystem::exists(markerPath(), ec);
+}
+
+Mirror::Status Mirror::status() const {
+    Status status;
+    status.root = root_.string();
+    status.async = async_;
+    status.dropped = dropped_.value();
+    status.failoverReads = failoverReads_.value();
+    status.repairing = repairing_.load();
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        status.queued = queue_.size();
+    }
+    std::lock_guard<std::mutex> lock(repairMutex_);
+    status.lastRepair = lastRepair_;
+    return status;
+}
+
+void Mirror::stop() {
+    {
+        std::lock_guard<std::mutex> lock(repairMutex_);
+        stopping_ = true;
+    }
+    repairCv_.notify_all();
+    if (repairThread_.joinable()) {
+        repairThread_.join();
+    }
+
+    // Queued writes are applied before shutdown rather than left to a repair
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        draining_ = true;
+    }
+    queueCv_.notify_all();
+    if (worker_.joinable()) {
+        worker_.join();
+    }
+}
+
+void Mirror::enqueue(Op op) {
+    {
+        std::lock_guard<std::mutex> lock(queueMutex_);
+        if (!draining_ && queue_.size() < queueSize_) {
+            op.enqueued = std::chrono::steady_clock::now();
+            queue_.push_back(std::move(op));
+            queueCv_.notify_one();
+            return;
+        }
+        dropped_.increment();
+    }
+    markStale();
+}
+
+void Mirror::markStale() {
+    {
+        std::lock_guard<std::mutex> lock(repairMutex_);
+        ++lostWrites_;
+        // A restart before the repair must not trust the mirror either
+        if (markerPresent_) {
+            std::error_code ec;
+            std::filesystem::remove(markerPath(), ec);
+            markerPresent_ = false;
+        }
+        if (!repairDue_) {
+            repairDue_ = std::chrono::steady_clock::now() + kRepairDelay;
+        }
+    }
+    repairCv_.notify_all();
+}
+
+void Mirror::apply(const Op& op) {
+    switch (op.kind) {
+        case OpKind::PutImage:
+            writeFile(imagePath(op.key), op.data.data(), op.data.size(), op.writtenAt);
+            break;
+        case OpKind::PutName:
+            writeFile(namePath(op.key), op.value.data(), op.value.size());
+            break;
+        case OpKind::RemoveImage:
+            eraseFile(imagePath(op.key));
+            break;
+        case OpKind::RemoveName:
+            eraseFile(namePath(op.key));
+            break;
+    }
+}
+
+void Mirror::workerLoop() {
+    std::unique_lock<std::mutex> lock(queueMutex_);
+    while (true) {
+        queueCv_.wait(lock, [this]() { return draining_ || !queue_.empty(); });
+        if (queue_.empty()) {
+            break; // draining and nothing left
+        }
+
+        // Applied one at a time and in order, so a delete never overtakes its write.
+        // The op leaves the queue only once applied, keeping the lag gauge honest.
+        lock.unlock();
+        apply(queue_.front());
+        lock.lock();
+        queue_.pop_front();
+    }
+}
+
+void Mirror::repairLoop() {
+    std::unique_lock<std::mutex> lock(repairMutex_);
+    while (!stopping_) {
+        repairCv_.wait(lock, [this]() { return stopping_ || repairRequested_ || repairDue_; });
+        if (!stopping_ && !repairRequested_) {
+            auto due = *repairDue_;
+            repairCv_.wait_until(lock, due, [this]() { return stopping_ || repairRequested_; });
+        }
+        if (stopping_) {
+            break;
+        }
+        repairRequested_ = false;
+        repairDue_.reset();
+        repairing_ = true;
+        uint64_t lostBefore = lostWrites_;
+        lock.unlock();
+
+        std::cout << "Mirror repair started" << std::endl;
+        RepairResult result = pass_();
+        repaired_.increment(result.imagesCopied + result.imagesRestored + result.namesCopied +
+                            result.namesRestored + result.removed);
+        lock.lock();
+        // A write lost during the pass may be behind it; only a clean pass is recorded
+        if (result.completed && lostWrites_ == lostBefore) {
+            std::ofstream marker(markerPath(), std::ios::trunc);
+            marker << "synced\n";
+            markerPresent_ = true;
+        } else if (!stopping_ && !repairDue_) {
+            repairDue_ = std::chrono::steady_clock::now() + kRepairDelay;
+        }
+        lock.unlock();
+        std::cout << "Mirror repair " << (result.completed ? "finished" : "abandoned") << ": "
+                  << result.imagesCopied << " images copied, " << result.imagesRestored << " restored, "
+                  << result.namesCopied << " names copied, " << result.namesRestored << " restored, "
+                  << result.removed << " stale entries removed, " << result.errors << " errors" << std::endl;
+
+        lock.lock();
+        lastRepair_ = result;
+        repairing_ = false;
+    }
+}
+
+bool Mirror::writeFile(const std::filesystem::path& path, const void* data, size_t size,
+                       std::optional<int64_t> writtenAt) {
+    try {
+        std::filesystem::create_directories(path.parent_path());
+
+        // Written beside the target and renamed, so a reader never sees half a file
+        auto temp = path;
+        temp += ".tmp." + std::to_string(tempCounter_++);
+        {
+            std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+            file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+            file.close();
+            if (!file.good() || (writtenAt && !setFileTime(temp, *writtenAt))) {
+                std::error_code ec;
+                std::filesystem::remove(temp, ec);
+                std::cerr << "Failed to write mirror file " << path << std::endl;
+                writeFailures_.increment();
+                markStale();
+                return false;
+            }
+        }
+        std::filesystem::rename(temp, path);
+        writes_.increment();
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Error writing mirror file: " << e.what() << std::endl;
+        writeFailures_.increment();
+        markStale();
+        return false;
+    }
+}
+
+bool Mirror::eraseFile(const std::filesystem::path& path) {
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    if (ec) {
+        std::cerr << "Failed to remove mirror file " << path << ": " << ec.message() << std::endl;
+        writeFailures_.increment();
+        markStale();
+        return false;
+    }
+    writes_.increment();
+    return true;
+}
+
+} // namespace imgstore
@@ -0,0 +1,680 @@
+#include "object_index.h"
+#include "hash_utils.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+namespace imgstore {
+
+namespace {
+
+constexpr char kSnapshotMagic[8] = {'I', 'M', 'G', 'I', 'D', 'X', '\0', '\1'};
+// Version 2 added the content format to image entries; version 1 snapshots
+// (16-byte image entries) are still read
+constexpr uint32_t kSnapshotVersion = 2;
+
+// Snapshot file layout: header | SnapshotImage[] | SnapshotName[] | name bytes.
+// All fields are fixed-size and naturally aligned so the file can be used
+// in place after mmap.
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint64_t seq;
+    uint64_t imageCount;
+    uint64_t nameCount;
+    uint64_t nameBytes;
+    uint64_t checksum; // XXH3 over everything after the header
+};
+
+struct SnapshotImage {
+    uint64_t hash;
+    uint64_t size;
+    uint8_t format;
+    uint8_t tier; // 0 in snapshots written before tiers existed, which is right for them
+    uint8_t reserved[6];
+};
+
+constexpr size_t kSnapshotImageSizeV1 = 16;
+
+struct SnapshotName {
+    uint64_t hash;
+    uint64_t offset;
+    uint32_t length;
+    uint32_t reserved;
+};
+
+struct JournalRecord {
+    uint64_t seq;
+    uint64_t hash;
+    uint64_t size;
+    uint16_t nameLength;
+    uint8_t op;
+    uint8_t format; // AddImage only; 0 (unknown) in journals written before formats were tracked
+                    // SetTier carries the tier in size
+    uint32_t checksum; // low 32 bits of XXH3 over the record (checksum zeroed) and name
+};
+
+static_assert(sizeof(SnapshotHeader) == 56);
+static_assert(sizeof(SnapshotImage) == 24);
+static_assert(sizeof(SnapshotName) == 24);
+static_assert(sizeof(JournalRecord) == 32);
+
+// Rotate the journal after this many records even if the interval has not elapsed
+constexpr uint64_t kSnapshotJournalRecords = 1'000'000;
+
+uint32_t recordChecksum(JournalRecord record, const char* name) {
+    record.checksum = 0;
+    Xxh3Stream hasher;
+    hasher.update(&record, sizeof(record));
+    hasher.update(name, record.nameLength);
+    return static_cast<uint32_t>(hasher.digest());
+}
+
+unsigned loaderThreads() {
+    return std::clamp(std::thread::hardware_concurrency(), 1u, 16u);
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+void syncDirectory(const std::filesystem::path& dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        ::fsync(fd);
+        ::close(fd);
+    }
+}
+
+} // namespace
+
+ObjectIndex::ObjectIndex(const std::filesystem::path& dir)
+    : dir_(dir),
+      snapshotsWritten_(Metrics::instance().counter("imgstore_index_snapshots_total",
+                                                    "Index snapshots written")),
+      journalRecordsReplayed_(Metrics::instance().counter("imgstore_index_journal_replayed_total",
+                                                          "Journal records replayed at startup")),
+      loadSeconds_(Metrics::instance().gauge("imgstore_index_load_seconds",
+                                             "Time taken to load the index snapshot and journal at startup")) {
+    Metrics::instance().callbackGauge("imgstore_index_entries{kind=\"image\"}", "Entries in the in-memory index",
+                                      [this]() { return static_cast<double>(imageCount()); });
+    Metrics::instance().callbackGauge("imgstore_index_entries{kind=\"name\"}", "Entries in the in-memory index",
+                                      [this]() { return static_cast<double>(nameCount()); });
+}
+
+ObjectIndex::~ObjectIndex() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_index_entries{kind=\"image\"}", "", nullptr);
+    Metrics::instance().callbackGauge("imgstore_index_entries{kind=\"name\"}", "", nullptr);
+}
+
+size_t ObjectIndex::shardOf(const std::string& name) {
+    return HashUtils::xxh3_64(name) >> 56;
+}
+
+bool ObjectIndex::load() {
+    auto start = std::chrono::steady_clock::now();
+
+    uint64_t snapshotSeq = 0;
+    if (!loadSnapshot(snapshotSeq)) {
+        return false;
+    }
+
+    // A retired journal exists if the process died while writing a snapshot
+    lastSeq_ = snapshotSeq;
+    lastSeq_ = std::max(lastSeq_, replayJournal(retiredJournalPath(), snapshotSeq));
+    lastSeq_ = std::max(lastSeq_, replayJournal(journalPath(), snapshotSeq));
+
+    loadSeconds_.set(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    std::cout << "Index loaded: " << imageCount() << " images, " << nameCount() << " names (seq "
+              << lastSeq_ << ", " << loadSeconds_.value() << "s)" << std::endl;
+    return true;
+}
+
+void ObjectIndex::reset() {
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    for (auto& shard : shards_) {
+        std::unique_lock<std::shared_mutex> shardLock(shard.mutex);
+        shard.images.clear();
+        shard.names.clear();
+    }
+    imageCount_ = 0;
+    nameCount_ = 0;
+    merkle_.clear();
+    lastSeq_ = 0;
+    journalRecords_ = 0;
+
+    if (journalFd_ >= 0) {
+        ::close(journalFd_);
+        journalFd_ = -1;
+    }
+    std::error_code ec;
+    std::filesystem::remove(journalPath(), ec);
+    std::filesystem::remove(retiredJournalPath(), ec);
+    std::filesystem::remove(snapshotPath(), ec);
+}
+
+bool ObjectIndex::openJournal() {
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    if (journalFd_ >= 0) {
+        return true;
+    }
+    journalFd_ = ::open(journalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (journalFd_ < 0) {
+        std::cerr << "Failed to open index journal: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void ObjectIndex::addImage(uint64_t hash, uint64_t size, ImageFormat format, bool journal) {
+    if (!journal) {
+        // Bulk population from a scan; only shard locks are needed
+        apply(Op::AddImage, hash, size, "", format);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    appendJournal(Op::AddImage, hash, size, "", format);
+    apply(Op::AddImage, hash, size, "", format);
+}
+
+void ObjectIndex::removeImage(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    appendJournal(Op::RemoveImage, hash, 0, "");
+    apply(Op::RemoveImage, hash, 0, "");
+}
+
+void ObjectIndex::setTier(uint64_t hash, uint8_t tier, bool journal) {
+    if (!journal) {
+        apply(Op::SetTier, hash, tier, "");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    appendJournal(Op::SetTier, hash, tier, "");
+    apply(Op::SetTier, hash, tier, "");
+}
+
+void ObjectIndex::setName(const std::string& name, uint64_t hash, bool journal) {
+    if (!journal) {
+        apply(Op::SetName, hash, 0, name);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    appendJournal(Op::SetName, hash, 0, name);
+    apply(Op::SetName, hash, 0, name);
+}
+
+void ObjectIndex::removeName(const std::string& name) {
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    appendJournal(Op::RemoveName, 0, 0, name);
+    apply(Op::RemoveName, 0, 0, name);
+}
+
+std::optional<ObjectRecord> ObjectIndex::findImage(uint64_t hash) const {
+    const auto& shard = shards_[shardOf(hash)];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.images.find(hash);
+    if (it == shard.images.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::optional<uint64_t> ObjectIndex::findName(const std::string& name) const {
+    const auto& shard = shards_[shardOf(name)];
+    std::shared_lock<std::shared_mutex> lock(shard.mutex);
+    auto it = shard.names.find(name);
+    if (it == shard.names.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void ObjectIndex::forEachImage(const std::function<void(uint64_t, const ObjectRecord&)>& fn) const {
+    for (const auto& shard : shards_) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& [hash, record] : shard.images) {
+            fn(hash, record);
+        }
+    }
+}
+
+void ObjectIndex::forEachName(const std::function<void(const std::string&, uint64_t)>& fn) const {
+    for (const auto& shard : shards_) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& [name, hash] : shard.names) {
+            fn(name, hash);
+        }
+    }
+}
+
+ObjectIndex::Capture ObjectIndex::capture() {
+    Capture capture;
+    {
+        std::lock_guard<std::mutex> lock(journalMutex_);
+        capture.seq = lastSeq_;
+        capture.images.reserve(imageCount());
+        capture.names.reserve(nameCount());
+        for (const auto& shard : shards_) {
+            std::shared_lock<std::shared_mutex> shardLock(shard.mutex);
+            for (const auto& [hash, record] : shard.images) {
+                capture.images.push_back(hash);
+            }
+            for (const auto& [name, hash] : shard.names) {
+                capture.names.emplace_back(name, hash);
+            }
+        }
+    }
+    std::sort(capture.images.begin(), capture.images.end());
+    std::sort(capture.names.begin(), capture.names.end());
+    return capture;
+}
+
+void ObjectIndex::appendJournal(Op op, uint64_t hash, uint64_t size, const std::string& name,
+                                ImageFormat format) {
+    if (journalFd_ < 0) {
+        return;
+    }
+
+    JournalRecord record{};
+    record.seq = lastSeq_ + 1;
+    record.hash = hash;
+    record.size = size;
+    record.nameLength = static_cast<uint16_t>(std::min<size_t>(name.size(), UINT16_MAX));
+    record.op = static_cast<uint8_t>(op);
+    record.format = static_cast<uint8_t>(format);
+    record.checksum = recordChecksum(record, name.data());
+
+    std::string buffer(reinterpret_cast<const char*>(&record), sizeof(record));
+    buffer.append(name.data(), record.nameLength);
+    if (!writeAll(journalFd_, buffer.data(), buffer.size())) {
+        std::cerr << "Failed to append to index journal: " << std::strerror(errno) << std::endl;
+        return;
+    }
+
+    lastSeq_ = record.seq;
+    ++journalRecords_;
+    journalDirty_ = true;
+}
+
+void ObjectIndex::apply(Op op, uint64_t hash, uint64_t size, const std::string& name, ImageFormat format) {
+    switch (op) {
+        case Op::AddImage: {
+            auto& shard = shards_[shardOf(hash)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto [it, inserted] = shard.images.try_emplace(hash);
+            if (size != 0) {
+                it->second.size = size;
+            }
+            if (format != ImageFormat::Unknown) {
+                it->second.format = format;
+            }
+            it->second.tier = 0;
+            if (inserted) {
+                ++imageCount_;
+                merkle_.toggle(hash);
+            }
+            break;
+        }
+        case Op::RemoveImage: {
+            auto& shard = shards_[shardOf(hash)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (shard.images.erase(hash) > 0) {
+                --imageCount_;
+                merkle_.toggle(hash);
+            }
+            break;
+        }
+        case Op::SetTier: {
+            auto& shard = shards_[shardOf(hash)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            auto it = shard.images.find(hash);
+            if (it != shard.images.end()) {
+                it->second.tier = static_cast<uint8_t>(size);
+            }
+            break;
+        }
+        case Op::SetName: {
+            auto& shard = shards_[shardOf(name)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (shard.names.insert_or_assign(name, hash).second) {
+                ++nameCount_;
+            }
+            break;
+        }
+        case Op::RemoveName: {
+            auto& shard = shards_[shardOf(name)];
+            std::unique_lock<std::shared_mutex> lock(shard.mutex);
+            if (shard.names.erase(name) > 0) {
+                --nameCount_;
+            }
+            break;
+        }
+    }
+}
+
+bool ObjectIndex::loadSnapshot(uint64_t& snapshotSeq) {
+    int fd = ::open(snapshotPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cout << "No index snapshot found" << std::endl;
+        return false;
+    }
+
+    struct stat st{};
+    if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SnapshotHeader)) {
+        ::close(fd);
+        std::cerr << "Index snapshot is truncated" << std::endl;
+        return false;
+    }
+
+    size_t fileSize = static_cast<size_t>(st.st_size);
+    void* mapping = ::mmap(nullptr, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        std::cerr << "Failed to map index snapshot: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    ::madvise(mapping, fileSize, MADV_SEQUENTIAL);
+
+    const auto* base = static_cast<const char*>(mapping);
+    const auto* header = reinterpret_cast<const SnapshotHeader*>(base);
+
+    size_t imageStride = header->version == 1 ? kSnapshotImageSizeV1 : sizeof(SnapshotImage);
+    bool valid = std::memcmp(header->magic, kSnapshotMagic, sizeof(kSnapshotMagic)) == 0 &&
+                 (header->version == 1 || header->version == kSnapshotVersion) &&
+                 header->headerSize == sizeof(SnapshotHeader) &&
+                 fileSize == sizeof(SnapshotHeader) + header->imageCount * imageStride +
+                             header->nameCount * sizeof(SnapshotName) + header->nameBytes &&
+                 HashUtils::xxh3_64(base + sizeof(SnapshotHeader), fileSize - sizeof(SnapshotHeader)) ==
+                     header->checksum;
+    if (!valid) {
+        ::munmap(mapping, fileSize);
+        std::cerr << "Index snapshot failed validation" << std::endl;
+        return false;
+    }
+
+    const char* images = base + sizeof(SnapshotHeader);
+    const auto* names = reinterpret_cast<const SnapshotName*>(images + header->imageCount * imageStride);
+    const char* nameBytes = reinterpret_cast<const char*>(names + header->nameCount);
+
+    // Each worker owns the shards congruent to its ID, so inserts need no locks
+    unsigned threads = loaderThreads();
+    std::vector<uint8_t> nameShards(header->nameCount);
+    {
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                for (uint64_t i = t; i < header->nameCount; i += threads) {
+                    std::string name(nameBytes + names[i].offset, names[i].length);
+                    nameShards[i] = static_cast<uint8_t>(shardOf(name));
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t]() {
+            for (uint64_t i = 0; i < header->imageCount; ++i) {
+                // Version 1 entries end after size; format is read only from version 2
+                const auto* image = reinterpret_cast<const SnapshotImage*>(images + i * imageStride);
+                size_t shard = shardOf(image->hash);
+                if (shard % threads == t) {
+                    auto [it, inserted] = shards_[shard].images.try_emplace(image->hash);
+                    if (inserted) {
+                        merkle_.toggle(image->hash);
+                    }
+                    auto& record = it->second;
+                    record.size = image->size;
+                    if (imageStride == sizeof(SnapshotImage)) {
+                        record.format = static_cast<ImageFormat>(image->format);
+                        record.tier = image->tier;
+                    }
+                }
+            }
+            for (uint64_t i = 0; i < header->nameCount; ++i) {
+                if (nameShards[i] % threads == t) {
+                    shards_[nameShards[i]].names.insert_or_assign(
+                        std::string(nameBytes + names[i].offset, names[i].length), names[i].hash);
+                }
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    imageCount_ = header->imageCount;
+    nameCount_ = header->nameCount;
+    snapshotSeq = header->seq;
+
+    ::munmap(mapping, fileSize);
+    return true;
+}
+
+uint64_t ObjectIndex::replayJournal(const std::filesystem::path& path, uint64_t afterSeq) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return afterSeq;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    uint64_t maxSeq = afterSeq;
+    uint64_t replayed = 0;
+    size_t pos = 0;
+    while (pos + sizeof(JournalRecord) <= data.size()) {
+        JournalRecord record;
+        std::memcpy(&record, data.data() + pos, sizeof(record));
+        if (pos + sizeof(record) + record.nameLength > data.size()) {
+            break; // torn tail from a crash mid-append
+        }
+        const char* name = data.data() + pos + sizeof(record);
+        if (recordChecksum(record, name) != record.checksum) {
+            std::cerr << "Index journal " << path << " corrupt at offset " << pos
+                      << "; ignoring the remainder" << std::endl;
+            break;
+        }
+        pos += sizeof(record) + record.nameLength;
+
+        if (record.seq <= afterSeq) {
+            continue;
+        }
+        apply(static_cast<Op>(record.op), record.hash, record.size, std::string(name, record.nameLength),
+              static_cast<ImageFormat>(record.format));
+        maxSeq = std::max(maxSeq, record.seq);
+        ++replayed;
+    }
+
+    journalRecordsReplayed_.increment(replayed);
+    return maxSeq;
+}
+
+bool ObjectIndex::writeSnapshot() {
+    std::lock_guard<std::mutex> snapshotLock(snapshotMutex_);
+
+    // Rotate the journal: everything up to seq goes into this snapshot, later
+    // records land in the fresh journal and are replayed on top of it
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(journalMutex_);
+        seq = lastSeq_;
+        if (journalFd_ >= 0) {
+            ::fdatasync(journalFd_);
+            ::close(journalFd_);
+            journalFd_ = -1;
+        }
+
+        std::error_code ec;
+        if (std::filesystem::exists(retiredJournalPath(), ec)) {
+            // An earlier snapshot failed; keep its records by appending ours
+            std::ifstream in(journalPath(), std::ios::binary);
+            std::ofstream out(retiredJournalPath(), std::ios::binary | std::ios::app);
+            out << in.rdbuf();
+            out.close();
+            std::filesystem::remove(journalPath(), ec);
+        } else {
+            std::filesystem::rename(journalPath(), retiredJournalPath(), ec);
+        }
+
+        journalFd_ = ::open(journalPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        journalRecords_ = 0;
+        journalDirty_ = false;
+    }
+
+    std::vector<SnapshotImage> images;
+    std::vector<SnapshotName> names;
+    std::string nameBytes;
+    images.reserve(imageCount());
+    names.reserve(nameCount());
+
+    for (const auto& shard : shards_) {
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        for (const auto& [hash, record] : shard.images) {
+            images.push_back({hash, record.size, static_cast<uint8_t>(record.format), record.tier, {}});
+        }
+        for (const auto& [name, hash] : shard.names) {
+            names.push_back({hash, nameBytes.size(), static_cast<uint32_t>(name.size()), 0});
+            nameBytes += name;
+        }
+    }
+    std::sort(images.begin(), images.end(),
+              [](const SnapshotImage& a, const SnapshotImage& b) { return a.hash < b.hash; });
+
+    SnapshotHeader header{};
+    std::memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+    header.version = kSnapshotVersion;
+    header.headerSize = sizeof(SnapshotHeader);
+    header.seq = seq;
+    header.imageCount = images.size();
+    header.nameCount = names.size();
+    header.nameBytes = nameBytes.size();
+
+    Xxh3Stream hasher;
+    hasher.update(images.data(), images.size() * sizeof(SnapshotImage));
+    hasher.update(names.data(), names.size() * sizeof(SnapshotName));
+    hasher.update(nameBytes.data(), nameBytes.size());
+    header.checksum = hasher.digest();
+
+    auto tmpPath = dir_ / "index.snapshot.tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Failed to create index snapshot: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+
+    bool ok = writeAll(fd, &header, sizeof(header)) &&
+              writeAll(fd, images.data(), images.size() * sizeof(SnapshotImage)) &&
+              writeAll(fd, names.data(), names.size() * sizeof(SnapshotName)) &&
+              writeAll(fd, nameBytes.data(), nameBytes.size()) &&
+              ::fsync(fd) == 0;
+    ::close(fd);
+
+    std::error_code ec;
+    if (!ok) {
+        std::cerr << "Failed to write index snapshot: " << std::strerror(errno) << std::endl;
+        std::filesystem::remove(tmpPath, ec);
+        return false;
+    }
+
+    std::filesystem::rename(tmpPath, snapshotPath(), ec);
+    if (ec) {
+        std::cerr << "Failed to commit index snapshot: " << ec.message() << std::endl;
+        return false;
+    }
+    syncDirectory(dir_);
+    std::filesystem::remove(retiredJournalPath(), ec);
+
+    snapshotsWritten_.increment();
+    return true;
+}
+
+void ObjectIndex::startBackgroundSnapshots(std::chrono::seconds interval) {
+    std::lock_guard<std::mutex> lock(threadMutex_);
+    if (thread_.joinable()) {
+        return;
+    }
+    stopRequested_ = false;
+    thread_ = std::thread(&ObjectIndex::backgroundLoop, this, interval);
+}
+
+void ObjectIndex::stop() {
+    {
+        std::lock_guard<std::mutex> lock(threadMutex_);
+        stopRequested_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+
+    std::lock_guard<std::mutex> lock(journalMutex_);
+    if (journalFd_ >= 0) {
+        ::fdatasync(journalFd_);
+        ::close(journalFd_);
+        journalFd_ = -1;
+    }
+}
+
+void ObjectIndex::backgroundLoop(std::chrono::seconds interval) {
+    auto lastSnapshot = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(threadMutex_);
+
+    while (!stopRequested_) {
+        // Journal data is flushed once a second rather than on every append
+        cv_.wait_for(lock, std::chrono::seconds(1), [this]() { return stopRequested_; });
+        if (stopRequested_) {
+            break;
+        }
+        lock.unlock();
+
+        bool snapshotDue;
+        int syncFd = -1;
+        {
+            std::lock_guard<std::mutex> journalLock(journalMutex_);
+            if (journalDirty_ && journalFd_ >= 0) {
+                syncFd = ::dup(journalFd_);
+                journalDirty_ = false;
+            }
+            snapshotDue = journalRecords_ > 0 &&
+                          (journalRecords_ >= kSnapshotJournalRecords ||
+                           std::chrono::steady_clock::now() - lastSnapshot >= interval);
+        }
+
+        // Sync a duplicate outside the lock so writers never wait on the disk
+        if (syncFd >= 0) {
+            ::fdatasync(syncFd);
+            ::close(syncFd);
+        }
+
+        if (snapshotDue && writeSnapshot()) {
+            lastSnapshot = std::chrono::steady_clock::now();
+        }
+
+        lock.lock();
+    }
+}
+
+} // namespace imgstore
@@ -0,0 +1,197 @@
+#include "peer_client.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace imgstore {
+
+namespace {
+
+// Closes the socket on every return path
+class Socket {
+public:
+    explicit Socket(int fd) : fd_(fd) {}
+    ~Socket() {
+        if (fd_ >= 0) {
+            ::close(fd_);
+        }
+    }
+    Socket(const Socket&) = delete;
+    Socket& operator=(const Socket&) = delete;
+
+    int fd() const { return fd_; }
+
+private:
+    int fd_;
+};
+
+int connectTo(const std::string& host, const std::string& port, std::chrono::milliseconds timeout) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (::getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0) {
+        return -1;
+    }
+
+    int result = -1;
+    for (addrinfo* ai = addresses; ai && result < 0; ai = ai->ai_next) {
+        int fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        // Non-blocking only for the connect, so it can time out
+        int flags = ::fcntl(fd, F_GETFL, 0);
+        ::fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+        bool connected = ::connect(fd, ai->ai_addr, ai->ai_addrlen) == 0;
+        if (!connected && errno == EINPROGRESS) {
+            pollfd pfd{fd, POLLOUT, 0};
+            int error = 0;
+            socklen_t length = sizeof(error);
+            connected = ::poll(&pfd, 1, static_cast<int>(timeout.count())) == 1 &&
+                        ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0;
+        }
+        if (!connected) {
+            ::close(fd);
+            continue;
+        }
+        ::fcntl(fd, F_SETFL, flags);
+        result = fd;
+    }
+    ::freeaddrinfo(addresses);
+    return result;
+}
+
+bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+std::string PeerClient::Response::header(const std::string& name) const {
+    for (const auto& [key, value] : headers) {
+        if (::strcasecmp(key.c_str(), name.c_str()) == 0) {
+            return value;
+        }
+    }
+    return "";
+}
+
+PeerClient::PeerClient(std::chrono::milliseconds timeout) : timeout_(timeout) {}
+
+std::optional<PeerClient::Response> PeerClient::send(const std::string& address, const std::string& method,
+                                                     const std::string& target, const Headers& headers,
+                                                     const std::string& body) const {
+    auto colon = address.rfind(':');
+    if (colon == std::string::npos) {
+        return std::nullopt;
+    }
+    Socket socket(connectTo(address.substr(0, colon), address.substr(colon + 1), timeout_));
+    if (socket.fd() < 0) {
+        return std::nullopt;
+    }
+
+    timeval tv{};
+    tv.tv_sec = static_cast<time_t>(timeout_.count() / 1000);
+    tv.tv_usec = static_cast<suseconds_t>((timeout_.count() % 1000) * 1000);
+    ::setsockopt(socket.fd(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    ::setsockopt(socket.fd(), SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string request = method + " " + target + " HTTP/1.1\r\nHost: " + address + "\r\n";
+    for (const auto& [key, value] : headers) {
+        request += key + ": " + value + "\r\n";
+    }
+    request += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+    if (!sendAll(socket.fd(), request.data(), request.size()) || !sendAll(socket.fd(), body.data(), body.size())) {
+        return std::nullopt;
+    }
+
+    // Read until the peer closes or the announced body has arrived
+    std::string raw;
+    size_t headerEnd = std::string::npos;
+    std::optional<size_t> contentLength;
+    char buffer[64 * 1024];
+    Response response;
+    while (true) {
+        ssize_t n = ::recv(socket.fd(), buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return std::nullopt; // timed out or reset
+        }
+        if (n == 0) {
+            break;
+        }
+        raw.append(buffer, static_cast<size_t>(n));
+
+        if (headerEnd == std::string::npos) {
+            headerEnd = raw.find("\r\n\r\n");
+            if (headerEnd == std::string::npos) {
+                continue;
+            }
+            size_t lineEnd = raw.find("\r\n");
+            std::string statusLine = raw.substr(0, lineEnd);
+            auto space = statusLine.find(' ');
+            if (statusLine.compare(0, 5, "HTTP/") != 0 || space == std::string::npos) {
+                return std::nullopt;
+            }
+            response.status = std::atoi(statusLine.c_str() + space + 1);
+
+            size_t pos = lineEnd + 2;
+            while (pos < headerEnd) {
+                size_t end = raw.find("\r\n", pos);
+                std::string line = raw.substr(pos, end - pos);
+                pos = end + 2;
+                auto separator = line.find(':');
+                if (separator == std::string::npos) {
+                    continue;
+                }
+                std::string key = line.substr(0, separator);
+                size_t valueStart = line.find_first_not_of(' ', separator + 1);
+                std::string value = valueStart == std::string::npos ? "" : line.substr(valueStart);
+                if (::strcasecmp(key.c_str(), "Content-Length") == 0) {
+                    contentLength = static_cast<size_t>(std::strtoull(value.c_str(), nullptr, 10));
+                }
+                response.headers.emplace_back(std::move(key), std::move(value));
+            }
+            if (method == "HEAD" || response.status == 204 || response.status == 304) {
+                contentLength = 0; // no body follows, whatever the headers say
+            }
+            if (contentLength) {
+                raw.reserve(headerEnd + 4 + *contentLength);
+            }
+        }
+        if (contentLength && raw.size() >= headerEnd + 4 + *contentLength) {
+            break;
+        }
+    }
+
+    if (headerEnd == std::string::npos || (contentLength && raw.size() < headerEnd + 4 + *contentLength)) {
+        return std::nullopt;
+    }
+    response.body = raw.substr(headerEnd + 4, contentLength.value_or(raw.size() - headerEnd - 4));
+    return response;
+}
+
+} // namespace imgstore
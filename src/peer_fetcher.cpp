@@ -0,0 +1,113 @@
+#include "peer_fetcher.h"
+#include "hash_utils.h"
+#include <iostream>
+
+namespace imgstore {
+
+PeerFetcher::PeerFetcher(std::vector<std::string> peers, std::chrono::milliseconds timeout, Store store)
+    : peers_(std::move(peers)), client_(timeout), store_(std::move(store)),
+      found_(Metrics::instance().counter("imgstore_peer_fetches_total{result=\"found\"}",
+                                         "Local misses looked up on peers, by outcome")),
+      missing_(Metrics::instance().counter("imgstore_peer_fetches_total{result=\"missing\"}",
+                                           "Local misses looked up on peers, by outcome")),
+      rejected_(Metrics::instance().counter("imgstore_peer_fetch_rejected_total",
+                                            "Images from peers that did not match their hash")),
+      shared_(Metrics::instance().counter("imgstore_peer_fetch_shared_total",
+                                          "Local misses that waited for a fetch already in flight")),
+      bytes_(Metrics::instance().counter("imgstore_peer_fetch_bytes_total",
+                                         "Image bytes fetched from peers")),
+      seconds_(Metrics::instance().summary("imgstore_peer_fetch_seconds",
+                                           "Time spent fetching images from peers")) {}
+
+std::optional<std::vector<uint8_t>> PeerFetcher::fetch(const std::string& imageId) {
+    uint64_t hash = 0;
+    if (peers_.empty() || !HashUtils::hexToHash(imageId, hash)) {
+        return std::nullopt; // without a content hash there is nothing to check the bytes against
+    }
+
+    std::promise<Result> promise;
+    std::shared_future<Result> flight;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = inflight_.find(imageId);
+        if (it != inflight_.end()) {
+            flight = it->second;
+        } else {
+            inflight_.emplace(imageId, promise.get_future().share());
+        }
+    }
+    if (flight.valid()) {
+        shared_.increment();
+        return flight.get();
+    }
+
+    Result result;
+    try {
+        result = fetchFromPeers(imageId, hash);
+        if (result && store_) {
+            store_(imageId, *result);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error fetching image " << imageId << " from peers: " << e.what() << std::endl;
+        result.reset();
+    }
+
+    // Waiters are released only once the image is stored, so they find it locally
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inflight_.erase(imageId);
+    }
+    promise.set_value(result);
+    return result;
+}
+
+std::optional<PeerClient::Response> PeerFetcher::relay(const std::string& imageId, const std::string& target,
+                                                       const PeerClient::Headers& headers) {
+    PeerClient::Headers forwarded = headers;
+    forwarded.emplace_back(PeerClient::kHopHeader, "peer");
+    for (size_t i : order(HashUtils::xxh3_64(imageId))) {
+        auto response = client_.send(peers_[i], "GET", target, forwarded, "");
+        if (response && response->status != 404) {
+            return response;
+        }
+    }
+    return std::nullopt;
+}
+
+std::vector<size_t> PeerFetcher::order(uint64_t hash) const {
+    std::vector<size_t> result;
+    for (size_t i = 0; i < peers_.size(); ++i) {
+        result.push_back((hash + i) % peers_.size());
+    }
+    return result;
+}
+
+PeerFetcher::Result PeerFetcher::fetchFromPeers(const std::string& imageId, uint64_t hash) {
+    auto start = std::chrono::steady_clock::now();
+    PeerClient::Headers headers = {{PeerClient::kHopHeader, "peer"}};
+    Result result;
+    for (size_t i : order(hash)) {
+        auto response = client_.send(peers_[i], "GET", "/images/" + imageId, headers, "");
+        if (!response || response->status != 200) {
+            continue;
+        }
+        if (HashUtils::xxh3_64(response->body) != hash) {
+            std::cerr << "Peer " << peers_[i] << " sent image " << imageId << " with the wrong content" << std::endl;
+            rejected_.increment();
+            continue;
+        }
+        result.emplace(response->body.begin(), response->body.end());
+        break;
+    }
+    seconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+    if (!result) {
+        missing_.increment();
+        return result;
+    }
+    found_.increment();
+    bytes_.increment(result->size());
+    return result;
+}
+
+} // namespace imgstore
@@ -0,0 +1,60 @@
+#include "perceptual_hash.h"
+#include <array>
+
+namespace imgstore {
+
+namespace {
+
+// Decoding at this size or above keeps several source pixels per grid
+// cell, so the averages are not dominated by single-pixel noise
+constexpr int kDecodeScale = 8;
+
+} // namespace
+
+uint64_t PerceptualHash::dhash(const Image& image) {
+    std::array<uint64_t, kGridWidth * kGridHeight> sums{};
+    std::array<uint32_t, kGridWidth * kGridHeight> counts{};
+
+    // Grid column of every source column, computed once per image
+    std::vector<int> column(static_cast<size_t>(image.width));
+    for (int x = 0; x < image.width; ++x) {
+        column[x] = static_cast<int>(static_cast<int64_t>(x) * kGridWidth / image.width);
+    }
+
+    const int channels = image.channels;
+    for (int y = 0; y < image.height; ++y) {
+        int row = static_cast<int>(static_cast<int64_t>(y) * kGridHeight / image.height) * kGridWidth;
+        const uint8_t* p = image.pixels.data() + static_cast<size_t>(y) * image.width * channels;
+        for (int x = 0; x < image.width; ++x, p += channels) {
+            // BT.601 luma in 8.8 fixed point
+            uint32_t luma = (77u * p[0] + 150u * p[1] + 29u * p[2]) >> 8;
+            if (channels == 4) {
+                luma = (luma * p[3] + 255u * (255u - p[3])) / 255u;
+            }
+            sums[row + column[x]] += luma;
+            ++counts[row + column[x]];
+        }
+    }
+
+    // Compare averages by cross-multiplying rather than dividing
+    uint64_t hash = 0;
+    for (int y = 0; y < kGridHeight; ++y) {
+        for (int x = 0; x + 1 < kGridWidth; ++x) {
+            size_t left = static_cast<size_t>(y * kGridWidth + x);
+            if (sums[left] * counts[left + 1] > sums[left + 1] * counts[left]) {
+                hash |= uint64_t{1} << (y * (kGridWidth - 1) + x);
+            }
+        }
+    }
+    return hash;
+}
+
+std::optional<uint64_t> PerceptualHash::compute(const std::vector<uint8_t>& data) {
+    auto image = ImageCodec::decode(data, kGridWidth * kDecodeScale, kGridHeight * kDecodeScale);
+    if (!image || image->width < kGridWidth || image->height < kGridHeight) {
+        return std::nullopt;
+    }
+    return dhash(*image);
+}
+
+} // namespace imgstore
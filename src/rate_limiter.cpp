@@ -0,0 +1,45 @@
+#include "rate_limiter.h"
+#include <algorithm>
+#include <thread>
+
+namespace imgstore {
+
+RateLimiter::RateLimiter(double bytesPerSecond, double burstBytes)
+    : rate_(bytesPerSecond),
+      burst_(burstBytes > 0 ? burstBytes : bytesPerSecond),
+      tokens_(burst_),
+      last_(Clock::now()) {}
+
+void RateLimiter::acquire(size_t bytes) {
+    std::chrono::duration<double> wait{0};
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (rate_ <= 0) {
+            return;
+        }
+
+        auto now = Clock::now();
+        double elapsed = std::chrono::duration<double>(now - last_).count();
+        last_ = now;
+        tokens_ = std::min(burst_, tokens_ + elapsed * rate_);
+
+        // Go into debt and sleep it off, so requests larger than the burst still pass
+        tokens_ -= static_cast<double>(bytes);
+        if (tokens_ < 0) {
+            wait = std::chrono::duration<double>(-tokens_ / rate_);
+        }
+    }
+
+    if (wait.count() > 0) {
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+void RateLimiter::setRate(double bytesPerSecond) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rate_ = bytesPerSecond;
+    burst_ = bytesPerSecond;
+    tokens_ = std::min(tokens_, burst_);
+}
+
+} // namespace imgstore
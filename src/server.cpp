@@ -1,16 +1,47 @@
 #include "server.h"
+#include <algorithm>
+#include <cstdlib>
 #include <iostream>
+#include <thread>
 
 namespace imgstore {
 
-Server::Server(const std::string& storageDir, int port, const std::string& apiKey)
-    : port_(port),
-      storage_(std::make_shared<StorageManager>(storageDir)),
+StorageOptions storageOptions(const ServerConfig& config) {
+    StorageOptions options;
+    options.shardDepth = config.shardDepth;
+    options.shardWidth = config.shardWidth;
+    options.reshardRate = std::max(config.reshardRate, 0.0);
+    options.snapshotIntervalSeconds = config.snapshotIntervalSeconds;
+    options.dirCacheSize = static_cast<size_t>(std::max(config.dirCacheSize, 0));
+    options.tombstoneRetentionHours = std::max(config.tombstoneRetentionHours, 0);
+    options.knownDirs = config.knownDirs;
+    options.chunking = config.chunking;
+    options.chunkMinSize = static_cast<size_t>(std::max(config.chunkMinSizeKB, 0)) * 1024;
+    options.diskDirs = config.dataDisks;
+    options.diskQueueDepth = static_cast<size_t>(std::max(config.diskQueueDepth, 1));
+    options.coldDirs = config.coldStorageDirs;
+    options.tierPolicy.demoteAfter =
+        std::chrono::seconds(static_cast<int64_t>(std::max(config.demoteAfterHours, 0.0) * 3600));
+    options.tierPolicy.promoteAfterReads = static_cast<uint32_t>(std::max(config.promoteAfterReads, 0));
+    options.mirrorDir = config.mirrorDir;
+    options.mirrorAsync = config.mirrorAsync;
+    options.mirrorQueueSize = static_cast<size_t>(std::max(config.mirrorQueueSize, 1));
+    options.mirrorReadTimeout = std::chrono::milliseconds(std::max(config.mirrorReadTimeoutMs, 0));
+    options.ecDirs = config.ecDirs;
+    options.ecParity = static_cast<size_t>(std::max(config.ecParity, 0));
+    options.ecMinSize = static_cast<size_t>(std::max(config.ecMinSizeKB, 0)) * 1024;
+    return options;
+}
+
+Server::Server(const ServerConfig& config)
+    : port_(config.port),
+      storage_(std::make_shared<StorageManager>(config.storageDir, storageOptions(config))),
       handler_(std::make_shared<ImageHandler>(storage_)),
-      authEnabled_(!apiKey.empty()) {
+      io_(std::make_shared<IoExecutor>(config.ioThreads)),
+      authEnabled_(!config.apiKey.empty()) {
     
     if (authEnabled_) {
-        auth_ = std::make_shared<AuthMiddleware>(apiKey);
+        auth_ = std::make_shared<AuthMiddleware>(config.apiKey);
         std::cout << "🔒 API key authentication enabled" << std::endl;
         std::cout << "   GET requests: Public (no auth required)" << std::endl;
         std::cout << "   POST/DELETE: Protected (API key required)" << std::endl;
@@ -19,10 +50,302 @@ Server::Server(const std::string& storageDir, int port, const std::string& apiKe
         std::cout << "   All endpoints are publicly accessible." << std::endl;
         std::cout << "   Set IMG_STORE_API_KEY environment variable to enable auth." << std::endl;
     }
+
+    // The scrubber thread always runs so an admin can trigger a pass;
+    // periodic passes only happen when enabled
+    auto scrubInterval = config.scrubEnabled ? std::chrono::hours(config.scrubIntervalHours) : std::chrono::hours(0);
+    scrubber_ = std::make_shared<IntegrityScrubber>(storage_, config.scrubRateMBps * 1024 * 1024,
+                                                    std::chrono::duration_cast<std::chrono::seconds>(scrubInterval));
+    scrubber_->start();
+    handler_->setScrubber(scrubber_);
+    handler_->setReadVerification(config.verifyReads);
+    handler_->setUploadValidation(config.validateUploads, config.rejectUnknownUploads);
+    handler_->setTransforms(std::make_shared<ImageTransformer>(config.resizeThreads),
+                            std::make_shared<VariantCache>(config.storageDir, storage_->layout(),
+                                                           static_cast<size_t>(std::max(0, config.variantsPerSource))));
+
+    std::vector<ImageFormat> transcodeFormats;
+    for (const auto& name : config.transcodeFormats) {
+        ImageFormat format = ImageCodec::parseFormat(name);
+        if (!ImageCodec::canEncode(format)) {
+            std::cerr << "Transcoding to '" << name << "' is not available in this build" << std::endl;
+            continue;
+        }
+        transcodeFormats.push_back(format);
+    }
+    handler_->setTranscodeFormats(transcodeFormats);
+    setupVariantPresets(config);
+    setupCluster(config);
+    setupPeerFetch(config);
+    setupAntiEntropy(config);
+
+    if (config.feedEnabled) {
+        ChangeFeed::Options options;
+        options.retention = std::chrono::hours(std::max(config.feedRetentionHours, 0));
+        options.maxBytes = static_cast<uint64_t>(std::max(config.feedMaxSizeMB, 1)) * 1024 * 1024;
+        feed_ = std::make_shared<ChangeFeed>(std::filesystem::path(config.storageDir) / "feed", options);
+        handler_->setChangeFeed(feed_);
+        std::cout << "📜 Change feed enabled (" << config.feedMaxSizeMB << " MB, " << config.feedRetentionHours
+                  << "h retention)" << std::endl;
+    }
+
+    auto backupDir = config.backupDir.empty() ? std::filesystem::path(config.storageDir) / "backups"
+                                              : std::filesystem::path(config.backupDir);
+    backups_ = std::make_shared<BackupManager>(storage_, backupDir, std::max(config.backupRateMBps, 0.0) * 1024 * 1024);
+    handler_->setBackups(backups_);
+
+    if (config.similarityIndex) {
+        auto similarity = std::make_shared<SimilarityIndex>(config.storageDir);
+        similarity->load();
+        handler_->setSimilarityIndex(similarity);
+        storage_->setSimilarityIndex(similarity);
+        std::cout << "🔎 Near-duplicate index enabled (" << similarity->size() << " images)" << std::endl;
+    }
+    if (config.scrubEnabled) {
+        std::cout << "🧹 Integrity scrubber enabled (every " << config.scrubIntervalHours
+                  << "h, " << config.scrubRateMBps << " MB/s)" << std::endl;
+    }
     
     setupRoutes();
 }
 
+Server::~Server() {
+    if (pipeline_) {
+        pipeline_->shutdown();
+    }
+    io_->shutdown();
+    scrubber_->stop();
+    if (sync_) {
+        sync_->stop();
+    }
+    backups_->stop();
+}
+
+void Server::setupVariantPresets(const ServerConfig& config) {
+    std::map<std::string, TransformSpec> presets;
+    for (const auto& definition : config.variantPresets) {
+        size_t colon = definition.find(':');
+        std::string name = definition.substr(0, colon);
+        TransformSpec spec;
+        std::string error;
+        if (colon == std::string::npos || name.empty()) {
+            error = "expected name:params";
+        } else {
+            spec.parse(definition.substr(colon + 1), error);
+        }
+        if (!error.empty()) {
+            std::cerr << "Ignoring variant preset '" << definition << "': " << error << std::endl;
+            continue;
+        }
+        presets[name] = spec;
+    }
+    handler_->setPresets(presets);
+
+    if (presets.empty() || config.variantQueueSize <= 0) {
+        return;
+    }
+
+    // Variant work is shed while requests queue for I/O threads or the
+    // machine is already loaded
+    size_t ioThreads = io_->threadCount();
+    double maxLoad = config.variantMaxLoad * std::max(1u, std::thread::hardware_concurrency());
+    auto io = io_;
+    auto underPressure = [io, ioThreads, maxLoad]() {
+        if (io->queueDepth() > ioThreads) {
+            return true;
+        }
+        double load = 0.0;
+        return maxLoad > 0 && getloadavg(&load, 1) == 1 && load > maxLoad;
+    };
+
+    pipeline_ = std::make_shared<VariantPipeline>(config.variantThreads, config.variantQueueSize, underPressure);
+    handler_->setVariantPipeline(pipeline_);
+    std::cout << "🖼️  Eager variants for " << presets.size() << " preset(s), queue of "
+              << config.variantQueueSize << std::endl;
+}
+
+void Server::setupCluster(const ServerConfig& config) {
+    if (config.nodeId.empty()) {
+        return;
+    }
+
+    Cluster::Options options;
+    for (const auto& spec : config.clusterNodes) {
+        ClusterRing::Node node;
+        if (!ClusterRing::parseNode(spec, node)) {
+            std::cerr << "Ignoring cluster node '" << spec << "': expected id=host:port" << std::endl;
+            continue;
+        }
+        options.nodes.push_back(node);
+    }
+    std::string error;
+    if (!config.clusterConfigFile.empty() && !ClusterRing::loadFile(config.clusterConfigFile, options.nodes, error)) {
+        std::cerr << "Cluster mode disabled: " << error << std::endl;
+        return;
+    }
+    options.self = config.nodeId;
+    options.replicas = static_cast<size_t>(std::max(config.replicas, 1));
+    options.writeQuorum = static_cast<size_t>(std::max(config.writeQuorum, 0));
+    options.readQuorum = static_cast<size_t>(std::max(config.readQuorum, 1));
+    options.virtualNodes = static_cast<size_t>(std::max(config.virtualNodes, 1));
+    options.redirect = config.clusterRedirect;
+    options.timeout = std::chrono::milliseconds(std::max(config.clusterTimeoutMs, 1));
+    options.threads = static_cast<size_t>(std::max(config.clusterThreads, 1));
+    options.secret = config.clusterSecret.empty() ? config.apiKey : config.clusterSecret;
+    if (options.secret.empty()) {
+        std::cout << "⚠️  WARNING: No cluster secret, any client can mark its requests as forwarded" << std::endl;
+    }
+
+    try {
+        cluster_ = std::make_shared<Cluster>(options);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Cluster mode disabled: " << e.what() << std::endl;
+        return;
+    }
+    handler_->setCluster(cluster_);
+
+    auto status = cluster_->status();
+    std::cout << "🕸️  Cluster node " << status.self << " of " << status.nodes.size() << ", " << status.replicas
+              << " replicas, write quorum " << status.writeQuorum << ", read quorum " << status.readQuorum
+              << (status.redirect ? ", redirecting" : ", proxying") << std::endl;
+}
+
+void Server::setupPeerFetch(const ServerConfig& config) {
+    if (config.peers.empty()) {
+        return;
+    }
+
+    PeerFetcher::Store store;
+    if (config.peerCache) {
+        // The handler owns the fetcher, so a plain pointer back to it cannot dangle
+        store = [handler = handler_.get()](const std::string& imageId, const std::vector<uint8_t>& data) {
+            if (!handler->keepPeerImage(imageId, data)) {
+                std::cerr << "Not keeping image " << imageId << " fetched from a peer" << std::endl;
+            }
+        };
+    }
+    handler_->setPeerFetcher(std::make_shared<PeerFetcher>(
+        config.peers, std::chrono::milliseconds(std::max(config.peerTimeoutMs, 1)), std::move(store)));
+    std::cout << "🔗 Fetching missing images from " << config.peers.size() << " peer(s)"
+              << (config.peerCache ? ", keeping copies" : "") << std::endl;
+}
+
+void Server::setupAntiEntropy(const ServerConfig& config) {
+    if (config.syncPeers.empty()) {
+        return;
+    }
+
+    AntiEntropy::Options options;
+    options.peers = config.syncPeers;
+    options.interval = std::chrono::seconds(std::max(config.syncIntervalSeconds, 0));
+    options.timeout = std::chrono::milliseconds(std::max(config.peerTimeoutMs, 1));
+    options.apiKey = config.apiKey;
+
+    // In cluster mode a replica only takes the images it owns
+    AntiEntropy::Filter filter;
+    if (cluster_) {
+        filter = [cluster = cluster_, self = cluster_->status().self](const std::string& imageId) {
+            for (const auto& node : cluster->owners(Cluster::imageKey(imageId))) {
+                if (node.id == self) {
+                    return true;
+                }
+            }
+            return false;
+        };
+    }
+    sync_ = std::make_shared<AntiEntropy>(storage_, std::move(options), std::move(filter));
+    sync_->start();
+    handler_->setAntiEntropy(sync_);
+    std::cout << "🔄 Anti-entropy sync with " << config.syncPeers.size() << " peer(s) every "
+              << config.syncIntervalSeconds << "s" << std::endl;
+}
+
+void Server::serveFeed(const crow::request& req, crow::response& res) {
+    constexpr size_t kDefaultLimit = 100;
+    constexpr size_t kMaxLimit = 1000;
+    constexpr int kMaxWaitSeconds = 60;
+
+    uint64_t since = 0;
+    size_t limit = kDefaultLimit;
+    int wait = 0;
+    try {
+        if (const char* param = req.url_params.get("since")) {
+            since = std::stoull(param);
+        }
+        if (const char* param = req.url_params.get("limit")) {
+            limit = std::clamp<size_t>(std::stoull(param), 1, kMaxLimit);
+        }
+        if (const char* param = req.url_params.get("wait")) {
+            wait = std::clamp(std::stoi(param), 0, kMaxWaitSeconds);
+        }
+    } catch (const std::exception&) {
+        res = crow::response(400, "since, limit and wait must be numbers");
+        res.end();
+        return;
+    }
+
+    auto read = [this, since, limit]() { return handler_->handleFeed(since, limit); };
+    if (!feed_ || wait == 0) {
+        dispatch(req, res, read);
+        return;
+    }
+
+    // Whichever of the next event and the timeout comes first answers the request
+    struct LongPoll {
+        explicit LongPoll(crow::asio::io_context& io) : timer(io) {}
+        crow::asio::steady_timer timer;
+        std::atomic<bool> done{false};
+        std::atomic<uint64_t> token{0};
+    };
+    auto poll = std::make_shared<LongPoll>(*req.io_context);
+    auto complete = [this, &req, &res, read, poll, feed = feed_]() {
+        if (poll->done.exchange(true)) {
+            return;
+        }
+        feed->cancel(poll->token.load());
+        crow::asio::post(*req.io_context, [poll]() { poll->timer.cancel(); });
+        dispatch(req, res, read);
+    };
+
+    auto token = feed_->wait(since, complete);
+    if (!token) {
+        complete();
+        return;
+    }
+    poll->token = *token;
+    poll->timer.expires_after(std::chrono::seconds(wait));
+    poll->timer.async_wait([complete](const crow::error_code& ec) {
+        if (!ec) {
+            complete();
+        }
+    });
+}
+
+void Server::clustered(const crow::request& req, crow::response& res, uint64_t key,
+                       std::function<crow::response()> local, std::optional<uint64_t> contentKey) {
+    if (!cluster_) {
+        dispatch(req, res, std::move(local));
+        return;
+    }
+
+    // The I/O thread only serves the local part; once other nodes are
+    // involved the cluster's own pool finishes the request
+    Cluster::Reply reply = [&req, &res](crow::response result) {
+        crow::asio::post(*req.io_context, [&res, result = std::move(result)]() mutable {
+            res = std::move(result);
+            res.end();
+        });
+    };
+    io_->submit([this, &req, key, local = std::move(local), reply, contentKey]() {
+        try {
+            cluster_->route(req, key, local, reply, contentKey);
+        } catch (const std::exception& e) {
+            std::cerr << "Request error: " << e.what() << std::endl;
+            reply(crow::response(500, "Internal server error"));
+        }
+    });
+}
+
 bool Server::requireAuth(const crow::request& req) {
     if (!authEnabled_) {
         return true; // Auth disabled, allow all
@@ -43,6 +366,27 @@ bool Server::requireAuth(const crow::request& req) {
     return true;
 }
 
+void Server::dispatch(const crow::request& req, crow::response& res, std::function<crow::response()> work) {
+    // Crow keeps the request and response alive until end() is called. The
+    // finished response is handed back to the connection's own io_context:
+    // Crow still touches res after the route handler returns, and the socket
+    // write must not race with it.
+    io_->submit([&req, &res, work = std::move(work)]() {
+        crow::response result;
+        try {
+            result = work();
+        } catch (const std::exception& e) {
+            std::cerr << "Request error: " << e.what() << std::endl;
+            result = crow::response(500, "Internal server error");
+        }
+
+        crow::asio::post(*req.io_context, [&res, result = std::move(result)]() mutable {
+            res = std::move(result);
+            res.end();
+        });
+    });
+}
+
 void Server::setupRoutes() {
     // Health check endpoint - PUBLIC
     CROW_ROUTE(app_, "/health")
@@ -52,68 +396,370 @@ void Server::setupRoutes() {
 
     // List all names endpoint - PUBLIC
     CROW_ROUTE(app_, "/images/names")
+    ([this](const crow::request& req, crow::response& res) {
+        dispatch(req, res, [this]() { return handler_->handleListNames(); });
+    });
+
+    // Metrics endpoint - PUBLIC
+    CROW_ROUTE(app_, "/metrics")
     ([this]() {
-        return handler_->handleListNames();
+        return handler_->handleMetrics();
+    });
+
+    // Lookup filter rebuild endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/filters/rebuild").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for write operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this]() { return handler_->handleRebuildFilters(); });
+    });
+
+    // Chunk garbage collection endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/chunks/gc").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this]() { return handler_->handleChunkGc(); });
+    });
+
+    // Storage disk endpoints - PROTECTED
+    CROW_ROUTE(app_, "/admin/disks")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleListDisks();
+    });
+
+    CROW_ROUTE(app_, "/admin/disks").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this, &req]() { return handler_->handleAddDisk(req); });
+    });
+
+    // Shard layout endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/layout")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleLayoutStatus();
+    });
+
+    // Storage mirror endpoints - PROTECTED
+    CROW_ROUTE(app_, "/admin/mirror")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleMirrorStatus();
+    });
+
+    CROW_ROUTE(app_, "/admin/mirror/repair").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleMirrorRepair();
+    });
+
+    // Erasure coding endpoints - PROTECTED
+    CROW_ROUTE(app_, "/admin/erasure")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleErasureStatus();
+    });
+
+    CROW_ROUTE(app_, "/admin/erasure/sweep").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleErasureSweep();
+    });
+
+    // Cluster membership endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/cluster")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleClusterStatus(req);
+    });
+
+    // Change feed endpoint - PUBLIC
+    CROW_ROUTE(app_, "/feed")
+    ([this](const crow::request& req, crow::response& res) {
+        serveFeed(req, res);
+    });
+
+    // Hash tree and anti-entropy endpoints - PROTECTED
+    CROW_ROUTE(app_, "/admin/merkle")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleMerkle(req);
+    });
+
+    CROW_ROUTE(app_, "/admin/merkle/objects").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this, &req]() { return handler_->handleMerkleObjects(req); });
+    });
+
+    CROW_ROUTE(app_, "/admin/merkle/fetch").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this, &req]() { return handler_->handleMerkleFetch(req); });
+    });
+
+    CROW_ROUTE(app_, "/admin/merkle/written").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        dispatch(req, res, [this, &req]() { return handler_->handleMerkleWritten(req); });
+    });
+
+    CROW_ROUTE(app_, "/admin/sync")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleSyncStatus();
+    });
+
+    CROW_ROUTE(app_, "/admin/sync").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleSyncStart();
+    });
+
+    // Backup endpoints - PROTECTED
+    CROW_ROUTE(app_, "/admin/backups")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleBackupList();
+    });
+
+    CROW_ROUTE(app_, "/admin/backups").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req, crow::response& res) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            res = crow::response(401, result);
+            res.end();
+            return;
+        }
+        // Capturing the index and reading a base backup's capture can take a while
+        dispatch(req, res, [this, &req]() { return handler_->handleBackupStart(req); });
+    });
+
+    CROW_ROUTE(app_, "/admin/backups/<string>")
+    ([this](const crow::request& req, const std::string& id) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleBackupDownload(id);
+    });
+
+    CROW_ROUTE(app_, "/admin/backups/<string>").methods(crow::HTTPMethod::DELETE)
+    ([this](const crow::request& req, const std::string& id) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleBackupDelete(id);
+    });
+
+    // Scrubber status endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/scrub")
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleScrubStatus();
+    });
+
+    // Scrubber trigger endpoint - PROTECTED
+    CROW_ROUTE(app_, "/admin/scrub").methods(crow::HTTPMethod::POST)
+    ([this](const crow::request& req) {
+        if (!requireAuth(req)) {
+            crow::json::wvalue result;
+            result["error"] = "Unauthorized";
+            result["message"] = "API key required for admin operations";
+            return crow::response(401, result);
+        }
+        return handler_->handleScrubStart();
     });
 
     // Upload endpoint - PROTECTED
     CROW_ROUTE(app_, "/images").methods(crow::HTTPMethod::POST)
-    ([this](const crow::request& req) {
+    ([this](const crow::request& req, crow::response& res) {
         if (!requireAuth(req)) {
             crow::json::wvalue result;
             result["error"] = "Unauthorized";
             result["message"] = "API key required for write operations";
-            return crow::response(401, result);
+            res = crow::response(401, result);
+            res.end();
+            return;
         }
-        return handler_->handleUpload(req);
+        clustered(req, res, HashUtils::xxh3_64(req.body), [this, &req]() { return handler_->handleUpload(req); });
     });
 
     // Download endpoint - PUBLIC (read-only)
     CROW_ROUTE(app_, "/images/<string>")
-    ([this](const std::string& imageId) {
-        return handler_->handleDownload(imageId);
+    ([this](const crow::request& req, crow::response& res, const std::string& imageId) {
+        clustered(req, res, Cluster::imageKey(imageId), [this, &req, imageId]() {
+            return handler_->handleDownload(imageId, req);
+        });
+    });
+
+    // Near-duplicate search endpoint - PUBLIC (read-only)
+    CROW_ROUTE(app_, "/images/<string>/similar")
+    ([this](const crow::request& req, crow::response& res, const std::string& imageId) {
+        dispatch(req, res, [this, &req, imageId]() { return handler_->handleSimilar(imageId, req); });
     });
 
     // Delete endpoint - PROTECTED
     CROW_ROUTE(app_, "/images/<string>").methods(crow::HTTPMethod::DELETE)
-    ([this](const crow::request& req, const std::string& imageId) {
+    ([this](const crow::request& req, crow::response& res, const std::string& imageId) {
         if (!requireAuth(req)) {
             crow::json::wvalue result;
             result["error"] = "Unauthorized";
             result["message"] = "API key required for write operations";
-            return crow::response(401, result);
+            res = crow::response(401, result);
+            res.end();
+            return;
         }
-        return handler_->handleDelete(imageId);
+        clustered(req, res, Cluster::imageKey(imageId), [this, imageId]() { return handler_->handleDelete(imageId); });
     });
 
     // Named upload endpoint - PROTECTED (root path)
     CROW_ROUTE(app_, "/<string>").methods(crow::HTTPMethod::POST)
-    ([this](const crow::request& req, const std::string& imageName) {
+    ([this](const crow::request& req, crow::response& res, const std::string& imageName) {
         if (!requireAuth(req)) {
             crow::json::wvalue result;
             result["error"] = "Unauthorized";
             result["message"] = "API key required for write operations";
-            return crow::response(401, result);
+            res = crow::response(401, result);
+            res.end();
+            return;
         }
-        return handler_->handleNamedUpload(req, imageName);
+        clustered(req, res, Cluster::nameKey(imageName), [this, &req, imageName]() {
+            return handler_->handleNamedUpload(req, imageName);
+        }, HashUtils::xxh3_64(req.body));
     });
 
     // Named download endpoint - PUBLIC (root path)
     CROW_ROUTE(app_, "/<string>")
-    ([this](const std::string& imageName) {
-        return handler_->handleNamedDownload(imageName);
+    ([this](const crow::request& req, crow::response& res, const std::string& imageName) {
+        clustered(req, res, Cluster::nameKey(imageName), [this, &req, imageName]() {
+            return handler_->handleNamedDownload(imageName, req);
+        });
     });
 
     // Named delete endpoint - PROTECTED (root path)
     CROW_ROUTE(app_, "/<string>").methods(crow::HTTPMethod::DELETE)
-    ([this](const crow::request& req, const std::string& imageName) {
+    ([this](const crow::request& req, crow::response& res, const std::string& imageName) {
         if (!requireAuth(req)) {
             crow::json::wvalue result;
             result["error"] = "Unauthorized";
             result["message"] = "API key required for write operations";
-            return crow::response(401, result);
+            res = crow::response(401, result);
+            res.end();
+            return;
         }
-        return handler_->handleNamedDelete(imageName);
+        clustered(req, res, Cluster::nameKey(imageName), [this, imageName]() {
+            return handler_->handleNamedDelete(imageName);
+        });
     });
 }
 
@@ -124,11 +770,36 @@ void Server::run() {
     std::cout << "  POST   /images              - Upload image (returns hash)" << std::endl;
     std::cout << "  GET    /images/<id>         - Download image by hash" << std::endl;
     std::cout << "  DELETE /images/<id>         - Delete image by hash" << std::endl;
+    std::cout << "  GET    /images/<id>/similar - Find near-duplicates of an image" << std::endl;
     std::cout << "  GET    /images/names        - List all image names" << std::endl;
     std::cout << "  POST   /<name>.png          - Upload image with name" << std::endl;
     std::cout << "  GET    /<name>.png          - Download image by name" << std::endl;
     std::cout << "  DELETE /<name>.png          - Delete name mapping" << std::endl;
+    std::cout << "  GET    /feed                - Change feed (long-poll with ?wait=)" << std::endl;
     std::cout << "  GET    /health              - Health check" << std::endl;
+    std::cout << "  GET    /metrics             - Prometheus metrics" << std::endl;
+    std::cout << "  POST   /admin/filters/rebuild - Rebuild lookup filters" << std::endl;
+    std::cout << "  POST   /admin/chunks/gc     - Delete unreferenced chunks" << std::endl;
+    std::cout << "  GET    /admin/disks         - Storage disk status" << std::endl;
+    std::cout << "  POST   /admin/disks?path=   - Add a storage disk" << std::endl;
+    std::cout << "  GET    /admin/layout        - Shard layout and migration progress" << std::endl;
+    std::cout << "  GET    /admin/mirror        - Storage mirror status" << std::endl;
+    std::cout << "  POST   /admin/mirror/repair - Re-sync storage and mirror" << std::endl;
+    std::cout << "  GET    /admin/erasure       - Erasure coding status" << std::endl;
+    std::cout << "  POST   /admin/erasure/sweep - Rebuild lost shards" << std::endl;
+    std::cout << "  GET    /admin/cluster       - Cluster members and key owners" << std::endl;
+    std::cout << "  GET    /admin/merkle        - Hash tree digests" << std::endl;
+    std::cout << "  POST   /admin/merkle/objects - Images under hash tree leaves" << std::endl;
+    std::cout << "  POST   /admin/merkle/fetch  - Bulk image download for sync" << std::endl;
+    std::cout << "  POST   /admin/merkle/written - When images were last written, for sync" << std::endl;
+    std::cout << "  GET    /admin/sync          - Anti-entropy sync status" << std::endl;
+    std::cout << "  POST   /admin/sync          - Start an anti-entropy round" << std::endl;
+    std::cout << "  GET    /admin/backups       - Backups and export progress" << std::endl;
+    std::cout << "  POST   /admin/backups       - Start a backup (?base= for incremental)" << std::endl;
+    std::cout << "  GET    /admin/backups/<id>  - Download a backup archive" << std::endl;
+    std::cout << "  DELETE /admin/backups/<id>  - Delete a backup" << std::endl;
+    std::cout << "  GET    /admin/scrub         - Integrity scrub status" << std::endl;
+    std::cout << "  POST   /admin/scrub         - Start an integrity scrub pass" << std::endl;
     std::cout << std::endl;
 
     app_.bindaddr("0.0.0.0").port(port_).multithreaded().run();
@@ -136,6 +807,15 @@ void Server::run() {
 
 void Server::stop() {
     app_.stop();
+    if (pipeline_) {
+        pipeline_->shutdown();
+    }
+    io_->shutdown();
+    scrubber_->stop();
+    if (sync_) {
+        sync_->stop();
+    }
+    backups_->stop();
 }
 
 } // namespace imgstore
@@ -0,0 +1,26 @@
+#include "shard_layout.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <cctype>
+
+namespace imgstore {
+
+std::string ShardLayout::shardPath(const std::string& key) const {
+    return HashUtils::generateShardPath(HashUtils::xxh3_64(key), depth, width);
+}
+
+std::filesystem::path ShardLayout::pathOf(const std::filesystem::path& root, const std::string& key,
+                                          const std::string& leaf) const {
+    return root / shardPath(key) / leaf;
+}
+
+bool ShardLayout::isComponent(const std::string& name) const {
+    return name.size() == static_cast<size_t>(width) &&
+           std::all_of(name.begin(), name.end(), [](char c) { return std::isxdigit(static_cast<unsigned char>(c)); });
+}
+
+std::string ShardLayout::describe() const {
+    return "depth " + std::to_string(depth) + ", width " + std::to_string(width);
+}
+
+} // namespace imgstore
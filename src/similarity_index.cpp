@@ -0,0 +1,367 @@
+#include "similarity_index.h"
+#include "hash_utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace imgstore {
+
+namespace {
+
+struct LogRecord {
+    uint64_t id;
+    uint64_t phash;
+    uint32_t op;
+    uint32_t checksum; // low 32 bits of XXH3 over the record with this field zeroed
+};
+
+static_assert(sizeof(LogRecord) == 24);
+
+// Rewrite the log at startup once superseded records outnumber live ones
+constexpr uint64_t kCompactMinRecords = 4096;
+
+uint32_t recordChecksum(LogRecord record) {
+    record.checksum = 0;
+    return static_cast<uint32_t>(HashUtils::xxh3_64(&record, sizeof(record)));
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Writes the positions of the hashes within maxDistance of query to
+// matches (room for count entries) and returns how many there are
+using FilterFn = size_t (*)(const uint64_t* hashes, size_t count, uint64_t query, unsigned maxDistance,
+                            uint32_t* matches);
+
+size_t filterPortable(const uint64_t* hashes, size_t count, uint64_t query, unsigned maxDistance,
+                      uint32_t* matches) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        matches[found] = static_cast<uint32_t>(i);
+        found += static_cast<unsigned>(std::popcount(hashes[i] ^ query)) <= maxDistance;
+    }
+    return found;
+}
+
+#if defined(__x86_64__)
+
+// Same loop, compiled to use the POPCNT instruction
+__attribute__((target("popcnt")))
+size_t filterPopcnt(const uint64_t* hashes, size_t count, uint64_t query, unsigned maxDistance,
+                    uint32_t* matches) {
+    size_t found = 0;
+    for (size_t i = 0; i < count; ++i) {
+        matches[found] = static_cast<uint32_t>(i);
+        found += static_cast<unsigned>(std::popcount(hashes[i] ^ query)) <= maxDistance;
+    }
+    return found;
+}
+
+// Eight distances per instruction with AVX-512 VPOPCNTQ
+__attribute__((target("avx512f,avx512vpopcntdq,popcnt")))
+size_t filterAvx512(const uint64_t* hashes, size_t count, uint64_t query, unsigned maxDistance,
+                    uint32_t* matches) {
+    const __m512i q = _mm512_set1_epi64(static_cast<long long>(query));
+    const __m512i limit = _mm512_set1_epi64(maxDistance);
+
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m512i distance = _mm512_popcnt_epi64(_mm512_xor_si512(_mm512_loadu_si512(hashes + i), q));
+        unsigned mask = _mm512_cmple_epu64_mask(distance, limit);
+        for (; mask != 0; mask &= mask - 1) {
+            matches[found++] = static_cast<uint32_t>(i + std::countr_zero(mask));
+        }
+    }
+    for (; i < count; ++i) {
+        matches[found] = static_cast<uint32_t>(i);
+        found += static_cast<unsigned>(std::popcount(hashes[i] ^ query)) <= maxDistance;
+    }
+    return found;
+}
+
+FilterFn selectFilter() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vpopcntdq")) {
+        return filterAvx512;
+    }
+    if (__builtin_cpu_supports("popcnt")) {
+        return filterPopcnt;
+    }
+    return filterPortable;
+}
+
+#else
+
+FilterFn selectFilter() {
+    return filterPortable;
+}
+
+#endif
+
+const FilterFn filterBucket = selectFilter();
+
+/**
+ * @brief Visit every 16-bit key within radius bits of key, each exactly once
+ */
+template <typename Fn>
+void forEachNeighbour(uint16_t key, int firstBit, int radius, int bits, Fn& fn) {
+    fn(key);
+    if (radius == 0) {
+        return;
+    }
+    for (int bit = firstBit; bit < bits; ++bit) {
+        forEachNeighbour(static_cast<uint16_t>(key ^ (1u << bit)), bit + 1, radius - 1, bits, fn);
+    }
+}
+
+} // namespace
+
+SimilarityIndex::SimilarityIndex(const std::filesystem::path& dir)
+    : dir_(dir),
+      querySeconds_(Metrics::instance().summary("imgstore_similarity_query_seconds",
+                                                "Time spent answering near-duplicate queries")),
+      candidates_(Metrics::instance().counter("imgstore_similarity_candidates_total",
+                                              "Index entries distance-checked by near-duplicate queries")) {
+    for (auto& table : tables_) {
+        table.resize(size_t{1} << kBlockBits);
+    }
+    Metrics::instance().callbackGauge("imgstore_similarity_entries", "Images in the near-duplicate index",
+                                      [this]() { return static_cast<double>(size()); });
+}
+
+SimilarityIndex::~SimilarityIndex() {
+    Metrics::instance().callbackGauge("imgstore_similarity_entries", "", nullptr);
+    if (logFd_ >= 0) {
+        ::close(logFd_);
+    }
+}
+
+bool SimilarityIndex::load() {
+    std::lock_guard<std::mutex> logLock(logMutex_);
+
+    std::ifstream file(logPath(), std::ios::binary);
+    if (file) {
+        std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        for (size_t pos = 0; pos + sizeof(LogRecord) <= data.size(); pos += sizeof(LogRecord)) {
+            LogRecord record;
+            std::memcpy(&record, data.data() + pos, sizeof(record));
+            if (recordChecksum(record) != record.checksum) {
+                std::cerr << "Similarity log corrupt at offset " << pos << "; ignoring the remainder" << std::endl;
+                break;
+            }
+            if (static_cast<Op>(record.op) == Op::Add) {
+                insertLocked(record.id, record.phash);
+            } else {
+                eraseLocked(record.id);
+            }
+            ++logRecords_;
+        }
+    }
+
+    if (logRecords_ > kCompactMinRecords && logRecords_ > 2 * size()) {
+        compactLog();
+    }
+
+    logFd_ = ::open(logPath().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (logFd_ < 0) {
+        std::cerr << "Failed to open similarity log: " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void SimilarityIndex::add(uint64_t id, uint64_t phash) {
+    std::lock_guard<std::mutex> logLock(logMutex_);
+    appendLog(Op::Add, id, phash);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    insertLocked(id, phash);
+}
+
+void SimilarityIndex::remove(uint64_t id) {
+    std::lock_guard<std::mutex> logLock(logMutex_);
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        if (!entries_.contains(id)) {
+            return;
+        }
+    }
+    appendLog(Op::Remove, id, 0);
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    eraseLocked(id);
+}
+
+std::optional<uint64_t> SimilarityIndex::find(uint64_t id) const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+size_t SimilarityIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return entries_.size();
+}
+
+std::vector<SimilarityIndex::Match> SimilarityIndex::search(uint64_t phash, int maxDistance, size_t limit,
+                                                            uint64_t exclude) const {
+    auto start = std::chrono::steady_clock::now();
+    maxDistance = std::clamp(maxDistance, 0, kMaxDistance);
+    const int radius = maxDistance / kBlocks;
+
+    std::vector<Match> matches;
+    std::vector<uint32_t> positions;
+    uint64_t scanned = 0;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        for (int b = 0; b < kBlocks; ++b) {
+            auto probe = [&](uint16_t key) {
+                const Bucket& bucket = tables_[b][key];
+                if (bucket.hashes.empty()) {
+                    return;
+                }
+                positions.resize(bucket.hashes.size());
+                size_t found = filterBucket(bucket.hashes.data(), bucket.hashes.size(), phash,
+                                            static_cast<unsigned>(maxDistance), positions.data());
+                scanned += bucket.hashes.size();
+
+                for (size_t i = 0; i < found; ++i) {
+                    uint64_t hash = bucket.hashes[positions[i]];
+                    uint64_t id = bucket.ids[positions[i]];
+                    // An entry close enough on an earlier block was already
+                    // reported by that block's probes
+                    bool reported = false;
+                    for (int e = 0; e < b && !reported; ++e) {
+                        reported = std::popcount(static_cast<unsigned>(block(hash, e) ^ block(phash, e))) <= radius;
+                    }
+                    if (!reported && id != exclude) {
+                        matches.push_back({id, std::popcount(hash ^ phash)});
+                    }
+                }
+            };
+            forEachNeighbour(block(phash, b), 0, radius, kBlockBits, probe);
+        }
+    }
+
+    std::sort(matches.begin(), matches.end(), [](const Match& a, const Match& b) {
+        return a.distance != b.distance ? a.distance < b.distance : a.id < b.id;
+    });
+    if (matches.size() > limit) {
+        matches.resize(limit);
+    }
+
+    candidates_.increment(scanned);
+    querySeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    return matches;
+}
+
+void SimilarityIndex::insertLocked(uint64_t id, uint64_t phash) {
+    auto [it, inserted] = entries_.try_emplace(id, phash);
+    if (!inserted) {
+        if (it->second == phash) {
+            return;
+        }
+        eraseLocked(id);
+        entries_.emplace(id, phash);
+    }
+    for (int b = 0; b < kBlocks; ++b) {
+        Bucket& bucket = tables_[b][block(phash, b)];
+        bucket.hashes.push_back(phash);
+        bucket.ids.push_back(id);
+    }
+}
+
+void SimilarityIndex::eraseLocked(uint64_t id) {
+    auto it = entries_.find(id);
+    if (it == entries_.end()) {
+        return;
+    }
+    for (int b = 0; b < kBlocks; ++b) {
+        Bucket& bucket = tables_[b][block(it->second, b)];
+        auto pos = std::find(bucket.ids.begin(), bucket.ids.end(), id);
+        if (pos == bucket.ids.end()) {
+            continue;
+        }
+        size_t i = static_cast<size_t>(pos - bucket.ids.begin());
+        bucket.ids[i] = bucket.ids.back();
+        bucket.hashes[i] = bucket.hashes.back();
+        bucket.ids.pop_back();
+        bucket.hashes.pop_back();
+    }
+    entries_.erase(it);
+}
+
+void SimilarityIndex::appendLog(Op op, uint64_t id, uint64_t phash) {
+    if (logFd_ < 0) {
+        return;
+    }
+    LogRecord record{id, phash, static_cast<uint32_t>(op), 0};
+    record.checksum = recordChecksum(record);
+    if (!writeAll(logFd_, &record, sizeof(record))) {
+        std::cerr << "Failed to append to similarity log: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    ++logRecords_;
+}
+
+bool SimilarityIndex::compactLog() {
+    std::vector<LogRecord> records;
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        records.reserve(entries_.size());
+        for (const auto& [id, phash] : entries_) {
+            LogRecord record{id, phash, static_cast<uint32_t>(Op::Add), 0};
+            record.checksum = recordChecksum(record);
+            records.push_back(record);
+        }
+    }
+
+    auto tmpPath = dir_ / "similarity.log.tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = writeAll(fd, records.data(), records.size() * sizeof(LogRecord)) && ::fsync(fd) == 0;
+    ::close(fd);
+
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(tmpPath, logPath(), ec);
+    }
+    if (!ok || ec) {
+        std::filesystem::remove(tmpPath, ec);
+        std::cerr << "Failed to compact similarity log" << std::endl;
+        return false;
+    }
+    logRecords_ = records.size();
+    return true;
+}
+
+} // namespace imgstore
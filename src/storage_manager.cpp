@@ -1,82 +1,681 @@
 #include "storage_manager.h"
 #include "hash_utils.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
 #include <fstream>
 #include <iostream>
 
 namespace imgstore {
 
-StorageManager::StorageManager(const std::string& baseDir, int shardDepth)
-    : baseDir_(baseDir), shardDepth_(shardDepth) {
+namespace {
+
+// Attempts to follow an image that moved between the lookup and the open
+constexpr int kMaxRelocations = 4;
+
+// Filters are never sized below this, so a young store has room to grow
+constexpr size_t kMinFilterCapacity = 1 << 20;
+constexpr double kFilterFalsePositiveRate = 0.01;
+
+// Chunk size for verified reads: small enough to hash while still in L2
+constexpr size_t kVerifyChunkSize = 256 * 1024;
+
+// Visit every file below the shard directories of root in sorted shard
+// order, skipping non-shard entries such as the names/ tree. The callback
+// returns false to stop the walk early.
+template <typename Fn>
+bool forEachShardedFile(const std::filesystem::path& root, const ShardLayout& layout, int depth, Fn&& fn) {
+    if (!std::filesystem::exists(root)) {
+        return true;
+    }
+
+    std::vector<std::filesystem::path> entries;
+    for (const auto& entry : std::filesystem::directory_iterator(root)) {
+        if (depth > 0) {
+            if (entry.is_directory() && layout.isComponent(entry.path().filename().string())) {
+                entries.push_back(entry.path());
+            }
+        } else if (entry.is_regular_file()) {
+            entries.push_back(entry.path());
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    for (const auto& path : entries) {
+        bool keepGoing = depth > 0 ? forEachShardedFile(path, layout, depth - 1, fn) : fn(path);
+        if (!keepGoing) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename Fn>
+bool forEachShardedFile(const std::filesystem::path& root, const ShardLayout& layout, Fn&& fn) {
+    return forEachShardedFile(root, layout, layout.depth, fn);
+}
+
+// Visit regular files below dir, descending depth more shard levels. Uses
+// readdir's d_type so a scan costs one getdents per directory, not a stat
+// per file.
+template <typename Fn>
+bool walkShardDirectory(const std::string& dir, const ShardLayout& layout, int depth, Fn&& fn) {
+    DIR* handle = ::opendir(dir.c_str());
+    if (!handle) {
+        return false;
+    }
+
+    bool ok = true;
+    while (dirent* entry = ::readdir(handle)) {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..") {
+            continue;
+        }
+
+        unsigned char type = entry->d_type;
+        if (type == DT_UNKNOWN) {
+            struct stat st{};
+            if (::stat((dir + "/" + name).c_str(), &st) != 0) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : (S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN);
+        }
+
+        if (depth > 0) {
+            if (type == DT_DIR && layout.isComponent(name)) {
+                ok = walkShardDirectory(dir + "/" + name, layout, depth - 1, fn) && ok;
+            }
+        } else if (type == DT_REG) {
+            fn(dir, name);
+        }
+    }
+
+    ::closedir(handle);
+    return ok;
+}
+
+// Closes a descriptor when the read or write using it returns
+struct FileCloser {
+    int fd;
+    ~FileCloser() {
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+};
+
+bool readFully(int fd, uint8_t* data, size_t size, uint64_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::pread(fd, data + done, size - done, static_cast<off_t>(offset + done));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool writeFully(int fd, const uint8_t* data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::write(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// Set a file's access and modification times to a unix time in milliseconds
+bool setFileTime(int fd, int64_t unixMillis) {
+    struct timespec times[2];
+    times[0].tv_sec = static_cast<time_t>(unixMillis / 1000);
+    times[0].tv_nsec = static_cast<long>(unixMillis % 1000) * 1000000;
+    times[1] = times[0];
+    return ::futimens(fd, times) == 0;
+}
+
+// Read the image hash a mapping file holds; false if the file could not be opened
+bool readMapping(DirectoryCache& dirs, const std::filesystem::path& path, std::string& imageHash) {
+    imageHash.clear();
+    FileCloser file{dirs.openFile(path, O_RDONLY)};
+    if (file.fd < 0) {
+        return false;
+    }
+    // Mappings are one hash long; anything past the first line is ignored
+    char buffer[256];
+    ssize_t n = 0;
+    do {
+        n = ::read(file.fd, buffer, sizeof(buffer));
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        imageHash.assign(buffer, static_cast<size_t>(n));
+        imageHash.erase(std::min(imageHash.find('\n'), imageHash.size()));
+    }
+    return true;
+}
+
+} // namespace
+
+StorageManager::StorageManager(const std::string& baseDir, const StorageOptions& options)
+    : baseDir_(baseDir),
+      chunking_(options.chunking), chunkMinSize_(options.chunkMinSize),
+      mirrorReadTimeout_(options.mirrorReadTimeout), erasureMinSize_(options.ecMinSize),
+      verifySeconds_(Metrics::instance().summary("imgstore_read_verify_seconds",
+                                                 "Time spent hashing image data to verify reads")),
+      verifyFailures_(Metrics::instance().counter("imgstore_read_verify_failures_total",
+                                                  "Reads whose content did not match the requested hash")),
+      sniffSeconds_(Metrics::instance().summary("imgstore_ingest_sniff_seconds",
+                                                "Time spent detecting the content format of uploads")) {
     // Ensure base directory exists
     std::filesystem::create_directories(baseDir_);
+    auto previousLayout = resolveLayout(options);
+
+    syncRoots_.push_back(baseDir_);
+    for (const auto* dirs : {&options.diskDirs, &options.coldDirs, &options.ecDirs}) {
+        syncRoots_.insert(syncRoots_.end(), dirs->begin(), dirs->end());
+    }
+    if (!options.mirrorDir.empty()) {
+        syncRoots_.push_back(options.mirrorDir);
+    }
+
+    initFilterMetrics(hashFilter_, "hash");
+    initFilterMetrics(nameFilter_, "name");
+
+    // Always present: chunked images stay readable after chunking is turned off
+    chunks_ = std::make_unique<ChunkStore>(baseDir_);
+
+    dirs_ = std::make_unique<DirectoryCache>(options.dirCacheSize);
+
+    index_ = std::make_unique<ObjectIndex>(baseDir_);
+    tombstones_ = std::make_unique<TombstoneSet>(baseDir_, std::chrono::hours(options.tombstoneRetentionHours));
+
+    disks_ = std::make_unique<DiskSet>(baseDir_, options.diskDirs, layout_, options.diskQueueDepth);
+    std::vector<std::filesystem::path> coldRoots(options.coldDirs.begin(), options.coldDirs.end());
+    tiers_ = std::make_unique<TierManager>(*disks_, std::move(coldRoots), layout_, *index_, options.tierPolicy);
+
+    // Only the trees writes create directories in; runs alongside the index load below
+    auto writeRoots = tiers_->roots(0);
+    writeRoots.push_back(std::filesystem::path(baseDir_) / "names");
+    knownDirs_ = std::make_unique<KnownDirectories>(layout_, writeRoots, options.knownDirs);
+    knownDirs_->startScan();
+
+    if (previousLayout) {
+        std::vector<LayoutMigrator::Tree> trees;
+        for (size_t tier = 0; tier < tiers_->tierCount(); ++tier) {
+            for (const auto& root : tiers_->roots(static_cast<uint8_t>(tier))) {
+                trees.push_back({root, LayoutMigrator::Kind::Images});
+            }
+        }
+        trees.push_back({std::filesystem::path(baseDir_) / "names", LayoutMigrator::Kind::Names});
+        trees.push_back({std::filesystem::path(baseDir_) / "variants", LayoutMigrator::Kind::Variants});
+        migrator_ = std::make_unique<LayoutMigrator>(
+            *previousLayout, layout_, std::move(trees), options.reshardRate,
+            [this](const std::string& imageId) -> std::mutex& { return tiers_->moveLock(imageId); },
+            [this]() { LayoutMigrator::save(baseDir_, {layout_, std::nullopt}); });
+    }
+
+    if (!index_->load()) {
+        auto start = std::chrono::steady_clock::now();
+        index_->reset();
+        if (scanIntoIndex()) {
+            std::cout << "Index rebuilt from shard scan: " << index_->imageCount() << " images, "
+                      << index_->nameCount() << " names in "
+                      << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()
+                      << "s" << std::endl;
+            index_->writeSnapshot();
+        }
+        trustMirror_ = true;
+    }
+    index_->openJournal();
+    index_->startBackgroundSnapshots(std::chrono::seconds(options.snapshotIntervalSeconds));
+
+    rebuildFilters();
+    tiers_->start();
+    disks_->startRebalance([this]() { return rebalanceDisks(); });
+    if (migrator_) {
+        migrator_->start();
+    }
+
+    if (!options.mirrorDir.empty()) {
+        mirror_ = std::make_unique<Mirror>(options.mirrorDir, layout_, options.mirrorAsync,
+                                           options.mirrorQueueSize);
+        // A mirror without a completed repair is new or was swapped; a
+        // rebuilt index means the primary may have lost what the mirror has
+        mirror_->startRepair([this]() { return repairMirror(); }, mirror_->needsRepair() || trustMirror_);
+    }
+
+    if (!options.ecDirs.empty()) {
+        try {
+            erasure_ = std::make_unique<ErasureStore>(options.ecDirs, options.ecParity, layout_, *index_);
+            // A new or swapped root is missing the shards it should hold
+            erasure_->start(erasure_->needsSweep());
+            std::cout << "Erasure coding images of " << erasureMinSize_ << " bytes and more as "
+                      << erasure_->dataShards() << "+" << erasure_->parityShards() << " ("
+                      << ErasureCoder::kernelName() << " kernel)" << std::endl;
+        } catch (const std::invalid_argument& e) {
+            std::cerr << "Erasure coding disabled: " << e.what() << std::endl;
+            erasure_.reset();
+        }
+    }
 }
 
-bool StorageManager::storeImage(const std::string& imageId, const std::vector<uint8_t>& data) {
+StorageManager::~StorageManager() {
+    // Stopped first: it takes image locks and renames under every tree
+    if (migrator_) {
+        migrator_->stop();
+    }
+    knownDirs_->stop();
+    // Queued replication drains while the rest of the storage is still up
+    if (mirror_) {
+        mirror_->stop();
+    }
+    if (erasure_) {
+        erasure_->stop();
+    }
+    disks_->stop();
+    tiers_->stop();
+
+    // A final snapshot lets the next start skip journal replay
+    index_->stop();
+    index_->writeSnapshot();
+}
+
+bool StorageManager::syncToDisk() {
+    bool ok = true;
+    for (const auto& root : syncRoots_) {
+        int fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || ::syncfs(fd) != 0) {
+            std::cerr << "Failed to sync " << root << ": " << std::strerror(errno) << std::endl;
+            ok = false;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+        }
+    }
+    return ok;
+}
+
+bool StorageManager::storeImage(const std::string& imageId, const std::vector<uint8_t>& data,
+                                std::optional<int64_t> writtenAt) {
+    // The mirror copy carries the same time, so a restore from it keeps the upload's place against deletes
+    if (!writtenAt && mirror_) {
+        writtenAt = TombstoneSet::now();
+    }
+    if (!storePrimary(imageId, data, writtenAt)) {
+        return false;
+    }
+    uint64_t hash = 0;
+    if (HashUtils::hexToHash(imageId, hash)) {
+        tombstones_->clear(hash);
+    }
+    // A failed mirror write schedules a repair that copies it later; the primary copy stands
+    if (mirror_) {
+        mirror_->putImage(imageId, data, writtenAt);
+    }
+    return true;
+}
+
+bool StorageManager::storePrimary(const std::string& imageId, const std::vector<uint8_t>& data,
+                                  std::optional<int64_t> writtenAt) {
+    uint64_t hash = 0;
+    bool added = false;
+    // A write that fails leaves no file behind, so it must leave no index entry either
+    auto fail = [&]() {
+        if (added) {
+            index_->removeImage(hash);
+        }
+        return false;
+    };
     try {
-        auto path = getImagePath(imageId);
-        
-        // Ensure parent directory exists
-        if (!ensureDirectory(path.parent_path())) {
-            std::cerr << "Failed to create directory: " << path.parent_path() << std::endl;
-            return false;
+        // New images always start on the fastest tier
+        std::lock_guard<std::mutex> lock(tiers_->moveLock(imageId));
+        auto path = tiers_->pathFor(imageId, 0);
+
+        // The format is detected once here and served from the index afterwards
+        auto sniffStart = std::chrono::steady_clock::now();
+        ImageFormat format = ContentSniffer::sniff(data);
+        sniffSeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - sniffStart).count());
+
+        // Index first: a crash after this point leaves an extra entry, never a missing one.
+        // An image indexed already keeps its entry; a failed rewrite leaves its file in place.
+        if (HashUtils::hexToHash(imageId, hash)) {
+            added = !index_->findImage(hash).has_value();
+            index_->addImage(hash, data.size(), format);
         }
 
-        // Write image data to file
-        std::ofstream file(path, std::ios::binary);
-        if (!file) {
-            std::cerr << "Failed to open file for writing: " << path << std::endl;
-            return false;
+        // Large images are erasure-coded or go to the chunk store, leaving a
+        // stub or manifest here. Data that happens to start with either magic
+        // is always chunked, so a file with one is never a plain image.
+        const std::vector<uint8_t>* contents = &data;
+        std::optional<std::vector<uint8_t>> manifest;
+        if (erasure_ && data.size() >= erasureMinSize_) {
+            manifest = erasure_->write(imageId, data);
+            if (!manifest) {
+                return fail();
+            }
+            contents = &*manifest;
+        } else if ((chunking_ && data.size() >= chunkMinSize_) || ChunkStore::isManifest(data.data(), data.size()) ||
+                   ErasureStore::isStub(data.data(), data.size())) {
+            manifest = chunks_->write(data);
+            if (!manifest) {
+                return fail();
+            }
+            contents = &*manifest;
         }
 
-        file.write(reinterpret_cast<const char*>(data.data()), data.size());
-        file.close();
+        // Written beside the target and renamed, so a concurrent reader sees the
+        // old copy or the new one, never a truncated file; the shard directory
+        // is created on first use
+        auto temp = path;
+        temp += ".tmp." + std::to_string(tempCounter_++);
+        auto slot = disks_->acquire(path);
+        int fd = createFile(temp);
+        if (fd < 0) {
+            std::cerr << "Failed to open file for writing: " << temp << ": " << std::strerror(errno) << std::endl;
+            slot.fail();
+            return fail();
+        }
 
-        return file.good();
+        bool written = writeFully(fd, contents->data(), contents->size()) &&
+                       (!writtenAt || setFileTime(fd, *writtenAt));
+        if (::close(fd) != 0 || !written || !dirs_->rename(temp, path)) {
+            std::cerr << "Failed to write image file " << path << std::endl;
+            dirs_->unlink(temp);
+            slot.fail();
+            return fail();
+        }
+
+        filterAdd(hashFilter_, imageId);
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Error storing image: " << e.what() << std::endl;
-        return false;
+        return fail();
     }
 }
 
 std::optional<std::vector<uint8_t>> StorageManager::retrieveImage(const std::string& imageId) {
+    ReadStatus status;
+    return retrieveImage(imageId, false, status);
+}
+
+std::optional<std::vector<uint8_t>> StorageManager::retrieveImage(const std::string& imageId, bool verify,
+                                                                  ReadStatus& status) {
+    status = ReadStatus::NotFound;
+    try {
+        if (!filterMayContain(hashFilter_, imageId)) {
+            return std::nullopt;
+        }
+
+        uint64_t expected = 0;
+        bool isHash = HashUtils::hexToHash(imageId, expected);
+        if (verify && !isHash) {
+            // Not a content hash, nothing to verify against
+            verify = false;
+        }
+
+        if (!mirror_) {
+            bool timedOut = false;
+            return readPrimary(imageId, verify, expected, status, std::chrono::milliseconds::zero(), timedOut);
+        }
+
+        // Checked before the read, which drops the entry if it quarantines the file
+        bool indexed = isHash && index_->findImage(expected).has_value();
+
+        bool timedOut = false;
+        auto data = readPrimary(imageId, verify, expected, status, mirrorReadTimeout_, timedOut);
+        if (data || (status == ReadStatus::NotFound && !indexed && !timedOut)) {
+            return data;
+        }
+
+        // A slow disk is left alone; a missing or damaged copy is replaced
+        return readMirror(imageId, status, !timedOut);
+    } catch (const std::exception& e) {
+        std::cerr << "Error retrieving image: " << e.what() << std::endl;
+        return std::nullopt;
+    }
+}
+
+std::optional<std::vector<uint8_t>> StorageManager::readPrimary(const std::string& imageId, bool verify,
+                                                                uint64_t expected, ReadStatus& status,
+                                                                std::chrono::milliseconds timeout, bool& timedOut) {
+    auto data = readPrimaryFile(imageId, verify, expected, status, timeout, timedOut);
+    if (status != ReadStatus::Corrupt) {
+        return data;
+    }
+    // The disk slot is released by now; quarantining takes the move lock, which writers take before a slot
+    if (quarantineImage(imageId)) {
+        return std::nullopt;
+    }
+    // Intact under the lock: the read raced a rewrite or move, so the current copy is served
+    return readPrimaryFile(imageId, verify, expected, status, timeout, timedOut);
+}
+
+std::optional<std::vector<uint8_t>> StorageManager::readPrimaryFile(const std::string& imageId, bool verify,
+                                                                    uint64_t expected, ReadStatus& status,
+                                                                    std::chrono::milliseconds timeout,
+                                                                    bool& timedOut) {
+    status = ReadStatus::NotFound;
+    timedOut = false;
     try {
-        auto path = getImagePath(imageId);
+        uint8_t tier = tiers_->tierOf(imageId);
+        auto path = tiers_->pathFor(imageId, tier);
 
-        if (!std::filesystem::exists(path)) {
+        FileCloser file{dirs_->openFile(path, O_RDONLY)};
+        for (int attempt = 0; file.fd < 0 && attempt < kMaxRelocations && relocated(imageId, path, tier); ++attempt) {
+            file.fd = dirs_->openFile(path, O_RDONLY);
+        }
+        if (file.fd < 0) {
+            hashFilter_.falsePositives->increment();
             return std::nullopt;
         }
+        auto slot = disks_->acquire(path, timeout);
+        if (slot.timedOut()) {
+            timedOut = true;
+            return std::nullopt;
+        }
+        tiers_->recordRead(imageId, tier);
 
-        std::ifstream file(path, std::ios::binary | std::ios::ate);
-        if (!file) {
+        struct stat st{};
+        if (::fstat(file.fd, &st) != 0) {
+            slot.fail();
             return std::nullopt;
         }
+        auto size = static_cast<size_t>(st.st_size);
 
-        auto size = file.tellg();
-        file.seekg(0, std::ios::beg);
+        uint8_t magic[8];
+        bool hasMagic = size >= sizeof(magic) && readFully(file.fd, magic, sizeof(magic), 0);
+        if (hasMagic && ChunkStore::isManifest(magic, sizeof(magic))) {
+            return readChunked(imageId, file.fd, size, verify, expected, status);
+        }
+        if (hasMagic && ErasureStore::isStub(magic, sizeof(magic))) {
+            return readErasure(imageId, file.fd, size, verify, expected, status);
+        }
 
         std::vector<uint8_t> data(size);
-        file.read(reinterpret_cast<char*>(data.data()), size);
 
-        if (!file) {
+        if (!verify) {
+            if (!readFully(file.fd, data.data(), size, 0)) {
+                slot.fail();
+                return std::nullopt;
+            }
+            status = ReadStatus::Ok;
+            return data;
+        }
+
+        Xxh3Stream hasher;
+        std::chrono::steady_clock::duration hashTime{0};
+        for (size_t offset = 0; offset < size; offset += kVerifyChunkSize) {
+            size_t len = std::min(kVerifyChunkSize, size - offset);
+            if (!readFully(file.fd, data.data() + offset, len, offset)) {
+                slot.fail();
+                return std::nullopt;
+            }
+
+            auto hashStart = std::chrono::steady_clock::now();
+            hasher.update(data.data() + offset, len);
+            hashTime += std::chrono::steady_clock::now() - hashStart;
+        }
+        verifySeconds_.observe(std::chrono::duration<double>(hashTime).count());
+
+        if (hasher.digest() != expected) {
+            std::cerr << "Hash mismatch on read of image " << imageId << std::endl;
+            verifyFailures_.increment();
+            status = ReadStatus::Corrupt;
             return std::nullopt;
         }
 
+        status = ReadStatus::Ok;
         return data;
     } catch (const std::exception& e) {
-        std::cerr << "Error retrieving image: " << e.what() << std::endl;
+        std::cerr << "Error reading image: " << e.what() << std::endl;
         return std::nullopt;
     }
 }
 
+std::optional<std::vector<uint8_t>> StorageManager::readMirror(const std::string& imageId, ReadStatus& status,
+                                                               bool restore) {
+    auto data = mirror_->readImage(imageId);
+    if (!data) {
+        return std::nullopt;
+    }
+
+    // The replica is checked even when the caller did not ask: it may be written back
+    uint64_t expected = 0;
+    if (HashUtils::hexToHash(imageId, expected) && HashUtils::xxh3_64(data->data(), data->size()) != expected) {
+        std::cerr << "Mirrored copy of image " << imageId << " is damaged too" << std::endl;
+        return std::nullopt;
+    }
+
+    mirror_->recordFailover();
+    if (restore && storePrimary(imageId, *data, mirror_->imageWrittenAt(imageId))) {
+        std::cerr << "Restored image " << imageId << " from the mirror" << std::endl;
+    }
+    status = ReadStatus::Ok;
+    return data;
+}
+
 bool StorageManager::deleteImage(const std::string& imageId) {
+    if (!eraseImage(imageId)) {
+        return false;
+    }
+    uint64_t hash = 0;
+    if (HashUtils::hexToHash(imageId, hash)) {
+        tombstones_->add(hash, TombstoneSet::now());
+    }
+    return true;
+}
+
+bool StorageManager::applyDelete(const std::string& imageId, int64_t deletedAt) {
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash)) {
+        return false;
+    }
+    // Stored again after the delete: the newer upload wins
+    auto writtenAt = imageWrittenAt(imageId);
+    if (writtenAt && *writtenAt > deletedAt) {
+        return false;
+    }
+    tombstones_->add(hash, deletedAt);
+    return writtenAt && eraseImage(imageId);
+}
+
+std::optional<int64_t> StorageManager::deletedAt(const std::string& imageId) const {
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash)) {
+        return std::nullopt;
+    }
+    return tombstones_->deletedAt(hash);
+}
+
+std::optional<int64_t> StorageManager::imageWrittenAt(const std::string& imageId) const {
+    struct stat st{};
+    if (!dirs_->stat(findImageFile(imageId), st)) {
+        return std::nullopt;
+    }
+    return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000 + st.st_mtim.tv_nsec / 1000000;
+}
+
+void StorageManager::setEraseHook(EraseHook hook) {
+    eraseHook_ = hook ? std::make_shared<const EraseHook>(std::move(hook)) : nullptr;
+}
+
+void StorageManager::setSimilarityIndex(std::shared_ptr<SimilarityIndex> index) {
+    similarity_ = std::move(index);
+}
+
+bool StorageManager::eraseImage(const std::string& imageId) {
     try {
-        auto path = getImagePath(imageId);
+        if (!filterMayContain(hashFilter_, imageId)) {
+            return false;
+        }
+
+        // Run before the move lock: the hook may read the image, which can restore it from the mirror
+        if (auto hook = eraseHook_.load()) {
+            (*hook)(imageId);
+        }
 
-        if (!std::filesystem::exists(path)) {
+        std::lock_guard<std::mutex> lock(tiers_->moveLock(imageId));
+        auto path = findImageFile(imageId);
+        uint64_t hash = 0;
+        bool isHash = HashUtils::hexToHash(imageId, hash);
+
+        if (!dirs_->exists(path)) {
+            // Lost from the primary but still indexed: the mirror copy is what is being deleted
+            if (!mirror_ || !isHash || !index_->findImage(hash)) {
+                return false;
+            }
+            index_->removeImage(hash);
+            if (auto similarity = similarity_.load()) {
+                similarity->remove(hash);
+            }
+            mirror_->removeImage(imageId);
+            tiers_->forget(imageId);
+            return true;
+        }
+
+        // Chunks stay until the next garbage collection; only the usage changes
+        std::vector<uint8_t> manifest;
+        uint64_t chunkedSize = 0;
+        bool chunked = readManifest(path, manifest) && ChunkStore::parseManifest(manifest, chunkedSize);
+        bool erasureCoded = ErasureStore::readStub(path).has_value();
+
+        auto slot = disks_->acquire(path);
+        if (!dirs_->unlink(path)) {
             return false;
         }
+        if (chunked) {
+            chunks_->release(chunkedSize);
+        }
+        if (erasureCoded && erasure_) {
+            erasure_->remove(imageId);
+        }
 
-        return std::filesystem::remove(path);
+        if (isHash) {
+            index_->removeImage(hash);
+            if (auto similarity = similarity_.load()) {
+                similarity->remove(hash);
+            }
+        }
+        if (mirror_) {
+            mirror_->removeImage(imageId);
+        }
+        tiers_->forget(imageId);
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Error deleting image: " << e.what() << std::endl;
         return false;
@@ -84,58 +683,130 @@ bool StorageManager::deleteImage(const std::string& imageId) {
 }
 
 bool StorageManager::imageExists(const std::string& imageId) {
-    auto path = getImagePath(imageId);
-    return std::filesystem::exists(path);
+    if (!filterMayContain(hashFilter_, imageId)) {
+        return false;
+    }
+
+    uint8_t tier = tiers_->tierOf(imageId);
+    auto path = tiers_->pathFor(imageId, tier);
+    bool found = dirs_->exists(path);
+    for (int attempt = 0; !found && attempt < kMaxRelocations && relocated(imageId, path, tier); ++attempt) {
+        found = dirs_->exists(path);
+    }
+    uint64_t hash = 0;
+    if (!found && mirror_ && HashUtils::hexToHash(imageId, hash) && index_->findImage(hash)) {
+        found = std::filesystem::exists(mirror_->imagePath(imageId));
+    }
+    if (!found) {
+        hashFilter_.falsePositives->increment();
+    }
+    return found;
+}
+
+ImageFormat StorageManager::getImageFormat(const std::string& imageId) const {
+    uint64_t hash = 0;
+    if (!HashUtils::hexToHash(imageId, hash)) {
+        return ImageFormat::Unknown;
+    }
+    auto record = index_->findImage(hash);
+    return record ? record->format : ImageFormat::Unknown;
 }
 
 bool StorageManager::storeNameMapping(const std::string& imageName, const std::string& imageHash) {
+    if (!storeNamePrimary(imageName, imageHash)) {
+        return false;
+    }
+    if (mirror_) {
+        mirror_->putName(imageName, imageHash);
+    }
+    return true;
+}
+
+std::mutex& StorageManager::nameLock(const std::string& name) {
+    return nameLocks_[HashUtils::xxh3_64(name) % kNameLocks];
+}
+
+bool StorageManager::storeNamePrimary(const std::string& imageName, const std::string& imageHash) {
+    std::optional<uint64_t> previous;
+    bool indexed = false;
+    // A failed write leaves the old mapping file, so the index goes back to the old mapping too
+    auto fail = [&]() {
+        if (indexed && previous) {
+            index_->setName(imageName, *previous);
+        } else if (indexed) {
+            index_->removeName(imageName);
+        }
+        return false;
+    };
+    std::lock_guard<std::mutex> lock(nameLock(imageName));
     try {
         auto path = getNameMappingPath(imageName);
-        
-        // Ensure parent directory exists
-        if (!ensureDirectory(path.parent_path())) {
-            std::cerr << "Failed to create directory: " << path.parent_path() << std::endl;
-            return false;
-        }
 
-        // Write mapping to file
-        std::ofstream file(path, std::ios::trunc);
-        if (!file) {
-            std::cerr << "Failed to open mapping file for writing: " << path << std::endl;
-            return false;
+        // Index first, as for images: a crash after this point leaves an extra entry, never a missing one
+        uint64_t hash = 0;
+        HashUtils::hexToHash(imageHash, hash);
+        previous = index_->findName(imageName);
+        index_->setName(imageName, hash);
+        indexed = previous != hash;
+
+        // Written beside the target and renamed like image files; the shard
+        // directory is created on first use
+        auto temp = path;
+        temp += ".tmp." + std::to_string(tempCounter_++);
+        int fd = createFile(temp);
+        if (fd < 0) {
+            std::cerr << "Failed to open mapping file for writing: " << temp << ": " << std::strerror(errno)
+                      << std::endl;
+            return fail();
         }
 
-        file << imageHash;
-        file.close();
+        bool written = writeFully(fd, reinterpret_cast<const uint8_t*>(imageHash.data()), imageHash.size());
+        if (::close(fd) != 0 || !written || !dirs_->rename(temp, path)) {
+            std::cerr << "Failed to write mapping file " << path << std::endl;
+            dirs_->unlink(temp);
+            return fail();
+        }
 
-        return file.good();
+        filterAdd(nameFilter_, imageName);
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Error storing name mapping: " << e.what() << std::endl;
-        return false;
+        return fail();
     }
 }
 
 std::optional<std::string> StorageManager::getHashByName(const std::string& imageName) {
     try {
-        auto path = getNameMappingPath(imageName);
-
-        if (!std::filesystem::exists(path)) {
+        if (!filterMayContain(nameFilter_, imageName)) {
             return std::nullopt;
         }
 
-        std::ifstream file(path);
-        if (!file) {
-            return std::nullopt;
-        }
+        auto path = getNameMappingPath(imageName);
 
         std::string imageHash;
-        std::getline(file, imageHash);
+        bool found = readMapping(*dirs_, path, imageHash);
+        if (imageHash.empty() && migrator_) {
+            // Not migrated yet, or migrated between the two reads
+            if (auto previous = migrator_->previousPath(path, imageName)) {
+                found = readMapping(*dirs_, *previous, imageHash) || readMapping(*dirs_, path, imageHash) || found;
+            }
+        }
+        if (!imageHash.empty()) {
+            return imageHash;
+        }
 
-        if (imageHash.empty()) {
-            return std::nullopt;
+        // The mapping is indexed, so the primary lost it; the next repair restores it
+        if (mirror_ && index_->findName(imageName)) {
+            if (auto mirrored = mirror_->readName(imageName)) {
+                mirror_->recordFailover();
+                return mirrored;
+            }
         }
 
-        return imageHash;
+        if (!found) {
+            nameFilter_.falsePositives->increment();
+        }
+        return std::nullopt;
     } catch (const std::exception& e) {
         std::cerr << "Error retrieving name mapping: " << e.what() << std::endl;
         return std::nullopt;
@@ -144,13 +815,31 @@ std::optional<std::string> StorageManager::getHashByName(const std::string& imag
 
 bool StorageManager::deleteNameMapping(const std::string& imageName) {
     try {
+        if (!filterMayContain(nameFilter_, imageName)) {
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(nameLock(imageName));
         auto path = getNameMappingPath(imageName);
 
-        if (!std::filesystem::exists(path)) {
+        // The old copy goes first: the migration may be moving it to the new path
+        bool removed = false;
+        if (migrator_) {
+            if (auto previous = migrator_->previousPath(path, imageName)) {
+                removed = dirs_->unlink(*previous);
+            }
+        }
+        removed = dirs_->unlink(path) || removed;
+
+        if (!removed && !(mirror_ && index_->findName(imageName))) {
             return false;
         }
 
-        return std::filesystem::remove(path);
+        index_->removeName(imageName);
+        if (mirror_) {
+            mirror_->removeName(imageName);
+        }
+        return true;
     } catch (const std::exception& e) {
         std::cerr << "Error deleting name mapping: " << e.what() << std::endl;
         return false;
@@ -158,45 +847,798 @@ bool StorageManager::deleteNameMapping(const std::string& imageName) {
 }
 
 bool StorageManager::nameMappingExists(const std::string& imageName) {
+    if (!filterMayContain(nameFilter_, imageName)) {
+        return false;
+    }
+
     auto path = getNameMappingPath(imageName);
-    return std::filesystem::exists(path);
+    if (dirs_->exists(path)) {
+        return true;
+    }
+    if (migrator_) {
+        auto previous = migrator_->previousPath(path, imageName);
+        if (previous && (dirs_->exists(*previous) || dirs_->exists(path))) {
+            return true;
+        }
+    }
+    if (mirror_ && index_->findName(imageName) && std::filesystem::exists(mirror_->namePath(imageName))) {
+        return true;
+    }
+    nameFilter_.falsePositives->increment();
+    return false;
 }
 
 std::vector<std::string> StorageManager::getAllNames() const {
     std::vector<std::string> names;
-    
+    names.reserve(index_->nameCount());
+
+    index_->forEachName([&](const std::string& name, uint64_t) {
+        names.push_back(name);
+    });
+
+    return names;
+}
+
+bool StorageManager::forEachImage(const ImageVisitor& fn) const {
     try {
-        std::filesystem::path namesDir = std::filesystem::path(baseDir_) / "names";
-        
-        if (!std::filesystem::exists(namesDir)) {
-            return names;
+        for (size_t tier = 0; tier < tiers_->tierCount(); ++tier) {
+            for (const auto& root : tiers_->roots(static_cast<uint8_t>(tier))) {
+                for (const auto& layout : layoutsOnDisk()) {
+                    bool completed = forEachShardedFile(root, layout, [&](const std::filesystem::path& path) {
+                        return fn(path.filename().string(), path);
+                    });
+                    if (!completed) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Error walking images: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+std::vector<std::string> StorageManager::imagesInBuckets(const std::vector<uint16_t>& buckets) const {
+    std::vector<bool> wanted(MerkleTree::kBuckets, false);
+    for (uint16_t bucket : buckets) {
+        wanted[bucket] = true;
+    }
+    std::vector<std::string> result;
+    index_->forEachImage([&](uint64_t hash, const ObjectRecord&) {
+        if (wanted[MerkleTree::bucketOf(hash)]) {
+            result.push_back(HashUtils::hashToHex(hash));
         }
-        
-        // Recursively iterate through all .mapping files
-        for (const auto& entry : std::filesystem::recursive_directory_iterator(namesDir)) {
-            if (entry.is_regular_file() && entry.path().extension() == ".mapping") {
-                std::string filename = entry.path().stem().string();
-                names.push_back(filename);
+    });
+    return result;
+}
+
+std::vector<std::pair<std::string, int64_t>> StorageManager::deletesInBuckets(
+    const std::vector<uint16_t>& buckets) const {
+    std::vector<bool> wanted(MerkleTree::kBuckets, false);
+    for (uint16_t bucket : buckets) {
+        wanted[bucket] = true;
+    }
+    std::vector<std::pair<std::string, int64_t>> result;
+    auto deletes = tombstones_->list([&](uint64_t hash) { return wanted[MerkleTree::bucketOf(hash)]; });
+    for (const auto& [hash, deletedAt] : deletes) {
+        result.emplace_back(HashUtils::hashToHex(hash), deletedAt);
+    }
+    return result;
+}
+
+std::optional<std::vector<std::filesystem::path>> StorageManager::imageFiles(const std::filesystem::path& path) const {
+    std::vector<uint8_t> manifest;
+    if (!readManifest(path, manifest)) {
+        std::error_code ec;
+        if (!std::filesystem::exists(path, ec)) {
+            return std::vector<std::filesystem::path>{};
+        }
+        return std::vector<std::filesystem::path>{path};
+    }
+
+    uint64_t totalSize = 0;
+    auto chunks = ChunkStore::parseManifest(manifest, totalSize);
+    if (!chunks) {
+        return std::nullopt;
+    }
+    std::vector<std::filesystem::path> files;
+    files.reserve(chunks->size());
+    for (const auto& chunk : *chunks) {
+        files.push_back(chunks_->chunkPath(chunk.hash));
+    }
+    return files;
+}
+
+ChunkStore::GcResult StorageManager::collectChunkGarbage() {
+    return chunks_->collectGarbage([this](const ChunkStore::ManifestVisitor& visit) {
+        return forEachImage([&](const std::string&, const std::filesystem::path& path) {
+            std::vector<uint8_t> manifest;
+            uint64_t totalSize = 0;
+            if (!readManifest(path, manifest)) {
+                return true;
             }
+            auto chunks = ChunkStore::parseManifest(manifest, totalSize);
+            if (!chunks) {
+                // Its chunks cannot be told apart from garbage; deleting any could lose data
+                std::cerr << "Damaged chunk manifest " << path << std::endl;
+                return false;
+            }
+            visit(*chunks, totalSize);
+            return true;
+        });
+    });
+}
+
+std::optional<std::vector<uint8_t>> StorageManager::readChunked(const std::string& imageId, int fd, size_t size,
+                                                                bool verify, uint64_t expected, ReadStatus& status) {
+    std::vector<uint8_t> manifest(size);
+    if (!readFully(fd, manifest.data(), size, 0)) {
+        return std::nullopt;
+    }
+
+    uint64_t totalSize = 0;
+    auto chunks = ChunkStore::parseManifest(manifest, totalSize);
+
+    std::vector<uint8_t> data;
+    Xxh3Stream hasher;
+    bool ok = chunks && chunks_->read(*chunks, totalSize, data, verify ? &hasher : nullptr);
+
+    if (!verify) {
+        if (!ok) {
+            std::cerr << "Failed to reassemble chunked image " << imageId << std::endl;
+            return std::nullopt;
+        }
+        status = ReadStatus::Ok;
+        return data;
+    }
+
+    if (!ok || hasher.digest() != expected) {
+        std::cerr << "Chunked image " << imageId << " is damaged or incomplete" << std::endl;
+        verifyFailures_.increment();
+        status = ReadStatus::Corrupt;
+        return std::nullopt;
+    }
+
+    status = ReadStatus::Ok;
+    return data;
+}
+
+std::optional<std::vector<uint8_t>> StorageManager::readErasure(const std::string& imageId, int fd, size_t size,
+                                                                bool verify, uint64_t expected, ReadStatus& status) {
+    std::vector<uint8_t> bytes(size);
+    if (!readFully(fd, bytes.data(), size, 0)) {
+        return std::nullopt;
+    }
+    auto stub = ErasureStore::parseStub(bytes);
+    if (!stub || !erasure_) {
+        std::cerr << "Cannot read erasure-coded image " << imageId
+                  << (stub ? ": no shard roots configured" : ": damaged stub") << std::endl;
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> data;
+    if (!erasure_->read(imageId, *stub, data)) {
+        return std::nullopt;
+    }
+    if (verify) {
+        auto hashStart = std::chrono::steady_clock::now();
+        uint64_t actual = HashUtils::xxh3_64(data.data(), data.size());
+        verifySeconds_.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - hashStart).count());
+        if (actual != expected) {
+            // Every shard passed its checksum, so the damage predates the encode
+            std::cerr << "Hash mismatch on read of erasure-coded image " << imageId << std::endl;
+            verifyFailures_.increment();
+            status = ReadStatus::Corrupt;
+            return std::nullopt;
+        }
+    }
+
+    status = ReadStatus::Ok;
+    return data;
+}
+
+bool StorageManager::readManifest(const std::filesystem::path& path, std::vector<uint8_t>& manifest) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return false;
+    }
+    auto size = static_cast<size_t>(file.tellg());
+    file.seekg(0, std::ios::beg);
+
+    char magic[8];
+    if (size < sizeof(magic) || !file.read(magic, sizeof(magic)) ||
+        !ChunkStore::isManifest(reinterpret_cast<const uint8_t*>(magic), sizeof(magic))) {
+        return false;
+    }
+
+    manifest.resize(size);
+    file.seekg(0, std::ios::beg);
+    return static_cast<bool>(file.read(reinterpret_cast<char*>(manifest.data()), size));
+}
+
+bool StorageManager::quarantineImage(const std::string& imageId) {
+    try {
+        // Writers replace the file under the same lock, so the second look
+        // below sees a finished copy; one that checks out was a racing read
+        std::lock_guard<std::mutex> lock(tiers_->moveLock(imageId));
+        auto path = findImageFile(imageId);
+        if (!dirs_->exists(path)) {
+            return false;
+        }
+        if (storedImageIntact(imageId, path)) {
+            std::cerr << "Image " << imageId << " verified on a second read; not quarantined" << std::endl;
+            return false;
+        }
+
+        // Quarantine on the image's own disk so the rename never crosses filesystems
+        bool previous = migrator_ && migrator_->currentPath(path, imageId);
+        auto root = path;
+        for (int i = 0; i <= (previous ? migrator_->from().depth : layout_.depth); ++i) {
+            root = root.parent_path();
+        }
+        auto quarantineDir = root / "quarantine";
+        if (!ensureDirectory(quarantineDir)) {
+            return false;
         }
+
+        // Keep every quarantined copy; the same ID may rot more than once
+        auto stamp = std::chrono::duration_cast<std::chrono::seconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        auto target = quarantineDir / (imageId + "." + std::to_string(stamp));
+
+        if (!dirs_->rename(path, target)) {
+            std::cerr << "Failed to quarantine " << path << ": " << std::strerror(errno) << std::endl;
+            return false;
+        }
+
+        uint64_t hash = 0;
+        if (HashUtils::hexToHash(imageId, hash)) {
+            index_->removeImage(hash);
+        }
+        std::cerr << "Quarantined image " << imageId << " to " << target << std::endl;
+        return true;
     } catch (const std::exception& e) {
-        std::cerr << "Error listing names: " << e.what() << std::endl;
+        std::cerr << "Error quarantining image: " << e.what() << std::endl;
+        return false;
     }
-    
-    return names;
+}
+
+bool StorageManager::storedImageIntact(const std::string& imageId, const std::filesystem::path& path) {
+    uint64_t expected = 0;
+    if (!HashUtils::hexToHash(imageId, expected)) {
+        return false;
+    }
+    uint64_t bytesRead = 0;
+    if (auto intact = verifyErasureCoded(imageId, path, bytesRead)) {
+        return *intact;
+    }
+    auto files = imageFiles(path);
+    if (!files || files->empty()) {
+        return false;
+    }
+
+    Xxh3Stream hasher;
+    std::vector<uint8_t> buffer(kVerifyChunkSize);
+    for (const auto& file : *files) {
+        FileCloser in{::open(file.c_str(), O_RDONLY | O_CLOEXEC)};
+        if (in.fd < 0) {
+            return false;
+        }
+        ssize_t n = 0;
+        while ((n = ::read(in.fd, buffer.data(), buffer.size())) != 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                return false;
+            }
+            hasher.update(buffer.data(), static_cast<size_t>(n));
+        }
+    }
+    return hasher.digest() == expected;
+}
+
+std::optional<ShardLayout> StorageManager::resolveLayout(const StorageOptions& options) {
+    auto stored = LayoutMigrator::load(baseDir_);
+    layout_ = stored.layout;
+    ShardLayout configured{options.shardDepth, options.shardWidth};
+
+    if (!configured.valid()) {
+        std::cerr << "Invalid shard layout (" << configured.describe() << "); keeping " << layout_.describe()
+                  << std::endl;
+    } else if (configured != stored.layout && stored.previous) {
+        std::cerr << "Shard layout migration to " << stored.layout.describe() << " is still running; "
+                  << configured.describe() << " can be configured once it completes" << std::endl;
+    } else if (configured != stored.layout && (!options.mirrorDir.empty() || !options.ecDirs.empty())) {
+        // Their trees are not walked, so their entries would become unreachable
+        std::cerr << "Shard layout not changed to " << configured.describe()
+                  << ": mirror and erasure-coding roots cannot be migrated; keeping " << layout_.describe()
+                  << std::endl;
+    } else if (configured != stored.layout) {
+        stored.previous = stored.layout;
+        stored.layout = configured;
+        if (LayoutMigrator::save(baseDir_, stored)) {
+            layout_ = configured;
+        } else {
+            stored.previous.reset();
+        }
+    }
+
+    // Recorded for new stores too, so a later change of the default cannot strand them
+    if (!std::filesystem::exists(std::filesystem::path(baseDir_) / "LAYOUT")) {
+        LayoutMigrator::save(baseDir_, stored);
+    }
+    return stored.previous;
+}
+
+std::vector<ShardLayout> StorageManager::layoutsOnDisk() const {
+    if (migrator_ && migrator_->active()) {
+        return {layout_, migrator_->from()};
+    }
+    return {layout_};
+}
+
+std::filesystem::path StorageManager::findImageFile(const std::string& imageId) const {
+    auto path = getImagePath(imageId);
+    if (!migrator_ || dirs_->exists(path)) {
+        return path;
+    }
+    auto previous = migrator_->previousPath(path, imageId);
+    return previous && dirs_->exists(*previous) ? *previous : path;
 }
 
 std::filesystem::path StorageManager::getImagePath(const std::string& imageId) const {
-    // Hash the image ID
-    uint64_t hash = HashUtils::xxh3_64(imageId);
-    
-    // Generate shard path
-    std::string shardPath = HashUtils::generateShardPath(hash, shardDepth_, 2);
-    
-    // Construct full path
-    std::filesystem::path fullPath = std::filesystem::path(baseDir_) / shardPath / imageId;
-    
-    return fullPath;
+    // The index knows the tier, so finding a cold image costs no extra stat
+    return tiers_->locate(imageId);
+}
+
+bool StorageManager::relocated(const std::string& imageId, std::filesystem::path& path, uint8_t& tier) const {
+    uint8_t current = tiers_->tierOf(imageId);
+    if (current != tier) {
+        tier = current;
+        path = tiers_->pathFor(imageId, tier);
+        return true;
+    }
+
+    // Each place is tried under the previous layout before moving on; coming
+    // back from there means the migration may have just moved the image
+    bool fromPrevious = false;
+    if (migrator_) {
+        if (auto previous = migrator_->previousPath(path, imageId)) {
+            path = *previous;
+            return true;
+        }
+        if (auto moved = migrator_->currentPath(path, imageId)) {
+            path = *moved;
+            fromPrevious = true;
+        }
+    }
+    if (tier == 0) {
+        if (auto other = disks_->alternatePath(imageId, path)) {
+            path = *other;
+            return true;
+        }
+    }
+    return fromPrevious;
+}
+
+bool StorageManager::addDisk(const std::string& dir, std::string& error) {
+    return disks_->addDisk(dir, error);
+}
+
+std::vector<DiskSet::DiskStatus> StorageManager::diskStatus() const {
+    return disks_->status();
+}
+
+bool StorageManager::disksRebalancing() const {
+    return disks_->rebalancing();
+}
+
+bool StorageManager::rebalanceDisks() {
+    bool ok = true;
+    // Images still under a previous layout are moved straight to their new place
+    for (size_t disk = 0; disk < disks_->diskCount(); ++disk) {
+        for (const auto& layout : layoutsOnDisk()) {
+            bool completed = forEachShardedFile(disks_->root(disk), layout, [&](const std::filesystem::path& path) {
+                if (disks_->stopping()) {
+                    return false;
+                }
+
+                std::string imageId = path.filename().string();
+                uint64_t hash = 0;
+                if (!HashUtils::hexToHash(imageId, hash)) {
+                    return true; // temporary files of moves in progress
+                }
+                auto target = disks_->pathFor(imageId);
+                if (target == path) {
+                    return true;
+                }
+
+                std::lock_guard<std::mutex> lock(tiers_->moveLock(imageId));
+                std::error_code ec;
+                if (!std::filesystem::exists(path, ec)) {
+                    return true; // deleted or demoted since the listing
+                }
+
+                uint64_t bytes = 0;
+                auto slot = disks_->acquire(path);
+                if (!DiskSet::copyDurably(path, target, bytes)) {
+                    slot.fail();
+                    ok = false;
+                    return true;
+                }
+                std::filesystem::remove(path, ec);
+                disks_->recordMove(bytes);
+                return true;
+            });
+            if (!completed) {
+                return false;
+            }
+        }
+    }
+    return ok;
+}
+
+Mirror::Status StorageManager::mirrorStatus() const {
+    return mirror_ ? mirror_->status() : Mirror::Status{};
+}
+
+bool StorageManager::triggerMirrorRepair() {
+    return mirror_ && mirror_->triggerRepair();
+}
+
+ErasureStore::Status StorageManager::erasureStatus() const {
+    return erasure_ ? erasure_->status() : ErasureStore::Status{};
+}
+
+bool StorageManager::triggerErasureSweep() {
+    return erasure_ && erasure_->triggerSweep();
+}
+
+std::optional<bool> StorageManager::verifyErasureCoded(const std::string& imageId, const std::filesystem::path& path,
+                                                       uint64_t& bytesRead) {
+    bytesRead = 0;
+    auto stub = ErasureStore::readStub(path);
+    if (!stub) {
+        return std::nullopt;
+    }
+    uint64_t expected = 0;
+    std::vector<uint8_t> data;
+    if (!erasure_ || !HashUtils::hexToHash(imageId, expected) || !erasure_->scrub(imageId, *stub, data, bytesRead)) {
+        return false;
+    }
+    return HashUtils::xxh3_64(data.data(), data.size()) == expected;
+}
+
+Mirror::RepairResult StorageManager::repairMirror() {
+    Mirror::RepairResult result;
+    const std::string suffix = ".mapping";
+    auto mappingName = [&](const std::filesystem::path& path) -> std::optional<std::string> {
+        std::string file = path.filename().string();
+        if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            return std::nullopt; // temporary files of writes in progress
+        }
+        return file.substr(0, file.size() - suffix.size());
+    };
+
+    auto restoreImage = [&](const std::string& imageId, uint64_t hash) {
+        auto data = mirror_->readImage(imageId);
+        if (!data || HashUtils::xxh3_64(data->data(), data->size()) != hash) {
+            std::cerr << "No intact copy of image " << imageId << " on either storage root" << std::endl;
+            return false;
+        }
+        return storePrimary(imageId, *data, mirror_->imageWrittenAt(imageId));
+    };
+
+    try {
+        auto imageRoot = mirror_->root();
+        auto nameRoot = imageRoot / "names";
+
+        // The scan that rebuilt the index only saw what survived on the
+        // primary, so whatever the mirror holds beyond that goes back first
+        if (trustMirror_) {
+            bool completed = forEachShardedFile(imageRoot, layout_, [&](const std::filesystem::path& path) {
+                std::string imageId = path.filename().string();
+                uint64_t hash = 0;
+                if (!HashUtils::hexToHash(imageId, hash) || index_->findImage(hash)) {
+                    return !mirror_->stopping();
+                }
+                if (restoreImage(imageId, hash)) {
+                    ++result.imagesRestored;
+                } else {
+                    ++result.errors;
+                }
+                return !mirror_->stopping();
+            });
+            completed = completed && forEachShardedFile(nameRoot, layout_, [&](const std::filesystem::path& path) {
+                auto name = mappingName(path);
+                if (!name || index_->findName(*name)) {
+                    return !mirror_->stopping();
+                }
+                auto imageHash = mirror_->readName(*name);
+                if (imageHash && storeNamePrimary(*name, *imageHash)) {
+                    ++result.namesRestored;
+                } else {
+                    ++result.errors;
+                }
+                return !mirror_->stopping();
+            });
+            if (!completed) {
+                return result;
+            }
+            trustMirror_ = false;
+        }
+
+        // Collect first so no index lock is held during the copies
+        std::vector<uint64_t> hashes;
+        hashes.reserve(index_->imageCount());
+        index_->forEachImage([&](uint64_t hash, const ObjectRecord&) {
+            hashes.push_back(hash);
+        });
+
+        for (uint64_t hash : hashes) {
+            if (mirror_->stopping()) {
+                return result;
+            }
+            std::string imageId = HashUtils::hashToHex(hash);
+            std::error_code ec;
+            bool onPrimary = std::filesystem::exists(findImageFile(imageId), ec);
+            bool onMirror = std::filesystem::exists(mirror_->imagePath(imageId), ec);
+            if (onPrimary == onMirror) {
+                continue;
+            }
+
+            if (!onPrimary) {
+                if (restoreImage(imageId, hash)) {
+                    ++result.imagesRestored;
+                } else {
+                    ++result.errors;
+                }
+                continue;
+            }
+
+            // Verified, so a primary copy that rotted is quarantined rather than replicated
+            ReadStatus status;
+            bool timedOut = false;
+            auto data = readPrimary(imageId, true, hash, status, std::chrono::milliseconds::zero(), timedOut);
+            if (data && mirror_->writeImage(imageId, *data, imageWrittenAt(imageId))) {
+                ++result.imagesCopied;
+            } else {
+                ++result.errors;
+            }
+        }
+
+        std::vector<std::pair<std::string, uint64_t>> names;
+        names.reserve(index_->nameCount());
+        index_->forEachName([&](const std::string& name, uint64_t hash) {
+            names.emplace_back(name, hash);
+        });
+
+        for (const auto& [name, hash] : names) {
+            if (mirror_->stopping()) {
+                return result;
+            }
+            std::error_code ec;
+            bool onPrimary = std::filesystem::exists(getNameMappingPath(name), ec);
+            auto mirrored = mirror_->readName(name);
+            if (!onPrimary) {
+                // Lost from both sides, the index still knows the mapping
+                std::string imageHash = mirrored.value_or(HashUtils::hashToHex(hash));
+                if (storeNamePrimary(name, imageHash) && (mirrored || mirror_->writeName(name, imageHash))) {
+                    ++result.namesRestored;
+                } else {
+                    ++result.errors;
+                }
+                continue;
+            }
+
+            uint64_t mirroredHash = 0;
+            if (mirrored && HashUtils::hexToHash(*mirrored, mirroredHash) && mirroredHash == hash) {
+                continue;
+            }
+            auto primary = getHashByName(name);
+            if (primary && mirror_->writeName(name, *primary)) {
+                ++result.namesCopied;
+            } else {
+                ++result.errors;
+            }
+        }
+
+        // Entries deleted while their removal was dropped from the queue
+        bool completed = forEachShardedFile(imageRoot, layout_, [&](const std::filesystem::path& path) {
+            uint64_t hash = 0;
+            if (HashUtils::hexToHash(path.filename().string(), hash) && !index_->findImage(hash) &&
+                mirror_->eraseImage(path.filename().string())) {
+                ++result.removed;
+            }
+            return !mirror_->stopping();
+        });
+        completed = completed && forEachShardedFile(nameRoot, layout_, [&](const std::filesystem::path& path) {
+            auto name = mappingName(path);
+            if (name && !index_->findName(*name) && mirror_->eraseName(*name)) {
+                ++result.removed;
+            }
+            return !mirror_->stopping();
+        });
+
+        result.completed = completed;
+        return result;
+    } catch (const std::exception& e) {
+        std::cerr << "Error repairing mirror: " << e.what() << std::endl;
+        ++result.errors;
+        return result;
+    }
+}
+
+bool StorageManager::rebuildFilters() {
+    std::lock_guard<std::mutex> lock(rebuildMutex_);
+
+    // Leave room for growth so the filter stays accurate until the next rebuild
+    size_t hashCapacity = std::max(kMinFilterCapacity, index_->imageCount() * 2);
+    size_t nameCapacity = std::max(kMinFilterCapacity, index_->nameCount() * 2);
+
+    auto hashes = std::make_shared<BloomFilter>(hashCapacity, kFilterFalsePositiveRate);
+    auto names = std::make_shared<BloomFilter>(nameCapacity, kFilterFalsePositiveRate);
+    hashFilter_.pending.store(hashes);
+    nameFilter_.pending.store(names);
+
+    index_->forEachImage([&](uint64_t hash, const ObjectRecord&) {
+        hashes->add(HashUtils::hashToHex(hash));
+    });
+    index_->forEachName([&](const std::string& name, uint64_t) {
+        names->add(name);
+    });
+
+    hashFilter_.current.store(hashes);
+    nameFilter_.current.store(names);
+    hashFilter_.pending.store(nullptr);
+    nameFilter_.pending.store(nullptr);
+
+    for (auto* filter : {&hashFilter_, &nameFilter_}) {
+        auto current = filter->current.load();
+        filter->entries->set(static_cast<double>(current->size()));
+        filter->estimatedRate->set(current->estimatedFalsePositiveRate());
+    }
+
+    std::cout << "Lookup filters rebuilt: " << hashes->size() << " images, "
+              << names->size() << " names" << std::endl;
+    return true;
+}
+
+bool StorageManager::scanIntoIndex() {
+    struct Task {
+        std::string dir;
+        bool names;
+        uint8_t tier;
+        ShardLayout layout;
+    };
+
+    std::vector<Task> tasks;
+    auto addTasks = [&](const std::filesystem::path& root, bool names, uint8_t tier) {
+        if (!std::filesystem::exists(root)) {
+            return;
+        }
+        // A top-level directory both layouts share is walked once for each
+        for (const auto& layout : layoutsOnDisk()) {
+            for (const auto& entry : std::filesystem::directory_iterator(root)) {
+                if (entry.is_directory() && layout.isComponent(entry.path().filename().string())) {
+                    tasks.push_back({entry.path().string(), names, tier, layout});
+                }
+            }
+        }
+    };
+
+    try {
+        for (size_t tier = 0; tier < tiers_->tierCount(); ++tier) {
+            for (const auto& root : tiers_->roots(static_cast<uint8_t>(tier))) {
+                addTasks(root, false, static_cast<uint8_t>(tier));
+            }
+        }
+        // Name mappings only ever live on the primary root
+        addTasks(std::filesystem::path(baseDir_) / "names", true, 0);
+    } catch (const std::exception& e) {
+        std::cerr << "Error listing shards: " << e.what() << std::endl;
+        return false;
+    }
+
+    std::atomic<size_t> next{0};
+    std::atomic<bool> failed{false};
+    auto worker = [&]() {
+        for (size_t i = next++; i < tasks.size(); i = next++) {
+            const auto& task = tasks[i];
+            bool ok = walkShardDirectory(task.dir, task.layout, task.layout.depth - 1,
+                                         [&](const std::string& dir, const std::string& file) {
+                if (!task.names) {
+                    uint64_t hash = 0;
+                    if (HashUtils::hexToHash(file, hash)) {
+                        index_->addImage(hash, 0, ImageFormat::Unknown, false);
+                        if (task.tier > 0) {
+                            index_->setTier(hash, task.tier, false);
+                        }
+                    }
+                    return;
+                }
+
+                const std::string suffix = ".mapping";
+                if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0) {
+                    return;
+                }
+                std::ifstream mapping(dir + "/" + file);
+                std::string imageHash;
+                std::getline(mapping, imageHash);
+                uint64_t hash = 0;
+                HashUtils::hexToHash(imageHash, hash);
+                index_->setName(file.substr(0, file.size() - suffix.size()), hash, false);
+            });
+            if (!ok) {
+                failed = true;
+            }
+        }
+    };
+
+    unsigned threads = std::clamp(std::thread::hardware_concurrency(), 1u, 32u);
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back(worker);
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    return !failed;
+}
+
+void StorageManager::initFilterMetrics(LookupFilter& filter, const std::string& label) {
+    auto& metrics = Metrics::instance();
+    std::string labels = "{filter=\"" + label + "\"}";
+
+    filter.lookups = &metrics.counter("imgstore_bloom_lookups_total" + labels,
+                                      "Lookups checked against the negative-lookup filter");
+    filter.rejections = &metrics.counter("imgstore_bloom_rejections_total" + labels,
+                                         "Lookups rejected by the filter without touching the disk");
+    filter.falsePositives = &metrics.counter("imgstore_bloom_false_positives_total" + labels,
+                                             "Lookups that passed the filter but were not on disk");
+    filter.estimatedRate = &metrics.gauge("imgstore_bloom_estimated_false_positive_ratio" + labels,
+                                          "Theoretical false-positive rate at the current fill level");
+    filter.entries = &metrics.gauge("imgstore_bloom_entries" + labels,
+                                    "Keys recorded in the filter");
+
+    Counter* rejections = filter.rejections;
+    Counter* falsePositives = filter.falsePositives;
+    metrics.callbackGauge("imgstore_bloom_observed_false_positive_ratio" + labels,
+                          "Share of misses that the filter failed to reject",
+                          [rejections, falsePositives]() {
+        double fp = static_cast<double>(falsePositives->value());
+        double misses = fp + static_cast<double>(rejections->value());
+        return misses > 0 ? fp / misses : 0.0;
+    });
+}
+
+bool StorageManager::filterMayContain(LookupFilter& filter, const std::string& key) {
+    filter.lookups->increment();
+
+    auto current = filter.current.load();
+    if (!current || current->mightContain(key)) {
+        return true;
+    }
+
+    filter.rejections->increment();
+    return false;
+}
+
+void StorageManager::filterAdd(LookupFilter& filter, const std::string& key) {
+    // Pending first: if a rebuild swaps generations between the two loads,
+    // the key still lands in the generation that becomes current.
+    if (auto pending = filter.pending.load()) {
+        pending->add(key);
+    }
+    if (auto current = filter.current.load()) {
+        current->add(key);
+        filter.entries->set(static_cast<double>(current->size()));
+        filter.estimatedRate->set(current->estimatedFalsePositiveRate());
+    }
 }
 
 bool StorageManager::ensureDirectory(const std::filesystem::path& path) {
@@ -209,17 +1651,30 @@ bool StorageManager::ensureDirectory(const std::filesystem::path& path) {
     }
 }
 
+int StorageManager::createFile(const std::filesystem::path& path) {
+    constexpr int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    auto dir = path.parent_path();
+    if (knownDirs_->contains(dir)) {
+        // An open descriptor still saves the path walk; without one, a plain
+        // open() costs one call where opening the directory first costs three
+        auto directory = dirs_->cached(dir);
+        int fd = directory ? ::openat(directory->fd, path.filename().c_str(), flags, 0644)
+                           : ::open(path.c_str(), flags, 0644);
+        if (fd >= 0 || errno != ENOENT) {
+            return fd;
+        }
+        // Removed behind the store's back; the cache recreates it
+    }
+    int fd = dirs_->openFile(path, flags);
+    if (fd >= 0) {
+        knownDirs_->add(dir);
+    }
+    return fd;
+}
+
 std::filesystem::path StorageManager::getNameMappingPath(const std::string& imageName) const {
-    // Hash the image name for sharding
-    uint64_t hash = HashUtils::xxh3_64(imageName);
-    
-    // Generate shard path
-    std::string shardPath = HashUtils::generateShardPath(hash, shardDepth_, 2);
-    
-    // Construct full path with .mapping extension
-    std::filesystem::path fullPath = std::filesystem::path(baseDir_) / "names" / shardPath / (imageName + ".mapping");
-    
-    return fullPath;
+    // Sharded by the hash of the name, with a .mapping extension
+    return layout_.pathOf(std::filesystem::path(baseDir_) / "names", imageName, imageName + ".mapping");
 }
 
 } // namespace imgstore
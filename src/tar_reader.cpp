@@ -0,0 +1,232 @@
+#include "tar_reader.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+namespace imgstore {
+
+namespace {
+
+constexpr size_t kBlock = 512;
+
+// Offsets of the ustar header fields used here
+constexpr size_t kNameOffset = 0, kNameSize = 100;
+constexpr size_t kSizeOffset = 124, kSizeSize = 12;
+constexpr size_t kChecksumOffset = 148, kChecksumSize = 8;
+constexpr size_t kTypeOffset = 156;
+constexpr size_t kMagicOffset = 257;
+constexpr size_t kPrefixOffset = 345, kPrefixSize = 155;
+
+uint64_t padded(uint64_t size) {
+    return (size + kBlock - 1) / kBlock * kBlock;
+}
+
+std::string field(const char* header, size_t offset, size_t size) {
+    const char* start = header + offset;
+    return std::string(start, std::find(start, start + size, '\0'));
+}
+
+bool parseNumber(const char* header, size_t offset, size_t size, uint64_t& value) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(header + offset);
+    value = 0;
+    if (bytes[0] & 0x80) {
+        // GNU base-256: big-endian, first byte's top bit set
+        value = bytes[0] & 0x3f;
+        for (size_t i = 1; i < size; ++i) {
+            value = (value << 8) | bytes[i];
+        }
+        return true;
+    }
+    size_t i = 0;
+    while (i < size && bytes[i] == ' ') {
+        ++i;
+    }
+    bool digits = false;
+    for (; i < size && bytes[i] >= '0' && bytes[i] <= '7'; ++i) {
+        value = (value << 3) | (bytes[i] - '0');
+        digits = true;
+    }
+    return digits;
+}
+
+bool checksumValid(const char* header) {
+    uint64_t expected = 0;
+    if (!parseNumber(header, kChecksumOffset, kChecksumSize, expected)) {
+        return false;
+    }
+    uint64_t sum = 0;
+    for (size_t i = 0; i < kBlock; ++i) {
+        bool inField = i >= kChecksumOffset && i < kChecksumOffset + kChecksumSize;
+        sum += inField ? ' ' : static_cast<unsigned char>(header[i]);
+    }
+    return sum == expected;
+}
+
+} // namespace
+
+TarReader::TarReader(const std::filesystem::path& path)
+    : fd_(path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY | O_CLOEXEC)), ownsFd_(path != "-") {
+    if (fd_ < 0) {
+        error_ = std::strerror(errno);
+    }
+}
+
+TarReader::~TarReader() {
+    if (ownsFd_ && fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool TarReader::next(Entry& entry) {
+    if (!good() || !skip(remaining_)) {
+        return false;
+    }
+    remaining_ = 0;
+
+    std::string longPath;
+    uint64_t paxSize = 0;
+    bool hasPaxSize = false;
+    char header[kBlock];
+    while (readExact(header, sizeof(header))) {
+        if (std::all_of(header, header + kBlock, [](char c) { return c == '\0'; })) {
+            return false; // end-of-archive marker
+        }
+        if (!checksumValid(header)) {
+            error_ = "bad tar header checksum";
+            return false;
+        }
+
+        uint64_t size = 0;
+        parseNumber(header, kSizeOffset, kSizeSize, size);
+        char type = header[kTypeOffset];
+
+        if (type == 'x' || type == 'L') {
+            std::string text;
+            if (!readString(size, text)) {
+                return false;
+            }
+            if (type == 'L') {
+                longPath = text.substr(0, text.find('\0'));
+                continue;
+            }
+            // pax records: "<length> <key>=<value>\n"
+            for (size_t pos = 0; pos < text.size();) {
+                size_t space = text.find(' ', pos);
+                if (space == std::string::npos) {
+                    break;
+                }
+                size_t length = std::strtoull(text.c_str() + pos, nullptr, 10);
+                if (length == 0 || pos + length > text.size()) {
+                    break;
+                }
+                std::string record = text.substr(space + 1, pos + length - space - 2);
+                size_t equals = record.find('=');
+                if (equals != std::string::npos) {
+                    std::string key = record.substr(0, equals);
+                    if (key == "path") {
+                        longPath = record.substr(equals + 1);
+                    } else if (key == "size") {
+                        paxSize = std::strtoull(record.c_str() + equals + 1, nullptr, 10);
+                        hasPaxSize = true;
+                    }
+                }
+                pos += length;
+            }
+            continue;
+        }
+
+        if (hasPaxSize) {
+            size = paxSize;
+        }
+        if (type != '0' && type != '\0' && type != '7') {
+            // Directories, links, devices and global headers carry no file
+            if (!skip(padded(size))) {
+                return false;
+            }
+            longPath.clear();
+            hasPaxSize = false;
+            continue;
+        }
+
+        if (longPath.empty()) {
+            std::string prefix;
+            if (std::memcmp(header + kMagicOffset, "ustar", 5) == 0) {
+                prefix = field(header, kPrefixOffset, kPrefixSize);
+            }
+            std::string name = field(header, kNameOffset, kNameSize);
+            longPath = prefix.empty() ? name : prefix + "/" + name;
+        }
+        entry.path = longPath;
+        entry.size = size;
+        size_ = size;
+        remaining_ = padded(size);
+        return true;
+    }
+    return false;
+}
+
+bool TarReader::read(std::vector<uint8_t>& data) {
+    if (!good() || remaining_ != padded(size_)) {
+        return false; // no current file, or it was already read
+    }
+    data.resize(size_);
+    if (!readExact(data.data(), data.size()) || !skip(remaining_ - size_)) {
+        if (error_.empty()) {
+            error_ = "archive is truncated";
+        }
+        return false;
+    }
+    remaining_ = 0;
+    return true;
+}
+
+bool TarReader::readExact(void* buffer, size_t size) {
+    char* bytes = static_cast<char*>(buffer);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::read(fd_, bytes + done, size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n < 0) {
+                error_ = std::strerror(errno);
+            } else if (done > 0) {
+                error_ = "archive is truncated";
+            }
+            return false;
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+bool TarReader::skip(uint64_t size) {
+    char buffer[64 * 1024];
+    while (size > 0) {
+        size_t chunk = static_cast<size_t>(std::min<uint64_t>(size, sizeof(buffer)));
+        if (!readExact(buffer, chunk)) {
+            if (error_.empty()) {
+                error_ = "archive is truncated";
+            }
+            return false;
+        }
+        size -= chunk;
+    }
+    return true;
+}
+
+bool TarReader::readString(uint64_t size, std::string& value) {
+    value.resize(size);
+    if (!readExact(value.data(), value.size()) || !skip(padded(size) - size)) {
+        if (error_.empty()) {
+            error_ = "archive is truncated";
+        }
+        return false;
+    }
+    return true;
+}
+
+} // namespace imgstore
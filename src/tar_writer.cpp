@@ -0,0 +1,152 @@
+#include "tar_writer.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+constexpr size_t kBlock = 512;
+
+// Largest value an 11-digit octal field holds
+constexpr uint64_t kMaxOctal = 077777777777ull;
+
+struct UstarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+static_assert(sizeof(UstarHeader) == kBlock, "tar header must fill one block");
+
+// Zero-padded octal digits followed by a NUL, as the header fields expect
+void putOctal(char* field, size_t width, uint64_t value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; --i, value >>= 3) {
+        field[i - 1] = static_cast<char>('0' + (value & 7));
+    }
+}
+
+// pax records are "<length> <key>=<value>\n", the length counting its own digits
+std::string paxRecord(const std::string& key, const std::string& value) {
+    size_t body = 1 + key.size() + 1 + value.size() + 1;
+    size_t length = body + std::to_string(body).size();
+    if (std::to_string(length).size() != std::to_string(body).size()) {
+        ++length;
+    }
+    return std::to_string(length) + " " + key + "=" + value + "\n";
+}
+
+} // namespace
+
+TarWriter::TarWriter(const std::filesystem::path& path)
+    : fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) {
+    if (fd_ < 0) {
+        std::cerr << "Failed to create archive " << path << ": " << std::strerror(errno) << std::endl;
+    }
+}
+
+TarWriter::~TarWriter() {
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+bool TarWriter::add(const std::string& name, const void* data, size_t size, int64_t mtime) {
+    if (name.size() > sizeof(UstarHeader::name)) {
+        std::string pax = paxRecord("path", name);
+        if (!writeHeader("PaxHeader", pax.size(), mtime, 'x') || !writePadded(pax.data(), pax.size())) {
+            return false;
+        }
+    }
+    return writeHeader(name, size, mtime, '0') && writePadded(data, size);
+}
+
+bool TarWriter::finish() {
+    static const char kZeros[2 * kBlock] = {};
+    if (!writeAll(kZeros, sizeof(kZeros))) {
+        return false;
+    }
+    if (fd_ >= 0 && ::fsync(fd_) != 0) {
+        ok_ = false;
+    }
+    return good();
+}
+
+bool TarWriter::writeHeader(const std::string& name, uint64_t size, int64_t mtime, char type) {
+    UstarHeader header;
+    std::memset(&header, 0, sizeof(header));
+    // A longer name was already carried by a pax header; the truncated copy is only a fallback
+    std::memcpy(header.name, name.data(), std::min(name.size(), sizeof(header.name)));
+    putOctal(header.mode, sizeof(header.mode), 0644);
+    putOctal(header.uid, sizeof(header.uid), 0);
+    putOctal(header.gid, sizeof(header.gid), 0);
+    if (size <= kMaxOctal) {
+        putOctal(header.size, sizeof(header.size), size);
+    } else {
+        header.size[0] = static_cast<char>(0x80);
+        for (size_t i = sizeof(header.size) - 1; i > 0; --i, size >>= 8) {
+            header.size[i] = static_cast<char>(size & 0xff);
+        }
+    }
+    putOctal(header.mtime, sizeof(header.mtime), static_cast<uint64_t>(std::max<int64_t>(mtime, 0)));
+    header.type = type;
+    std::memcpy(header.magic, "ustar", 6);
+    std::memcpy(header.version, "00", 2);
+
+    std::memset(header.checksum, ' ', sizeof(header.checksum));
+    unsigned sum = 0;
+    for (size_t i = 0; i < sizeof(header); ++i) {
+        sum += reinterpret_cast<const unsigned char*>(&header)[i];
+    }
+    // Six digits, a NUL and the space that is already there
+    putOctal(header.checksum, 7, sum);
+    return writeAll(&header, sizeof(header));
+}
+
+bool TarWriter::writePadded(const void* data, size_t size) {
+    static const char kZeros[kBlock] = {};
+    size_t padding = (kBlock - size % kBlock) % kBlock;
+    return writeAll(data, size) && writeAll(kZeros, padding);
+}
+
+bool TarWriter::writeAll(const void* data, size_t size) {
+    if (!good()) {
+        return false;
+    }
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = ::write(fd_, bytes, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Failed to write archive: " << std::strerror(errno) << std::endl;
+            ok_ = false;
+            return false;
+        }
+        bytes += n;
+        size -= static_cast<size_t>(n);
+        bytes_ += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+} // namespace imgstore
@@ -0,0 +1,280 @@
+#include "tier_manager.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+// Demotion passes run a few times per idle period, but never more often
+// than this or less often than kMaxPassInterval
+constexpr std::chrono::seconds kMinPassInterval{1};
+constexpr std::chrono::seconds kMaxPassInterval{600};
+
+} // namespace
+
+TierManager::TierManager(DiskSet& hot, std::vector<std::filesystem::path> coldRoots, const ShardLayout& layout,
+                         ObjectIndex& index, const TierPolicy& policy)
+    : hot_(hot), cold_(std::move(coldRoots)), layout_(layout), index_(index), policy_(policy),
+      startTime_(std::chrono::steady_clock::now()),
+      demotions_(Metrics::instance().counter("imgstore_tier_moves_total{direction=\"demote\"}",
+                                             "Images moved between storage tiers")),
+      promotions_(Metrics::instance().counter("imgstore_tier_moves_total{direction=\"promote\"}",
+                                              "Images moved between storage tiers")),
+      demotedBytes_(Metrics::instance().counter("imgstore_tier_moved_bytes_total{direction=\"demote\"}",
+                                                "Bytes copied between storage tiers")),
+      promotedBytes_(Metrics::instance().counter("imgstore_tier_moved_bytes_total{direction=\"promote\"}",
+                                                 "Bytes copied between storage tiers")),
+      moveFailures_(Metrics::instance().counter("imgstore_tier_move_failures_total",
+                                                "Tier moves abandoned because of an I/O error")) {
+    for (const auto& root : cold_) {
+        std::filesystem::create_directories(root);
+    }
+    for (size_t tier = 0; tier < tierCount(); ++tier) {
+        reads_.push_back(&Metrics::instance().counter(
+            "imgstore_tier_reads_total{tier=\"" + std::to_string(tier) + "\"}",
+            "Image reads served by each storage tier"));
+    }
+    Metrics::instance().callbackGauge("imgstore_tier_promotion_queue_depth",
+                                      "Cold images waiting to move back to tier 0",
+                                      [this]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return static_cast<double>(pending_.size());
+    });
+}
+
+TierManager::~TierManager() {
+    stop();
+    Metrics::instance().callbackGauge("imgstore_tier_promotion_queue_depth", "", nullptr);
+}
+
+void TierManager::start() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cold_.empty() || thread_.joinable()) {
+        return;
+    }
+    stopRequested_ = false;
+    thread_ = std::thread(&TierManager::loop, this);
+}
+
+void TierManager::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopRequested_ = true;
+    }
+    cv_.notify_all();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+std::vector<std::filesystem::path> TierManager::roots(uint8_t tier) const {
+    if (tier > 0) {
+        return {cold_[tier - 1]};
+    }
+    std::vector<std::filesystem::path> disks;
+    for (size_t disk = 0; disk < hot_.diskCount(); ++disk) {
+        disks.push_back(hot_.root(disk));
+    }
+    return disks;
+}
+
+std::filesystem::path TierManager::pathFor(const std::string& imageId, uint8_t tier) const {
+    if (tier == 0) {
+        return hot_.pathFor(imageId);
+    }
+    return layout_.pathOf(cold_[tier - 1], imageId, imageId);
+}
+
+std::filesystem::path TierManager::locate(const std::string& imageId) const {
+    uint8_t tier = tierOf(imageId);
+    return tier == 0 ? hot_.locate(imageId) : pathFor(imageId, tier);
+}
+
+uint8_t TierManager::tierOf(const std::string& imageId) const {
+    uint64_t hash = 0;
+    if (cold_.empty() || !HashUtils::hexToHash(imageId, hash)) {
+        return 0;
+    }
+    auto record = index_.findImage(hash);
+    // A tier beyond the configured roots means a cold directory was dropped
+    // from the configuration; the primary disks are the only sensible guess
+    return record && record->tier < tierCount() ? record->tier : 0;
+}
+
+void TierManager::recordRead(const std::string& imageId, uint8_t tier) {
+    reads_[tier]->increment();
+
+    uint64_t hash = 0;
+    if (cold_.empty() || !HashUtils::hexToHash(imageId, hash)) {
+        return;
+    }
+
+    bool promote = false;
+    {
+        auto& shard = accessShard(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto& access = shard.entries[hash];
+        access.lastRead = now();
+        promote = tier > 0 && policy_.promoteAfterReads > 0 && ++access.reads >= policy_.promoteAfterReads;
+    }
+
+    if (promote) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!queued_.insert(imageId).second) {
+                return;
+            }
+            pending_.push_back(imageId);
+        }
+        cv_.notify_all();
+    }
+}
+
+void TierManager::forget(const std::string& imageId) {
+    uint64_t hash = 0;
+    if (cold_.empty() || !HashUtils::hexToHash(imageId, hash)) {
+        return;
+    }
+    auto& shard = accessShard(hash);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.entries.erase(hash);
+}
+
+std::mutex& TierManager::moveLock(const std::string& imageId) {
+    return moveLocks_[HashUtils::xxh3_64(imageId) % kMoveLocks];
+}
+
+bool TierManager::moveImage(const std::string& imageId, uint8_t tier) {
+    uint64_t hash = 0;
+    if (tier >= tierCount() || !HashUtils::hexToHash(imageId, hash)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(moveLock(imageId));
+    auto record = index_.findImage(hash);
+    if (!record) {
+        return false; // deleted since it was picked
+    }
+    if (record->tier == tier) {
+        return true;
+    }
+
+    auto source = record->tier == 0 ? hot_.locate(imageId) : pathFor(imageId, record->tier);
+    auto target = pathFor(imageId, tier);
+
+    uint64_t bytes = 0;
+    {
+        // Moves queue behind foreground I/O on the primary disk they touch
+        auto slot = hot_.acquire(record->tier == 0 ? source : target);
+        if (!DiskSet::copyDurably(source, target, bytes)) {
+            slot.fail();
+            moveFailures_.increment();
+            return false;
+        }
+    }
+
+    // The new copy is durable before the index points at it, and the index
+    // points at it before the old copy goes, so a crash leaves at worst a
+    // stray duplicate
+    index_.setTier(hash, tier);
+
+    std::error_code ec;
+    if (!std::filesystem::remove(source, ec) && ec) {
+        std::cerr << "Failed to remove " << source << " after moving it: " << ec.message() << std::endl;
+    }
+
+    {
+        auto& shard = accessShard(hash);
+        std::lock_guard<std::mutex> accessLock(shard.mutex);
+        shard.entries[hash] = Access{now(), 0};
+    }
+
+    if (tier > record->tier) {
+        demotions_.increment();
+        demotedBytes_.increment(bytes);
+    } else {
+        promotions_.increment();
+        promotedBytes_.increment(bytes);
+    }
+    return true;
+}
+
+size_t TierManager::runDemotionPass() {
+    if (cold_.empty()) {
+        return 0;
+    }
+
+    // Collect first so no index or access lock is held during the copies
+    int64_t cutoff = now() - policy_.demoteAfter.count();
+    std::vector<uint64_t> candidates;
+    std::vector<uint8_t> targets;
+    index_.forEachImage([&](uint64_t hash, const ObjectRecord& record) {
+        if (record.tier + 1u >= tierCount()) {
+            return;
+        }
+        auto& shard = accessShard(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(hash);
+        int64_t lastRead = it != shard.entries.end() ? it->second.lastRead : 0;
+        if (lastRead <= cutoff) {
+            candidates.push_back(hash);
+            targets.push_back(static_cast<uint8_t>(record.tier + 1));
+        }
+    });
+
+    size_t moved = 0;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (stopRequested_) {
+                break;
+            }
+        }
+        if (moveImage(HashUtils::hashToHex(candidates[i]), targets[i])) {
+            ++moved;
+        }
+    }
+
+    if (moved > 0) {
+        std::cout << "Demoted " << moved << " idle images" << std::endl;
+    }
+    return moved;
+}
+
+int64_t TierManager::now() const {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - startTime_).count();
+}
+
+void TierManager::loop() {
+    auto interval = std::clamp(policy_.demoteAfter / 4, kMinPassInterval, kMaxPassInterval);
+    auto nextPass = std::chrono::steady_clock::now() + interval;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopRequested_) {
+        cv_.wait_until(lock, nextPass, [this]() { return stopRequested_ || !pending_.empty(); });
+        if (stopRequested_) {
+            break;
+        }
+
+        // Promotions are served first: a reader is waiting on a cold disk
+        if (!pending_.empty()) {
+            std::string imageId = std::move(pending_.front());
+            pending_.pop_front();
+            queued_.erase(imageId);
+
+            lock.unlock();
+            moveImage(imageId, 0);
+            lock.lock();
+            continue;
+        }
+
+        lock.unlock();
+        runDemotionPass();
+        lock.lock();
+        nextPass = std::chrono::steady_clock::now() + interval;
+    }
+}
+
+} // namespace imgstore
@@ -0,0 +1,181 @@
+#include "tombstone_set.h"
+#include "hash_utils.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+namespace imgstore {
+
+namespace {
+
+const char* kLogFile = "tombstones.log";
+
+// Compact once the log holds this many times the live entries, and at least this many lines
+constexpr size_t kCompactFactor = 4;
+constexpr size_t kCompactMinRecords = 4096;
+
+bool writeAll(int fd, const std::string& text) {
+    const char* p = text.data();
+    size_t size = text.size();
+    while (size > 0) {
+        ssize_t n = ::write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+} // namespace
+
+TombstoneSet::TombstoneSet(const std::filesystem::path& baseDir, std::chrono::seconds retention)
+    : path_(baseDir / kLogFile), retention_(retention) {
+    load();
+    Metrics::instance().callbackGauge("imgstore_tombstones", "Deleted images remembered for anti-entropy", [this]() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return static_cast<double>(entries_.size());
+    });
+}
+
+TombstoneSet::~TombstoneSet() {
+    Metrics::instance().callbackGauge("imgstore_tombstones", "", nullptr);
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+}
+
+void TombstoneSet::add(uint64_t hash, int64_t deletedAt) {
+    if (expired(deletedAt)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto [it, inserted] = entries_.emplace(hash, deletedAt);
+    if (!inserted && it->second >= deletedAt) {
+        return;
+    }
+    it->second = deletedAt;
+    append(hash, std::to_string(deletedAt).c_str());
+}
+
+void TombstoneSet::clear(uint64_t hash) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entries_.erase(hash) > 0) {
+        append(hash, "-");
+    }
+}
+
+std::optional<int64_t> TombstoneSet::deletedAt(uint64_t hash) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(hash);
+    if (it == entries_.end() || expired(it->second)) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+std::vector<std::pair<uint64_t, int64_t>> TombstoneSet::list(const std::function<bool(uint64_t)>& wanted) const {
+    std::vector<std::pair<uint64_t, int64_t>> result;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [hash, deletedAt] : entries_) {
+        if (!expired(deletedAt) && wanted(hash)) {
+            result.emplace_back(hash, deletedAt);
+        }
+    }
+    return result;
+}
+
+int64_t TombstoneSet::now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+void TombstoneSet::load() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::ifstream file(path_);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string id;
+        std::string value;
+        uint64_t hash = 0;
+        if (!(fields >> id >> value) || !HashUtils::hexToHash(id, hash)) {
+            continue; // a line torn by a crash
+        }
+        if (value == "-") {
+            entries_.erase(hash);
+            continue;
+        }
+        try {
+            entries_[hash] = std::stoll(value);
+        } catch (const std::exception&) {
+        }
+    }
+    compactLocked();
+}
+
+void TombstoneSet::append(uint64_t hash, const char* value) {
+    if (fd_ < 0) {
+        return;
+    }
+    if (!writeAll(fd_, HashUtils::hashToHex(hash) + " " + value + "\n")) {
+        std::cerr << "Failed to append to tombstone log: " << std::strerror(errno) << std::endl;
+        return;
+    }
+    if (++records_ >= std::max(kCompactMinRecords, entries_.size() * kCompactFactor)) {
+        compactLocked();
+    }
+}
+
+void TombstoneSet::compactLocked() {
+    for (auto it = entries_.begin(); it != entries_.end();) {
+        it = expired(it->second) ? entries_.erase(it) : std::next(it);
+    }
+
+    auto temp = path_;
+    temp += ".tmp";
+    std::string contents;
+    for (const auto& [hash, deletedAt] : entries_) {
+        contents += HashUtils::hashToHex(hash) + " " + std::to_string(deletedAt) + "\n";
+    }
+    int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && writeAll(fd, contents) && ::fsync(fd) == 0;
+    if (fd >= 0) {
+        ::close(fd);
+    }
+    std::error_code ec;
+    if (ok) {
+        std::filesystem::rename(temp, path_, ec);
+    }
+    if (!ok || ec) {
+        // Appending to the old log still records every change
+        std::cerr << "Failed to compact tombstone log " << path_ << std::endl;
+        std::filesystem::remove(temp, ec);
+    }
+    records_ = entries_.size();
+
+    if (fd_ >= 0) {
+        ::close(fd_);
+    }
+    fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        std::cerr << "Failed to open tombstone log: " << std::strerror(errno) << std::endl;
+    }
+}
+
+bool TombstoneSet::expired(int64_t deletedAt) const {
+    auto retention = std::chrono::duration_cast<std::chrono::milliseconds>(retention_).count();
+    return retention > 0 && deletedAt < now() - retention;
+}
+
+} // namespace imgstore
@@ -0,0 +1,181 @@
+#include "variant_cache.h"
+#include "hash_utils.h"
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+
+namespace imgstore {
+
+VariantCache::VariantCache(const std::string& baseDir, const ShardLayout& layout, size_t maxPerSource)
+    : root_(std::filesystem::path(baseDir) / "variants"), layout_(layout), maxPerSource_(maxPerSource),
+      hits_(Metrics::instance().counter("imgstore_variant_cache_hits_total",
+                                        "Variant requests served from the variant cache")),
+      misses_(Metrics::instance().counter("imgstore_variant_cache_misses_total",
+                                          "Variant requests that had to run a transform")),
+      joins_(Metrics::instance().counter("imgstore_variant_singleflight_joins_total",
+                                         "Variant requests that waited on an identical in-flight transform")),
+      bytesWritten_(Metrics::instance().counter("imgstore_variant_bytes_written_total",
+                                                "Bytes of derived variants written to disk")),
+      evictions_(Metrics::instance().counter("imgstore_variant_evictions_total",
+                                             "Cached variants removed to keep a source under its limit")) {}
+
+std::shared_ptr<const Variant> VariantCache::getOrCreate(const std::string& sourceId,
+                                                         const std::string& transformKey,
+                                                         const Producer& produce, bool& cached) {
+    auto path = variantPath(sourceId, transformKey);
+    cached = true;
+
+    if (auto data = readVariant(path)) {
+        hits_.increment();
+        auto variant = std::make_shared<Variant>();
+        variant->status = data->empty() ? Variant::Status::Original : Variant::Status::Ok;
+        variant->data = std::move(*data);
+        return variant;
+    }
+
+    std::string flightKey = sourceId + "/" + transformKey;
+    std::promise<Result> promise;
+    std::shared_future<Result> future;
+    bool leader = false;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = inflight_.find(flightKey);
+        if (it != inflight_.end()) {
+            future = it->second;
+        } else {
+            future = promise.get_future().share();
+            inflight_.emplace(flightKey, future);
+            leader = true;
+        }
+    }
+
+    if (!leader) {
+        joins_.increment();
+        return future.get();
+    }
+
+    auto variant = std::make_shared<Variant>();
+    // A previous leader may have finished between the disk check and the lookup above
+    if (auto data = readVariant(path)) {
+        hits_.increment();
+        variant->status = data->empty() ? Variant::Status::Original : Variant::Status::Ok;
+        variant->data = std::move(*data);
+    } else {
+        misses_.increment();
+        cached = false;
+        try {
+            *variant = produce();
+        } catch (const std::exception& e) {
+            std::cerr << "Variant generation failed for " << flightKey << ": " << e.what() << std::endl;
+            variant->status = Variant::Status::Failed;
+        }
+        bool written = false;
+        if (variant->status == Variant::Status::Ok) {
+            written = writeVariant(path, variant->data);
+        } else if (variant->status == Variant::Status::Original) {
+            written = writeVariant(path, {});
+        }
+        if (written && maxPerSource_ > 0) {
+            evictOldest(path.parent_path());
+        }
+    }
+
+    promise.set_value(variant);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        inflight_.erase(flightKey);
+    }
+    return variant;
+}
+
+size_t VariantCache::removeVariants(const std::string& sourceId) {
+    try {
+        auto removed = std::filesystem::remove_all(sourceDirectory(sourceId));
+        // remove_all also counts the directory itself
+        return removed > 0 ? static_cast<size_t>(removed - 1) : 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error removing variants of " << sourceId << ": " << e.what() << std::endl;
+        return 0;
+    }
+}
+
+std::filesystem::path VariantCache::variantPath(const std::string& sourceId, const std::string& transformKey) const {
+    return sourceDirectory(sourceId) / HashUtils::hashToHex(HashUtils::xxh3_64(transformKey));
+}
+
+std::filesystem::path VariantCache::sourceDirectory(const std::string& sourceId) const {
+    return layout_.pathOf(root_, sourceId, sourceId);
+}
+
+std::optional<std::vector<uint8_t>> VariantCache::readVariant(const std::filesystem::path& path) const {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return std::nullopt;
+    }
+
+    auto size = file.tellg();
+    file.seekg(0, std::ios::beg);
+
+    std::vector<uint8_t> data(static_cast<size_t>(size));
+    if (!file.read(reinterpret_cast<char*>(data.data()), size)) {
+        return std::nullopt;
+    }
+    return data;
+}
+
+bool VariantCache::writeVariant(const std::filesystem::path& path, const std::vector<uint8_t>& data) {
+    try {
+        std::filesystem::create_directories(path.parent_path());
+
+        // Write beside the target and rename, so readers never see a partial variant
+        std::ostringstream suffix;
+        suffix << ".tmp." << std::this_thread::get_id();
+        auto temp = path;
+        temp += suffix.str();
+
+        std::ofstream file(temp, std::ios::binary);
+        if (!file) {
+            std::cerr << "Failed to open variant for writing: " << temp << std::endl;
+            return false;
+        }
+        file.write(reinterpret_cast<const char*>(data.data()), data.size());
+        file.close();
+        if (!file.good()) {
+            std::filesystem::remove(temp);
+            return false;
+        }
+
+        std::filesystem::rename(temp, path);
+        bytesWritten_.increment(data.size());
+        return true;
+    } catch (const std::exception& e) {
+        std::cerr << "Error storing variant: " << e.what() << std::endl;
+        return false;
+    }
+}
+
+void VariantCache::evictOldest(const std::filesystem::path& dir) {
+    std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> variants;
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+        // Temporary files of writes in flight are left to their writers
+        if (entry.path().filename().string().find('.') == std::string::npos) {
+            variants.emplace_back(entry.last_write_time(ec), entry.path());
+        }
+    }
+    if (variants.size() <= maxPerSource_) {
+        return;
+    }
+
+    size_t excess = variants.size() - maxPerSource_;
+    std::partial_sort(variants.begin(), variants.begin() + excess, variants.end());
+    for (size_t i = 0; i < excess; ++i) {
+        if (std::filesystem::remove(variants[i].second, ec)) {
+            evictions_.increment();
+        }
+    }
+}
+
+} // namespace imgstore
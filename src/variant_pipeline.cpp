@@ -0,0 +1,131 @@
+#include "variant_pipeline.h"
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iostream>
+
+namespace imgstore {
+
+namespace {
+
+// Niceness of pipeline threads: request handling always wins the CPU
+constexpr int kWorkerNiceness = 10;
+
+} // namespace
+
+VariantPipeline::VariantPipeline(size_t threads, size_t capacity, std::function<bool()> underPressure)
+    : capacity_(capacity), underPressure_(std::move(underPressure)),
+      accepted_(Metrics::instance().counter("imgstore_variant_pipeline_jobs_total",
+                                            "Uploads queued for eager variant generation")),
+      shedQueueFull_(Metrics::instance().counter("imgstore_variant_pipeline_shed_total{reason=\"queue_full\"}",
+                                                 "Eager variant jobs refused by admission control, by reason")),
+      shedPressure_(Metrics::instance().counter("imgstore_variant_pipeline_shed_total{reason=\"pressure\"}",
+                                                "Eager variant jobs refused by admission control, by reason")),
+      abandoned_(Metrics::instance().counter("imgstore_variant_pipeline_abandoned_total",
+                                             "Eager variant jobs stopped early because the server got busy")),
+      completed_(Metrics::instance().counter("imgstore_variant_pipeline_completed_total",
+                                             "Eager variant jobs that ran to completion")) {
+    threads = std::max<size_t>(threads, 1);
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back(&VariantPipeline::workerLoop, this);
+    }
+
+    Metrics::instance().callbackGauge("imgstore_variant_pipeline_queue_depth",
+                                      "Eager variant jobs waiting for a worker",
+                                      [this]() { return static_cast<double>(queueDepth()); });
+}
+
+VariantPipeline::~VariantPipeline() {
+    shutdown();
+    Metrics::instance().callbackGauge("imgstore_variant_pipeline_queue_depth", "", nullptr);
+}
+
+bool VariantPipeline::submit(const std::string& sourceId, Job job) {
+    if (pressure()) {
+        shedPressure_.increment();
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_ || queue_.size() >= capacity_) {
+            shedQueueFull_.increment();
+            return false;
+        }
+        queue_.push_back({sourceId, std::move(job)});
+    }
+    accepted_.increment();
+    cv_.notify_one();
+    return true;
+}
+
+size_t VariantPipeline::queueDepth() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+}
+
+void VariantPipeline::shutdown() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+        queue_.clear();
+    }
+    cv_.notify_all();
+    for (auto& thread : threads_) {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+}
+
+bool VariantPipeline::pressure() const {
+    return underPressure_ && underPressure_();
+}
+
+void VariantPipeline::workerLoop() {
+    // On Linux, PRIO_PROCESS with a thread ID applies to that thread only
+    if (setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), kWorkerNiceness) != 0) {
+        std::cerr << "Could not lower variant pipeline thread priority" << std::endl;
+    }
+
+    auto shouldStop = [this]() { return stopping_.load() || pressure(); };
+
+    while (true) {
+        Entry entry;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+            if (stopping_) {
+                return;
+            }
+            entry = std::move(queue_.front());
+            queue_.pop_front();
+        }
+
+        // Conditions may have changed while the job sat in the queue
+        if (shouldStop()) {
+            abandoned_.increment();
+            continue;
+        }
+
+        bool finished = false;
+        try {
+            finished = entry.job(shouldStop);
+        } catch (const std::exception& e) {
+            std::cerr << "Eager variant generation failed for " << entry.sourceId << ": " << e.what() << std::endl;
+            continue;
+        }
+
+        if (finished) {
+            completed_.increment();
+        } else {
+            abandoned_.increment();
+        }
+    }
+}
+
+} // namespace imgstore
@@ -0,0 +1,127 @@
+// Deletes from other replicas are ordered against an image's upload time,
+// which must survive the copies a store makes of its own files.
+
+#include "hash_utils.h"
+#include "storage_manager.h"
+#include "tombstone_set.h"
+#include <unistd.h>
+#include <chrono>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace imgstore;
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << std::endl; \
+            ++failures; \
+        } \
+    } while (0)
+
+struct TempDir {
+    std::filesystem::path path;
+    TempDir() {
+        path = std::filesystem::temp_directory_path() / ("imgstore-test-" + std::to_string(::getpid()));
+        std::filesystem::remove_all(path);
+        std::filesystem::create_directories(path);
+    }
+    ~TempDir() {
+        std::error_code ec;
+        std::filesystem::remove_all(path, ec);
+    }
+};
+
+std::vector<uint8_t> image(uint8_t seed) {
+    std::vector<uint8_t> data(4096);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<uint8_t>(seed * 31 + i * 7);
+    }
+    return data;
+}
+
+std::string idOf(const std::vector<uint8_t>& data) {
+    return HashUtils::hashToHex(HashUtils::xxh3_64(data.data(), data.size()));
+}
+
+void pause() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+}
+
+// A tier move rewrites the file later than a delete that came after the upload
+void testDeleteAfterUploadWinsOverTierMove(StorageManager& storage) {
+    auto data = image(1);
+    auto id = idOf(data);
+    CHECK(storage.storeImage(id, data));
+    auto writtenAt = storage.imageWrittenAt(id);
+    CHECK(writtenAt.has_value());
+
+    pause();
+    int64_t deletedAt = TombstoneSet::now();
+    pause();
+
+    CHECK(storage.moveImage(id, 1));
+    CHECK(storage.imageWrittenAt(id) == writtenAt);
+    CHECK(storage.moveImage(id, 0));
+    CHECK(storage.imageWrittenAt(id) == writtenAt);
+
+    CHECK(storage.applyDelete(id, deletedAt));
+    CHECK(!storage.imageExists(id));
+    CHECK(storage.deletedAt(id) == deletedAt);
+}
+
+// A delete older than the upload leaves the moved copy alone
+void testUploadAfterDeleteSurvivesTierMove(StorageManager& storage) {
+    int64_t deletedAt = TombstoneSet::now();
+    pause();
+
+    auto data = image(2);
+    auto id = idOf(data);
+    CHECK(storage.storeImage(id, data));
+    pause();
+    CHECK(storage.moveImage(id, 1));
+
+    CHECK(!storage.applyDelete(id, deletedAt));
+    CHECK(storage.imageExists(id));
+    CHECK(storage.retrieveImage(id) == data);
+}
+
+// Replicated copies keep the time they were uploaded with
+void testCopyKeepsGivenWriteTime(StorageManager& storage) {
+    auto data = image(3);
+    auto id = idOf(data);
+    int64_t uploadedAt = TombstoneSet::now() - 60 * 1000;
+    CHECK(storage.storeImage(id, data, uploadedAt));
+    CHECK(storage.imageWrittenAt(id) == uploadedAt);
+
+    CHECK(storage.applyDelete(id, uploadedAt + 1));
+    CHECK(!storage.imageExists(id));
+}
+
+} // namespace
+
+int main() {
+    TempDir dir;
+    StorageOptions options;
+    options.coldDirs = {(dir.path / "cold").string()};
+    {
+        StorageManager storage((dir.path / "hot").string(), options);
+        testDeleteAfterUploadWinsOverTierMove(storage);
+        testUploadAfterDeleteSurvivesTierMove(storage);
+        testCopyKeepsGivenWriteTime(storage);
+    }
+
+    if (failures > 0) {
+        std::cerr << failures << " check(s) failed" << std::endl;
+        return 1;
+    }
+    std::cout << "tombstone_order: ok" << std::endl;
+    return 0;
+}